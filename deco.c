@@ -7,8 +7,16 @@
  * The implementation below is a fairly complete rewrite since then
  * (C) Robert C. Helling 2013 and released under the GPLv2
  *
+ * All tissue state lives in a struct deco_state that the caller owns and
+ * passes in explicitly, so independent calculations (profile, planner,
+ * statistics) can run concurrently. The gradient factors are set globally
+ * with set_gf(), but each deco state takes its own copy of them when it is
+ * cleared or restored, so a calculation keeps the settings it started with.
+ *
  * add_segment()	- add <seconds> at the given pressure, breathing gasmix
+ * add_segment_ramp()	- add <seconds> of linear pressure change, breathing gasmix
  * deco_allowed_depth() - ceiling based on lead tissue, surface pressure, 3m increments or smooth
+ * deco_ndl()		- no deco limit at constant pressure and gasmix
  * set_gf()		- set Buehlmann gradient factors
  * clear_deco()
  * cache_deco_state()
@@ -18,6 +26,7 @@
 #include <math.h>
 #include <string.h>
 #include "dive.h"
+#include "deco.h"
 
 //! Option structure for Buehlmann decompression.
 struct buehlmann_config {
@@ -77,198 +86,439 @@ const double buehlmann_He_factor_expositon_one_second[] = {
 
 #define WV_PRESSURE 0.0627 // water vapor pressure in bar
 #define DECO_STOPS_MULTIPLIER_MM 3000.0
+#define LN_2 0.69314718055994530942
+#define RAMP_STEP_LIMIT 30 /* seconds */
 
-double tissue_n2_sat[16];
-double tissue_he_sat[16];
-int ci_pointing_to_guiding_tissue;
-double gf_low_pressure_this_dive;
-#define TISSUE_ARRAY_SZ sizeof(tissue_n2_sat)
-
-double tolerated_by_tissue[16];
-double tissue_inertgas_saturation[16];
-double buehlmann_inertgas_a[16], buehlmann_inertgas_b[16];
-
-static double tissue_tolerance_calc(const struct dive *dive)
+/*
+ * The per-compartment work below is written as straight loops over the
+ * 16 compartments without data dependent branches, so the compiler can
+ * vectorize them for whatever SIMD unit the target has. The only loop
+ * carried state (the leading tissue and the running maximum it implies)
+ * is resolved in a separate, cheap scalar pass. The arithmetic is done in
+ * exactly the same order as in the straightforward formulation, so the
+ * results are bit for bit the same.
+ */
+static double tissue_tolerance_calc(struct deco_state *ds, const struct dive *dive)
 {
-	int ci = -1;
+	int ci;
 	double ret_tolerance_limit_ambient_pressure = 0.0;
-	double gf_high = buehlmann_config.gf_high;
-	double gf_low = buehlmann_config.gf_low;
+	double gf_high = ds->gf_high;
+	double gf_low = ds->gf_low;
 	double surface = get_surface_pressure_in_mbar(dive, true) / 1000.0;
 	double lowest_ceiling = 0.0;
+	double gf_low_pressure;
 	double tissue_lowest_ceiling[16];
+	double tolerated[16];
+	double applies[16]; /* 1.0 or 0.0, a double so it vectorizes with the rest */
 
 	for (ci = 0; ci < 16; ci++) {
-		tissue_inertgas_saturation[ci] = tissue_n2_sat[ci] + tissue_he_sat[ci];
-		buehlmann_inertgas_a[ci] = ((buehlmann_N2_a[ci] * tissue_n2_sat[ci]) + (buehlmann_He_a[ci] * tissue_he_sat[ci])) / tissue_inertgas_saturation[ci];
-		buehlmann_inertgas_b[ci] = ((buehlmann_N2_b[ci] * tissue_n2_sat[ci]) + (buehlmann_He_b[ci] * tissue_he_sat[ci])) / tissue_inertgas_saturation[ci];
+		double n2 = ds->tissue_n2_sat[ci], he = ds->tissue_he_sat[ci];
+		double saturation = n2 + he;
+		double a = ((buehlmann_N2_a[ci] * n2) + (buehlmann_He_a[ci] * he)) / saturation;
+		double b = ((buehlmann_N2_b[ci] * n2) + (buehlmann_He_b[ci] * he)) / saturation;
 
+		ds->tissue_inertgas_saturation[ci] = saturation;
+		ds->buehlmann_inertgas_a[ci] = a;
+		ds->buehlmann_inertgas_b[ci] = b;
 
 		/* tolerated = (tissue_inertgas_saturation - buehlmann_inertgas_a) * buehlmann_inertgas_b; */
 
-		tissue_lowest_ceiling[ci] = (buehlmann_inertgas_b[ci] * tissue_inertgas_saturation[ci] - gf_low * buehlmann_inertgas_a[ci] * buehlmann_inertgas_b[ci]) /
-					     ((1.0 - buehlmann_inertgas_b[ci]) * gf_low + buehlmann_inertgas_b[ci]);
+		tissue_lowest_ceiling[ci] = (b * saturation - gf_low * a * b) / ((1.0 - b) * gf_low + b);
+	}
+	for (ci = 0; ci < 16; ci++) {
 		if (tissue_lowest_ceiling[ci] > lowest_ceiling)
 			lowest_ceiling = tissue_lowest_ceiling[ci];
-		if (!buehlmann_config.gf_low_at_maxdepth) {
-			if (lowest_ceiling > gf_low_pressure_this_dive)
-				gf_low_pressure_this_dive = lowest_ceiling;
-		}
 	}
-	for (ci = 0; ci <16; ci++) {
-		double tolerated;
-
-		if ((surface / buehlmann_inertgas_b[ci] + buehlmann_inertgas_a[ci] - surface) * gf_high + surface <
-		    (gf_low_pressure_this_dive / buehlmann_inertgas_b[ci] + buehlmann_inertgas_a[ci] - gf_low_pressure_this_dive) * gf_low + gf_low_pressure_this_dive)
-			tolerated = (-buehlmann_inertgas_a[ci] * buehlmann_inertgas_b[ci] * (gf_high * gf_low_pressure_this_dive - gf_low * surface) -
-				     (1.0 - buehlmann_inertgas_b[ci]) * (gf_high - gf_low) * gf_low_pressure_this_dive * surface +
-				     buehlmann_inertgas_b[ci] * (gf_low_pressure_this_dive - surface) * tissue_inertgas_saturation[ci]) /
-				    (-buehlmann_inertgas_a[ci] * buehlmann_inertgas_b[ci] * (gf_high - gf_low) +
-				     (1.0 - buehlmann_inertgas_b[ci]) * (gf_low * gf_low_pressure_this_dive - gf_high * surface) +
-				     buehlmann_inertgas_b[ci] * (gf_low_pressure_this_dive - surface));
-		else
-			tolerated = ret_tolerance_limit_ambient_pressure;
+	if (!ds->gf_low_at_maxdepth && lowest_ceiling > ds->gf_low_pressure_this_dive)
+		ds->gf_low_pressure_this_dive = lowest_ceiling;
+	gf_low_pressure = ds->gf_low_pressure_this_dive;
 
+	for (ci = 0; ci < 16; ci++) {
+		double a = ds->buehlmann_inertgas_a[ci];
+		double b = ds->buehlmann_inertgas_b[ci];
+
+		applies[ci] = (surface / b + a - surface) * gf_high + surface <
+			      (gf_low_pressure / b + a - gf_low_pressure) * gf_low + gf_low_pressure ? 1.0 : 0.0;
+		tolerated[ci] = (-a * b * (gf_high * gf_low_pressure - gf_low * surface) -
+				 (1.0 - b) * (gf_high - gf_low) * gf_low_pressure * surface +
+				 b * (gf_low_pressure - surface) * ds->tissue_inertgas_saturation[ci]) /
+				(-a * b * (gf_high - gf_low) +
+				 (1.0 - b) * (gf_low * gf_low_pressure - gf_high * surface) +
+				 b * (gf_low_pressure - surface));
+	}
 
-		tolerated_by_tissue[ci] = tolerated;
+	/* find the leading tissue; compartments the formula doesn't apply to tolerate the current maximum */
+	for (ci = 0; ci < 16; ci++) {
+		double t = applies[ci] != 0.0 ? tolerated[ci] : ret_tolerance_limit_ambient_pressure;
 
-		if (tolerated >= ret_tolerance_limit_ambient_pressure) {
-			ci_pointing_to_guiding_tissue = ci;
-			ret_tolerance_limit_ambient_pressure = tolerated;
+		ds->tolerated_by_tissue[ci] = t;
+		if (t >= ret_tolerance_limit_ambient_pressure) {
+			ds->ci_pointing_to_guiding_tissue = ci;
+			ret_tolerance_limit_ambient_pressure = t;
 		}
 	}
 	return ret_tolerance_limit_ambient_pressure;
 }
 
 /*
- * Return buelman factor for a particular period and tissue index.
+ * Return the buelman factors of all compartments for a particular period.
  *
- * We cache the last factor, since we commonly call this with the
- * same values... We have a special "fixed cache" for the one second
- * case, although I wonder if that's even worth it considering the
- * more general-purpose cache.
+ * We cache the factors of the last few periods in the deco state, since
+ * we commonly alternate between a small number of step sizes (ascent and
+ * stop steps in the planner, sample and NDL steps in the profile). The
+ * one second case comes from a fixed table.
  */
-struct factor_cache {
-	int last_period;
-	double last_factor;
-};
+static void get_factors(struct deco_state *ds, int period_in_seconds, const double **n2_f, const double **he_f)
+{
+	int i, ci;
+	struct factor_cache *cache;
 
-double n2_factor(int period_in_seconds, int ci)
+	if (period_in_seconds == 1) {
+		*n2_f = buehlmann_N2_factor_expositon_one_second;
+		*he_f = buehlmann_He_factor_expositon_one_second;
+		return;
+	}
+	for (i = 0; i < FACTOR_CACHE_SIZE; i++) {
+		cache = ds->factor_cache + i;
+		if (cache->period == period_in_seconds)
+			goto found;
+	}
+	cache = ds->factor_cache + ds->factor_cache_next;
+	ds->factor_cache_next = (ds->factor_cache_next + 1) % FACTOR_CACHE_SIZE;
+	cache->period = period_in_seconds;
+	for (ci = 0; ci < 16; ci++) {
+		cache->n2_factor[ci] = 1 - pow(2.0, -period_in_seconds / (buehlmann_N2_t_halflife[ci] * 60));
+		cache->he_factor[ci] = 1 - pow(2.0, -period_in_seconds / (buehlmann_He_t_halflife[ci] * 60));
+	}
+found:
+	*n2_f = cache->n2_factor;
+	*he_f = cache->he_factor;
+}
+
+/* add period_in_seconds at the given pressure and gas to the deco calculation */
+double add_segment(struct deco_state *ds, double pressure, const struct gasmix *gasmix, int period_in_seconds, int ccpo2, const struct dive *dive)
 {
-	static struct factor_cache cache[16];
+	int ci;
+	struct gas_pressures pressures;
+	const double *n2_factors, *he_factors;
+	double satmult = buehlmann_config.satmult;
+	double desatmult = buehlmann_config.desatmult;
+	double n2_sat[16], he_sat[16];
+
+	fill_pressures(&pressures, pressure, gasmix, (double) ccpo2 / 1000.0);
 
-	if (period_in_seconds == 1)
-		return buehlmann_N2_factor_expositon_one_second[ci];
+	if (ds->gf_low_at_maxdepth && pressure > ds->gf_low_pressure_this_dive)
+		ds->gf_low_pressure_this_dive = pressure;
 
-	if (period_in_seconds != cache[ci].last_period) {
-		cache[ci].last_period = period_in_seconds;
-		cache[ci].last_factor = 1 - pow(2.0, -period_in_seconds / (buehlmann_N2_t_halflife[ci] * 60));
+	get_factors(ds, period_in_seconds, &n2_factors, &he_factors);
+	memcpy(n2_sat, ds->tissue_n2_sat, sizeof(n2_sat));
+	memcpy(he_sat, ds->tissue_he_sat, sizeof(he_sat));
+	for (ci = 0; ci < 16; ci++) {
+		double pn2_oversat = pressures.n2 - n2_sat[ci];
+		double phe_oversat = pressures.he - he_sat[ci];
+		double n2_satmult = pn2_oversat > 0 ? satmult : desatmult;
+		double he_satmult = phe_oversat > 0 ? satmult : desatmult;
+
+		n2_sat[ci] += n2_satmult * pn2_oversat * n2_factors[ci];
+		he_sat[ci] += he_satmult * phe_oversat * he_factors[ci];
 	}
+	memcpy(ds->tissue_n2_sat, n2_sat, sizeof(n2_sat));
+	memcpy(ds->tissue_he_sat, he_sat, sizeof(he_sat));
+	ds->tissue_tolerance = tissue_tolerance_calc(ds, dive);
+	return ds->tissue_tolerance;
+}
 
-	return cache[ci].last_factor;
+/* recalculate the tolerance of the current tissues, e.g. for a different dive's surface pressure */
+double deco_tissue_tolerance(struct deco_state *ds, const struct dive *dive)
+{
+	ds->tissue_tolerance = tissue_tolerance_calc(ds, dive);
+	return ds->tissue_tolerance;
 }
 
-double he_factor(int period_in_seconds, int ci)
+/*
+ * Add period_in_seconds of a linear pressure change from start_pressure to
+ * end_pressure (a descent or ascent) in a single step.
+ *
+ * For a linearly changing inspired inert gas pressure Pi(t) = Pi0 + R * t
+ * the Schreiner equation gives the tissue pressure after time t as
+ *
+ *   P(t) = Pi0 + R * (t - 1/k) - (Pi0 - P0 - R/k) * exp(-k * t)
+ *
+ * with k = ln 2 / halftime. Writing f = 1 - exp(-k * t) (the same factor
+ * add_segment() uses) this becomes
+ *
+ *   P(t) - P0 = (Pi0 - P0) * f + (Pi1 - Pi0) * (1 - f / (k * t))
+ *
+ * which reduces to the constant depth update for Pi1 == Pi0. The
+ * saturation / desaturation multipliers are applied to the net change
+ * over the step. Long ramps are taken in steps of at most
+ * RAMP_STEP_LIMIT seconds, so the multipliers and the tracking of the
+ * deepest ceiling for gf_low still see the shape of the ramp.
+ */
+double add_segment_ramp(struct deco_state *ds, double start_pressure, double end_pressure, const struct gasmix *gasmix, int period_in_seconds, int ccpo2, const struct dive *dive)
 {
-	static struct factor_cache cache[16];
+	int ci;
+	struct gas_pressures start, end;
+	const double *n2_factors, *he_factors;
+	double satmult = buehlmann_config.satmult;
+	double desatmult = buehlmann_config.desatmult;
+	double po2 = (double) ccpo2 / 1000.0;
+	double n2_sat[16], he_sat[16];
+
+	if (period_in_seconds <= 0)
+		return ds->tissue_tolerance;
+	if (start_pressure == end_pressure)
+		return add_segment(ds, end_pressure, gasmix, period_in_seconds, ccpo2, dive);
+	while (period_in_seconds > RAMP_STEP_LIMIT) {
+		double pressure = start_pressure + (end_pressure - start_pressure) * RAMP_STEP_LIMIT / period_in_seconds;
+
+		add_segment_ramp(ds, start_pressure, pressure, gasmix, RAMP_STEP_LIMIT, ccpo2, dive);
+		start_pressure = pressure;
+		period_in_seconds -= RAMP_STEP_LIMIT;
+	}
+
+	/* On a rebreather the inert gas pressures have a kink where the ambient
+	 * pressure crosses the setpoint. Handle both sides separately. */
+	if (ccpo2 && get_o2(gasmix) != 1000 && (po2 - start_pressure) * (po2 - end_pressure) < 0) {
+		int split = rint(period_in_seconds * (po2 - start_pressure) / (end_pressure - start_pressure));
 
-	if (period_in_seconds == 1)
-		return buehlmann_He_factor_expositon_one_second[ci];
+		if (split > 0 && split < period_in_seconds) {
+			double pressure = start_pressure + (end_pressure - start_pressure) * split / period_in_seconds;
 
-	if (period_in_seconds != cache[ci].last_period) {
-		cache[ci].last_period = period_in_seconds;
-		cache[ci].last_factor = 1 - pow(2.0, -period_in_seconds / (buehlmann_He_t_halflife[ci] * 60));
+			add_segment_ramp(ds, start_pressure, pressure, gasmix, split, ccpo2, dive);
+			return add_segment_ramp(ds, pressure, end_pressure, gasmix, period_in_seconds - split, ccpo2, dive);
+		}
 	}
 
-	return cache[ci].last_factor;
+	fill_pressures(&start, start_pressure, gasmix, po2);
+	fill_pressures(&end, end_pressure, gasmix, po2);
+
+	if (ds->gf_low_at_maxdepth && MAX(start_pressure, end_pressure) > ds->gf_low_pressure_this_dive)
+		ds->gf_low_pressure_this_dive = MAX(start_pressure, end_pressure);
+
+	get_factors(ds, period_in_seconds, &n2_factors, &he_factors);
+	memcpy(n2_sat, ds->tissue_n2_sat, sizeof(n2_sat));
+	memcpy(he_sat, ds->tissue_he_sat, sizeof(he_sat));
+	for (ci = 0; ci < 16; ci++) {
+		/* 1 / (k * t) */
+		double n2_inv_kt = buehlmann_N2_t_halflife[ci] * 60 / LN_2 / period_in_seconds;
+		double he_inv_kt = buehlmann_He_t_halflife[ci] * 60 / LN_2 / period_in_seconds;
+		double n2_delta = (start.n2 - n2_sat[ci]) * n2_factors[ci] + (end.n2 - start.n2) * (1.0 - n2_factors[ci] * n2_inv_kt);
+		double he_delta = (start.he - he_sat[ci]) * he_factors[ci] + (end.he - start.he) * (1.0 - he_factors[ci] * he_inv_kt);
+		double n2_satmult = n2_delta > 0 ? satmult : desatmult;
+		double he_satmult = he_delta > 0 ? satmult : desatmult;
+
+		n2_sat[ci] += n2_satmult * n2_delta;
+		he_sat[ci] += he_satmult * he_delta;
+	}
+	memcpy(ds->tissue_n2_sat, n2_sat, sizeof(n2_sat));
+	memcpy(ds->tissue_he_sat, he_sat, sizeof(he_sat));
+	ds->tissue_tolerance = tissue_tolerance_calc(ds, dive);
+	return ds->tissue_tolerance;
 }
 
-/* add period_in_seconds at the given pressure and gas to the deco calculation */
-double add_segment(double pressure, const struct gasmix *gasmix, int period_in_seconds, int ccpo2, const struct dive *dive)
+/* how far (in bar) a compartment is below its gf_high M-value at the surface */
+static double surface_margin(int ci, double n2, double he, double surface, double gf_high)
 {
+	double saturation = n2 + he;
+	double a = ((buehlmann_N2_a[ci] * n2) + (buehlmann_He_a[ci] * he)) / saturation;
+	double b = ((buehlmann_N2_b[ci] * n2) + (buehlmann_He_b[ci] * he)) / saturation;
+
+	return surface + gf_high * (surface / b + a - surface) - saturation;
+}
+
+/* rate of the exponential approach to the inspired pressure, including the safety multipliers */
+static double tissue_rate(double factor_one_second, double inspired, double tissue)
+{
+	double mult = inspired > tissue ? buehlmann_config.satmult : buehlmann_config.desatmult;
+
+	return -log(1.0 - mult * factor_one_second);
+}
+
+/*
+ * Estimate of the seconds we can stay at the given pressure and gas
+ * before a compartment reaches its gf_high M-value at the surface.
+ *
+ * At constant pressure every compartment approaches the inspired gas
+ * pressure exponentially, so for a single inert gas that time has a
+ * closed form. With helium in the mix a and b drift with the N2/He
+ * ratio; there we look for the first crossing minute by minute on the
+ * same exponentials and bisect it.
+ */
+static double ndl_estimate(const struct deco_state *ds, const struct gas_pressures *pressures, double surface, double max_ndl)
+{
+	int ci;
+	double ndl = max_ndl;
+
+	for (ci = 0; ci < 16; ci++) {
+		double n2 = ds->tissue_n2_sat[ci], he = ds->tissue_he_sat[ci];
+		double k_n2 = tissue_rate(buehlmann_N2_factor_expositon_one_second[ci], pressures->n2, n2);
+		double k_he = tissue_rate(buehlmann_He_factor_expositon_one_second[ci], pressures->he, he);
+		double lo, hi;
+
+		if (surface_margin(ci, n2, he, surface, ds->gf_high) <= 0.0)
+			return 0.0;
+		if (he == 0.0 && pressures->he == 0.0) {
+			double limit = n2 + surface_margin(ci, n2, he, surface, ds->gf_high);
+			double t;
+
+			if (pressures->n2 <= limit)
+				continue;
+			t = log((pressures->n2 - n2) / (pressures->n2 - limit)) / k_n2;
+			if (t < ndl)
+				ndl = t;
+			continue;
+		}
+		for (hi = 60.0; hi < ndl + 60.0; hi += 60.0) {
+			double t = MIN(hi, ndl);
+
+			if (surface_margin(ci, pressures->n2 + (n2 - pressures->n2) * exp(-k_n2 * t),
+					   pressures->he + (he - pressures->he) * exp(-k_he * t), surface, ds->gf_high) <= 0.0)
+				break;
+		}
+		if (hi >= ndl + 60.0)
+			continue;
+		hi = MIN(hi, ndl);
+		lo = MAX(hi - 60.0, 0.0);
+		while (hi - lo > 0.5) {
+			double t = (lo + hi) / 2;
+
+			if (surface_margin(ci, pressures->n2 + (n2 - pressures->n2) * exp(-k_n2 * t),
+					   pressures->he + (he - pressures->he) * exp(-k_he * t), surface, ds->gf_high) <= 0.0)
+				hi = t;
+			else
+				lo = t;
+		}
+		ndl = hi;
+	}
+	return ndl;
+}
+
+/*
+ * Is there a ceiling after t seconds at the given pressure? The tissues
+ * are moved forward in one go, to where t one second add_segment() steps
+ * would take them, and then get the full tolerance calculation, gf_low
+ * and all.
+ */
+static bool ndl_exceeded(const struct deco_state *start, double pressure, const struct gas_pressures *pressures, int t, struct dive *dive, double surface)
+{
+	struct deco_state ds = *start;
 	int ci;
-	int fo2 = get_o2(gasmix), fhe = get_he(gasmix);
+
+	for (ci = 0; ci < 16; ci++) {
+		double n2 = start->tissue_n2_sat[ci], he = start->tissue_he_sat[ci];
+		double k_n2 = tissue_rate(buehlmann_N2_factor_expositon_one_second[ci], pressures->n2, n2);
+		double k_he = tissue_rate(buehlmann_He_factor_expositon_one_second[ci], pressures->he, he);
+
+		ds.tissue_n2_sat[ci] = pressures->n2 + (n2 - pressures->n2) * exp(-k_n2 * t);
+		ds.tissue_he_sat[ci] = pressures->he + (he - pressures->he) * exp(-k_he * t);
+	}
+	if (ds.gf_low_at_maxdepth && pressure > ds.gf_low_pressure_this_dive)
+		ds.gf_low_pressure_this_dive = pressure;
+	return deco_allowed_depth(tissue_tolerance_calc(&ds, dive), surface, dive, true) > 0;
+}
+
+/*
+ * Seconds we can stay at the given pressure and gas before a direct ascent
+ * to the surface is no longer allowed, up to max_ndl. This is the first
+ * second in which stepping with add_segment() would show a ceiling.
+ *
+ * The estimate only looks at the gf_high M-values; the actual ceiling
+ * also depends on gf_low and is rounded to whole millimeters. So we
+ * bracket the real crossing starting from the estimate and bisect it,
+ * which usually takes a handful of tolerance calculations. The deco
+ * state is not modified.
+ */
+double deco_ndl(const struct deco_state *ds, double pressure, const struct gasmix *gasmix, int ccpo2, struct dive *dive, double surface, double max_ndl)
+{
 	struct gas_pressures pressures;
+	int lo, hi, step = 60;
+	int limit = floor(max_ndl);
 
 	fill_pressures(&pressures, pressure, gasmix, (double) ccpo2 / 1000.0);
 
-	if (buehlmann_config.gf_low_at_maxdepth && pressure > gf_low_pressure_this_dive)
-		gf_low_pressure_this_dive = pressure;
+	lo = MIN((int)floor(ndl_estimate(ds, &pressures, surface, max_ndl)), limit);
+	if (ndl_exceeded(ds, pressure, &pressures, lo, dive, surface)) {
+		/* the ceiling shows up before the estimate */
+		for (;;) {
+			if (lo == 0)
+				return 0.0;
+			hi = lo;
+			lo = MAX(hi - step, 0);
+			step *= 2;
+			if (!ndl_exceeded(ds, pressure, &pressures, lo, dive, surface))
+				break;
+		}
+	} else {
+		for (;;) {
+			if (lo >= limit)
+				return max_ndl;
+			hi = MIN(lo + step, limit);
+			step *= 2;
+			if (ndl_exceeded(ds, pressure, &pressures, hi, dive, surface))
+				break;
+			lo = hi;
+		}
+	}
+	while (hi - lo > 1) {
+		int t = (lo + hi) / 2;
 
-	for (ci = 0; ci < 16; ci++) {
-		double pn2_oversat = pressures.n2 - tissue_n2_sat[ci];
-		double phe_oversat = pressures.he - tissue_he_sat[ci];
-		double n2_f = n2_factor(period_in_seconds, ci);
-		double he_f = he_factor(period_in_seconds, ci);
-		double n2_satmult = pn2_oversat > 0 ? buehlmann_config.satmult : buehlmann_config.desatmult;
-		double he_satmult = phe_oversat > 0 ? buehlmann_config.satmult : buehlmann_config.desatmult;
-
-		tissue_n2_sat[ci] += n2_satmult * pn2_oversat * n2_f;
-		tissue_he_sat[ci] += he_satmult * phe_oversat * he_f;
+		if (ndl_exceeded(ds, pressure, &pressures, t, dive, surface))
+			hi = t;
+		else
+			lo = t;
 	}
-	return tissue_tolerance_calc(dive);
+	return hi;
 }
 
 #ifdef DECO_CALC_DEBUG
-void dump_tissues()
+void dump_tissues(struct deco_state *ds)
 {
 	int ci;
 	printf("N2 tissues:");
 	for (ci = 0; ci < 16; ci++)
-		printf(" %6.3e", tissue_n2_sat[ci]);
+		printf(" %6.3e", ds->tissue_n2_sat[ci]);
 	printf("\nHe tissues:");
 	for (ci = 0; ci < 16; ci++)
-		printf(" %6.3e", tissue_he_sat[ci]);
+		printf(" %6.3e", ds->tissue_he_sat[ci]);
 	printf("\n");
 }
 #endif
 
-void clear_deco(double surface_pressure)
+void clear_deco(struct deco_state *ds, double surface_pressure)
 {
 	int ci;
+
+	memset(ds, 0, sizeof(*ds));
+	ds->gf_low = buehlmann_config.gf_low;
+	ds->gf_high = buehlmann_config.gf_high;
+	ds->gf_low_at_maxdepth = buehlmann_config.gf_low_at_maxdepth;
 	for (ci = 0; ci < 16; ci++) {
-		tissue_n2_sat[ci] = (surface_pressure - WV_PRESSURE) * N2_IN_AIR / 1000;
-		tissue_he_sat[ci] = 0.0;
+		ds->tissue_n2_sat[ci] = (surface_pressure - WV_PRESSURE) * N2_IN_AIR / 1000;
+		ds->tissue_he_sat[ci] = 0.0;
 	}
-	gf_low_pressure_this_dive = surface_pressure;
-	if (!buehlmann_config.gf_low_at_maxdepth)
-		gf_low_pressure_this_dive += buehlmann_config.gf_low_position_min;
+	ds->gf_low_pressure_this_dive = surface_pressure;
+	if (!ds->gf_low_at_maxdepth)
+		ds->gf_low_pressure_this_dive += buehlmann_config.gf_low_position_min;
+	ds->tissue_tolerance = surface_pressure;
 }
 
-void cache_deco_state(double tissue_tolerance, char **cached_datap)
+/* the deco state is self-contained, so caching it is a plain copy */
+void cache_deco_state(const struct deco_state *ds, struct deco_state **cached_datap)
 {
-	char *data = *cached_datap;
-
-	if (!data) {
-		data = malloc(2 * TISSUE_ARRAY_SZ + 2 * sizeof(double) + sizeof(int));
-		*cached_datap = data;
-	}
-	memcpy(data, tissue_n2_sat, TISSUE_ARRAY_SZ);
-	data += TISSUE_ARRAY_SZ;
-	memcpy(data, tissue_he_sat, TISSUE_ARRAY_SZ);
-	data += TISSUE_ARRAY_SZ;
-	memcpy(data, &gf_low_pressure_this_dive, sizeof(double));
-	data += sizeof(double);
-	memcpy(data, &tissue_tolerance, sizeof(double));
-	data += sizeof(double);
-	memcpy(data, &ci_pointing_to_guiding_tissue, sizeof(int));
+	if (!*cached_datap)
+		*cached_datap = malloc(sizeof(struct deco_state));
+	**cached_datap = *ds;
 }
 
-double restore_deco_state(char *data)
+/* the restored tissues continue with the current gradient factors */
+double restore_deco_state(struct deco_state *ds, const struct deco_state *data)
 {
-	double tissue_tolerance;
-
-	memcpy(tissue_n2_sat, data, TISSUE_ARRAY_SZ);
-	data += TISSUE_ARRAY_SZ;
-	memcpy(tissue_he_sat, data, TISSUE_ARRAY_SZ);
-	data += TISSUE_ARRAY_SZ;
-	memcpy(&gf_low_pressure_this_dive, data, sizeof(double));
-	data += sizeof(double);
-	memcpy(&tissue_tolerance, data, sizeof(double));
-	data += sizeof(double);
-	memcpy(&ci_pointing_to_guiding_tissue, data, sizeof(int));
-
-	return tissue_tolerance;
+	*ds = *data;
+	ds->gf_low = buehlmann_config.gf_low;
+	ds->gf_high = buehlmann_config.gf_high;
+	ds->gf_low_at_maxdepth = buehlmann_config.gf_low_at_maxdepth;
+	return ds->tissue_tolerance;
 }
 
 unsigned int deco_allowed_depth(double tissues_tolerance, double surface_pressure, struct dive *dive, bool smooth)
@@ -298,3 +548,14 @@ void set_gf(short gflow, short gfhigh, bool gf_low_at_maxdepth)
 		buehlmann_config.gf_high = (double)gfhigh / 100.0;
 	buehlmann_config.gf_low_at_maxdepth = gf_low_at_maxdepth;
 }
+
+uint32_t deco_config_hash(void)
+{
+	uint32_t hash = FNV_INITIAL_HASH;
+
+	hash = fnv_hash(hash, &buehlmann_config.gf_low, sizeof(buehlmann_config.gf_low));
+	hash = fnv_hash(hash, &buehlmann_config.gf_high, sizeof(buehlmann_config.gf_high));
+	hash = fnv_hash(hash, &buehlmann_config.gf_low_at_maxdepth, sizeof(buehlmann_config.gf_low_at_maxdepth));
+	hash = fnv_hash(hash, &buehlmann_config.last_deco_stop_in_mtr, sizeof(buehlmann_config.last_deco_stop_in_mtr));
+	return hash;
+}
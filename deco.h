@@ -5,12 +5,47 @@
 extern "C" {
 #endif
 
-extern double tolerated_by_tissue[];
-extern double buehlmann_N2_t_halflife[];
-extern double tissue_inertgas_saturation[16];
-extern double buehlmann_inertgas_a[16], buehlmann_inertgas_b[16];
-extern double gf_low_pressure_this_dive;
+extern const double buehlmann_N2_t_halflife[];
 
+#define FACTOR_CACHE_SIZE 3
+
+/* exposure factors of all compartments for one period length */
+struct factor_cache {
+	int period;
+	double n2_factor[16], he_factor[16];
+};
+
+/*
+ * Complete Buehlmann state of one decompression calculation.
+ * Each user (profile, planner, statistics...) owns its own instance,
+ * so independent calculations don't interfere with each other.
+ */
+struct deco_state {
+	double tissue_n2_sat[16];
+	double tissue_he_sat[16];
+	double tolerated_by_tissue[16];
+	double tissue_inertgas_saturation[16];
+	double buehlmann_inertgas_a[16], buehlmann_inertgas_b[16];
+	double gf_low_pressure_this_dive;
+	double gf_low, gf_high; /* copied from set_gf() by clear_deco() and restore_deco_state() */
+	bool gf_low_at_maxdepth;
+	double tissue_tolerance; /* result of the last add_segment() */
+	int ci_pointing_to_guiding_tissue;
+	struct factor_cache factor_cache[FACTOR_CACHE_SIZE];
+	int factor_cache_next;
+};
+
+/*
+ * The deco state at the end of a dive (including the following surface
+ * interval) as seen by the dives after it. The key fingerprints the dive
+ * and all the dives before it that went into the state.
+ */
+struct deco_snapshot {
+	uint32_t key;
+	timestamp_t lasttime;
+	double tissue_tolerance;
+	struct deco_state ds;
+};
 
 #ifdef __cplusplus
 }
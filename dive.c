@@ -119,6 +119,7 @@ void remove_event(struct event *event)
 		struct event *temp = (*ep)->next;
 		free(*ep);
 		*ep = temp;
+		invalidate_dive_metrics(current_dive);
 	}
 }
 
@@ -155,6 +156,55 @@ struct gasmix *get_gasmix_from_event(struct event *ev)
 	return &dummy;
 }
 
+/*
+ * Collect the gas switches of a divecomputer once, so that code walking
+ * the samples in time order can get the gas in use without rescanning the
+ * event list (and comparing event names) for every sample.
+ */
+void init_gas_timeline(struct gas_timeline *timeline, struct dive *dive, struct divecomputer *dc)
+{
+	struct event *ev;
+	int nr = 0;
+
+	memset(timeline, 0, sizeof(*timeline));
+	for (ev = dc->events; ev; ev = ev->next) {
+		if (!strcmp(ev->name, "gaschange"))
+			nr++;
+	}
+	if (!nr)
+		return;
+	timeline->switches = malloc(nr * sizeof(struct gas_switch));
+	if (!timeline->switches)
+		return;
+	for (ev = dc->events; ev; ev = ev->next) {
+		if (strcmp(ev->name, "gaschange"))
+			continue;
+		timeline->switches[timeline->nr].time = ev->time.seconds;
+		timeline->switches[timeline->nr].cylinder = get_cylinder_index(dive, ev);
+		timeline->nr++;
+	}
+}
+
+void free_gas_timeline(struct gas_timeline *timeline)
+{
+	free(timeline->switches);
+	timeline->switches = NULL;
+	timeline->nr = 0;
+}
+
+/* the cylinder in use at 'time' - this only moves forward unless 'time' goes backwards */
+int gas_timeline_cylinder(struct gas_timeline *timeline, int time)
+{
+	if (time < timeline->time) {
+		timeline->next = 0;
+		timeline->cylinder = 0;
+	}
+	timeline->time = time;
+	while (timeline->next < timeline->nr && timeline->switches[timeline->next].time <= time)
+		timeline->cylinder = timeline->switches[timeline->next++].cylinder;
+	return timeline->cylinder;
+}
+
 int get_pressure_units(int mb, const char **units)
 {
 	int pressure;
@@ -420,6 +470,8 @@ void clear_dive(struct dive *d)
 	taglist_free(d->tag_list);
 	STRUCTURED_LIST_FREE(struct divecomputer, d->dc.next, free_dc);
 	STRUCTURED_LIST_FREE(struct picture, d->picture_list, free_pic);
+	free(d->deco_snapshot);
+	free(d->gas_string);
 	memset(d, 0, sizeof(struct dive));
 }
 
@@ -438,6 +490,8 @@ void copy_dive(struct dive *s, struct dive *d)
 	d->location = copy_string(s->location);
 	d->notes = copy_string(s->notes);
 	d->suit = copy_string(s->suit);
+	d->deco_snapshot = NULL;
+	d->gas_string = copy_string(s->gas_string);
 	STRUCTURED_LIST_COPY(struct picture, s->picture_list, d->picture_list, copy_pl);
 	STRUCTURED_LIST_COPY(struct tag_entry, s->tag_list, d->tag_list, copy_tl);
 	STRUCTURED_LIST_COPY(struct divecomputer, s->dc.next, d->dc.next, copy_dc);
@@ -1224,6 +1278,7 @@ struct dive *fixup_dive(struct dive *dive)
 	int i;
 	struct divecomputer *dc;
 
+	invalidate_dive_metrics(dive);
 	sanitize_cylinder_info(dive);
 	dive->maxcns = dive->cns;
 
@@ -2354,15 +2409,6 @@ int taglist_get_tagstring(struct tag_entry *tag_list, char *buffer, int len)
 	return i;
 }
 
-static inline void taglist_free_divetag(struct divetag *tag)
-{
-	if (tag->name != NULL)
-		free(tag->name);
-	if (tag->source != NULL)
-		free(tag->source);
-	free(tag);
-}
-
 /* Add a tag to the tag_list, keep the list sorted */
 static struct divetag *taglist_add_divetag(struct tag_entry **tag_list, struct divetag *tag)
 {
@@ -2389,46 +2435,116 @@ static struct divetag *taglist_add_divetag(struct tag_entry **tag_list, struct d
 	return tag;
 }
 
-struct divetag *taglist_add_tag(struct tag_entry **tag_list, const char *tag)
+/*
+ * The tag dictionary: every divetag ever created, hashed by its name and
+ * by its untranslated source. Tags are never freed, so their ids and the
+ * pointers in the tag_entries stay valid.
+ */
+struct tag_slot {
+	const char *key; /* NULL for an empty slot */
+	struct divetag *tag;
+};
+
+static struct tag_slot *tag_hash;
+static unsigned int tag_hash_size, tag_hash_used; /* the size is a power of two */
+static int nr_tags;
+
+static struct tag_slot *tag_hash_slot(struct tag_slot *hash, unsigned int size, const char *key)
 {
-	int i = 0, is_default_tag = 0;
-	struct divetag *ret_tag, *new_tag;
-	const char *translation;
-	new_tag = malloc(sizeof(struct divetag));
+	unsigned int i = fnv_hash(FNV_INITIAL_HASH, key, strlen(key)) & (size - 1);
+
+	while (hash[i].key && strcmp(hash[i].key, key))
+		i = (i + 1) & (size - 1);
+	return hash + i;
+}
+
+static struct divetag *tag_hash_lookup(const char *key)
+{
+	if (!tag_hash_size)
+		return NULL;
+	return tag_hash_slot(tag_hash, tag_hash_size, key)->tag;
+}
+
+static void tag_hash_insert(const char *key, struct divetag *tag)
+{
+	struct tag_slot *slot;
+
+	/* keep the hash at most half full */
+	if (2 * (tag_hash_used + 1) > tag_hash_size) {
+		unsigned int i, size = tag_hash_size ? 2 * tag_hash_size : 64;
+		struct tag_slot *hash = calloc(size, sizeof(*hash));
+
+		for (i = 0; i < tag_hash_size; i++) {
+			if (tag_hash[i].key)
+				*tag_hash_slot(hash, size, tag_hash[i].key) = tag_hash[i];
+		}
+		free(tag_hash);
+		tag_hash = hash;
+		tag_hash_size = size;
+	}
+	slot = tag_hash_slot(tag_hash, tag_hash_size, key);
+	if (slot->key)
+		return;
+	slot->key = key;
+	slot->tag = tag;
+	tag_hash_used++;
+}
+
+/* find the divetag for a tag, creating it and adding it to g_tag_list the first time we see it */
+static struct divetag *taglist_intern_tag(const char *tag)
+{
+	struct divetag *ret_tag;
+	const char *name = tag;
+	bool is_default_tag = false;
+	int i;
+
+	ret_tag = tag_hash_lookup(tag);
+	if (ret_tag)
+		return ret_tag;
 
 	for (i = 0; i < sizeof(default_tags) / sizeof(char *); i++) {
 		if (strcmp(default_tags[i], tag) == 0) {
-			is_default_tag = 1;
+			is_default_tag = true;
 			break;
 		}
 	}
 	/* Only translate default tags */
 	if (is_default_tag) {
-		translation = translate("gettextFromC", tag);
-		new_tag->name = malloc(strlen(translation) + 1);
-		memcpy(new_tag->name, translation, strlen(translation) + 1);
-		new_tag->source = malloc(strlen(tag) + 1);
-		memcpy(new_tag->source, tag, strlen(tag) + 1);
-	} else {
-		new_tag->source = NULL;
-		new_tag->name = malloc(strlen(tag) + 1);
-		memcpy(new_tag->name, tag, strlen(tag) + 1);
-	}
-	/* Try to insert new_tag into g_tag_list if we are not operating on it */
-	if (tag_list != &g_tag_list) {
-		ret_tag = taglist_add_divetag(&g_tag_list, new_tag);
-		/* g_tag_list already contains new_tag, free the duplicate */
-		if (ret_tag != new_tag)
-			taglist_free_divetag(new_tag);
-		ret_tag = taglist_add_divetag(tag_list, ret_tag);
-	} else {
-		ret_tag = taglist_add_divetag(tag_list, new_tag);
-		if (ret_tag != new_tag)
-			taglist_free_divetag(new_tag);
+		name = translate("gettextFromC", tag);
+		/* the translation may already be known as a tag of its own */
+		ret_tag = tag_hash_lookup(name);
+		if (ret_tag && !strcmp(ret_tag->name, name)) {
+			tag_hash_insert(strdup(tag), ret_tag);
+			return ret_tag;
+		}
 	}
+
+	ret_tag = malloc(sizeof(struct divetag));
+	ret_tag->name = strdup(name);
+	ret_tag->source = is_default_tag ? strdup(tag) : NULL;
+	ret_tag->id = nr_tags++;
+	tag_hash_insert(ret_tag->name, ret_tag);
+	if (ret_tag->source)
+		tag_hash_insert(ret_tag->source, ret_tag);
+	taglist_add_divetag(&g_tag_list, ret_tag);
 	return ret_tag;
 }
 
+struct divetag *taglist_add_tag(struct tag_entry **tag_list, const char *tag)
+{
+	struct divetag *ret_tag;
+
+	/* the parser can add tags from several threads */
+	lock_shared_dive_data();
+	ret_tag = taglist_intern_tag(tag);
+	unlock_shared_dive_data();
+
+	/* interning already put it into g_tag_list */
+	if (tag_list == &g_tag_list)
+		return ret_tag;
+	return taglist_add_divetag(tag_list, ret_tag);
+}
+
 void taglist_free(struct tag_entry *entry)
 {
 	STRUCTURED_LIST_FREE(struct tag_entry, entry, free)
@@ -2504,18 +2620,116 @@ struct dive *merge_dives(struct dive *a, struct dive *b, int offset, bool prefer
 	return res;
 }
 
-struct dive *find_dive_including(timestamp_t when)
+/*
+ * The dives sorted by start time, for the time based lookups below. Along
+ * with each dive we keep the latest end time of it and all dives before it.
+ * That only ever grows, so we can binary search for the first dive that is
+ * still going on at a given time.
+ *
+ * The index is rebuilt on the next lookup after dives were added to or
+ * removed from dive_table, or the table was sorted - which is what the UI
+ * does after changing the start or duration of dives (see
+ * invalidate_dive_time_index()). The table is normally sorted already, and
+ * ties keep the table order, so the results are the same as walking the
+ * table.
+ *
+ * As before, we always use the duration from the first divecomputer.
+ */
+struct dive_interval {
+	timestamp_t start, end;
+	timestamp_t max_end;
+	int idx;
+	struct dive *dive;
+};
+
+static struct dive_interval *time_index;
+static int time_index_alloc;
+static bool time_index_valid;
+
+void invalidate_dive_time_index(void)
+{
+	time_index_valid = false;
+}
+
+static int interval_cmp(const void *_a, const void *_b)
+{
+	const struct dive_interval *a = _a, *b = _b;
+
+	if (a->start != b->start)
+		return a->start < b->start ? -1 : 1;
+	return a->idx - b->idx;
+}
+
+static void build_time_index(void)
 {
 	int i;
+	bool sorted = true;
 	struct dive *dive;
 
-	/* binary search, anyone? Too lazy for now;
-	 * also we always use the duration from the first divecomputer
-	 *     could this ever be a problem? */
+	if (time_index_valid)
+		return;
+	if (dive_table.nr > time_index_alloc) {
+		time_index_alloc = dive_table.nr + 32;
+		time_index = realloc(time_index, time_index_alloc * sizeof(struct dive_interval));
+		if (!time_index)
+			exit(1);
+	}
 	for_each_dive (i, dive) {
-		if (dive->when <= when && when <= dive->when + dive->duration.seconds)
-			return dive;
+		struct dive_interval *interval = time_index + i;
+
+		interval->start = dive->when;
+		interval->end = dive->when + dive->duration.seconds;
+		interval->idx = i;
+		interval->dive = dive;
+		if (i && interval->start < interval[-1].start)
+			sorted = false;
+	}
+	if (!sorted)
+		qsort(time_index, dive_table.nr, sizeof(struct dive_interval), interval_cmp);
+	for (i = 0; i < dive_table.nr; i++)
+		time_index[i].max_end = i ? MAX(time_index[i - 1].max_end, time_index[i].end) : time_index[i].end;
+	time_index_valid = true;
+}
+
+/* index of the first dive starting at or after 'when' */
+static int first_starting_from(timestamp_t when)
+{
+	int lo = 0, hi = dive_table.nr;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (time_index[mid].start < when)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* index of the first dive that hasn't ended before 'when' */
+static int first_ending_from(timestamp_t when)
+{
+	int lo = 0, hi = dive_table.nr;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (time_index[mid].max_end < when)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	return lo;
+}
+
+struct dive *find_dive_including(timestamp_t when)
+{
+	int i;
+
+	build_time_index();
+	/* the first dive not over by then; all later ones start no earlier */
+	i = first_ending_from(when);
+	if (i < dive_table.nr && time_index[i].start <= when)
+		return time_index[i].dive;
 	return NULL;
 }
 
@@ -2529,12 +2743,12 @@ bool dive_within_time_range(struct dive *dive, timestamp_t when, timestamp_t off
 struct dive *find_dive_n_near(timestamp_t when, int n, timestamp_t offset)
 {
 	int i, j = 0;
-	struct dive *dive;
 
-	for_each_dive (i, dive) {
-		if (dive_within_time_range(dive, when, offset))
+	build_time_index();
+	for (i = first_starting_from(when - offset); i < dive_table.nr && time_index[i].start <= when + offset; i++) {
+		if (time_index[i].end <= when + offset)
 			if (++j == n)
-				return dive;
+				return time_index[i].dive;
 	}
 	return NULL;
 }
@@ -2548,6 +2762,7 @@ void shift_times(const timestamp_t amount)
 		if (!dive->selected)
 			continue;
 		dive->when += amount;
+		invalidate_dive_metrics(dive);
 	}
 }
 
@@ -2705,6 +2920,7 @@ void make_first_dc()
 	current_dive->dc = *cur_dc;
 	current_dive->dc.next = newdc;
 	free(cur_dc);
+	invalidate_dive_metrics(current_dive);
 }
 
 /* always acts on the current dive */
@@ -2744,4 +2960,5 @@ void delete_current_divecomputer(void)
 	}
 	if (dc_number == count_divecomputers())
 		dc_number--;
+	invalidate_dive_metrics(current_dive);
 }
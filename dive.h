@@ -34,6 +34,18 @@ static inline char *copy_string(const char *s)
 	return s ? strdup(s) : NULL;
 }
 
+/* FNV-1a, used to fingerprint data for the various caches */
+#define FNV_INITIAL_HASH 2166136261u
+
+static inline uint32_t fnv_hash(uint32_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+
+	while (len--)
+		hash = (hash ^ *p++) * 16777619u;
+	return hash;
+}
+
 #include <libxml/tree.h>
 #include <libxslt/transform.h>
 #include <libxslt/xsltutils.h>
@@ -202,6 +214,11 @@ struct divetag {
 	 * This enables us to write a non-localized tag to the xml file.
 	 */
 	char *source;
+	/*
+	 * Small integer that identifies the tag for as long as the program
+	 * runs, so filters can keep one bit per tag.
+	 */
+	int id;
 };
 
 struct tag_entry {
@@ -212,7 +229,9 @@ struct tag_entry {
 /*
  * divetags are only stored once, each dive only contains
  * a list of tag_entries which then point to the divetags
- * in the global g_tag_list
+ * in the global g_tag_list. Looking a tag up by name goes
+ * through a hash, so adding a known tag doesn't allocate
+ * anything but the tag_entry.
  */
 
 extern struct tag_entry *g_tag_list;
@@ -319,6 +338,9 @@ struct dive {
 	struct divecomputer dc;
 	int id; // unique ID for this dive
 	struct picture *picture_list;
+	struct deco_snapshot *deco_snapshot; // tissues at the end of this dive, see init_decompression()
+	bool metrics_valid; // sac, otu, maxcns and gas_string are up to date, see update_dive_metrics()
+	char *gas_string;
 };
 
 /* when selectively copying dive information, which parts should be copied? */
@@ -359,6 +381,13 @@ extern void picture_load_exif_data(struct picture *p, timestamp_t *timestamp);
 extern void dive_set_geodata_from_picture(struct dive *d, struct picture *pic);
 
 
+/* call this when the samples, cylinders, gas change events or time of a dive change */
+static inline void invalidate_dive_metrics(struct dive *dive)
+{
+	if (dive)
+		dive->metrics_valid = false;
+}
+
 static inline int dive_has_gps_location(struct dive *dive)
 {
 	return dive->latitude.udeg || dive->longitude.udeg;
@@ -442,6 +471,7 @@ extern short autogroup;
 #define DIVE_NEEDS_TRIP(_dive) ((_dive)->tripflag == TF_NONE)
 
 extern void add_dive_to_trip(struct dive *, dive_trip_t *);
+extern void link_dive_to_trip(struct dive *, dive_trip_t *);
 
 extern void delete_single_dive(int idx);
 extern void add_single_dive(int idx, struct dive *dive);
@@ -543,48 +573,13 @@ static inline struct dive *get_dive_by_uemis_diveid(uint32_t diveid, uint32_t de
 	return NULL;
 }
 
-static inline struct dive *get_dive_by_uniq_id(int id)
-{
-	int i;
-	struct dive *dive = NULL;
-
-	for_each_dive (i, dive) {
-		if (dive->id == id)
-			break;
-	}
-#ifdef DEBUG
-	if (dive == NULL) {
-		fprintf(stderr, "Invalid id %x passed to get_dive_by_diveid, try to fix the code\n", id);
-		exit(1);
-	}
-#endif
-	return dive;
-}
-
-static inline int get_idx_by_uniq_id(int id)
-{
-	int i;
-	struct dive *dive = NULL;
-
-	for_each_dive (i, dive) {
-		if (dive->id == id)
-			break;
-	}
-#ifdef DEBUG
-	if (dive == NULL) {
-		fprintf(stderr, "Invalid id %x passed to get_dive_by_diveid, try to fix the code\n", id);
-		exit(1);
-	}
-#endif
-	return i;
-}
-
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 extern int report_error(const char *fmt, ...);
 extern const char *get_error_string(void);
+extern bool have_error_string(void);
 
 extern struct dive *find_dive_including(timestamp_t when);
 extern bool dive_within_time_range(struct dive *dive, timestamp_t when, timestamp_t offset);
@@ -595,6 +590,13 @@ extern int match_one_dc(struct divecomputer *a, struct divecomputer *b);
 
 extern void parse_xml_init(void);
 extern void parse_xml_buffer(const char *url, const char *buf, int size, struct dive_table *table, const char **params);
+/* how parse_xml_buffer() may read our own files; the tests compare the results */
+enum parse_xml_mode {
+	PARSE_XML_ANY,
+	PARSE_XML_SERIAL,	/* streaming, but not in pieces on several threads */
+	PARSE_XML_DOM
+};
+extern enum parse_xml_mode parse_xml_mode;
 extern void parse_xml_exit(void);
 extern void set_filename(const char *filename, bool force);
 
@@ -602,10 +604,18 @@ extern int parse_dm4_buffer(sqlite3 *handle, const char *url, const char *buf, i
 extern int parse_shearwater_buffer(sqlite3 *handle, const char *url, const char *buf, int size, struct dive_table *table);
 
 extern int parse_file(const char *filename);
+
+/* binary snapshots of a loaded logbook, see snapshot.c */
+#define SNAPSHOT_KEY_SIZE 48
+extern char *snapshot_name(const char *filename);
+extern int load_dive_snapshot(const char *filename, const char *key);
+extern int save_dive_snapshot(const char *filename, const char *key);
 extern int parse_csv_file(const char *filename, int time, int depth, int temp, int po2f, int cnsf, int ndlf, int ttsf, int stopdepthf, int pressuref, int sepidx, const char *csvtemplate, int units);
 extern int parse_manual_file(const char *filename, int separator_index, int units, int number, int date, int time, int duration, int location, int gps, int maxdepth, int meandepth, int buddy, int notes, int weight, int tags);
 
 extern int save_dives(const char *filename);
+struct membuffer;
+extern void save_dives_buffer(struct membuffer *b, const bool select_only);
 extern int save_dives_logic(const char *filename, bool select_only);
 extern int save_dive(FILE *f, struct dive *dive);
 extern int export_dives_xslt(const char *filename, const bool selected, const char *export_xslt);
@@ -639,12 +649,17 @@ extern void shift_times(const timestamp_t amount);
 extern timestamp_t get_times();
 
 extern xsltStylesheetPtr get_stylesheet(const char *name);
+extern void free_stylesheets(void);
+/* reports what get_stylesheet() compiled and reused for one import or export */
+extern void start_stylesheet_batch(void);
+extern void end_stylesheet_batch(const char *what);
 
 extern timestamp_t utc_mktime(struct tm *tm);
 extern void utc_mkdate(timestamp_t, struct tm *tm);
 
 extern struct dive *alloc_dive(void);
 extern void record_dive(struct dive *dive);
+extern void add_dive_to_table(struct dive *dive, struct dive_table *table);
 extern void clear_dive(struct dive *dive);
 extern void copy_dive(struct dive *s, struct dive *d);
 extern void selective_copy_dive(struct dive *s, struct dive *d, struct dive_components what, bool clear);
@@ -656,9 +671,17 @@ extern void finish_sample(struct divecomputer *dc);
 extern bool has_hr_data(struct divecomputer *dc);
 
 extern void sort_table(struct dive_table *table);
+extern struct dive *get_dive_by_uniq_id(int id);
+extern int get_idx_by_uniq_id(int id);
+extern void invalidate_dive_indexes(void);
+extern void invalidate_dive_time_index(void);
+extern void dive_id_index_add(int idx);
 extern struct dive *fixup_dive(struct dive *dive);
 extern void fixup_dc_duration(struct divecomputer *dc);
 extern int dive_getUniqID(struct dive *d);
+extern void run_in_parallel(int nr, void (*fn)(void *data, int i), void *data);
+extern void lock_shared_dive_data(void);
+extern void unlock_shared_dive_data(void);
 extern unsigned int dc_airtemp(struct divecomputer *dc);
 extern unsigned int dc_watertemp(struct divecomputer *dc);
 extern struct dive *merge_dives(struct dive *a, struct dive *b, int offset, bool prefer_downloaded);
@@ -675,6 +698,22 @@ extern void remove_event(struct event *event);
 extern void update_event_name(struct dive *d, struct event* event, char *name);
 extern void per_cylinder_mean_depth(struct dive *dive, struct divecomputer *dc, int *mean, int *duration);
 extern int get_cylinder_index(struct dive *dive, struct event *ev);
+
+/* the gas switches of a divecomputer in time order, and how far we got in them */
+struct gas_switch {
+	int time;
+	int cylinder;
+};
+
+struct gas_timeline {
+	int nr;
+	struct gas_switch *switches;
+	int next, cylinder, time;
+};
+
+extern void init_gas_timeline(struct gas_timeline *timeline, struct dive *dive, struct divecomputer *dc);
+extern void free_gas_timeline(struct gas_timeline *timeline);
+extern int gas_timeline_cylinder(struct gas_timeline *timeline, int time);
 extern int nr_cylinders(struct dive *dive);
 extern int nr_weightsystems(struct dive *dive);
 
@@ -721,13 +760,18 @@ extern void subsurface_command_line_exit(int *, char ***);
 
 #define FRACTION(n, x) ((unsigned)(n) / (x)), ((unsigned)(n) % (x))
 
-extern double add_segment(double pressure, const struct gasmix *gasmix, int period_in_seconds, int setpoint, const struct dive *dive);
-extern void clear_deco(double surface_pressure);
-extern void dump_tissues(void);
+struct deco_state;
+extern double add_segment(struct deco_state *ds, double pressure, const struct gasmix *gasmix, int period_in_seconds, int setpoint, const struct dive *dive);
+extern double add_segment_ramp(struct deco_state *ds, double start_pressure, double end_pressure, const struct gasmix *gasmix, int period_in_seconds, int setpoint, const struct dive *dive);
+extern void clear_deco(struct deco_state *ds, double surface_pressure);
+extern double deco_tissue_tolerance(struct deco_state *ds, const struct dive *dive);
+extern void dump_tissues(struct deco_state *ds);
 extern unsigned int deco_allowed_depth(double tissues_tolerance, double surface_pressure, struct dive *dive, bool smooth);
+extern double deco_ndl(const struct deco_state *ds, double pressure, const struct gasmix *gasmix, int setpoint, struct dive *dive, double surface_pressure, double max_ndl);
 extern void set_gf(short gflow, short gfhigh, bool gf_low_at_maxdepth);
-extern void cache_deco_state(double, char **datap);
-extern double restore_deco_state(char *data);
+extern uint32_t deco_config_hash(void);
+extern void cache_deco_state(const struct deco_state *ds, struct deco_state **datap);
+extern double restore_deco_state(struct deco_state *ds, const struct deco_state *data);
 
 /* this should be converted to use our types */
 struct divedatapoint {
@@ -754,7 +798,7 @@ struct divedatapoint *create_dp(int time_incr, int depth, struct gasmix gasmix,
 #if DEBUG_PLAN
 void dump_plan(struct diveplan *diveplan);
 #endif
-int plan(struct diveplan *diveplan, char **cached_datap, bool is_planner, bool show_disclaimer);
+int plan(struct diveplan *diveplan, struct deco_state **cached_datap, bool is_planner, bool show_disclaimer);
 void delete_single_dive(int idx);
 
 struct event *get_next_event(struct event *event, char *name);
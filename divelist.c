@@ -10,12 +10,14 @@
  * void get_dive_gas(struct dive *dive, int *o2_p, int *he_p, int *o2low_p)
  * int total_weight(struct dive *dive)
  * int get_divenr(struct dive *dive)
- * double init_decompression(struct dive *dive)
+ * double init_decompression(struct deco_state *ds, struct dive *dive)
  * void update_cylinder_related_info(struct dive *dive)
+ * void update_dive_metrics(struct dive *dive)
  * void dump_trip_list(void)
  * dive_trip_t *find_matching_trip(timestamp_t when)
  * void insert_trip(dive_trip_t **dive_trip_p)
  * void remove_dive_from_trip(struct dive *dive)
+ * void link_dive_to_trip(struct dive *dive, dive_trip_t *trip)
  * void add_dive_to_trip(struct dive *dive, dive_trip_t *trip)
  * dive_trip_t *create_and_hookup_trip_from_dive(struct dive *dive)
  * void autogroup_dives(void)
@@ -27,6 +29,9 @@
  * void mark_divelist_changed(int changed)
  * int unsaved_changes()
  * void remove_autogen_trips()
+ * void set_divelist_notifier(const struct divelist_notifier *notifier)
+ * void notify_dive_changed(struct dive *dive)
+ * void notify_trip_changed(dive_trip_t *trip)
  */
 #include <unistd.h>
 #include <stdio.h>
@@ -43,6 +48,7 @@
 #include "divelist.h"
 #include "display.h"
 #include "planner.h"
+#include "deco.h"
 
 static short dive_list_changed = false;
 
@@ -52,6 +58,30 @@ dive_trip_t *dive_trip_list;
 
 unsigned int amount_selected;
 
+/* the UI listens to these to update its model in place */
+static const struct divelist_notifier *divelist_notifier;
+
+#define NOTIFY_DIVELIST(_what, _arg)					\
+	do {								\
+		if (divelist_notifier && divelist_notifier->_what)	\
+			divelist_notifier->_what(_arg);			\
+	} while (0)
+
+void set_divelist_notifier(const struct divelist_notifier *notifier)
+{
+	divelist_notifier = notifier;
+}
+
+void notify_dive_changed(struct dive *dive)
+{
+	NOTIFY_DIVELIST(dive_changed, dive);
+}
+
+void notify_trip_changed(dive_trip_t *trip)
+{
+	NOTIFY_DIVELIST(trip_changed, trip);
+}
+
 #if DEBUG_SELECTION_TRACKING
 void dump_selection(void)
 {
@@ -151,11 +181,9 @@ int total_weight(struct dive *dive)
 	return total_grams;
 }
 
-static int active_o2(struct dive *dive, struct divecomputer *dc, duration_t time)
+static int active_o2(struct dive *dive, struct gas_timeline *timeline, duration_t time)
 {
-	struct gasmix gas;
-	get_gas_at_time(dive, dc, time, &gas);
-	return get_o2(&gas);
+	return get_o2(&dive->cylinder[gas_timeline_cylinder(timeline, time.seconds)].gasmix);
 }
 
 /* calculate OTU for a dive - this only takes the first divecomputer into account */
@@ -164,7 +192,9 @@ static int calculate_otu(struct dive *dive)
 	int i;
 	double otu = 0.0;
 	struct divecomputer *dc = &dive->dc;
+	struct gas_timeline timeline;
 
+	init_gas_timeline(&timeline, dive, dc);
 	for (i = 1; i < dc->samples; i++) {
 		int t;
 		int po2;
@@ -174,12 +204,13 @@ static int calculate_otu(struct dive *dive)
 		if (sample->setpoint.mbar) {
 			po2 = sample->setpoint.mbar;
 		} else {
-			int o2 = active_o2(dive, dc, sample->time);
+			int o2 = active_o2(dive, &timeline, sample->time);
 			po2 = o2 * depth_to_atm(sample->depth.mm, dive);
 		}
 		if (po2 >= 500)
 			otu += pow((po2 - 500) / 1000.0, 0.83) * t / 30.0;
 	}
+	free_gas_timeline(&timeline);
 	return rint(otu);
 }
 /* calculate CNS for a dive - this only takes the first divecomputer into account */
@@ -208,6 +239,7 @@ static int calculate_cns(struct dive *dive)
 	struct divecomputer *dc = &dive->dc;
 	struct dive *prev_dive;
 	timestamp_t endtime;
+	struct gas_timeline timeline;
 
 	/* shortcut */
 	if (dive->cns)
@@ -229,6 +261,7 @@ static int calculate_cns(struct dive *dive)
 		}
 	}
 	/* Caclulate the cns for each sample in this dive and sum them */
+	init_gas_timeline(&timeline, dive, dc);
 	for (i = 1; i < dc->samples; i++) {
 		int t;
 		int po2;
@@ -238,7 +271,7 @@ static int calculate_cns(struct dive *dive)
 		if (sample->setpoint.mbar) {
 			po2 = sample->setpoint.mbar;
 		} else {
-			int o2 = active_o2(dive, dc, sample->time);
+			int o2 = active_o2(dive, &timeline, sample->time);
 			po2 = o2 * depth_to_atm(sample->depth.mm, dive);
 		}
 		/* CNS don't increse when below 500 matm */
@@ -251,6 +284,7 @@ static int calculate_cns(struct dive *dive)
 		j--;
 		cns += ((double)t) / ((double)cns_table[j][1]) * 100;
 	}
+	free_gas_timeline(&timeline);
 	/* save calculated cns in dive struct */
 	dive->cns = cns;
 	return dive->cns;
@@ -305,7 +339,7 @@ static int calculate_sac(struct dive *dive)
 }
 
 /* for now we do this based on the first divecomputer */
-static void add_dive_to_deco(struct dive *dive)
+static void add_dive_to_deco(struct deco_state *ds, struct dive *dive)
 {
 	struct divecomputer *dc = &dive->dc;
 	int i;
@@ -315,46 +349,291 @@ static void add_dive_to_deco(struct dive *dive)
 	for (i = 1; i < dc->samples; i++) {
 		struct sample *psample = dc->sample + i - 1;
 		struct sample *sample = dc->sample + i;
-		int t0 = psample->time.seconds;
-		int t1 = sample->time.seconds;
-		int j;
-
-		for (j = t0; j < t1; j++) {
-			int depth = interpolate(psample->depth.mm, sample->depth.mm, j - t0, t1 - t0);
-			(void)add_segment(depth_to_mbar(depth, dive) / 1000.0,
-					  &dive->cylinder[sample->sensor].gasmix, 1, sample->setpoint.mbar, dive);
+
+		(void)add_segment_ramp(ds, depth_to_mbar(psample->depth.mm, dive) / 1000.0, depth_to_mbar(sample->depth.mm, dive) / 1000.0,
+				       &dive->cylinder[sample->sensor].gasmix, sample->time.seconds - psample->time.seconds,
+				       sample->setpoint.mbar, dive);
+	}
+}
+
+/*
+ * Hash index from dive id to the position in dive_table, so looking up a
+ * dive by id doesn't have to scan the whole table. Open addressing with
+ * linear probing, at most half full.
+ *
+ * Adding and removing dives (record_dive(), add_single_dive(),
+ * delete_single_dive()) updates the index in place. Sorting the table
+ * (sort_table()) or changing the id of a dive invalidates it, and the next
+ * lookup rebuilds it. Editing a dive otherwise doesn't affect it.
+ */
+struct dive_id_slot {
+	int id;
+	int idx; /* -1 for an empty slot */
+};
+
+static struct dive_id_slot *dive_id_index;
+static unsigned int dive_id_index_size; /* a power of two */
+static bool dive_id_index_valid;
+
+static inline unsigned int dive_id_hash(int id)
+{
+	return ((unsigned int)id * 2654435761u) & (dive_id_index_size - 1);
+}
+
+static void dive_id_index_insert(int id, int idx)
+{
+	unsigned int i = dive_id_hash(id);
+
+	while (dive_id_index[i].idx >= 0) {
+		/* with duplicate ids the first dive wins, like with a linear search */
+		if (dive_id_index[i].id == id) {
+			if (idx < dive_id_index[i].idx)
+				dive_id_index[i].idx = idx;
+			return;
 		}
+		i = (i + 1) & (dive_id_index_size - 1);
 	}
+	dive_id_index[i].id = id;
+	dive_id_index[i].idx = idx;
 }
 
-int get_divenr(struct dive *dive)
+static bool rebuild_dive_id_index(void)
 {
-	int i;
-	struct dive *d;
-	// tempting as it may be, don't die when called with dive=NULL
-	if (dive)
-		for_each_dive(i, d) {
-			if (d->id == dive->id) // don't compare pointers, we could be passing in a copy of the dive
-				return i;
+	unsigned int size = 64, i;
+
+	while (size < 2 * (unsigned int)dive_table.nr + 2)
+		size *= 2;
+	if (size != dive_id_index_size) {
+		struct dive_id_slot *index = realloc(dive_id_index, size * sizeof(*index));
+		if (!index)
+			return false;
+		dive_id_index = index;
+		dive_id_index_size = size;
+	}
+	for (i = 0; i < size; i++)
+		dive_id_index[i].idx = -1;
+	for (i = 0; i < (unsigned int)dive_table.nr; i++)
+		dive_id_index_insert(dive_table.dives[i]->id, i);
+	dive_id_index_valid = true;
+	return true;
+}
+
+/* empty slot i, moving up the entries after it that would no longer be found */
+static void dive_id_index_delete_slot(unsigned int i)
+{
+	unsigned int j = i, mask = dive_id_index_size - 1;
+
+	for (;;) {
+		unsigned int home;
+
+		j = (j + 1) & mask;
+		if (dive_id_index[j].idx < 0)
+			break;
+		/* the entry at j can fill the hole unless its home slot lies between the two */
+		home = dive_id_hash(dive_id_index[j].id);
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		dive_id_index[i] = dive_id_index[j];
+		i = j;
+	}
+	dive_id_index[i].idx = -1;
+}
+
+/* dives were moved around in dive_table, or changed their id */
+void invalidate_dive_indexes(void)
+{
+	dive_id_index_valid = false;
+	invalidate_dive_time_index();
+}
+
+/* the dive at position idx was just inserted into dive_table, the ones after it moved up by one */
+void dive_id_index_add(int idx)
+{
+	unsigned int i;
+
+	invalidate_dive_time_index();
+	if (!dive_id_index_valid)
+		return;
+	if (2 * (unsigned int)dive_table.nr + 2 > dive_id_index_size) {
+		dive_id_index_valid = false;
+		return;
+	}
+	if (idx < dive_table.nr - 1) {
+		for (i = 0; i < dive_id_index_size; i++) {
+			if (dive_id_index[i].idx >= idx)
+				dive_id_index[i].idx++;
+		}
+	}
+	dive_id_index_insert(dive_table.dives[idx]->id, idx);
+}
+
+/* the dive with the given id at position idx was just removed from dive_table */
+static void dive_id_index_remove(int id, int idx)
+{
+	unsigned int i;
+	int j;
+
+	invalidate_dive_time_index();
+	if (!dive_id_index_valid)
+		return;
+	for (i = dive_id_hash(id); dive_id_index[i].idx >= 0; i = (i + 1) & (dive_id_index_size - 1)) {
+		if (dive_id_index[i].id == id) {
+			if (dive_id_index[i].idx == idx)
+				dive_id_index_delete_slot(i);
+			break;
+		}
+	}
+	for (i = 0; i < dive_id_index_size; i++) {
+		if (dive_id_index[i].idx > idx)
+			dive_id_index[i].idx--;
+	}
+	/* another dive with the same id? */
+	for (j = idx; j < dive_table.nr; j++) {
+		if (dive_table.dives[j]->id == id) {
+			dive_id_index_insert(id, j);
+			break;
+		}
+	}
+}
+
+/*
+ * Position of the dive with the given id in dive_table, or -1.
+ *
+ * Only hits are checked against dive_table: if the dive at the indexed
+ * position doesn't have the id (anymore), the index is rebuilt. A miss
+ * is trusted, so a dive whose id was changed in place is not found by
+ * its new id until the index is invalidated - code that changes the id
+ * of a dive in the table has to call invalidate_dive_indexes().
+ */
+static int lookup_dive_id(int id)
+{
+	unsigned int i;
+	int idx;
+
+	if (!dive_id_index_valid && !rebuild_dive_id_index()) {
+		for (idx = 0; idx < dive_table.nr; idx++) {
+			if (dive_table.dives[idx]->id == id)
+				return idx;
 		}
+		return -1;
+	}
+	for (i = dive_id_hash(id); (idx = dive_id_index[i].idx) >= 0; i = (i + 1) & (dive_id_index_size - 1)) {
+		if (dive_id_index[i].id != id)
+			continue;
+		/* the dive moved or changed its id behind our back */
+		if (idx >= dive_table.nr || dive_table.dives[idx]->id != id) {
+			dive_id_index_valid = false;
+			return lookup_dive_id(id);
+		}
+		return idx;
+	}
 	return -1;
 }
 
+struct dive *get_dive_by_uniq_id(int id)
+{
+	int idx = lookup_dive_id(id);
+
+#ifdef DEBUG
+	if (idx < 0) {
+		fprintf(stderr, "Invalid id %x passed to get_dive_by_diveid, try to fix the code\n", id);
+		exit(1);
+	}
+#endif
+	return idx < 0 ? NULL : dive_table.dives[idx];
+}
+
+/* like the dive iteration this replaces, returns dive_table.nr for unknown ids */
+int get_idx_by_uniq_id(int id)
+{
+	int idx = lookup_dive_id(id);
+
+#ifdef DEBUG
+	if (idx < 0) {
+		fprintf(stderr, "Invalid id %x passed to get_dive_by_diveid, try to fix the code\n", id);
+		exit(1);
+	}
+#endif
+	return idx < 0 ? dive_table.nr : idx;
+}
+
+int get_divenr(struct dive *dive)
+{
+	// tempting as it may be, don't die when called with dive=NULL
+	if (!dive)
+		return -1;
+	// don't compare pointers, we could be passing in a copy of the dive
+	return lookup_dive_id(dive->id);
+}
+
+/*
+ * Fingerprint everything add_dive_to_deco() and the surface interval
+ * before this dive depend on, chained to the key of the previous dive.
+ */
+static uint32_t deco_snapshot_key(uint32_t key, const struct dive *dive)
+{
+	const struct divecomputer *dc = &dive->dc;
+	int i;
+
+	key = fnv_hash(key, &dive->id, sizeof(dive->id));
+	key = fnv_hash(key, &dive->when, sizeof(dive->when));
+	key = fnv_hash(key, &dive->duration, sizeof(dive->duration));
+	key = fnv_hash(key, &dive->surface_pressure, sizeof(dive->surface_pressure));
+	key = fnv_hash(key, &dive->salinity, sizeof(dive->salinity));
+	key = fnv_hash(key, &dc->salinity, sizeof(dc->salinity));
+	for (i = 0; i < MAX_CYLINDERS; i++)
+		key = fnv_hash(key, &dive->cylinder[i].gasmix, sizeof(dive->cylinder[i].gasmix));
+	key = fnv_hash(key, &dc->samples, sizeof(dc->samples));
+	for (i = 0; i < dc->samples; i++) {
+		const struct sample *sample = dc->sample + i;
+
+		key = fnv_hash(key, &sample->time, sizeof(sample->time));
+		key = fnv_hash(key, &sample->depth, sizeof(sample->depth));
+		key = fnv_hash(key, &sample->setpoint, sizeof(sample->setpoint));
+		key = fnv_hash(key, &sample->sensor, sizeof(sample->sensor));
+	}
+	return key;
+}
+
+static void save_deco_snapshot(struct dive *dive, uint32_t key, const struct deco_state *ds, timestamp_t lasttime, double tissue_tolerance)
+{
+	struct deco_snapshot *snap = dive->deco_snapshot;
+
+	if (!snap) {
+		snap = malloc(sizeof(*snap));
+		if (!snap)
+			return;
+		dive->deco_snapshot = snap;
+	}
+	snap->key = key;
+	snap->lasttime = lasttime;
+	snap->tissue_tolerance = tissue_tolerance;
+	snap->ds = *ds;
+}
+
 static struct gasmix air = { .o2.permille = O2_IN_AIR, .he.permille = 0 };
 
 /* take into account previous dives until there is a 48h gap between dives */
-double init_decompression(struct dive *dive)
+double init_decompression(struct deco_state *ds, struct dive *dive)
 {
 	int i, divenr = -1;
 	unsigned int surface_time;
 	timestamp_t when, lasttime = 0;
 	bool deco_init = false;
 	double tissue_tolerance, surface_pressure;
+	uint32_t key;
+	struct deco_snapshot *pending = NULL;
 
 	if (!dive)
 		return 0.0;
 
 	tissue_tolerance = surface_pressure = get_surface_pressure_in_mbar(dive, true) / 1000.0;
+	/*
+	 * The tissues of the chain only depend on the earlier dives, so the
+	 * snapshots are shared by all the dives after them. This dive only
+	 * comes in through the tolerance, which is recalculated at the end.
+	 */
+	key = deco_config_hash();
 	divenr = get_divenr(dive);
 	when = dive->when;
 	i = divenr;
@@ -381,46 +660,69 @@ double init_decompression(struct dive *dive)
 		if (dive->divetrip && dive->divetrip != pdive->divetrip)
 			continue;
 		surface_pressure = get_surface_pressure_in_mbar(pdive, true) / 1000.0;
+		/* the previous calculation of this chain got this far already? */
+		key = deco_snapshot_key(key, pdive);
+		if (pdive->deco_snapshot && pdive->deco_snapshot->key == key) {
+			pending = pdive->deco_snapshot;
+			continue;
+		}
+		if (pending) {
+			(void)restore_deco_state(ds, &pending->ds);
+			tissue_tolerance = pending->tissue_tolerance;
+			lasttime = pending->lasttime;
+			deco_init = true;
+			pending = NULL;
+		}
 		if (!deco_init) {
-			clear_deco(surface_pressure);
+			clear_deco(ds, surface_pressure);
 			deco_init = true;
 #if DECO_CALC_DEBUG & 2
-			dump_tissues();
+			dump_tissues(ds);
 #endif
 		}
-		add_dive_to_deco(pdive);
+		add_dive_to_deco(ds, pdive);
 #if DECO_CALC_DEBUG & 2
 		printf("added dive #%d\n", pdive->number);
-		dump_tissues();
+		dump_tissues(ds);
 #endif
 		if (pdive->when > lasttime) {
 			surface_time = pdive->when - lasttime;
 			lasttime = pdive->when + pdive->duration.seconds;
-			tissue_tolerance = add_segment(surface_pressure, &air, surface_time, 0, dive);
+			tissue_tolerance = add_segment(ds, surface_pressure, &air, surface_time, 0, pdive);
 #if DECO_CALC_DEBUG & 2
 			printf("after surface intervall of %d:%02u\n", FRACTION(surface_time, 60));
-			dump_tissues();
+			dump_tissues(ds);
 #endif
 		}
+		save_deco_snapshot(pdive, key, ds, lasttime, tissue_tolerance);
+	}
+	if (pending) {
+		(void)restore_deco_state(ds, &pending->ds);
+		tissue_tolerance = pending->tissue_tolerance;
+		lasttime = pending->lasttime;
+		deco_init = true;
 	}
+	if (deco_init)
+		tissue_tolerance = deco_tissue_tolerance(ds, dive);
 	/* add the final surface time */
 	if (lasttime && dive->when > lasttime) {
 		surface_time = dive->when - lasttime;
 		surface_pressure = get_surface_pressure_in_mbar(dive, true) / 1000.0;
-		tissue_tolerance = add_segment(surface_pressure, &air, surface_time, 0, dive);
+		tissue_tolerance = add_segment(ds, surface_pressure, &air, surface_time, 0, dive);
 #if DECO_CALC_DEBUG & 2
 		printf("after surface intervall of %d:%02u\n", FRACTION(surface_time, 60));
-		dump_tissues();
+		dump_tissues(ds);
 #endif
 	}
 	if (!deco_init) {
 		surface_pressure = get_surface_pressure_in_mbar(dive, true) / 1000.0;
-		clear_deco(surface_pressure);
+		clear_deco(ds, surface_pressure);
 #if DECO_CALC_DEBUG & 2
 		printf("no previous dive\n");
-		dump_tissues();
+		dump_tissues(ds);
 #endif
 	}
+	ds->tissue_tolerance = tissue_tolerance;
 	return tissue_tolerance;
 }
 
@@ -431,9 +733,23 @@ void update_cylinder_related_info(struct dive *dive)
 		dive->otu = calculate_otu(dive);
 		if (dive->maxcns == 0)
 			dive->maxcns = calculate_cns(dive);
+		free(dive->gas_string);
+		dive->gas_string = get_dive_gas_string(dive);
+		dive->metrics_valid = true;
 	}
 }
 
+/*
+ * The values above only change with the samples, cylinders or time of
+ * a dive, so they are kept in the dive until invalidate_dive_metrics()
+ * is called for it.
+ */
+void update_dive_metrics(struct dive *dive)
+{
+	if (dive && !dive->metrics_valid)
+		update_cylinder_related_info(dive);
+}
+
 #define MAX_GAS_STRING 80
 #define UTF8_ELLIPSIS "\xE2\x80\xA6"
 
@@ -641,18 +957,22 @@ void remove_dive_from_trip(struct dive *dive, short was_autogen)
 	else
 		dive->tripflag = NO_TRIP;
 	assert(trip->nrdives > 0);
-	if (!--trip->nrdives)
+	--trip->nrdives;
+	/* tell the dive list while the trip is still around */
+	NOTIFY_DIVELIST(dive_trip_changed, dive);
+	if (!trip->nrdives)
 		delete_trip(trip);
 	else if (trip->when == dive->when)
 		find_new_trip_start_time(trip);
 }
 
-void add_dive_to_trip(struct dive *dive, dive_trip_t *trip)
+/*
+ * The parsers use this for dives that aren't in the dive table yet - maybe
+ * on other threads - so the dive list isn't told about them.
+ */
+void link_dive_to_trip(struct dive *dive, dive_trip_t *trip)
 {
-	if (dive->divetrip == trip)
-		return;
-	assert(trip->when);
-	remove_dive_from_trip(dive, false);
+	assert(!dive->divetrip);
 	trip->nrdives++;
 	dive->divetrip = trip;
 	dive->tripflag = ASSIGNED_TRIP;
@@ -668,6 +988,16 @@ void add_dive_to_trip(struct dive *dive, dive_trip_t *trip)
 		trip->when = dive->when;
 }
 
+void add_dive_to_trip(struct dive *dive, dive_trip_t *trip)
+{
+	if (dive->divetrip == trip)
+		return;
+	assert(trip->when);
+	remove_dive_from_trip(dive, false);
+	link_dive_to_trip(dive, trip);
+	NOTIFY_DIVELIST(dive_trip_changed, dive);
+}
+
 dive_trip_t *create_and_hookup_trip_from_dive(struct dive *dive)
 {
 	dive_trip_t *dive_trip = calloc(1, sizeof(dive_trip_t));
@@ -706,8 +1036,10 @@ void autogroup_dives(void)
 		if (lastdive && dive->when < lastdive->when + TRIP_THRESHOLD) {
 			dive_trip_t *trip = lastdive->divetrip;
 			add_dive_to_trip(dive, trip);
-			if (dive->location && !trip->location)
+			if (dive->location && !trip->location) {
 				trip->location = strdup(dive->location);
+				NOTIFY_DIVELIST(trip_changed, trip);
+			}
 			lastdive = dive;
 			continue;
 		}
@@ -730,12 +1062,14 @@ void delete_single_dive(int idx)
 	struct dive *dive = get_dive(idx);
 	if (!dive)
 		return; /* this should never happen */
+	NOTIFY_DIVELIST(dive_removed, dive);
 	remove_dive_from_trip(dive, false);
 	if (dive->selected)
 		deselect_dive(idx);
 	for (i = idx; i < dive_table.nr - 1; i++)
 		dive_table.dives[i] = dive_table.dives[i + 1];
 	dive_table.dives[--dive_table.nr] = NULL;
+	dive_id_index_remove(dive->id, idx);
 	/* free all allocations */
 	free(dive->dc.sample);
 	free((void *)dive->location);
@@ -744,12 +1078,15 @@ void delete_single_dive(int idx)
 	free((void *)dive->buddy);
 	free((void *)dive->suit);
 	taglist_free(dive->tag_list);
+	free(dive->deco_snapshot);
+	free(dive->gas_string);
 	free(dive);
 }
 
 void add_single_dive(int idx, struct dive *dive)
 {
 	int i;
+	struct dive *added = dive;
 	dive_table.nr++;
 	if (dive->selected)
 		amount_selected++;
@@ -758,6 +1095,8 @@ void add_single_dive(int idx, struct dive *dive)
 		dive_table.dives[i] = dive;
 		dive = tmp;
 	}
+	dive_id_index_add(idx);
+	NOTIFY_DIVELIST(dive_added, added);
 }
 
 bool consecutive_selected()
@@ -807,6 +1146,7 @@ struct dive *merge_two_dives(struct dive *a, struct dive *b)
 	// why?
 	// because this way one of the previously selected ids is still around
 	res->id = id;
+	invalidate_dive_indexes();
 	mark_divelist_changed(true);
 	return res;
 }
@@ -885,6 +1225,7 @@ void combine_trips(struct dive_trip *trip_a, struct dive_trip *trip_b)
 	 * calls delete_trip(trip_b) when the last dive has been moved */
 	while (trip_b->dives)
 		add_dive_to_trip(trip_b->dives, trip_a);
+	NOTIFY_DIVELIST(trip_changed, trip_a);
 }
 
 void mark_divelist_changed(int changed)
@@ -1025,6 +1366,7 @@ void process_dives(bool is_imported, bool prefer_imported)
 		delete_single_dive(i + 1);
 		// keep the id or the first dive for the merged dive
 		merged->id = id;
+		invalidate_dive_indexes();
 	}
 	/* make sure no dives are still marked as downloaded */
 	for (i = 1; i < dive_table.nr; i++)
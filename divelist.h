@@ -6,12 +6,14 @@ extern "C" {
 #endif
 
 struct dive;
+struct deco_state;
 
 extern void update_cylinder_related_info(struct dive *);
+extern void update_dive_metrics(struct dive *);
 extern void mark_divelist_changed(int);
 extern int unsaved_changes(void);
 extern void remove_autogen_trips(void);
-extern double init_decompression(struct dive *dive);
+extern double init_decompression(struct deco_state *ds, struct dive *dive);
 
 /* divelist core logic functions */
 extern void process_dives(bool imported, bool prefer_imported);
@@ -39,6 +41,20 @@ extern struct dive *last_selected_dive();
 extern bool is_trip_before_after(struct dive *dive, bool before);
 extern void set_dive_nr_for_current_dive();
 
+/* fine grained change notifications for the dive list model;
+ * dive_trip_changed is sent while the dive is detached from its old
+ * trip and again once it is attached to the new one */
+struct divelist_notifier {
+	void (*dive_added)(struct dive *dive);
+	void (*dive_removed)(struct dive *dive);
+	void (*dive_trip_changed)(struct dive *dive);
+	void (*dive_changed)(struct dive *dive);
+	void (*trip_changed)(dive_trip_t *trip);
+};
+extern void set_divelist_notifier(const struct divelist_notifier *notifier);
+extern void notify_dive_changed(struct dive *dive);
+extern void notify_trip_changed(dive_trip_t *trip);
+
 #ifdef DEBUG_TRIP
 extern void dump_selection(void);
 extern void dump_trip_list(void);
@@ -0,0 +1,148 @@
+#include "divesearch.h"
+#include "dive.h"
+
+DiveSearchIndex::DiveSearchIndex() : changes(0)
+{
+}
+
+DiveSearchIndex *DiveSearchIndex::instance()
+{
+	static DiveSearchIndex *self = new DiveSearchIndex();
+	return self;
+}
+
+QStringList DiveSearchIndex::tokenize(const QString &text)
+{
+	QStringList tokens;
+	QString folded = text.toCaseFolded();
+	int start = -1;
+
+	for (int i = 0; i <= folded.length(); i++) {
+		bool inWord = i < folded.length() && folded.at(i).isLetterOrNumber();
+		if (inWord && start < 0) {
+			start = i;
+		} else if (!inWord && start >= 0) {
+			tokens.append(folded.mid(start, i - start));
+			start = -1;
+		}
+	}
+	return tokens;
+}
+
+// all the text we search in, one field per line
+QByteArray DiveSearchIndex::indexedText(struct dive *dive)
+{
+	QByteArray text;
+	struct tag_entry *tag;
+
+	text.append(dive->location).append('\n');
+	text.append(dive->notes).append('\n');
+	text.append(dive->buddy).append('\n');
+	text.append(dive->divemaster).append('\n');
+	text.append(dive->suit).append('\n');
+	for (tag = dive->tag_list; tag; tag = tag->next)
+		text.append(tag->tag->name).append('\n');
+	if (dive->divetrip)
+		text.append(dive->divetrip->location);
+	return text;
+}
+
+void DiveSearchIndex::addTerms(int diveId, const QByteArray &text)
+{
+	QSet<QString> words = tokenize(QString::fromUtf8(text)).toSet();
+	Q_FOREACH (const QString &word, words)
+		terms[word].insert(diveId);
+}
+
+void DiveSearchIndex::removeTerms(int diveId, const QByteArray &text)
+{
+	QSet<QString> words = tokenize(QString::fromUtf8(text)).toSet();
+	Q_FOREACH (const QString &word, words) {
+		QMap<QString, QSet<int> >::iterator it = terms.find(word);
+		if (it == terms.end())
+			continue;
+		it->remove(diveId);
+		if (it->isEmpty())
+			terms.erase(it);
+	}
+}
+
+void DiveSearchIndex::updateDive(struct dive *dive)
+{
+	QByteArray text = indexedText(dive);
+	QHash<int, QByteArray>::iterator it = diveText.find(dive->id);
+
+	if (it != diveText.end()) {
+		if (*it == text)
+			return;
+		removeTerms(dive->id, *it);
+		*it = text;
+	} else {
+		diveText.insert(dive->id, text);
+	}
+	addTerms(dive->id, text);
+	changes++;
+}
+
+void DiveSearchIndex::removeDive(int diveId)
+{
+	QHash<int, QByteArray>::iterator it = diveText.find(diveId);
+
+	if (it == diveText.end())
+		return;
+	removeTerms(diveId, *it);
+	diveText.erase(it);
+	changes++;
+}
+
+// bring the index up to date with the dive table, only re-indexing dives whose text changed
+void DiveSearchIndex::sync()
+{
+	QSet<int> seen;
+	struct dive *dive;
+	int i;
+
+	for_each_dive (i, dive) {
+		seen.insert(dive->id);
+		updateDive(dive);
+	}
+	Q_FOREACH (int diveId, diveText.keys()) {
+		if (!seen.contains(diveId))
+			removeDive(diveId);
+	}
+}
+
+void DiveSearchIndex::clear()
+{
+	terms.clear();
+	diveText.clear();
+	changes++;
+}
+
+QSet<int> DiveSearchIndex::search(const QString &query) const
+{
+	QSet<int> result;
+	QStringList words = tokenize(query);
+
+	for (int i = 0; i < words.count(); i++) {
+		const QString &word = words.at(i);
+		QSet<int> matches;
+		// all the terms starting with word are next to each other in the map
+		QMap<QString, QSet<int> >::const_iterator it = terms.lowerBound(word);
+		for (; it != terms.constEnd() && it.key().startsWith(word); ++it)
+			matches.unite(it.value());
+		if (i == 0)
+			result = matches;
+		else
+			result.intersect(matches);
+		if (result.isEmpty())
+			break;
+	}
+	return result;
+}
+
+// changes whenever the result of a search might have changed
+unsigned int DiveSearchIndex::generation() const
+{
+	return changes;
+}
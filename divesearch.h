@@ -0,0 +1,39 @@
+#ifndef DIVESEARCH_H
+#define DIVESEARCH_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QMap>
+#include <QHash>
+#include <QSet>
+
+struct dive;
+
+/*
+ * Inverted index over the free text of the dives (location, notes,
+ * buddy, divemaster, suit, tags and the trip location). Words are case
+ * folded; every word of a query has to be the start of a word of the dive.
+ */
+class DiveSearchIndex {
+public:
+	DiveSearchIndex();
+	static DiveSearchIndex *instance();
+	void updateDive(struct dive *dive);
+	void removeDive(int diveId);
+	void sync();
+	void clear();
+	QSet<int> search(const QString &query) const;
+	unsigned int generation() const;
+	static QStringList tokenize(const QString &text);
+
+private:
+	static QByteArray indexedText(struct dive *dive);
+	void addTerms(int diveId, const QByteArray &text);
+	void removeTerms(int diveId, const QByteArray &text);
+	QMap<QString, QSet<int> > terms;
+	QHash<int, QByteArray> diveText;
+	unsigned int changes;
+};
+
+#endif // DIVESEARCH_H
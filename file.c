@@ -7,9 +7,13 @@
 #include "gettext.h"
 #include <zip.h>
 #include <time.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 
 #include "dive.h"
 #include "file.h"
+#include "device.h"
 
 /* Crazy windows sh*t */
 #ifndef O_BINARY
@@ -24,6 +28,7 @@ int readfile(const char *filename, struct memblock *mem)
 
 	mem->buffer = NULL;
 	mem->size = 0;
+	mem->mapped = false;
 
 	fd = subsurface_open(filename, O_RDONLY | O_BINARY, 0);
 	if (fd < 0)
@@ -61,6 +66,57 @@ out:
 	return ret;
 }
 
+/*
+ * Like readfile(), but map the file read-only instead of copying it
+ * when we can. The parsers rely on the buffer being NUL-terminated,
+ * and only the zero-filled tail of the last page gives us that - so a
+ * file that is an exact number of pages (or anything we can't map,
+ * like a pipe) is still read into memory. Release with unmapfile().
+ */
+int mapfile(const char *filename, struct memblock *mem)
+{
+#ifndef WIN32
+	int fd;
+	struct stat st;
+	void *map;
+
+	mem->buffer = NULL;
+	mem->size = 0;
+	mem->mapped = false;
+	fd = subsurface_open(filename, O_RDONLY | O_BINARY, 0);
+	if (fd < 0)
+		return fd;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size ||
+	    st.st_size % sysconf(_SC_PAGESIZE) == 0) {
+		close(fd);
+		return readfile(filename, mem);
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return readfile(filename, mem);
+	mem->buffer = map;
+	mem->size = st.st_size;
+	mem->mapped = true;
+	return st.st_size;
+#else
+	return readfile(filename, mem);
+#endif
+}
+
+void unmapfile(struct memblock *mem)
+{
+#ifndef WIN32
+	if (mem->mapped)
+		munmap(mem->buffer, mem->size);
+	else
+#endif
+		free(mem->buffer);
+	mem->buffer = NULL;
+	mem->size = 0;
+	mem->mapped = false;
+}
+
 
 static void zip_read(struct zip_file *file, const char *filename)
 {
@@ -353,18 +409,72 @@ static void parse_file_buffer(const char *filename, struct memblock *mem)
 	parse_xml_buffer(filename, mem->buffer, mem->size, &dive_table, NULL);
 }
 
+/*
+ * Only big logbooks of our own get a snapshot, and only when they are
+ * loaded into an empty session: then the snapshot is all we end up with.
+ */
+#define SNAPSHOT_MIN_SIZE (1024 * 1024)
+
+static bool wants_snapshot(const char *filename)
+{
+	const char *fmt = strrchr(filename, '.');
+
+	if (dive_table.nr || dive_trip_list)
+		return false;
+	return fmt && (!strcasecmp(fmt + 1, "XML") || !strcasecmp(fmt + 1, "SSRF"));
+}
+
+/* the sub-second part of the modification time, where the platform has one */
+static long mtime_nsec(const struct stat *st)
+{
+#if defined(__APPLE__)
+	return st->st_mtimespec.tv_nsec;
+#elif defined(WIN32)
+	return 0;
+#else
+	return st->st_mtim.tv_nsec;
+#endif
+}
+
+/* the snapshot is good for as long as the file has the same size and modification time */
+static int file_snapshot_key(const char *filename, char *key)
+{
+	struct stat st;
+	int ret, fd;
+
+	fd = subsurface_open(filename, O_RDONLY | O_BINARY, 0);
+	if (fd < 0)
+		return fd;
+	ret = fstat(fd, &st);
+	close(fd);
+	if (ret < 0 || !S_ISREG(st.st_mode) || st.st_size < SNAPSHOT_MIN_SIZE)
+		return -1;
+	snprintf(key, SNAPSHOT_KEY_SIZE, "%lld %lld.%09ld", (long long)st.st_size, (long long)st.st_mtime, mtime_nsec(&st));
+	return 0;
+}
+
 int parse_file(const char *filename)
 {
 	struct git_repository *git;
 	const char *branch;
 	struct memblock mem;
-	char *fmt;
+	char *fmt, *snapshot = NULL;
+	char key[SNAPSHOT_KEY_SIZE], newkey[SNAPSHOT_KEY_SIZE];
 
 	git = is_git_repository(filename, &branch);
 	if (git && !git_load_dives(git, branch))
 		return 0;
 
-	if (readfile(filename, &mem) < 0) {
+	if (wants_snapshot(filename) && !file_snapshot_key(filename, key)) {
+		snapshot = snapshot_name(filename);
+		if (snapshot && !load_dive_snapshot(snapshot, key)) {
+			free(snapshot);
+			return 0;
+		}
+	}
+
+	if (mapfile(filename, &mem) < 0) {
+		free(snapshot);
 		/* we don't want to display an error if this was the default file */
 		if (prefs.default_filename && !strcmp(filename, prefs.default_filename))
 			return 0;
@@ -375,13 +485,247 @@ int parse_file(const char *filename)
 	fmt = strrchr(filename, '.');
 	if (fmt && (!strcasecmp(fmt + 1, "DB") || !strcasecmp(fmt + 1, "BAK"))) {
 		if (!try_to_open_db(filename, &mem)) {
-			free(mem.buffer);
+			unmapfile(&mem);
 			return 0;
 		}
 	}
 
 	parse_file_buffer(filename, &mem);
-	free(mem.buffer);
+	unmapfile(&mem);
+
+	/* don't keep a snapshot that would hide errors, or of a file that changed while we read it */
+	if (snapshot && !have_error_string() &&
+	    !file_snapshot_key(filename, newkey) && !strcmp(key, newkey))
+		save_dive_snapshot(snapshot, key);
+	free(snapshot);
+	return 0;
+}
+
+/*
+ * The generic CSV import: one sample per line, in the columns picked in
+ * the import dialog. This used to wrap the whole file in XML and run it
+ * through csv2xml.xslt; now we read it a block at a time and convert the
+ * fields the same way the stylesheet did.
+ */
+struct csv_columns {
+	int time, depth, temp, po2, cns, ndl, tts, stopdepth, pressure;
+	char separator;
+	bool imperial;
+};
+
+#define CSV_BLOCK_SIZE (64 * 1024)
+
+/* Like the XML parser, accept a decimal comma when there's no decimal point */
+static bool csv_value(const char *field, double *val)
+{
+	const char *end;
+
+	errno = 0;
+	*val = ascii_strtod(field, &end);
+	if (errno || end == field)
+		return false;
+	if (*end == ',' && IS_FP_SAME(*val, rint(*val)))
+		*val = strtod_flags(field, &end, 0);
+	return true;
+}
+
+/* seconds, m:s or h:m:s */
+static bool csv_time(const char *field, int *seconds)
+{
+	double part[3];
+	const char *p = field, *end;
+	int n = 0;
+
+	for (;;) {
+		part[n] = ascii_strtod(p, &end);
+		if (end == p)
+			return false;
+		if (++n == 3 || *end != ':')
+			break;
+		p = end + 1;
+	}
+	switch (n) {
+	case 1:
+		*seconds = floor(part[0] + 0.5);
+		break;
+	case 2:
+		*seconds = part[0] * 60 + part[1];
+		break;
+	case 3:
+		*seconds = part[0] * 3600 + part[1] * 60 + part[2];
+		break;
+	}
+	return true;
+}
+
+/* ndl and tts are plain seconds (or m:s), like sample times in our XML */
+static void csv_duration(const char *field, duration_t *duration)
+{
+	int min, sec;
+
+	switch (sscanf(field, "%d:%d", &min, &sec)) {
+	case 1:
+		duration->seconds = min;
+		break;
+	case 2:
+		duration->seconds = min * 60 + sec;
+		break;
+	}
+}
+
+static void csv_fill_sample(struct sample *sample, char **field, const struct csv_columns *cols)
+{
+	double val;
+
+	if (csv_value(field[cols->depth], &val))
+		sample->depth.mm = cols->imperial ? feet_to_mm(val) : rint(val * 1000);
+	if (cols->temp >= 0 && csv_value(field[cols->temp], &val)) {
+		/* Fahrenheit got rounded to a tenth of a degree Celsius */
+		if (cols->imperial)
+			val = floor((val - 32) * 50 / 9 + 0.5) / 10;
+		sample->temperature.mkelvin = C_to_mkelvin(val);
+		if (sample->temperature.mkelvin < ZERO_C_IN_MKELVIN - 40000 ||
+		    sample->temperature.mkelvin > ZERO_C_IN_MKELVIN + 70000)
+			sample->temperature.mkelvin = 0;
+	}
+	if (cols->po2 >= 0 && csv_value(field[cols->po2], &val))
+		sample->setpoint.mbar = rint(val * 1000);
+	if (cols->cns >= 0)
+		sample->cns = atoi(field[cols->cns]);
+	if (cols->ndl >= 0)
+		csv_duration(field[cols->ndl], &sample->ndl);
+	if (cols->tts >= 0)
+		csv_duration(field[cols->tts], &sample->tts);
+	if (cols->stopdepth >= 0 && csv_value(field[cols->stopdepth], &val)) {
+		/* feet got rounded to centimeters */
+		sample->stopdepth.mm = cols->imperial ? rint(val * 30.48) * 10 : rint(val * 1000);
+		sample->in_deco = val > 0;
+	}
+	/* pressures are in bar, or in mbar if they're big; zero means no reading */
+	if (cols->pressure >= 0 && csv_value(field[cols->pressure], &val) && val) {
+		if (fabs(val) < 5000)
+			val *= 1000;
+		if (fabs(val) > 5 && fabs(val) < 5000000)
+			sample->cylinderpressure.mbar = rint(val);
+	}
+}
+
+/* Split a line into its first nr fields; missing fields are empty */
+static void csv_split(char *line, char separator, char **field, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		field[i] = line;
+		line = strchr(line, separator);
+		if (!line)
+			break;
+		*line++ = 0;
+	}
+	while (++i < nr)
+		field[i] = "";
+}
+
+/* The end of the line starting at p, or NULL if we have to read more to know */
+static char *csv_eol(char *p, char *end, bool eof)
+{
+	while (p < end && *p != '\n' && *p != '\r')
+		p++;
+	if (p == end || (*p == '\r' && p + 1 == end))
+		return eof ? p : NULL;
+	return p;
+}
+
+static int parse_csv_samples(const char *filename, const struct csv_columns *cols)
+{
+	int fd, n, nr_fields, len = 0, size = CSV_BLOCK_SIZE;
+	int last_time_size = 64;
+	char *buf, **field, *last_time;
+	bool pending = false;
+	struct dive *dive;
+	struct divecomputer *dc;
+	struct sample *sample;
+	time_t now;
+	struct tm tm;
+
+	fd = subsurface_open(filename, O_RDONLY | O_BINARY, 0);
+	if (fd < 0)
+		return report_error(translate("gettextFromC", "Failed to read '%s'"), filename);
+
+	nr_fields = MAX(MAX(MAX(cols->time, cols->depth), MAX(cols->temp, cols->po2)),
+			MAX(MAX(cols->cns, cols->ndl), MAX(MAX(cols->tts, cols->stopdepth), cols->pressure))) + 1;
+	field = malloc(nr_fields * sizeof(*field));
+	buf = malloc(size + 1);
+	last_time = malloc(last_time_size);
+
+	/* the file doesn't have a date, so the dive starts now */
+	time(&now);
+	tm = *localtime(&now);
+	tm.tm_sec = 0;
+	dive = alloc_dive();
+	dive->when = utc_mktime(&tm);
+	dc = &dive->dc;
+
+	do {
+		char *p = buf, *end, *eol;
+
+		n = read(fd, buf + len, size - len);
+		if (n < 0)
+			break;
+		len += n;
+		end = buf + len;
+		while (p < end && (eol = csv_eol(p, end, !n)) != NULL) {
+			char *next = eol;
+			int seconds;
+
+			if (next < end && *next++ == '\r' && next < end && *next == '\n')
+				next++;
+			*eol = 0;
+			csv_split(p, cols->separator, field, nr_fields);
+			p = next;
+
+			/* of the lines with the same time, only the last one counts */
+			if (pending && strcmp(field[cols->time], last_time))
+				finish_sample(dc);
+			pending = false;
+			if (!csv_time(field[cols->time], &seconds))
+				continue;
+			if (strlen(field[cols->time]) >= last_time_size) {
+				last_time_size = strlen(field[cols->time]) + 1;
+				last_time = realloc(last_time, last_time_size);
+			}
+			strcpy(last_time, field[cols->time]);
+			sample = prepare_sample(dc);
+			sample->time.seconds = seconds;
+			csv_fill_sample(sample, field, cols);
+			pending = true;
+		}
+
+		/* keep the partial line, and make room if a line doesn't fit */
+		len = end - p;
+		memmove(buf, p, len);
+		if (len == size) {
+			size *= 2;
+			buf = realloc(buf, size + 1);
+		}
+	} while (n > 0);
+	if (pending)
+		finish_sample(dc);
+	close(fd);
+	free(buf);
+	free(field);
+	free(last_time);
+
+	if (n < 0) {
+		free(dc->sample);
+		free(dive);
+		return report_error(translate("gettextFromC", "Failed to read '%s'"), filename);
+	}
+	if (cols->po2 >= 0 && dc->samples)
+		dc->dctype = CCR;
+	/* the device node csv2xml.xslt declared with its <divecomputerid> */
+	create_device_node("csv", 0xffffffff, NULL, NULL, NULL);
+	record_dive(dive);
 	return 0;
 }
 
@@ -411,6 +755,17 @@ int parse_csv_file(const char *filename, int timef, int depthf, int tempf, int p
 	if (timef >= MAXCOLS || depthf >= MAXCOLS || tempf >= MAXCOLS || po2f >= MAXCOLS || cnsf >= MAXCOLS || ndlf >= MAXCOLS || cnsf >= MAXCOLS || stopdepthf >= MAXCOLS || pressuref >= MAXCOLS)
 		return report_error(translate("gettextFromC", "Maximum number of supported columns on CSV import is %d"), MAXCOLS);
 
+	if (filename == NULL)
+		return report_error("No CSV filename");
+
+	if (!strcmp(csvtemplate, "csv")) {
+		struct csv_columns columns = {
+			timef, depthf, tempf, po2f, cnsf, ndlf, ttsf, stopdepthf, pressuref,
+			sepidx == 0 ? '\t' : sepidx == 2 ? ';' : ',', unitidx != 0
+		};
+		return parse_csv_samples(filename, &columns);
+	}
+
 	snprintf(timebuf, MAXCOLDIGITS, "%d", timef);
 	snprintf(depthbuf, MAXCOLDIGITS, "%d", depthf);
 	snprintf(tempbuf, MAXCOLDIGITS, "%d", tempf);
@@ -458,9 +813,6 @@ int parse_csv_file(const char *filename, int timef, int depthf, int tempf, int p
 	params[pnr++] = separator_index;
 	params[pnr++] = NULL;
 
-	if (filename == NULL)
-		return report_error("No CSV filename");
-
 	if (try_to_xslt_open_csv(filename, &mem, csvtemplate))
 		return -1;
 
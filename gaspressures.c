@@ -10,11 +10,11 @@
  *                                  -> fill_missing_tank_pressures() -> fill_missing_segment_pressures()
  *                                                                   -> get_pr_interpolate_data()
  *
- *  The pr_track_t related functions below implement a linked list that is used by
- *  the majority of the functions below. The linked list covers a part of the dive profile
- *  for which there are no cylinder pressure data. Each element in the linked list
+ *  The pr_track_t related functions below implement a per-cylinder array of segments that
+ *  is used by the majority of the functions below. The array covers the parts of the dive profile
+ *  for which there are no cylinder pressure data. Each element in the array
  *  represents a segment between two consecutive points on the dive profile.
- *  pr_track_t is defined in gaspressures.h
+ *  pr_track_t and struct pr_track_list are defined in gaspressures.h
  */
 
 #include "dive.h"
@@ -22,58 +22,38 @@
 #include "profile.h"
 #include "gaspressures.h"
 
-static pr_track_t *pr_track_alloc(int start, int t_start)
+static pr_track_t *pr_track_add(struct pr_track_list *list, int start, int t_start, int idx)
 {
-	pr_track_t *pt = malloc(sizeof(pr_track_t));
+	pr_track_t *pt;
+
+	if (list->nr >= list->allocated) {
+		int allocated = (list->allocated + 8) * 3 / 2;
+		pt = realloc(list->track, allocated * sizeof(pr_track_t));
+		if (!pt)
+			return NULL;
+		list->track = pt;
+		list->allocated = allocated;
+	}
+	pt = list->track + list->nr++;
 	pt->start = start;
 	pt->end = 0;
 	pt->t_start = pt->t_end = t_start;
 	pt->pressure_time = 0;
-	pt->next = NULL;
+	pt->idx_start = pt->idx_end = idx;
 	return pt;
 }
 
-/* poor man's linked list */
-static pr_track_t *list_last(pr_track_t *list)
-{
-	pr_track_t *tail = list;
-	if (!tail)
-		return NULL;
-	while (tail->next) {
-		tail = tail->next;
-	}
-	return tail;
-}
-
-static pr_track_t *list_add(pr_track_t *list, pr_track_t *element)
-{
-	pr_track_t *tail = list_last(list);
-	if (!tail)
-		return element;
-	tail->next = element;
-	return list;
-}
-
-static void list_free(pr_track_t *list)
-{
-	if (!list)
-		return;
-	list_free(list->next);
-	free(list);
-}
-
 #ifdef DEBUG_PR_TRACK
-static void dump_pr_track(pr_track_t **track_pr)
+static void dump_pr_track(struct pr_track_list *track_pr)
 {
-	int cyl;
+	int cyl, i;
 	pr_track_t *list;
 
 	for (cyl = 0; cyl < MAX_CYLINDERS; cyl++) {
-		list = track_pr[cyl];
-		while (list) {
+		for (i = 0; i < track_pr[cyl].nr; i++) {
+			list = track_pr[cyl].track + i;
 			printf("cyl%d: start %d end %d t_start %d t_end %d pt %d\n", cyl,
 			       list->start, list->end, list->t_start, list->t_end, list->pressure_time);
-			list = list->next;
 		}
 	}
 }
@@ -97,9 +77,11 @@ static void dump_pr_track(pr_track_t **track_pr)
  * segments according to how big of a time_pressure area
  * they have.
  */
-static void fill_missing_segment_pressures(pr_track_t *list)
+static void fill_missing_segment_pressures(struct pr_track_list *track)
 {
-	while (list) {
+	pr_track_t *list = track->track, *last = track->track + track->nr;
+
+	while (list < last) {
 		int start = list->start, end;
 		pr_track_t *tmp = list;
 		int pt_sum = 0, pt = 0;
@@ -110,9 +92,9 @@ static void fill_missing_segment_pressures(pr_track_t *list)
 			if (end)
 				break;
 			end = start;
-			if (!tmp->next)
+			if (tmp + 1 == last)
 				break;
-			tmp = tmp->next;
+			tmp++;
 		}
 
 		if (!start)
@@ -137,12 +119,12 @@ static void fill_missing_segment_pressures(pr_track_t *list)
 			list->end = pressure;
 			if (list == tmp)
 				break;
-			list = list->next;
+			list++;
 			list->start = pressure;
 		}
 
 		/* Ok, we've done that set of segments */
-		list = list->next;
+		list++;
 	}
 }
 
@@ -154,79 +136,118 @@ void dump_pr_interpolate(int i, pr_interpolate_t interpolate_pr)
 }
 #endif
 
+/*
+ * The plot entries are visited in time order, so for each cylinder the
+ * segment we interpolate in, the last entry that gave us a starting
+ * pressure and the next entry that gives us an end pressure only ever
+ * move forward. Together with the prefix sums of pressure_time this
+ * turns the interpolation into a single pass over the plot entries.
+ */
+struct pr_interpolate_cursor {
+	pr_track_t *segment;
+	int first;     /* first entry at segment->t_start */
+	int first_end; /* first entry after segment->t_start */
+	int last;      /* first entry at segment->t_end */
+	int pos;       /* next entry to look at for a starting pressure */
+	int reset;     /* last entry that (re)started the interpolation */
+	int start;
+	int next;      /* entry that ends the interpolation */
+	int end;
+};
+
+static inline int entry_pressure(struct plot_data *entry, int diluent_flag)
+{
+	return diluent_flag ? DILUENT_PRESSURE(entry) : SENSOR_PRESSURE(entry);
+}
+
+static void init_pr_interpolate_cursor(struct pr_interpolate_cursor *cursor, pr_track_t *segment, struct plot_info *pi)
+{
+	int i = segment->idx_start;
+
+	while (i > 0 && pi->entry[i - 1].sec >= segment->t_start)
+		i--;
+	cursor->first = cursor->pos = cursor->reset = i;
+	while (i < pi->nr && pi->entry[i].sec <= segment->t_start)
+		i++;
+	cursor->first_end = i;
+	i = segment->idx_end;
+	while (i > 0 && pi->entry[i - 1].sec >= segment->t_end)
+		i--;
+	cursor->last = i;
+	cursor->segment = segment;
+	cursor->start = segment->start;
+	cursor->next = -1;
+}
 
-static struct pr_interpolate_struct get_pr_interpolate_data(pr_track_t *segment, struct plot_info *pi, int cur, int diluent_flag)
-{ // cur = index to pi->entry corresponding to t_end of segment; diluent_flag=1 indicates diluent cylinder
+static struct pr_interpolate_struct get_pr_interpolate_data(struct pr_interpolate_cursor *cursor, struct plot_info *pi,
+							   const int64_t *pt_sum, int cur, int diluent_flag)
+{ // cur = index to pi->entry within the cursor's segment; diluent_flag=1 indicates diluent cylinder
 	struct pr_interpolate_struct interpolate;
-	int i;
-	struct plot_data *entry;
-	int pressure;
+	int limit;
+
+	/* The entries at t_start and, before cur, every pressure reading restart the interpolation */
+	limit = cur < cursor->first_end ? cursor->first_end : MIN(cur, cursor->last);
+	for (; cursor->pos < limit; cursor->pos++) {
+		int pressure = entry_pressure(pi->entry + cursor->pos, diluent_flag);
+		if (pressure)
+			cursor->start = pressure;
+		if (pressure || cursor->pos < cursor->first_end)
+			cursor->reset = cursor->pos;
+	}
+	interpolate.start = cursor->start;
+	interpolate.end = cursor->segment->end;
 
-	interpolate.start = segment->start;
-	interpolate.end = segment->end;
-	interpolate.acc_pressure_time = 0;
-	interpolate.pressure_time = 0;
+	if (cur >= cursor->last) { // cur is at the end of the segment
+		interpolate.acc_pressure_time = pt_sum[cursor->last] - pt_sum[cursor->reset + 1];
+		interpolate.pressure_time = pt_sum[cursor->last + 1] - pt_sum[cursor->reset + 1];
+		return interpolate;
+	}
 
-	for (i = 0; i < pi->nr; i++) {
-		entry = pi->entry + i;
-		if (diluent_flag)
-			pressure = DILUENT_PRESSURE(entry);
+	/* The next pressure reading (or the end of the segment) is shared by all entries before it */
+	if (cursor->next <= cur) {
+		cursor->next = MAX(cur + 1, cursor->first_end);
+		while (cursor->next < cursor->last && !entry_pressure(pi->entry + cursor->next, diluent_flag))
+			cursor->next++;
+		if (cursor->next < cursor->last)
+			cursor->end = entry_pressure(pi->entry + cursor->next, diluent_flag);
 		else
-			pressure = SENSOR_PRESSURE(entry);
-
-		if (entry->sec < segment->t_start)
-			continue;
-		if (entry->sec >= segment->t_end) {
-			interpolate.pressure_time += entry->pressure_time;
-			break;
-		}
-		if (entry->sec == segment->t_start) {
-			interpolate.acc_pressure_time = 0;
-			interpolate.pressure_time = 0;
-			if (pressure)
-				interpolate.start = pressure;
-			continue;
-		}
-		if (i < cur) {
-			if (pressure) {
-				interpolate.start = pressure;
-				interpolate.acc_pressure_time = 0;
-				interpolate.pressure_time = 0;
-			} else {
-				interpolate.acc_pressure_time += entry->pressure_time;
-				interpolate.pressure_time += entry->pressure_time;
-			}
-			continue;
-		}
-		if (i == cur) {
-			interpolate.acc_pressure_time += entry->pressure_time;
-			interpolate.pressure_time += entry->pressure_time;
-			continue;
-		}
-		interpolate.pressure_time += entry->pressure_time;
-		if (pressure) {
-			interpolate.end = pressure;
-			break;
-		}
+			cursor->end = cursor->segment->end;
 	}
+	interpolate.end = cursor->end;
+	if (cur < cursor->first_end)
+		interpolate.acc_pressure_time = 0;
+	else
+		interpolate.acc_pressure_time = pt_sum[cur + 1] - pt_sum[cursor->reset + 1];
+	interpolate.pressure_time = pt_sum[MIN(cursor->next + 1, pi->nr)] - pt_sum[cursor->reset + 1];
 	return interpolate;
 }
 
-static void fill_missing_tank_pressures(struct dive *dive, struct plot_info *pi, pr_track_t **track_pr, int diluent_flag)
+static void fill_missing_tank_pressures(struct dive *dive, struct plot_info *pi, struct pr_track_list *track_pr, int diluent_flag)
 {
 	int cyl, i;
 	struct plot_data *entry;
 	int cur_pr[MAX_CYLINDERS]; // cur_pr[MAX_CYLINDERS] is the CCR diluent cylinder
+	int cur_segment[MAX_CYLINDERS] = { 0, };
+	struct pr_interpolate_cursor cursor[MAX_CYLINDERS] = { { NULL, }, };
+	int64_t *pt_sum;
+
+	/* pt_sum[i] is the pressure_time of all plot entries before entry i */
+	pt_sum = malloc((pi->nr + 1) * sizeof(*pt_sum));
+	if (!pt_sum)
+		return;
+	pt_sum[0] = 0;
+	for (i = 0; i < pi->nr; i++)
+		pt_sum[i + 1] = pt_sum[i] + pi->entry[i].pressure_time;
 
 	for (cyl = 0; cyl < MAX_CYLINDERS; cyl++) {
-		if (!track_pr[cyl]) {
+		if (!track_pr[cyl].nr) {
 			/* no segment where this cylinder is used */
 			cur_pr[cyl] = -1;
 			continue;
 		}
-		fill_missing_segment_pressures(track_pr[cyl]); // Interpolate the missing tank pressure values ..
-		cur_pr[cyl] = track_pr[cyl]->start;	       // in the pr_track_t lists of structures
-	}						       // and keep the starting pressure for each cylinder.
+		fill_missing_segment_pressures(&track_pr[cyl]); // Interpolate the missing tank pressure values ..
+		cur_pr[cyl] = track_pr[cyl].track[0].start;	 // in the pr_track_t arrays of structures
+	}							 // and keep the starting pressure for each cylinder.
 
 #ifdef DEBUG_PR_TRACK
 	/* another great debugging tool */
@@ -270,16 +291,19 @@ static void fill_missing_tank_pressures(struct dive *dive, struct plot_info *pi,
 		}
 		// If there is NO valid pressure value..
 		// Find the pressure segment corresponding to this entry..
-		segment = track_pr[cyl];
-		while (segment && segment->t_end < entry->sec) // Find the track_pr with end time..
-			segment = segment->next;	       // ..that matches the plot_info time (entry->sec)
+		while (cur_segment[cyl] < track_pr[cyl].nr &&		     // Find the track_pr with end time..
+		       track_pr[cyl].track[cur_segment[cyl]].t_end < entry->sec) // ..that matches the plot_info time (entry->sec)
+			cur_segment[cyl]++;
+		segment = cur_segment[cyl] < track_pr[cyl].nr ? track_pr[cyl].track + cur_segment[cyl] : NULL;
 
 		if (!segment || !segment->pressure_time) { // No (or empty) segment?
 			*save_pressure = cur_pr[cyl];      // Just use our current pressure
 			continue;			   // and skip to next point.
 		}
 		// If there is a valid segment but no tank pressure ..
-		interpolate = get_pr_interpolate_data(segment, pi, i, diluent_flag); // Set up an interpolation structure
+		if (cursor[cyl].segment != segment)
+			init_pr_interpolate_cursor(&cursor[cyl], segment, pi);
+		interpolate = get_pr_interpolate_data(&cursor[cyl], pi, pt_sum, i, diluent_flag); // Set up an interpolation structure
 
 		/* if this segment has pressure_time, then calculate a new interpolated pressure */
 		if (interpolate.pressure_time) {
@@ -291,6 +315,7 @@ static void fill_missing_tank_pressures(struct dive *dive, struct plot_info *pi,
 		}
 		*save_interpolated = cur_pr[cyl]; // and store the interpolated data in plot_info
 	}
+	free(pt_sum);
 }
 
 
@@ -331,17 +356,17 @@ static void debug_print_pressures(struct plot_info *pi)
 /* This function goes through the list of tank pressures, either SENSOR_PRESSURE(entry) or DILUENT_PRESSURE(entry),
  * of structure plot_info for the dive profile where each item in the list corresponds to one point (node) of the
  * profile. It finds values for which there are no tank pressures (pressure==0). For each missing item (node) of
- * tank pressure it creates a pr_track_alloc structure that represents a segment on the dive profile and that
- * contains tank pressures. There is a linked list of pr_track_alloc structures for each cylinder. These pr_track_alloc
+ * tank pressure it creates a pr_track_t structure that represents a segment on the dive profile and that
+ * contains tank pressures. There is an array of pr_track_t structures for each cylinder. These pr_track_t
  * structures ultimately allow for filling the missing tank pressure values on the dive profile using the depth_pressure
  * of the dive. To do this, it calculates the summed pressure-time value for the duration of the dive and stores these
- * in the pr_track_alloc structures. If diluent_flag = 1, then DILUENT_PRESSURE(entry) is used instead of SENSOR_PRESSURE.
+ * in the pr_track_t structures. If diluent_flag = 1, then DILUENT_PRESSURE(entry) is used instead of SENSOR_PRESSURE.
  * This function is called by create_plot_info_new() in profile.c
  */
 void populate_pressure_information(struct dive *dive, struct divecomputer *dc, struct plot_info *pi, int diluent_flag)
 {
 	int i, cylinderid, cylinderindex = -1;
-	pr_track_t *track_pr[MAX_CYLINDERS] = { NULL, };
+	struct pr_track_list track_pr[MAX_CYLINDERS] = { { NULL, }, };
 	pr_track_t *current = NULL;
 	bool missing_pr = false;
 
@@ -361,6 +386,7 @@ void populate_pressure_information(struct dive *dive, struct divecomputer *dc, s
 			entry->pressure_time = calc_pressure_time(dive, dc, entry - 1, entry);
 			current->pressure_time += entry->pressure_time;
 			current->t_end = entry->sec;
+			current->idx_end = i;
 		}
 
 		/* If 1st record or different cylinder: Create a new track_pr structure: */
@@ -370,8 +396,9 @@ void populate_pressure_information(struct dive *dive, struct divecomputer *dc, s
 				cylinderindex = DILUENT_CYLINDER; // indicate diluent cylinder
 			else
 				cylinderindex = entry->cylinderindex;
-			current = pr_track_alloc(pressure, entry->sec);
-			track_pr[cylinderindex] = list_add(track_pr[cylinderindex], current);
+			current = pr_track_add(&track_pr[cylinderindex], pressure, entry->sec, i);
+			if (!current)
+				goto out;
 			continue;
 		}
 
@@ -388,8 +415,9 @@ void populate_pressure_information(struct dive *dive, struct divecomputer *dc, s
 			continue;
 
 		/* transmitter stopped transmitting cylinder pressure data */
-		current = pr_track_alloc(pressure, entry->sec);
-		track_pr[cylinderindex] = list_add(track_pr[cylinderindex], current);
+		current = pr_track_add(&track_pr[cylinderindex], pressure, entry->sec, i);
+		if (!current)
+			goto out;
 	}
 
 	if (missing_pr) {
@@ -400,6 +428,7 @@ void populate_pressure_information(struct dive *dive, struct divecomputer *dc, s
 	debug_print_pressures(pi);
 #endif
 
+out:
 	for (i = 0; i < MAX_CYLINDERS; i++)
-		list_free(track_pr[i]);
+		free(track_pr[i].track);
 }
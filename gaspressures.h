@@ -16,7 +16,14 @@ struct pr_track_struct {
 	int t_start;
 	int t_end;
 	int pressure_time;
-	pr_track_t *next;
+	int idx_start; /* plot_info entries at t_start .. */
+	int idx_end;   /* .. and t_end */
+};
+
+/* the segments of one cylinder, in time order */
+struct pr_track_list {
+	pr_track_t *track;
+	int nr, allocated;
 };
 
 typedef struct pr_interpolate_struct pr_interpolate_t;
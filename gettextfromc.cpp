@@ -4,6 +4,7 @@
 
 const char *gettextFromC::trGettext(const char *text)
 {
+	QMutexLocker locker(&lock);
 	QByteArray &result = translationCache[QByteArray(text)];
 	if (result.isEmpty())
 		result = trUtf8(text).toUtf8();
@@ -12,6 +13,7 @@ const char *gettextFromC::trGettext(const char *text)
 
 void gettextFromC::reset(void)
 {
+	QMutexLocker locker(&lock);
 	translationCache.clear();
 }
 
@@ -2,6 +2,7 @@
 #define GETTEXTFROMC_H
 
 #include <QHash>
+#include <QMutex>
 #include <QCoreApplication>
 
 extern "C" const char *trGettext(const char *text);
@@ -13,6 +14,10 @@ public:
 	const char *trGettext(const char *text);
 	void reset(void);
 	QHash<QByteArray, QByteArray> translationCache;
+
+private:
+	// the file parser can run on several threads
+	QMutex lock;
 };
 
 #endif // GETTEXTFROMC_H
@@ -22,10 +22,28 @@ struct keyword_action {
 };
 #define ARRAY_SIZE(array) (sizeof(array)/sizeof(array[0]))
 
+/*
+ * The files of a dive, found while walking the tree and parsed
+ * later, on whatever thread gets to them. The dive file parsers
+ * get this, since they also count the cylinders and weightsystems.
+ */
+struct git_dive_file {
+	git_oid id;
+	bool is_dc;
+	int number;
+};
+
+struct git_dive {
+	struct dive *dive;
+	int nr_files, alloc_files;
+	struct git_dive_file *files;
+	int cylinder_index, weightsystem_index;
+};
+
 extern degrees_t parse_degrees(char *buf, char **end);
-static void parse_dive_gps(char *line, struct membuffer *str, void *_dive)
+static void parse_dive_gps(char *line, struct membuffer *str, void *_gd)
 {
-	struct dive *dive = _dive;
+	struct dive *dive = ((struct git_dive *)_gd)->dive;
 
 	dive->latitude = parse_degrees(line, &line);
 	dive->longitude = parse_degrees(line, &line);
@@ -135,28 +153,28 @@ static int get_index(const char *line)
 static int get_hex(const char *line)
 { return strtoul(line, NULL, 16); }
 
-static void parse_dive_location(char *line, struct membuffer *str, void *_dive)
-{ struct dive *dive = _dive; dive->location = get_utf8(str); }
+static void parse_dive_location(char *line, struct membuffer *str, void *_gd)
+{ struct git_dive *gd = _gd; gd->dive->location = get_utf8(str); }
 
-static void parse_dive_divemaster(char *line, struct membuffer *str, void *_dive)
-{ struct dive *dive = _dive; dive->divemaster = get_utf8(str); }
+static void parse_dive_divemaster(char *line, struct membuffer *str, void *_gd)
+{ struct git_dive *gd = _gd; gd->dive->divemaster = get_utf8(str); }
 
-static void parse_dive_buddy(char *line, struct membuffer *str, void *_dive)
-{ struct dive *dive = _dive; dive->buddy = get_utf8(str); }
+static void parse_dive_buddy(char *line, struct membuffer *str, void *_gd)
+{ struct git_dive *gd = _gd; gd->dive->buddy = get_utf8(str); }
 
-static void parse_dive_suit(char *line, struct membuffer *str, void *_dive)
-{ struct dive *dive = _dive; dive->suit = get_utf8(str); }
+static void parse_dive_suit(char *line, struct membuffer *str, void *_gd)
+{ struct git_dive *gd = _gd; gd->dive->suit = get_utf8(str); }
 
-static void parse_dive_notes(char *line, struct membuffer *str, void *_dive)
-{ struct dive *dive = _dive; dive->notes = get_utf8(str); }
+static void parse_dive_notes(char *line, struct membuffer *str, void *_gd)
+{ struct git_dive *gd = _gd; gd->dive->notes = get_utf8(str); }
 
 /*
  * We can have multiple tags in the membuffer. They are separated by
  * NUL bytes.
  */
-static void parse_dive_tags(char *line, struct membuffer *str, void *_dive)
+static void parse_dive_tags(char *line, struct membuffer *str, void *_gd)
 {
-	struct dive *dive = _dive;
+	struct dive *dive = ((struct git_dive *)_gd)->dive;
 	const char *tag;
 	int len = str->len;
 
@@ -177,23 +195,23 @@ static void parse_dive_tags(char *line, struct membuffer *str, void *_dive)
 	}
 }
 
-static void parse_dive_airtemp(char *line, struct membuffer *str, void *_dive)
-{ struct dive *dive = _dive; dive->airtemp = get_temperature(line); }
+static void parse_dive_airtemp(char *line, struct membuffer *str, void *_gd)
+{ struct git_dive *gd = _gd; gd->dive->airtemp = get_temperature(line); }
 
-static void parse_dive_watertemp(char *line, struct membuffer *str, void *_dive)
-{ struct dive *dive = _dive; dive->watertemp = get_temperature(line); }
+static void parse_dive_watertemp(char *line, struct membuffer *str, void *_gd)
+{ struct git_dive *gd = _gd; gd->dive->watertemp = get_temperature(line); }
 
-static void parse_dive_duration(char *line, struct membuffer *str, void *_dive)
-{ struct dive *dive = _dive; dive->duration = get_duration(line); }
+static void parse_dive_duration(char *line, struct membuffer *str, void *_gd)
+{ struct git_dive *gd = _gd; gd->dive->duration = get_duration(line); }
 
-static void parse_dive_rating(char *line, struct membuffer *str, void *_dive)
-{ struct dive *dive = _dive; dive->rating = get_index(line); }
+static void parse_dive_rating(char *line, struct membuffer *str, void *_gd)
+{ struct git_dive *gd = _gd; gd->dive->rating = get_index(line); }
 
-static void parse_dive_visibility(char *line, struct membuffer *str, void *_dive)
-{ struct dive *dive = _dive; dive->visibility = get_index(line); }
+static void parse_dive_visibility(char *line, struct membuffer *str, void *_gd)
+{ struct git_dive *gd = _gd; gd->dive->visibility = get_index(line); }
 
-static void parse_dive_notrip(char *line, struct membuffer *str, void *_dive)
-{ struct dive *dive = _dive; dive->tripflag = NO_TRIP; }
+static void parse_dive_notrip(char *line, struct membuffer *str, void *_gd)
+{ struct git_dive *gd = _gd; gd->dive->tripflag = NO_TRIP; }
 
 /* Parse key=val parts of samples and cylinders etc */
 static char *parse_keyvalue_entry(void (*fn)(void *, const char *, const char *), void *fndata, char *line)
@@ -222,8 +240,6 @@ static char *parse_keyvalue_entry(void (*fn)(void *, const char *, const char *)
 	return line;
 }
 
-static int cylinder_index, weightsystem_index;
-
 static void parse_cylinder_keyvalue(void *_cylinder, const char *key, const char *value)
 {
 	cylinder_t *cylinder = _cylinder;
@@ -257,12 +273,12 @@ static void parse_cylinder_keyvalue(void *_cylinder, const char *key, const char
 	report_error("Unknown cylinder key/value pair (%s/%s)", key, value);
 }
 
-static void parse_dive_cylinder(char *line, struct membuffer *str, void *_dive)
+static void parse_dive_cylinder(char *line, struct membuffer *str, void *_gd)
 {
-	struct dive *dive = _dive;
-	cylinder_t *cylinder = dive->cylinder + cylinder_index;
+	struct git_dive *gd = _gd;
+	cylinder_t *cylinder = gd->dive->cylinder + gd->cylinder_index;
 
-	cylinder_index++;
+	gd->cylinder_index++;
 	cylinder->type.description = get_utf8(str);
 	for (;;) {
 		char c;
@@ -287,12 +303,12 @@ static void parse_weightsystem_keyvalue(void *_ws, const char *key, const char *
 	report_error("Unknown weightsystem key/value pair (%s/%s)", key, value);
 }
 
-static void parse_dive_weightsystem(char *line, struct membuffer *str, void *_dive)
+static void parse_dive_weightsystem(char *line, struct membuffer *str, void *_gd)
 {
-	struct dive *dive = _dive;
-	weightsystem_t *ws = dive->weightsystem + weightsystem_index;
+	struct git_dive *gd = _gd;
+	weightsystem_t *ws = gd->dive->weightsystem + gd->weightsystem_index;
 
-	weightsystem_index++;
+	gd->weightsystem_index++;
 	ws->description = get_utf8(str);
 	for (;;) {
 		char c;
@@ -721,9 +737,9 @@ struct keyword_action dive_action[] = {
 	D(tags), D(visibility), D(watertemp), D(weightsystem)
 };
 
-static void dive_parser(char *line, struct membuffer *str, void *_dive)
+static void dive_parser(char *line, struct membuffer *str, void *_gd)
 {
-	match_action(line, str, _dive, dive_action, ARRAY_SIZE(dive_action));
+	match_action(line, str, _gd, dive_action, ARRAY_SIZE(dive_action));
 }
 
 /* These need to be sorted! */
@@ -888,10 +904,13 @@ static void for_each_line(git_blob *blob, line_fn_t *fn, void *fndata)
 #define GIT_WALK_OK   0
 #define GIT_WALK_SKIP 1
 
-static struct divecomputer *active_dc;
 static struct dive *active_dive;
 static dive_trip_t *active_trip;
 
+/* All the dives of the tree, in the order we walked them */
+static struct git_dive *git_dives;
+static int nr_git_dives, alloc_git_dives;
+
 static void finish_active_trip(void)
 {
 	dive_trip_t *trip = active_trip;
@@ -902,14 +921,10 @@ static void finish_active_trip(void)
 	}
 }
 
+/* The dive gets recorded once its files have been parsed */
 static void finish_active_dive(void)
 {
-	struct dive *dive = active_dive;
-
-	if (dive) {
-		active_dive = NULL;
-		record_dive(dive);
-	}
+	active_dive = NULL;
 }
 
 static struct dive *create_new_dive(timestamp_t when)
@@ -920,7 +935,16 @@ static struct dive *create_new_dive(timestamp_t when)
 	dive->when = when;
 
 	if (active_trip)
-		add_dive_to_trip(dive, active_trip);
+		link_dive_to_trip(dive, active_trip);
+
+	if (nr_git_dives == alloc_git_dives) {
+		alloc_git_dives = alloc_git_dives ? 2 * alloc_git_dives : 64;
+		git_dives = realloc(git_dives, alloc_git_dives * sizeof(*git_dives));
+		if (!git_dives)
+			exit(1);
+	}
+	memset(git_dives + nr_git_dives, 0, sizeof(*git_dives));
+	git_dives[nr_git_dives++].dive = dive;
 	return dive;
 }
 
@@ -1184,37 +1208,83 @@ static struct divecomputer *create_new_dc(struct dive *dive)
 }
 
 /*
- * We should *really* try to delay the dive computer data parsing
- * until necessary, in order to reduce load-time. The parsing is
- * cheap, but the loading of the git blob into memory can be pretty
- * costly.
+ * Loading the git blobs of the dives and dive computers into memory
+ * is what's costly, so the walk just remembers them for the dive
+ * and they get loaded and parsed later, in parallel.
  */
-static int parse_divecomputer_entry(git_repository *repo, const git_tree_entry *entry, const char *suffix)
+static int add_dive_file(const git_tree_entry *entry, bool is_dc, const char *suffix)
 {
-	git_blob *blob = git_tree_entry_blob(repo, entry);
-
-	if (!blob)
-		return report_error("Unable to read divecomputer file");
+	struct git_dive *gd = git_dives + nr_git_dives - 1;
+	struct git_dive_file *file;
 
-	active_dc = create_new_dc(active_dive);
-	for_each_line(blob, divecomputer_parser, active_dc);
-	git_blob_free(blob);
-	active_dc = NULL;
+	if (gd->nr_files == gd->alloc_files) {
+		gd->alloc_files = gd->alloc_files ? 2 * gd->alloc_files : 4;
+		gd->files = realloc(gd->files, gd->alloc_files * sizeof(*gd->files));
+		if (!gd->files)
+			exit(1);
+	}
+	file = gd->files + gd->nr_files++;
+	git_oid_cpy(&file->id, git_tree_entry_id(entry));
+	file->is_dc = is_dc;
+	file->number = !is_dc && *suffix ? atoi(suffix+1) : 0;
 	return 0;
 }
 
-static int parse_dive_entry(git_repository *repo, const git_tree_entry *entry, const char *suffix)
+static void parse_divecomputer_file(git_blob *blob, struct git_dive *gd)
 {
-	struct dive *dive = active_dive;
-	git_blob *blob = git_tree_entry_blob(repo, entry);
-	if (!blob)
-		return report_error("Unable to read dive file");
-	if (*suffix)
-		dive->number = atoi(suffix+1);
-	cylinder_index = weightsystem_index = 0;
-	for_each_line(blob, dive_parser, active_dive);
-	git_blob_free(blob);
-	return 0;
+	struct divecomputer *dc = create_new_dc(gd->dive);
+
+	for_each_line(blob, divecomputer_parser, dc);
+}
+
+static void parse_dive_file(git_blob *blob, struct git_dive *gd, int number)
+{
+	if (number)
+		gd->dive->number = number;
+	gd->cylinder_index = gd->weightsystem_index = 0;
+	for_each_line(blob, dive_parser, gd);
+}
+
+/*
+ * The files of a dive are parsed in the order the walk found them,
+ * since the dive computers get their duration from the dive file.
+ */
+static void parse_git_dive(git_repository *repo, struct git_dive *gd)
+{
+	int i;
+
+	for (i = 0; i < gd->nr_files; i++) {
+		struct git_dive_file *file = gd->files + i;
+		git_blob *blob;
+
+		if (!repo || git_blob_lookup(&blob, repo, &file->id)) {
+			report_error(file->is_dc ? "Unable to read divecomputer file" : "Unable to read dive file");
+			continue;
+		}
+		if (file->is_dc)
+			parse_divecomputer_file(blob, gd);
+		else
+			parse_dive_file(blob, gd, file->number);
+		git_blob_free(blob);
+	}
+}
+
+#define GIT_DIVES_PER_TASK 64
+
+/* libgit2 objects can't be shared between threads, so every task opens the repository itself */
+static void parse_git_dives(void *_repo, int task)
+{
+	git_repository *repo;
+	int i = task * GIT_DIVES_PER_TASK;
+	int end = MIN(i + GIT_DIVES_PER_TASK, nr_git_dives);
+
+	if (git_repository_open(&repo, git_repository_path(_repo))) {
+		report_error("Unable to open git repository at '%s'", git_repository_path(_repo));
+		repo = NULL;
+	}
+	for (; i < end; i++)
+		parse_git_dive(repo, git_dives + i);
+	git_repository_free(repo);
 }
 
 static int parse_trip_entry(git_repository *repo, const git_tree_entry *entry)
@@ -1285,9 +1355,9 @@ static int walk_tree_file(const char *root, const git_tree_entry *entry, git_rep
 		break;
 	case 'D':
 		if (dive && !strncmp(name, "Divecomputer", 12))
-			return parse_divecomputer_entry(repo, entry, name+12);
+			return add_dive_file(entry, true, name+12);
 		if (dive && !strncmp(name, "Dive", 4))
-			return parse_dive_entry(repo, entry, name+4);
+			return add_dive_file(entry, false, name+4);
 		break;
 	case '0':
 		if (trip && !strcmp(name, "00-Trip"))
@@ -1313,9 +1383,27 @@ static int walk_tree_cb(const char *root, const git_tree_entry *entry, void *pay
 	return GIT_WALK_OK;
 }
 
+/*
+ * The walk sets up the trips and dives and finds their files,
+ * then the dive files get parsed on all cores, and the dives are
+ * recorded in the order of the tree.
+ */
 static int load_dives_from_tree(git_repository *repo, git_tree *tree)
 {
+	int i;
+
 	git_tree_walk(tree, GIT_TREEWALK_PRE, walk_tree_cb, repo);
+	finish_active_dive();
+
+	run_in_parallel((nr_git_dives + GIT_DIVES_PER_TASK - 1) / GIT_DIVES_PER_TASK, parse_git_dives, repo);
+
+	for (i = 0; i < nr_git_dives; i++) {
+		record_dive(git_dives[i].dive);
+		free(git_dives[i].files);
+	}
+	free(git_dives);
+	git_dives = NULL;
+	nr_git_dives = alloc_git_dives = 0;
 	return 0;
 }
 
@@ -1332,22 +1420,57 @@ void set_git_id(const struct git_oid * id)
 	saved_git_id = git_id_buffer;
 }
 
+/*
+ * The snapshot of a branch lives in the git directory, and is good for
+ * as long as the branch points to the same commit.
+ */
+static char *git_snapshot_name(git_repository *repo, const char *branch)
+{
+	struct membuffer name = { 0 };
+	const char *p;
+
+	if (dive_table.nr || dive_trip_list)
+		return NULL;
+	put_format(&name, "%ssubsurface-", git_repository_path(repo));
+	for (p = branch; *p; p++)
+		put_bytes(&name, *p == '/' || *p == '\\' ? "_" : p, 1);
+	put_string(&name, ".snapshot");
+	/* the buffer is ours to hand out */
+	return (char *)mb_cstring(&name);
+}
+
 static int do_git_load(git_repository *repo, const char *branch)
 {
 	int ret;
 	git_object *object;
 	git_commit *commit;
 	git_tree *tree;
+	char key[GIT_OID_HEXSZ + 1], *snapshot;
 
 	if (git_revparse_single(&object, repo, branch))
 		return report_error("Unable to look up revision '%s'", branch);
 	if (git_object_peel((git_object **)&commit, object, GIT_OBJ_COMMIT))
 		return report_error("Revision '%s' is not a valid commit", branch);
-	if (git_commit_tree(&tree, commit))
+	git_oid_tostr(key, sizeof(key), git_commit_id(commit));
+	snapshot = git_snapshot_name(repo, branch);
+	if (snapshot && !load_dive_snapshot(snapshot, key)) {
+		free(snapshot);
+		set_git_id(git_commit_id(commit));
+		return 0;
+	}
+	if (git_commit_tree(&tree, commit)) {
+		free(snapshot);
 		return report_error("Could not look up tree of commit in branch '%s'", branch);
+	}
 	ret = load_dives_from_tree(repo, tree);
-	if (!ret)
+	if (!ret) {
 		set_git_id(git_commit_id(commit));
+		finish_active_dive();
+		finish_active_trip();
+		if (snapshot && !have_error_string())
+			save_dive_snapshot(snapshot, key);
+	}
+	free(snapshot);
 	git_object_free((git_object *)tree);
 	return ret;
 }
@@ -9,6 +9,8 @@
 #include "subsurfacestartup.h"
 #include "qt-ui/mainwindow.h"
 #include "qt-ui/diveplanner.h"
+#include "dive.h"
+#include "profile.h"
 
 #include <QStringList>
 #include <git2.h>
@@ -62,6 +64,7 @@ int main(int argc, char **argv)
 	if (!quit)
 		run_ui();
 	exit_ui();
+	free_plot_info_cache();
 	parse_xml_exit();
 	subsurface_console_exit();
 	return 0;
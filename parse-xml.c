@@ -2,6 +2,7 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
@@ -10,6 +11,7 @@
 #include <libxml/parser.h>
 #include <libxml/parserInternals.h>
 #include <libxml/tree.h>
+#include <libxml/xmlreader.h>
 #include <libxslt/transform.h>
 #include <libdivecomputer/parser.h>
 
@@ -17,21 +19,21 @@
 
 #include "dive.h"
 #include "device.h"
+#include "membuffer.h"
 
 int verbose, quit;
 int metric = 1;
 
 static xmlDoc *test_xslt_transforms(xmlDoc *doc, const char **params);
+static bool xslt_root_element(const char *name);
 
-/* the dive table holds the overall dive list; target table points at
- * the table we are currently filling */
+/* the dive table holds the overall dive list */
 struct dive_table dive_table;
-struct dive_table *target_table = NULL;
 
 /*
  * Add a dive into the dive_table array
  */
-static void record_dive_to_table(struct dive *dive, struct dive_table *table)
+void add_dive_to_table(struct dive *dive, struct dive_table *table)
 {
 	assert(table != NULL);
 	int nr = table->nr, allocated = table->allocated;
@@ -45,8 +47,15 @@ static void record_dive_to_table(struct dive *dive, struct dive_table *table)
 		table->dives = dives;
 		table->allocated = allocated;
 	}
-	dives[nr] = fixup_dive(dive);
+	dives[nr] = dive;
 	table->nr = nr + 1;
+	if (table == &dive_table)
+		dive_id_index_add(nr);
+}
+
+static void record_dive_to_table(struct dive *dive, struct dive_table *table)
+{
+	add_dive_to_table(fixup_dive(dive), table);
 }
 
 void record_dive(struct dive *dive)
@@ -68,25 +77,44 @@ static void nonmatch(const char *type, const char *name, char *buffer)
 		       type, name, buffer);
 }
 
+struct parser_state;
+
 typedef void (*matchfn_t)(char *buffer, void *);
+/* for the ones that need to look at (or update) what we are building up */
+typedef void (*matchfn_state_t)(char *buffer, void *, struct parser_state *state);
 
-static int match(const char *pattern, int plen,
-		 const char *name,
-		 matchfn_t fn, char *buf, void *data)
+static bool match_name(const char *pattern, int plen, const char *name)
 {
 	switch (name[plen]) {
 	case '\0':
 	case '.':
 		break;
 	default:
-		return 0;
+		return false;
 	}
-	if (memcmp(pattern, name, plen))
+	return !memcmp(pattern, name, plen);
+}
+
+static int match(const char *pattern, int plen,
+		 const char *name,
+		 matchfn_t fn, char *buf, void *data)
+{
+	if (!match_name(pattern, plen, name))
 		return 0;
 	fn(buf, data);
 	return 1;
 }
 
+static int match_state(const char *pattern, int plen,
+		       const char *name,
+		       matchfn_state_t fn, char *buf, void *data, struct parser_state *state)
+{
+	if (!match_name(pattern, plen, name))
+		return 0;
+	fn(buf, data, state);
+	return 1;
+}
+
 
 struct units xml_parsing_units;
 const struct units SI_units = SI_UNITS;
@@ -96,37 +124,62 @@ const struct units IMPERIAL_units = IMPERIAL_UNITS;
  * Dive info as it is being built up..
  */
 #define MAX_EVENT_NAME 128
-static struct divecomputer *cur_dc;
-static struct dive *cur_dive;
-static dive_trip_t *cur_trip = NULL;
-static struct sample *cur_sample;
-static struct picture *cur_picture;
-static union {
-	struct event event;
-	char allocation[sizeof(struct event)+MAX_EVENT_NAME];
-} event_allocation = { .event.deleted = 1 };
-#define cur_event event_allocation.event
-static struct {
+struct parser_state {
+	struct divecomputer *cur_dc;
+	struct dive *cur_dive;
+	dive_trip_t *cur_trip;
+	struct sample *cur_sample;
+	struct picture *cur_picture;
+	union {
+		struct event cur_event;
+		char event_allocation[sizeof(struct event) + MAX_EVENT_NAME];
+	};
 	struct {
-		const char *model;
-		uint32_t deviceid;
-		const char *nickname, *serial_nr, *firmware;
-	} dc;
-} cur_settings;
-static bool in_settings = false;
-static bool in_userid = false;
-static struct tm cur_tm;
-static int cur_cylinder_index, cur_ws_index;
-static int lastndl, laststoptime, laststopdepth, lastcns, lastpo2, lastindeco;
-static int lastcylinderindex, lastsensor;
+		struct {
+			const char *model;
+			uint32_t deviceid;
+			const char *nickname, *serial_nr, *firmware;
+		} dc;
+	} cur_settings;
+	bool in_settings;
+	bool in_userid;
+	struct tm cur_tm;
+	int cur_cylinder_index, cur_ws_index;
+	int lastndl, laststoptime, laststopdepth, lastcns, lastpo2, lastindeco;
+	int lastcylinderindex, lastsensor;
+	const char *country, *city;
+	sqlite3 *sql_handle;
+
+	/* the per-dive queries of the database importers, prepared once */
+	sqlite3_stmt *sql_events, *sql_tags, *sql_records;
+	int sql_records_status;
+
+	/* the table we are filling */
+	struct dive_table *target_table;
+
+	/*
+	 * A chunk of a file that is parsed on a worker thread must not
+	 * touch the global dive data: it keeps its dives (not fixed up
+	 * yet) and its trips to itself until they are merged.
+	 */
+	bool in_chunk;
+	dive_trip_t *chunk_trips, **last_chunk_trip;
+};
+
+static void init_parser_state(struct parser_state *state, struct dive_table *table)
+{
+	memset(state, 0, sizeof(*state));
+	state->cur_event.deleted = 1;
+	state->target_table = table;
+}
 
 /*
  * If we don't have an explicit dive computer,
  * we use the implicit one that every dive has..
  */
-static struct divecomputer *get_dc(void)
+static struct divecomputer *get_dc(struct parser_state *state)
 {
-	return cur_dc ?: &cur_dive->dc;
+	return state->cur_dc ?: &state->cur_dive->dc;
 }
 
 static enum import_source {
@@ -136,7 +189,7 @@ static enum import_source {
 	UDDF,
 } import_source;
 
-static void divedate(char *buffer, timestamp_t *when)
+static void divedate(char *buffer, timestamp_t *when, struct parser_state *state)
 {
 	int d, m, y;
 	int hh, mm, ss;
@@ -152,43 +205,43 @@ static void divedate(char *buffer, timestamp_t *when)
 		fprintf(stderr, "Unable to parse date '%s'\n", buffer);
 		return;
 	}
-	cur_tm.tm_year = y;
-	cur_tm.tm_mon = m - 1;
-	cur_tm.tm_mday = d;
-	cur_tm.tm_hour = hh;
-	cur_tm.tm_min = mm;
-	cur_tm.tm_sec = ss;
+	state->cur_tm.tm_year = y;
+	state->cur_tm.tm_mon = m - 1;
+	state->cur_tm.tm_mday = d;
+	state->cur_tm.tm_hour = hh;
+	state->cur_tm.tm_min = mm;
+	state->cur_tm.tm_sec = ss;
 
-	*when = utc_mktime(&cur_tm);
+	*when = utc_mktime(&state->cur_tm);
 }
 
-static void divetime(char *buffer, timestamp_t *when)
+static void divetime(char *buffer, timestamp_t *when, struct parser_state *state)
 {
 	int h, m, s = 0;
 
 	if (sscanf(buffer, "%d:%d:%d", &h, &m, &s) >= 2) {
-		cur_tm.tm_hour = h;
-		cur_tm.tm_min = m;
-		cur_tm.tm_sec = s;
-		*when = utc_mktime(&cur_tm);
+		state->cur_tm.tm_hour = h;
+		state->cur_tm.tm_min = m;
+		state->cur_tm.tm_sec = s;
+		*when = utc_mktime(&state->cur_tm);
 	}
 }
 
 /* Libdivecomputer: "2011-03-20 10:22:38" */
-static void divedatetime(char *buffer, timestamp_t *when)
+static void divedatetime(char *buffer, timestamp_t *when, struct parser_state *state)
 {
 	int y, m, d;
 	int hr, min, sec;
 
 	if (sscanf(buffer, "%d-%d-%d %d:%d:%d",
 		   &y, &m, &d, &hr, &min, &sec) == 6) {
-		cur_tm.tm_year = y;
-		cur_tm.tm_mon = m - 1;
-		cur_tm.tm_mday = d;
-		cur_tm.tm_hour = hr;
-		cur_tm.tm_min = min;
-		cur_tm.tm_sec = sec;
-		*when = utc_mktime(&cur_tm);
+		state->cur_tm.tm_year = y;
+		state->cur_tm.tm_mon = m - 1;
+		state->cur_tm.tm_mday = d;
+		state->cur_tm.tm_hour = hr;
+		state->cur_tm.tm_min = min;
+		state->cur_tm.tm_sec = sec;
+		*when = utc_mktime(&state->cur_tm);
 	}
 }
 
@@ -469,12 +522,12 @@ static void percent(char *buffer, fraction_t *fraction)
 	}
 }
 
-static void gasmix(char *buffer, fraction_t *fraction)
+static void gasmix(char *buffer, fraction_t *fraction, struct parser_state *state)
 {
 	/* libdivecomputer does negative percentages. */
 	if (*buffer == '-')
 		return;
-	if (cur_cylinder_index < MAX_CYLINDERS)
+	if (state->cur_cylinder_index < MAX_CYLINDERS)
 		percent(buffer, fraction);
 }
 
@@ -548,6 +601,104 @@ static void get_dc_type(char *buffer, enum dive_comp_type *i)
 	if (0) (fn)("test", dest);			\
 	match(pattern, strlen(pattern), name, (matchfn_t) (fn), buf, dest); })
 
+#define MATCH_STATE(pattern, fn, dest) ({ 		\
+	/* Silly type compatibility test */ 		\
+	if (0) (fn)("test", dest, state);		\
+	match_state(pattern, strlen(pattern), name, (matchfn_state_t) (fn), buf, dest, state); })
+
+/*
+ * Small hash from the names in a table (the first member of every entry)
+ * to the first entry with that name, built the first time it is used.
+ */
+struct name_index {
+	unsigned int size; /* a power of two, 0 until it is built */
+	short *slots;	   /* entry + 1, 0 for an empty slot */
+};
+
+#define TABLE_NAME(table, stride, i) (*(const char **)((const char *)(table) + (i) * (stride)))
+
+static void build_name_index(struct name_index *index, const void *table, size_t stride, int nr)
+{
+	unsigned int size = 16;
+	int i;
+
+	while (size < 2 * nr)
+		size *= 2;
+	index->slots = calloc(size, sizeof(*index->slots));
+	if (!index->slots)
+		exit(1);
+	for (i = 0; i < nr; i++) {
+		const char *name = TABLE_NAME(table, stride, i);
+		unsigned int h = fnv_hash(FNV_INITIAL_HASH, name, strlen(name)) & (size - 1);
+
+		while (index->slots[h] && strcmp(TABLE_NAME(table, stride, index->slots[h] - 1), name))
+			h = (h + 1) & (size - 1);
+		if (!index->slots[h])
+			index->slots[h] = i + 1;
+	}
+	index->size = size;
+}
+
+/* the first entry called name[0..len-1], or -1 */
+static int lookup_name_index(struct name_index *index, const void *table, size_t stride, int nr, const char *name, int len)
+{
+	unsigned int h;
+
+	if (!index->size)
+		build_name_index(index, table, stride, nr);
+	h = fnv_hash(FNV_INITIAL_HASH, name, len) & (index->size - 1);
+	while (index->slots[h]) {
+		const char *entry = TABLE_NAME(table, stride, index->slots[h] - 1);
+		if (!strncmp(entry, name, len) && !entry[len])
+			return index->slots[h] - 1;
+		h = (h + 1) & (index->size - 1);
+	}
+	return -1;
+}
+
+/*
+ * A table of MATCH() rules that fill in fields of one structure. A
+ * pattern matches the first component or the first two components of
+ * a name, so instead of trying the patterns one by one we look both up
+ * and take the earlier rule: the one a chain of MATCH() calls in table
+ * order would have picked.
+ */
+struct match_rule {
+	const char *pattern;
+	matchfn_t fn;
+	matchfn_state_t state_fn;
+	size_t offset; /* of the field in the structure */
+};
+
+#define MATCH_RULE(_type, _pattern, _fn, _field) \
+	{ .pattern = _pattern, .fn = (matchfn_t)(_fn), .offset = offsetof(_type, _field) }
+#define MATCH_STATE_RULE(_type, _pattern, _fn, _field) \
+	{ .pattern = _pattern, .state_fn = (matchfn_state_t)(_fn), .offset = offsetof(_type, _field) }
+
+static int match_rules(const struct match_rule *rules, int nr, struct name_index *index,
+		       const char *name, char *buf, void *base, struct parser_state *state)
+{
+	const char *dot = strchr(name, '.');
+	int i = lookup_name_index(index, rules, sizeof(*rules), nr, name, dot ? dot - name : strlen(name));
+
+	if (dot) {
+		const char *end = strchr(dot + 1, '.');
+		int j = lookup_name_index(index, rules, sizeof(*rules), nr, name, end ? end - name : strlen(name));
+		if (j >= 0 && (i < 0 || j < i))
+			i = j;
+	}
+	if (i < 0)
+		return 0;
+	if (rules[i].state_fn)
+		rules[i].state_fn(buf, (char *)base + rules[i].offset, state);
+	else
+		rules[i].fn(buf, (char *)base + rules[i].offset);
+	return 1;
+}
+
+#define MATCH_RULES(rules, index, base) \
+	match_rules(rules, sizeof(rules) / sizeof(rules[0]), &index, name, buf, base, state)
+
 static void get_index(char *buffer, int *i)
 {
 	*i = atoi(buffer);
@@ -672,31 +823,31 @@ static int divinglog_fill_sample(struct sample *sample, const char *name, char *
 	       0;
 }
 
-static void uddf_gasswitch(char *buffer, struct sample *sample)
+static void uddf_gasswitch(char *buffer, struct sample *sample, struct parser_state *state)
 {
 	int idx = atoi(buffer);
 	int seconds = sample->time.seconds;
-	struct dive *dive = cur_dive;
-	struct divecomputer *dc = get_dc();
+	struct dive *dive = state->cur_dive;
+	struct divecomputer *dc = get_dc(state);
 
 	add_gas_switch_event(dive, dc, seconds, idx);
 }
 
-static int uddf_fill_sample(struct sample *sample, const char *name, char *buf)
+static int uddf_fill_sample(struct parser_state *state, struct sample *sample, const char *name, char *buf)
 {
 	return MATCH("divetime", sampletime, &sample->time) ||
 	       MATCH("depth", depth, &sample->depth) ||
 	       MATCH("temperature", temperature, &sample->temperature) ||
 	       MATCH("tankpressure", pressure, &sample->cylinderpressure) ||
-	       MATCH("ref.switchmix", uddf_gasswitch, sample) ||
+	       MATCH_STATE("ref.switchmix", uddf_gasswitch, sample) ||
 	       0;
 }
 
-static void eventtime(char *buffer, duration_t *duration)
+static void eventtime(char *buffer, duration_t *duration, struct parser_state *state)
 {
 	sampletime(buffer, duration);
-	if (cur_sample)
-		duration->seconds += cur_sample->time.seconds;
+	if (state->cur_sample)
+		duration->seconds += state->cur_sample->time.seconds;
 }
 
 static void try_to_match_autogroup(const char *name, char *buf)
@@ -729,179 +880,157 @@ void add_gas_switch_event(struct dive *dive, struct divecomputer *dc, int second
 		ev->gas.index = idx;
 		ev->gas.mix = *mix;
 	}
+	invalidate_dive_metrics(dive);
 }
 
-static void get_cylinderindex(char *buffer, uint8_t *i)
+static void get_cylinderindex(char *buffer, uint8_t *i, struct parser_state *state)
 {
 	*i = atoi(buffer);
-	if (lastcylinderindex != *i) {
-		add_gas_switch_event(cur_dive, get_dc(), cur_sample->time.seconds, *i);
-		lastcylinderindex = *i;
+	if (state->lastcylinderindex != *i) {
+		add_gas_switch_event(state->cur_dive, get_dc(state), state->cur_sample->time.seconds, *i);
+		state->lastcylinderindex = *i;
 	}
 }
 
-static void get_sensor(char *buffer, uint8_t *i)
+static void get_sensor(char *buffer, uint8_t *i, struct parser_state *state)
 {
 	*i = atoi(buffer);
-	lastsensor = *i;
+	state->lastsensor = *i;
 }
 
-static void try_to_fill_dc_settings(const char *name, char *buf)
+static void try_to_fill_dc_settings(struct parser_state *state, const char *name, char *buf)
 {
 	start_match("divecomputerid", name, buf);
-	if (MATCH("model.divecomputerid", utf8_string, &cur_settings.dc.model))
+	if (MATCH("model.divecomputerid", utf8_string, &state->cur_settings.dc.model))
 		return;
-	if (MATCH("deviceid.divecomputerid", hex_value, &cur_settings.dc.deviceid))
+	if (MATCH("deviceid.divecomputerid", hex_value, &state->cur_settings.dc.deviceid))
 		return;
-	if (MATCH("nickname.divecomputerid", utf8_string, &cur_settings.dc.nickname))
+	if (MATCH("nickname.divecomputerid", utf8_string, &state->cur_settings.dc.nickname))
 		return;
-	if (MATCH("serial.divecomputerid", utf8_string, &cur_settings.dc.serial_nr))
+	if (MATCH("serial.divecomputerid", utf8_string, &state->cur_settings.dc.serial_nr))
 		return;
-	if (MATCH("firmware.divecomputerid", utf8_string, &cur_settings.dc.firmware))
+	if (MATCH("firmware.divecomputerid", utf8_string, &state->cur_settings.dc.firmware))
 		return;
 
 	nonmatch("divecomputerid", name, buf);
 }
 
-static void try_to_fill_event(const char *name, char *buf)
+static void get_event_cylinder(char *buffer, int *index)
+{
+	/* We add one to indicate that we got an actual cylinder index value */
+	*index = atoi(buffer) + 1;
+}
+
+static const struct match_rule event_rules[] = {
+	MATCH_RULE(struct event, "event", event_name, name),
+	MATCH_RULE(struct event, "name", event_name, name),
+	MATCH_STATE_RULE(struct event, "time", eventtime, time),
+	MATCH_RULE(struct event, "type", get_index, type),
+	MATCH_RULE(struct event, "flags", get_index, flags),
+	MATCH_RULE(struct event, "value", get_index, value),
+	MATCH_RULE(struct event, "cylinder", get_event_cylinder, gas.index),
+	MATCH_RULE(struct event, "o2", percent, gas.mix.o2),
+	MATCH_RULE(struct event, "he", percent, gas.mix.he),
+};
+static struct name_index event_index;
+
+static void try_to_fill_event(struct parser_state *state, const char *name, char *buf)
 {
 	start_match("event", name, buf);
-	if (MATCH("event", event_name, cur_event.name))
-		return;
-	if (MATCH("name", event_name, cur_event.name))
-		return;
-	if (MATCH("time", eventtime, &cur_event.time))
-		return;
-	if (MATCH("type", get_index, &cur_event.type))
-		return;
-	if (MATCH("flags", get_index, &cur_event.flags))
-		return;
-	if (MATCH("value", get_index, &cur_event.value))
-		return;
-	if (MATCH("cylinder", get_index, &cur_event.gas.index)) {
-		/* We add one to indicate that we got an actual cylinder index value */
-		cur_event.gas.index++;
-		return;
-	}
-	if (MATCH("o2", percent, &cur_event.gas.mix.o2))
-		return;
-	if (MATCH("he", percent, &cur_event.gas.mix.he))
+	if (MATCH_RULES(event_rules, event_index, &state->cur_event))
 		return;
 	nonmatch("event", name, buf);
 }
 
-static int match_dc_data_fields(struct divecomputer *dc, const char *name, char *buf)
-{
-	if (MATCH("maxdepth", depth, &dc->maxdepth))
-		return 1;
-	if (MATCH("meandepth", depth, &dc->meandepth))
-		return 1;
-	if (MATCH("max.depth", depth, &dc->maxdepth))
-		return 1;
-	if (MATCH("mean.depth", depth, &dc->meandepth))
-		return 1;
-	if (MATCH("duration", duration, &dc->duration))
-		return 1;
-	if (MATCH("divetime", duration, &dc->duration))
-		return 1;
-	if (MATCH("divetimesec", duration, &dc->duration))
-		return 1;
-	if (MATCH("surfacetime", duration, &dc->surfacetime))
-		return 1;
-	if (MATCH("airtemp", temperature, &dc->airtemp))
-		return 1;
-	if (MATCH("watertemp", temperature, &dc->watertemp))
-		return 1;
-	if (MATCH("air.temperature", temperature, &dc->airtemp))
-		return 1;
-	if (MATCH("water.temperature", temperature, &dc->watertemp))
-		return 1;
-	if (MATCH("pressure.surface", pressure, &dc->surface_pressure))
-		return 1;
-	if (MATCH("salinity.water", salinity, &dc->salinity))
-		return 1;
+static const struct match_rule dc_data_rules[] = {
+	MATCH_RULE(struct divecomputer, "maxdepth", depth, maxdepth),
+	MATCH_RULE(struct divecomputer, "meandepth", depth, meandepth),
+	MATCH_RULE(struct divecomputer, "max.depth", depth, maxdepth),
+	MATCH_RULE(struct divecomputer, "mean.depth", depth, meandepth),
+	MATCH_RULE(struct divecomputer, "duration", duration, duration),
+	MATCH_RULE(struct divecomputer, "divetime", duration, duration),
+	MATCH_RULE(struct divecomputer, "divetimesec", duration, duration),
+	MATCH_RULE(struct divecomputer, "surfacetime", duration, surfacetime),
+	MATCH_RULE(struct divecomputer, "airtemp", temperature, airtemp),
+	MATCH_RULE(struct divecomputer, "watertemp", temperature, watertemp),
+	MATCH_RULE(struct divecomputer, "air.temperature", temperature, airtemp),
+	MATCH_RULE(struct divecomputer, "water.temperature", temperature, watertemp),
+	MATCH_RULE(struct divecomputer, "pressure.surface", pressure, surface_pressure),
+	MATCH_RULE(struct divecomputer, "salinity.water", salinity, salinity),
+};
+static struct name_index dc_data_index;
 
-	return 0;
+static int match_dc_data_fields(struct parser_state *state, struct divecomputer *dc, const char *name, char *buf)
+{
+	return MATCH_RULES(dc_data_rules, dc_data_index, dc);
 }
 
+static const struct match_rule dc_rules[] = {
+	MATCH_STATE_RULE(struct divecomputer, "date", divedate, when),
+	MATCH_STATE_RULE(struct divecomputer, "time", divetime, when),
+	MATCH_RULE(struct divecomputer, "model", utf8_string, model),
+	MATCH_RULE(struct divecomputer, "deviceid", hex_value, deviceid),
+	MATCH_RULE(struct divecomputer, "diveid", hex_value, diveid),
+	MATCH_RULE(struct divecomputer, "dctype", get_dc_type, dctype),
+	MATCH_STATE_RULE(struct divecomputer, "no_o2sensors", get_sensor, no_o2sensors),
+};
+static struct name_index dc_index;
+
 /* We're in the top-level dive xml. Try to convert whatever value to a dive value */
-static void try_to_fill_dc(struct divecomputer *dc, const char *name, char *buf)
+static void try_to_fill_dc(struct parser_state *state, struct divecomputer *dc, const char *name, char *buf)
 {
 	start_match("divecomputer", name, buf);
 
-	if (MATCH("date", divedate, &dc->when))
-		return;
-	if (MATCH("time", divetime, &dc->when))
-		return;
-	if (MATCH("model", utf8_string, &dc->model))
-		return;
-	if (MATCH("deviceid", hex_value, &dc->deviceid))
-		return;
-	if (MATCH("diveid", hex_value, &dc->diveid))
-		return;
-	if (MATCH("dctype", get_dc_type, &dc->dctype))
-		return;
-	if (MATCH("no_o2sensors", get_sensor, &dc->no_o2sensors))
+	if (MATCH_RULES(dc_rules, dc_index, dc))
 		return;
-	if (match_dc_data_fields(dc, name, buf))
+	if (match_dc_data_fields(state, dc, name, buf))
 		return;
 
 	nonmatch("divecomputer", name, buf);
 }
 
+static void get_in_deco(char *buffer, bool *in_deco)
+{
+	*in_deco = atoi(buffer) == 1;
+}
+
+static void get_setpoint(char *buffer, o2pressure_t *setpoint, struct parser_state *state)
+{
+	double_to_o2pressure(buffer, setpoint);
+	state->cur_dive->dc.dctype = CCR;
+}
+
+static const struct match_rule sample_rules[] = {
+	MATCH_RULE(struct sample, "pressure.sample", pressure, cylinderpressure),
+	MATCH_RULE(struct sample, "cylpress.sample", pressure, cylinderpressure),
+	MATCH_RULE(struct sample, "pdiluent.sample", pressure, diluentpressure),
+	MATCH_STATE_RULE(struct sample, "cylinderindex.sample", get_cylinderindex, sensor),
+	MATCH_STATE_RULE(struct sample, "sensor.sample", get_sensor, sensor),
+	MATCH_RULE(struct sample, "depth.sample", depth, depth),
+	MATCH_RULE(struct sample, "temp.sample", temperature, temperature),
+	MATCH_RULE(struct sample, "temperature.sample", temperature, temperature),
+	MATCH_RULE(struct sample, "sampletime.sample", sampletime, time),
+	MATCH_RULE(struct sample, "time.sample", sampletime, time),
+	MATCH_RULE(struct sample, "ndl.sample", sampletime, ndl),
+	MATCH_RULE(struct sample, "tts.sample", sampletime, tts),
+	MATCH_RULE(struct sample, "in_deco.sample", get_in_deco, in_deco),
+	MATCH_RULE(struct sample, "stoptime.sample", sampletime, stoptime),
+	MATCH_RULE(struct sample, "stopdepth.sample", depth, stopdepth),
+	MATCH_RULE(struct sample, "cns.sample", get_uint8, cns),
+	MATCH_RULE(struct sample, "sensor1.sample", double_to_o2pressure, o2sensor[0]), // CCR O2 sensor data
+	MATCH_RULE(struct sample, "sensor2.sample", double_to_o2pressure, o2sensor[1]),
+	MATCH_RULE(struct sample, "sensor3.sample", double_to_o2pressure, o2sensor[2]), // up to 3 CCR sensors
+	MATCH_STATE_RULE(struct sample, "po2.sample", get_setpoint, setpoint),
+	MATCH_RULE(struct sample, "heartbeat", get_uint8, heartbeat),
+	MATCH_RULE(struct sample, "bearing", get_bearing, bearing),
+};
+static struct name_index sample_index;
+
 /* We're in samples - try to convert the random xml value to something useful */
-static void try_to_fill_sample(struct sample *sample, const char *name, char *buf)
+static void try_to_fill_sample(struct parser_state *state, struct sample *sample, const char *name, char *buf)
 {
-	int in_deco;
-
 	start_match("sample", name, buf);
-	if (MATCH("pressure.sample", pressure, &sample->cylinderpressure))
-		return;
-	if (MATCH("cylpress.sample", pressure, &sample->cylinderpressure))
-		return;
-	if (MATCH("pdiluent.sample", pressure, &sample->diluentpressure))
-		return;
-	if (MATCH("cylinderindex.sample", get_cylinderindex, &sample->sensor))
-		return;
-	if (MATCH("sensor.sample", get_sensor, &sample->sensor))
-		return;
-	if (MATCH("depth.sample", depth, &sample->depth))
-		return;
-	if (MATCH("temp.sample", temperature, &sample->temperature))
-		return;
-	if (MATCH("temperature.sample", temperature, &sample->temperature))
-		return;
-	if (MATCH("sampletime.sample", sampletime, &sample->time))
-		return;
-	if (MATCH("time.sample", sampletime, &sample->time))
-		return;
-	if (MATCH("ndl.sample", sampletime, &sample->ndl))
-		return;
-	if (MATCH("tts.sample", sampletime, &sample->tts))
-		return;
-	if (MATCH("in_deco.sample", get_index, &in_deco)) {
-		sample->in_deco = (in_deco == 1);
-		return;
-	}
-	if (MATCH("stoptime.sample", sampletime, &sample->stoptime))
-		return;
-	if (MATCH("stopdepth.sample", depth, &sample->stopdepth))
-		return;
-	if (MATCH("cns.sample", get_uint8, &sample->cns))
-		return;
-	if (MATCH("sensor1.sample", double_to_o2pressure, &sample->o2sensor[0])) // CCR O2 sensor data
-		return;
-	if (MATCH("sensor2.sample", double_to_o2pressure, &sample->o2sensor[1]))
-		return;
-	if (MATCH("sensor3.sample", double_to_o2pressure, &sample->o2sensor[2])) // up to 3 CCR sensors
-		return;
-	if (MATCH("po2.sample", double_to_o2pressure, &sample->setpoint)) {
-		cur_dive->dc.dctype = CCR;
-		return;
-	}
-	if (MATCH("heartbeat", get_uint8, &sample->heartbeat))
-		return;
-	if (MATCH("bearing", get_bearing, &sample->bearing))
+	if (MATCH_RULES(sample_rules, sample_index, sample))
 		return;
 
 	switch (import_source) {
@@ -911,7 +1040,7 @@ static void try_to_fill_sample(struct sample *sample, const char *name, char *bu
 		break;
 
 	case UDDF:
-		if (uddf_fill_sample(sample, name, buf))
+		if (uddf_fill_sample(state, sample, name, buf))
 			return;
 		break;
 
@@ -928,9 +1057,7 @@ void try_to_fill_userid(const char *name, char *buf)
 		set_userid(buf);
 }
 
-static const char *country, *city;
-
-static void divinglog_place(char *place, char **location)
+static void divinglog_place(char *place, char **location, struct parser_state *state)
 {
 	char buffer[1024], *p;
 	int len;
@@ -938,23 +1065,23 @@ static void divinglog_place(char *place, char **location)
 	len = snprintf(buffer, sizeof(buffer),
 		       "%s%s%s%s%s",
 		       place,
-		       city ? ", " : "",
-		       city ? city : "",
-		       country ? ", " : "",
-		       country ? country : "");
+		       state->city ? ", " : "",
+		       state->city ? state->city : "",
+		       state->country ? ", " : "",
+		       state->country ? state->country : "");
 
 	p = malloc(len + 1);
 	memcpy(p, buffer, len + 1);
 	*location = p;
 
-	city = NULL;
-	country = NULL;
+	state->city = NULL;
+	state->country = NULL;
 }
 
-static int divinglog_dive_match(struct dive *dive, const char *name, char *buf)
+static int divinglog_dive_match(struct parser_state *state, struct dive *dive, const char *name, char *buf)
 {
-	return MATCH("divedate", divedate, &dive->when) ||
-	       MATCH("entrytime", divetime, &dive->when) ||
+	return MATCH_STATE("divedate", divedate, &dive->when) ||
+	       MATCH_STATE("entrytime", divetime, &dive->when) ||
 	       MATCH("divetime", duration, &dive->dc.duration) ||
 	       MATCH("depth", depth, &dive->dc.maxdepth) ||
 	       MATCH("depthavg", depth, &dive->dc.meandepth) ||
@@ -965,9 +1092,9 @@ static int divinglog_dive_match(struct dive *dive, const char *name, char *buf)
 	       MATCH("prese", pressure, &dive->cylinder[0].end) ||
 	       MATCH("comments", utf8_string, &dive->notes) ||
 	       MATCH("names.buddy", utf8_string, &dive->buddy) ||
-	       MATCH("name.country", utf8_string, &country) ||
-	       MATCH("name.city", utf8_string, &city) ||
-	       MATCH("name.place", divinglog_place, &dive->location) ||
+	       MATCH("name.country", utf8_string, &state->country) ||
+	       MATCH("name.city", utf8_string, &state->city) ||
+	       MATCH_STATE("name.place", divinglog_place, &dive->location) ||
 	       0;
 }
 
@@ -1013,10 +1140,10 @@ success:
 }
 
 #define uddf_datedata(name, offset)                              \
-	static void uddf_##name(char *buffer, timestamp_t *when) \
+	static void uddf_##name(char *buffer, timestamp_t *when, struct parser_state *state) \
 	{                                                        \
-		cur_tm.tm_##name = atoi(buffer) + offset;        \
-		*when = utc_mktime(&cur_tm);                     \
+		state->cur_tm.tm_##name = atoi(buffer) + offset; \
+		*when = utc_mktime(&state->cur_tm);              \
 	}
 
 uddf_datedata(year, 0)
@@ -1025,16 +1152,16 @@ uddf_datedata(mday, 0)
 uddf_datedata(hour, 0)
 uddf_datedata(min, 0)
 
-static int uddf_dive_match(struct dive *dive, const char *name, char *buf)
+static int uddf_dive_match(struct parser_state *state, struct dive *dive, const char *name, char *buf)
 {
 	return MATCH("datetime", uddf_datetime, &dive->when) ||
 	       MATCH("diveduration", duration, &dive->dc.duration) ||
 	       MATCH("greatestdepth", depth, &dive->dc.maxdepth) ||
-	       MATCH("year.date", uddf_year, &dive->when) ||
-	       MATCH("month.date", uddf_mon, &dive->when) ||
-	       MATCH("day.date", uddf_mday, &dive->when) ||
-	       MATCH("hour.time", uddf_hour, &dive->when) ||
-	       MATCH("minute.time", uddf_min, &dive->when) ||
+	       MATCH_STATE("year.date", uddf_year, &dive->when) ||
+	       MATCH_STATE("month.date", uddf_mon, &dive->when) ||
+	       MATCH_STATE("day.date", uddf_mday, &dive->when) ||
+	       MATCH_STATE("hour.time", uddf_hour, &dive->when) ||
+	       MATCH_STATE("minute.time", uddf_min, &dive->when) ||
 	       0;
 }
 
@@ -1117,18 +1244,18 @@ static void gps_picture_location(char *buffer, struct picture *pic)
 }
 
 /* We're in the top-level dive xml. Try to convert whatever value to a dive value */
-static void try_to_fill_dive(struct dive *dive, const char *name, char *buf)
+static void try_to_fill_dive(struct parser_state *state, struct dive *dive, const char *name, char *buf)
 {
 	start_match("dive", name, buf);
 
 	switch (import_source) {
 	case DIVINGLOG:
-		if (divinglog_dive_match(dive, name, buf))
+		if (divinglog_dive_match(state, dive, name, buf))
 			return;
 		break;
 
 	case UDDF:
-		if (uddf_dive_match(dive, name, buf))
+		if (uddf_dive_match(state, dive, name, buf))
 			return;
 		break;
 
@@ -1142,24 +1269,24 @@ static void try_to_fill_dive(struct dive *dive, const char *name, char *buf)
 		return;
 	if (MATCH("tripflag", get_tripflag, &dive->tripflag))
 		return;
-	if (MATCH("date", divedate, &dive->when))
+	if (MATCH_STATE("date", divedate, &dive->when))
 		return;
-	if (MATCH("time", divetime, &dive->when))
+	if (MATCH_STATE("time", divetime, &dive->when))
 		return;
-	if (MATCH("datetime", divedatetime, &dive->when))
+	if (MATCH_STATE("datetime", divedatetime, &dive->when))
 		return;
 	/*
 	 * Legacy format note: per-dive depths and duration get saved
 	 * in the first dive computer entry
 	 */
-	if (match_dc_data_fields(&dive->dc, name, buf))
+	if (match_dc_data_fields(state, &dive->dc, name, buf))
 		return;
 
-	if (MATCH("filename.picture", utf8_string, &cur_picture->filename))
+	if (MATCH("filename.picture", utf8_string, &state->cur_picture->filename))
 		return;
-	if (MATCH("offset.picture", offsettime, &cur_picture->offset))
+	if (MATCH("offset.picture", offsettime, &state->cur_picture->offset))
 		return;
-	if (MATCH("gps.picture", gps_picture_location, cur_picture))
+	if (MATCH("gps.picture", gps_picture_location, state->cur_picture))
 		return;
 	if (MATCH("cylinderstartpressure", pressure, &dive->cylinder[0].start))
 		return;
@@ -1199,29 +1326,29 @@ static void try_to_fill_dive(struct dive *dive, const char *name, char *buf)
 		return;
 	if (MATCH("visibility.dive", get_rating, &dive->visibility))
 		return;
-	if (MATCH("size.cylinder", cylindersize, &dive->cylinder[cur_cylinder_index].type.size))
+	if (MATCH("size.cylinder", cylindersize, &dive->cylinder[state->cur_cylinder_index].type.size))
 		return;
-	if (MATCH("workpressure.cylinder", pressure, &dive->cylinder[cur_cylinder_index].type.workingpressure))
+	if (MATCH("workpressure.cylinder", pressure, &dive->cylinder[state->cur_cylinder_index].type.workingpressure))
 		return;
-	if (MATCH("description.cylinder", utf8_string, &dive->cylinder[cur_cylinder_index].type.description))
+	if (MATCH("description.cylinder", utf8_string, &dive->cylinder[state->cur_cylinder_index].type.description))
 		return;
-	if (MATCH("start.cylinder", pressure, &dive->cylinder[cur_cylinder_index].start))
+	if (MATCH("start.cylinder", pressure, &dive->cylinder[state->cur_cylinder_index].start))
 		return;
-	if (MATCH("end.cylinder", pressure, &dive->cylinder[cur_cylinder_index].end))
+	if (MATCH("end.cylinder", pressure, &dive->cylinder[state->cur_cylinder_index].end))
 		return;
-	if (MATCH("description.weightsystem", utf8_string, &dive->weightsystem[cur_ws_index].description))
+	if (MATCH("description.weightsystem", utf8_string, &dive->weightsystem[state->cur_ws_index].description))
 		return;
-	if (MATCH("weight.weightsystem", weight, &dive->weightsystem[cur_ws_index].weight))
+	if (MATCH("weight.weightsystem", weight, &dive->weightsystem[state->cur_ws_index].weight))
 		return;
-	if (MATCH("weight", weight, &dive->weightsystem[cur_ws_index].weight))
+	if (MATCH("weight", weight, &dive->weightsystem[state->cur_ws_index].weight))
 		return;
-	if (MATCH("o2", gasmix, &dive->cylinder[cur_cylinder_index].gasmix.o2))
+	if (MATCH_STATE("o2", gasmix, &dive->cylinder[state->cur_cylinder_index].gasmix.o2))
 		return;
-	if (MATCH("o2percent", gasmix, &dive->cylinder[cur_cylinder_index].gasmix.o2))
+	if (MATCH_STATE("o2percent", gasmix, &dive->cylinder[state->cur_cylinder_index].gasmix.o2))
 		return;
-	if (MATCH("n2", gasmix_nitrogen, &dive->cylinder[cur_cylinder_index].gasmix))
+	if (MATCH("n2", gasmix_nitrogen, &dive->cylinder[state->cur_cylinder_index].gasmix))
 		return;
-	if (MATCH("he", gasmix, &dive->cylinder[cur_cylinder_index].gasmix.he))
+	if (MATCH_STATE("he", gasmix, &dive->cylinder[state->cur_cylinder_index].gasmix.he))
 		return;
 	if (MATCH("air.divetemperature", temperature, &dive->airtemp))
 		return;
@@ -1232,15 +1359,15 @@ static void try_to_fill_dive(struct dive *dive, const char *name, char *buf)
 }
 
 /* We're in the top-level trip xml. Try to convert whatever value to a trip value */
-static void try_to_fill_trip(dive_trip_t **dive_trip_p, const char *name, char *buf)
+static void try_to_fill_trip(struct parser_state *state, dive_trip_t **dive_trip_p, const char *name, char *buf)
 {
 	start_match("trip", name, buf);
 
 	dive_trip_t *dive_trip = *dive_trip_p;
 
-	if (MATCH("date", divedate, &dive_trip->when))
+	if (MATCH_STATE("date", divedate, &dive_trip->when))
 		return;
-	if (MATCH("time", divetime, &dive_trip->when))
+	if (MATCH_STATE("time", divetime, &dive_trip->when))
 		return;
 	if (MATCH("location", utf8_string, &dive_trip->location))
 		return;
@@ -1262,196 +1389,203 @@ static void try_to_fill_trip(dive_trip_t **dive_trip_p, const char *name, char *
  * to make a dive valid, but if it has no location, no date and no
  * samples I'm pretty sure it's useless.
  */
-static bool is_dive(void)
+static bool is_dive(struct parser_state *state)
 {
-	return (cur_dive &&
-		(cur_dive->location || cur_dive->when || cur_dive->dc.samples));
+	return (state->cur_dive &&
+		(state->cur_dive->location || state->cur_dive->when || state->cur_dive->dc.samples));
 }
 
-static void reset_dc_info(struct divecomputer *dc)
+static void reset_dc_info(struct parser_state *state, struct divecomputer *dc)
 {
-	lastcns = lastpo2 = lastndl = laststoptime = laststopdepth = lastindeco = 0;
-	lastsensor = lastcylinderindex = 0;
+	state->lastcns = state->lastpo2 = state->lastndl = state->laststoptime = state->laststopdepth = state->lastindeco = 0;
+	state->lastsensor = state->lastcylinderindex = 0;
 }
 
-static void reset_dc_settings(void)
+static void reset_dc_settings(struct parser_state *state)
 {
-	free((void *)cur_settings.dc.model);
-	free((void *)cur_settings.dc.nickname);
-	free((void *)cur_settings.dc.serial_nr);
-	free((void *)cur_settings.dc.firmware);
-	cur_settings.dc.model = NULL;
-	cur_settings.dc.nickname = NULL;
-	cur_settings.dc.serial_nr = NULL;
-	cur_settings.dc.firmware = NULL;
-	cur_settings.dc.deviceid = 0;
+	free((void *)state->cur_settings.dc.model);
+	free((void *)state->cur_settings.dc.nickname);
+	free((void *)state->cur_settings.dc.serial_nr);
+	free((void *)state->cur_settings.dc.firmware);
+	state->cur_settings.dc.model = NULL;
+	state->cur_settings.dc.nickname = NULL;
+	state->cur_settings.dc.serial_nr = NULL;
+	state->cur_settings.dc.firmware = NULL;
+	state->cur_settings.dc.deviceid = 0;
 }
 
-static void settings_start(void)
+static void settings_start(struct parser_state *state)
 {
-	in_settings = true;
+	state->in_settings = true;
 }
 
-static void settings_end(void)
+static void settings_end(struct parser_state *state)
 {
-	in_settings = false;
+	state->in_settings = false;
 }
 
-static void dc_settings_start(void)
+static void dc_settings_start(struct parser_state *state)
 {
-	reset_dc_settings();
+	reset_dc_settings(state);
 }
 
-static void dc_settings_end(void)
+static void dc_settings_end(struct parser_state *state)
 {
-	create_device_node(cur_settings.dc.model, cur_settings.dc.deviceid, cur_settings.dc.serial_nr,
-			   cur_settings.dc.firmware, cur_settings.dc.nickname);
-	reset_dc_settings();
+	create_device_node(state->cur_settings.dc.model, state->cur_settings.dc.deviceid, state->cur_settings.dc.serial_nr,
+			   state->cur_settings.dc.firmware, state->cur_settings.dc.nickname);
+	reset_dc_settings(state);
 }
 
-static void dive_start(void)
+static void dive_start(struct parser_state *state)
 {
-	if (cur_dive)
+	if (state->cur_dive)
 		return;
-	cur_dive = alloc_dive();
-	reset_dc_info(&cur_dive->dc);
-	memset(&cur_tm, 0, sizeof(cur_tm));
-	if (cur_trip) {
-		add_dive_to_trip(cur_dive, cur_trip);
-		cur_dive->tripflag = IN_TRIP;
+	state->cur_dive = alloc_dive();
+	reset_dc_info(state, &state->cur_dive->dc);
+	memset(&state->cur_tm, 0, sizeof(state->cur_tm));
+	if (state->cur_trip) {
+		link_dive_to_trip(state->cur_dive, state->cur_trip);
+		state->cur_dive->tripflag = IN_TRIP;
 	}
 }
 
-static void dive_end(void)
+static void dive_end(struct parser_state *state)
 {
-	if (!cur_dive)
+	if (!state->cur_dive)
 		return;
-	if (!is_dive())
-		free(cur_dive);
+	if (!is_dive(state))
+		free(state->cur_dive);
+	else if (state->in_chunk)
+		add_dive_to_table(state->cur_dive, state->target_table);
 	else
-		record_dive_to_table(cur_dive, target_table);
-	cur_dive = NULL;
-	cur_dc = NULL;
-	cur_cylinder_index = 0;
-	cur_ws_index = 0;
+		record_dive_to_table(state->cur_dive, state->target_table);
+	state->cur_dive = NULL;
+	state->cur_dc = NULL;
+	state->cur_cylinder_index = 0;
+	state->cur_ws_index = 0;
 }
 
-static void trip_start(void)
+static void trip_start(struct parser_state *state)
 {
-	if (cur_trip)
+	if (state->cur_trip)
 		return;
-	dive_end();
-	cur_trip = calloc(1, sizeof(dive_trip_t));
-	memset(&cur_tm, 0, sizeof(cur_tm));
+	dive_end(state);
+	state->cur_trip = calloc(1, sizeof(dive_trip_t));
+	memset(&state->cur_tm, 0, sizeof(state->cur_tm));
 }
 
-static void trip_end(void)
+static void trip_end(struct parser_state *state)
 {
-	if (!cur_trip)
+	if (!state->cur_trip)
 		return;
-	insert_trip(&cur_trip);
-	cur_trip = NULL;
+	if (state->in_chunk) {
+		*state->last_chunk_trip = state->cur_trip;
+		state->last_chunk_trip = &state->cur_trip->next;
+	} else {
+		insert_trip(&state->cur_trip);
+	}
+	state->cur_trip = NULL;
 }
 
-static void event_start(void)
+static void event_start(struct parser_state *state)
 {
-	memset(&cur_event, 0, sizeof(cur_event));
-	cur_event.deleted = 0;	/* Active */
+	memset(&state->cur_event, 0, sizeof(state->cur_event));
+	state->cur_event.deleted = 0;	/* Active */
 }
 
-static void event_end(void)
+static void event_end(struct parser_state *state)
 {
-	struct divecomputer *dc = get_dc();
-	if (strcmp(cur_event.name, "surface") != 0) {			/* 123 is a magic event that we used for a while to encode images in dives */
-		if (cur_event.type == 123) {
+	struct divecomputer *dc = get_dc(state);
+	if (strcmp(state->cur_event.name, "surface") != 0) {			/* 123 is a magic event that we used for a while to encode images in dives */
+		if (state->cur_event.type == 123) {
 			struct picture *pic = alloc_picture();
-			pic->filename = strdup(cur_event.name);
+			pic->filename = strdup(state->cur_event.name);
 			/* theoretically this could fail - but we didn't support multi year offsets */
-			pic->offset.seconds = cur_event.time.seconds;
-			dive_add_picture(cur_dive, pic);
+			pic->offset.seconds = state->cur_event.time.seconds;
+			dive_add_picture(state->cur_dive, pic);
 		} else {
 			struct event *ev;
 			/* At some point gas change events did not have any type. Thus we need to add
 			 * one on import, if we encounter the type one missing.
 			 */
-			if (cur_event.type == 0 && strcmp(cur_event.name, "gaschange") == 0)
-				cur_event.type = cur_event.value >> 16 > 0 ? SAMPLE_EVENT_GASCHANGE2 : SAMPLE_EVENT_GASCHANGE;
-			ev = add_event(dc, cur_event.time.seconds,
-				       cur_event.type, cur_event.flags,
-				       cur_event.value, cur_event.name);
+			if (state->cur_event.type == 0 && strcmp(state->cur_event.name, "gaschange") == 0)
+				state->cur_event.type = state->cur_event.value >> 16 > 0 ? SAMPLE_EVENT_GASCHANGE2 : SAMPLE_EVENT_GASCHANGE;
+			ev = add_event(dc, state->cur_event.time.seconds,
+				       state->cur_event.type, state->cur_event.flags,
+				       state->cur_event.value, state->cur_event.name);
 			if (ev && event_is_gaschange(ev)) {
 				/* See try_to_fill_event() on why the filled-in index is one too big */
-				ev->gas.index = cur_event.gas.index-1;
-				if (cur_event.gas.mix.o2.permille || cur_event.gas.mix.he.permille)
-					ev->gas.mix = cur_event.gas.mix;
+				ev->gas.index = state->cur_event.gas.index-1;
+				if (state->cur_event.gas.mix.o2.permille || state->cur_event.gas.mix.he.permille)
+					ev->gas.mix = state->cur_event.gas.mix;
 			}
 		}
 	}
-	cur_event.deleted = 1;	/* No longer active */
+	state->cur_event.deleted = 1;	/* No longer active */
 }
 
-static void picture_start(void)
+static void picture_start(struct parser_state *state)
 {
-	cur_picture = alloc_picture();
+	state->cur_picture = alloc_picture();
 }
 
-static void picture_end(void)
+static void picture_end(struct parser_state *state)
 {
-	dive_add_picture(cur_dive, cur_picture);
-	cur_picture = NULL;
+	dive_add_picture(state->cur_dive, state->cur_picture);
+	state->cur_picture = NULL;
 }
 
-static void cylinder_start(void)
+static void cylinder_start(struct parser_state *state)
 {
 }
 
-static void cylinder_end(void)
+static void cylinder_end(struct parser_state *state)
 {
-	cur_cylinder_index++;
+	state->cur_cylinder_index++;
 }
 
-static void ws_start(void)
+static void ws_start(struct parser_state *state)
 {
 }
 
-static void ws_end(void)
+static void ws_end(struct parser_state *state)
 {
-	cur_ws_index++;
+	state->cur_ws_index++;
 }
 
-static void sample_start(void)
+static void sample_start(struct parser_state *state)
 {
-	cur_sample = prepare_sample(get_dc());
-	cur_sample->ndl.seconds = lastndl;
-	cur_sample->in_deco = lastindeco;
-	cur_sample->stoptime.seconds = laststoptime;
-	cur_sample->stopdepth.mm = laststopdepth;
-	cur_sample->cns = lastcns;
-	cur_sample->setpoint.mbar = lastpo2;
-	cur_sample->sensor = lastsensor;
+	state->cur_sample = prepare_sample(get_dc(state));
+	state->cur_sample->ndl.seconds = state->lastndl;
+	state->cur_sample->in_deco = state->lastindeco;
+	state->cur_sample->stoptime.seconds = state->laststoptime;
+	state->cur_sample->stopdepth.mm = state->laststopdepth;
+	state->cur_sample->cns = state->lastcns;
+	state->cur_sample->setpoint.mbar = state->lastpo2;
+	state->cur_sample->sensor = state->lastsensor;
 }
 
-static void sample_end(void)
+static void sample_end(struct parser_state *state)
 {
-	if (!cur_dive)
+	if (!state->cur_dive)
 		return;
 
-	finish_sample(get_dc());
-	lastndl = cur_sample->ndl.seconds;
-	lastindeco = cur_sample->in_deco;
-	laststoptime = cur_sample->stoptime.seconds;
-	laststopdepth = cur_sample->stopdepth.mm;
-	lastcns = cur_sample->cns;
-	lastpo2 = cur_sample->setpoint.mbar;
-	cur_sample = NULL;
+	finish_sample(get_dc(state));
+	state->lastndl = state->cur_sample->ndl.seconds;
+	state->lastindeco = state->cur_sample->in_deco;
+	state->laststoptime = state->cur_sample->stoptime.seconds;
+	state->laststopdepth = state->cur_sample->stopdepth.mm;
+	state->lastcns = state->cur_sample->cns;
+	state->lastpo2 = state->cur_sample->setpoint.mbar;
+	state->cur_sample = NULL;
 }
 
-static void divecomputer_start(void)
+static void divecomputer_start(struct parser_state *state)
 {
 	struct divecomputer *dc;
 
 	/* Start from the previous dive computer */
-	dc = &cur_dive->dc;
+	dc = &state->cur_dive->dc;
 	while (dc->next)
 		dc = dc->next;
 
@@ -1465,77 +1599,75 @@ static void divecomputer_start(void)
 	}
 
 	/* .. this is the one we'll use */
-	cur_dc = dc;
-	reset_dc_info(dc);
+	state->cur_dc = dc;
+	reset_dc_info(state, dc);
 }
 
-static void divecomputer_end(void)
+static void divecomputer_end(struct parser_state *state)
 {
-	if (!cur_dc->when)
-		cur_dc->when = cur_dive->when;
-	cur_dc = NULL;
+	if (!state->cur_dc->when)
+		state->cur_dc->when = state->cur_dive->when;
+	state->cur_dc = NULL;
 }
 
-static void userid_start(void)
+static void userid_start(struct parser_state *state)
 {
-	in_userid = true;
+	state->in_userid = true;
 	set_save_userid_local(true); //if the xml contains userid, keep saving it.
 }
 
-static void userid_stop(void)
+static void userid_stop(struct parser_state *state)
 {
-	in_userid = false;
+	state->in_userid = false;
 }
 
-static void entry(const char *name, char *buf)
+static void entry(struct parser_state *state, const char *name, char *buf)
 {
-	if (in_userid) {
+	if (state->in_userid) {
 		try_to_fill_userid(name, buf);
 		return;
 	}
-	if (in_settings) {
-		try_to_fill_dc_settings(name, buf);
+	if (state->in_settings) {
+		try_to_fill_dc_settings(state, name, buf);
 		try_to_match_autogroup(name, buf);
 		return;
 	}
-	if (!cur_event.deleted) {
-		try_to_fill_event(name, buf);
+	if (!state->cur_event.deleted) {
+		try_to_fill_event(state, name, buf);
 		return;
 	}
-	if (cur_sample) {
-		try_to_fill_sample(cur_sample, name, buf);
+	if (state->cur_sample) {
+		try_to_fill_sample(state, state->cur_sample, name, buf);
 		return;
 	}
-	if (cur_dc) {
-		try_to_fill_dc(cur_dc, name, buf);
+	if (state->cur_dc) {
+		try_to_fill_dc(state, state->cur_dc, name, buf);
 		return;
 	}
-	if (cur_dive) {
-		try_to_fill_dive(cur_dive, name, buf);
+	if (state->cur_dive) {
+		try_to_fill_dive(state, state->cur_dive, name, buf);
 		return;
 	}
-	if (cur_trip) {
-		try_to_fill_trip(&cur_trip, name, buf);
+	if (state->cur_trip) {
+		try_to_fill_trip(state, &state->cur_trip, name, buf);
 		return;
 	}
 }
 
-static const char *nodename(xmlNode *node, char *buf, int len)
+/*
+ * "name.parent" in lower case, from the names of a node and its ancestors
+ * (innermost first). A trailing '.' means there were more ancestors.
+ */
+static const char *format_nodename(const char **names, int nr, char *buf, int len)
 {
 	int levels = 2;
 	char *p = buf;
 
-	if (!node || !node->name)
-		return "root";
-
-	if (node->parent && !strcmp(node->name, "text"))
-		node = node->parent;
-
 	/* Make sure it's always NUL-terminated */
 	p[--len] = 0;
 
 	for (;;) {
-		const char *name = node->name;
+		const char *name = *names++;
 		char c;
 		while ((c = *name++) != 0) {
 			/* Cheaper 'tolower()' for ASCII */
@@ -1545,20 +1677,36 @@ static const char *nodename(xmlNode *node, char *buf, int len)
 				return buf;
 		}
 		*p = 0;
-		node = node->parent;
-		if (!node || !node->name)
+		if (!--nr)
 			return buf;
 		*p++ = '.';
 		if (!--len)
 			return buf;
+		*p = 0;
 		if (!--levels)
 			return buf;
 	}
 }
 
+static const char *nodename(xmlNode *node, char *buf, int len)
+{
+	const char *names[3];
+	int nr = 0;
+
+	if (!node || !node->name)
+		return "root";
+
+	if (node->parent && !strcmp(node->name, "text"))
+		node = node->parent;
+
+	for (; node && node->name && nr < 3; node = node->parent)
+		names[nr++] = (const char *)node->name;
+	return format_nodename(names, nr, buf, len);
+}
+
 #define MAXNAME 32
 
-static void visit_one_node(xmlNode *node)
+static void visit_one_node(struct parser_state *state, xmlNode *node)
 {
 	char *content;
 	static char buffer[MAXNAME];
@@ -1570,27 +1718,27 @@ static void visit_one_node(xmlNode *node)
 
 	name = nodename(node, buffer, sizeof(buffer));
 
-	entry(name, content);
+	entry(state, name, content);
 }
 
-static void traverse(xmlNode *root);
+static void traverse(struct parser_state *state, xmlNode *root);
 
-static void traverse_properties(xmlNode *node)
+static void traverse_properties(struct parser_state *state, xmlNode *node)
 {
 	xmlAttr *p;
 
 	for (p = node->properties; p; p = p->next)
-		traverse(p->children);
+		traverse(state, p->children);
 }
 
-static void visit(xmlNode *n)
+static void visit(struct parser_state *state, xmlNode *n)
 {
-	visit_one_node(n);
-	traverse_properties(n);
-	traverse(n->children);
+	visit_one_node(state, n);
+	traverse_properties(state, n);
+	traverse(state, n->children);
 }
 
-static void DivingLog_importer(void)
+static void DivingLog_importer(struct parser_state *state)
 {
 	import_source = DIVINGLOG;
 
@@ -1607,7 +1755,7 @@ static void DivingLog_importer(void)
 	xml_parsing_units = SI_units;
 }
 
-static void uddf_importer(void)
+static void uddf_importer(struct parser_state *state)
 {
 	import_source = UDDF;
 	xml_parsing_units = SI_units;
@@ -1621,7 +1769,7 @@ static void uddf_importer(void)
  */
 static struct nesting {
 	const char *name;
-	void (*start)(void), (*end)(void);
+	void (*start)(struct parser_state *), (*end)(struct parser_state *);
 } nesting[] = {
 	  { "divecomputerid", dc_settings_start, dc_settings_end },
 	  { "settings", settings_start, settings_end },
@@ -1648,29 +1796,48 @@ static struct nesting {
 	  { NULL, }
   };
 
-static void traverse(xmlNode *root)
+static struct name_index nesting_index;
+
+/* the rule for an element, or the empty rule at the end of the table */
+static struct nesting *find_nesting(const char *name)
+{
+	const int nr = sizeof(nesting) / sizeof(nesting[0]) - 1;
+	int i = lookup_name_index(&nesting_index, nesting, sizeof(nesting[0]), nr, name, strlen(name));
+
+	return nesting + (i < 0 ? nr : i);
+}
+
+#define PREPARE_INDEX(index, table, nr) \
+	if (!index.size) build_name_index(&index, table, sizeof(table[0]), nr)
+
+/* the name hashes get built on first use; do that before threads share them */
+static void prepare_match_indexes(void)
+{
+	PREPARE_INDEX(nesting_index, nesting, sizeof(nesting) / sizeof(nesting[0]) - 1);
+	PREPARE_INDEX(event_index, event_rules, sizeof(event_rules) / sizeof(event_rules[0]));
+	PREPARE_INDEX(dc_index, dc_rules, sizeof(dc_rules) / sizeof(dc_rules[0]));
+	PREPARE_INDEX(dc_data_index, dc_data_rules, sizeof(dc_data_rules) / sizeof(dc_data_rules[0]));
+	PREPARE_INDEX(sample_index, sample_rules, sizeof(sample_rules) / sizeof(sample_rules[0]));
+}
+
+static void traverse(struct parser_state *state, xmlNode *root)
 {
 	xmlNode *n;
 
 	for (n = root; n; n = n->next) {
-		struct nesting *rule = nesting;
+		struct nesting *rule;
 
 		if (!n->name) {
-			visit(n);
+			visit(state, n);
 			continue;
 		}
 
-		do {
-			if (!strcmp(rule->name, n->name))
-				break;
-			rule++;
-		} while (rule->name);
-
+		rule = find_nesting((const char *)n->name);
 		if (rule->start)
-			rule->start();
-		visit(n);
+			rule->start(state);
+		visit(state, n);
 		if (rule->end)
-			rule->end();
+			rule->end(state);
 	}
 }
 
@@ -1688,6 +1855,448 @@ static void reset_all(void)
 	import_source = UNKNOWN;
 }
 
+/*
+ * Subsurface's own files don't need a transform, so instead of building a
+ * DOM we stream them through an xmlTextReader. This calls the nesting rules
+ * and entry() in the same order, with the same names, as traverse() does.
+ */
+struct stream_element {
+	const char *name;
+	struct nesting *rule;
+};
+
+struct xml_stream {
+	struct parser_state *state;
+	xmlTextReaderPtr reader;
+	struct stream_element *stack;
+	int depth, allocated;
+	struct membuffer value;
+	char name[MAXNAME];
+};
+
+static bool is_blank(const char *s)
+{
+	while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r')
+		s++;
+	return !*s;
+}
+
+/* entry() may modify the buffer, and the reader's strings can be shared */
+static void stream_value(struct xml_stream *stream, const char *name, const char *value)
+{
+	stream->value.len = 0;
+	put_string(&stream->value, value);
+	entry(stream->state, name, (char *)mb_cstring(&stream->value));
+}
+
+/* a node called name inside the first 'level' elements on the stack */
+static void stream_entry(struct xml_stream *stream, const char *name, int level, const char *value)
+{
+	const char *names[3] = { name };
+	int nr = 1;
+
+	if (level > 0)
+		names[nr++] = stream->stack[level - 1].name;
+	if (level > 1)
+		names[nr++] = stream->stack[level - 2].name;
+	stream_value(stream, format_nodename(names, nr, stream->name, sizeof(stream->name)), value);
+}
+
+static void stream_element_start(struct xml_stream *stream)
+{
+	xmlTextReaderPtr reader = stream->reader;
+	const char *name = (const char *)xmlTextReaderConstLocalName(reader);
+	struct nesting *rule = find_nesting(name);
+	struct stream_element *element;
+	bool empty = xmlTextReaderIsEmptyElement(reader) == 1;
+
+	if (stream->depth == stream->allocated) {
+		stream->allocated = stream->allocated ? 2 * stream->allocated : 16;
+		stream->stack = realloc(stream->stack, stream->allocated * sizeof(*stream->stack));
+		if (!stream->stack)
+			exit(1);
+	}
+	element = stream->stack + stream->depth++;
+	element->name = name;
+	element->rule = rule;
+
+	if (rule->start)
+		rule->start(stream->state);
+	while (xmlTextReaderMoveToNextAttribute(reader) == 1) {
+		const char *value = (const char *)xmlTextReaderConstValue(reader);
+		if (xmlTextReaderIsNamespaceDecl(reader) == 1 || !value || is_blank(value))
+			continue;
+		stream_entry(stream, (const char *)xmlTextReaderConstLocalName(reader), stream->depth, value);
+	}
+	xmlTextReaderMoveToElement(reader);
+
+	/* there won't be an end element */
+	if (empty) {
+		stream->depth--;
+		if (rule->end)
+			rule->end(stream->state);
+	}
+}
+
+static void stream_element_end(struct xml_stream *stream)
+{
+	struct nesting *rule;
+
+	if (!stream->depth)
+		return;
+	rule = stream->stack[--stream->depth].rule;
+	if (rule->end)
+		rule->end(stream->state);
+}
+
+static void stream_node(struct xml_stream *stream, int type)
+{
+	const char *value = (const char *)xmlTextReaderConstValue(stream->reader);
+	int depth = stream->depth;
+
+	if (!value)
+		return;
+	switch (type) {
+	case XML_READER_TYPE_TEXT:
+		/* text is named after the element it is in */
+		if (!depth || is_blank(value))
+			return;
+		stream_entry(stream, stream->stack[depth - 1].name, depth - 1, value);
+		break;
+	case XML_READER_TYPE_CDATA:
+		/* nodename() has no name for these */
+		if (!is_blank(value))
+			stream_value(stream, "root", value);
+		break;
+	case XML_READER_TYPE_COMMENT:
+	case XML_READER_TYPE_PROCESSING_INSTRUCTION:
+		stream_entry(stream, (const char *)xmlTextReaderConstLocalName(stream->reader), depth, value);
+		break;
+	}
+}
+
+/*
+ * The decision test_xslt_transforms() makes, taken from the first two
+ * elements of the file: a root element we know from a foreign format
+ * needs a transform, unless its first child says the file was written
+ * by Subsurface. Broken files go the DOM way, too.
+ */
+static bool needs_xslt_transform(const char *url, const char *buffer)
+{
+	xmlTextReaderPtr reader = xmlReaderForMemory(buffer, strlen(buffer), url, NULL, 0);
+	bool transform = true;
+	bool in_root = false;
+
+	if (!reader)
+		return true;
+	while (xmlTextReaderRead(reader) == 1) {
+		if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT)
+			continue;
+		if (!in_root) {
+			if (!xslt_root_element((const char *)xmlTextReaderConstLocalName(reader))) {
+				transform = false;
+				break;
+			}
+			if (xmlTextReaderIsEmptyElement(reader) == 1)
+				break;
+			in_root = true;
+			continue;
+		}
+		char *name = (char *)xmlTextReaderGetAttribute(reader, (const xmlChar *)"name");
+		transform = !name || strcasecmp(name, "subsurface") != 0;
+		xmlFree(name);
+		break;
+	}
+	xmlFreeTextReader(reader);
+	return transform;
+}
+
+/*
+ * Stream a document into the parser state. Returns false without having
+ * touched anything if it has no root element; *failed tells whether the
+ * document broke off somewhere. Any dive that is still open is left to
+ * the caller.
+ */
+static bool stream_xml(struct parser_state *state, const char *url, const char *buffer, int size,
+		       bool new_file, bool *failed)
+{
+	struct xml_stream stream = { state };
+	bool started = false;
+	int ret;
+
+	stream.reader = xmlReaderForMemory(buffer, size, url, NULL, 0);
+	if (!stream.reader)
+		return false;
+
+	while ((ret = xmlTextReaderRead(stream.reader)) == 1) {
+		int type = xmlTextReaderNodeType(stream.reader);
+
+		if (!started) {
+			/* like traverse(), start at the root element */
+			if (type != XML_READER_TYPE_ELEMENT)
+				continue;
+			started = true;
+			if (new_file) {
+				set_save_userid_local(false);
+				set_userid("");
+				reset_all();
+			}
+			dive_start(state);
+		}
+		if (type == XML_READER_TYPE_ELEMENT)
+			stream_element_start(&stream);
+		else if (type == XML_READER_TYPE_END_ELEMENT)
+			stream_element_end(&stream);
+		else
+			stream_node(&stream, type);
+	}
+	xmlFreeTextReader(stream.reader);
+	/* on a parse error keep what we have read so far */
+	while (stream.depth)
+		stream_element_end(&stream);
+	free(stream.stack);
+	free_buffer(&stream.value);
+	*failed = ret < 0;
+	return started;
+}
+
+/*
+ * A big file of our own is split up between the elements inside its
+ * <dives> element, and the pieces are parsed on several threads. To find
+ * them we only look at the tags: comments, CDATA sections, processing
+ * instructions and quoted attribute values are skipped, and we give up on
+ * anything fancier (a DTD, namespaces, encodings other than UTF-8).
+ */
+#define XML_CHUNK_SIZE (256 * 1024)
+
+struct xml_chunk {
+	const char *start;
+	int size;
+	struct parser_state state;
+	struct dive_table dives;
+	bool failed;
+};
+
+struct xml_chunks {
+	const char *url;
+	const char *root, *parent;	/* the names of the root and the <dives> element */
+	int root_len, parent_len;
+	const char *content, *content_end;	/* what is inside <dives> */
+	int nr, allocated;
+	struct xml_chunk *chunk;
+};
+
+static void add_xml_chunk(struct xml_chunks *chunks, const char *start)
+{
+	if (chunks->nr)
+		chunks->chunk[chunks->nr - 1].size = start - chunks->chunk[chunks->nr - 1].start;
+	if (chunks->nr == chunks->allocated) {
+		chunks->allocated = chunks->allocated ? 2 * chunks->allocated : 16;
+		chunks->chunk = realloc(chunks->chunk, chunks->allocated * sizeof(*chunks->chunk));
+		if (!chunks->chunk)
+			exit(1);
+	}
+	memset(chunks->chunk + chunks->nr, 0, sizeof(*chunks->chunk));
+	chunks->chunk[chunks->nr++].start = start;
+}
+
+/* is there an xmlns attribute in the tag from start to end? */
+static bool declares_namespace(const char *start, const char *end)
+{
+	const char *p = start;
+
+	while ((p = memchr(p, 'x', end - p)) != NULL && end - p >= 5) {
+		if (!memcmp(p, "xmlns", 5))
+			return true;
+		p++;
+	}
+	return false;
+}
+
+static bool utf8_declaration(const char *start, const char *end)
+{
+	const char *p = strstr(start, "encoding");
+
+	if (!p || p > end)
+		return true;
+	p += strcspn(p, "\"'");
+	return p < end && !strncasecmp(p + 1, "utf-8", 5);
+}
+
+static bool find_xml_chunks(const char *buffer, struct xml_chunks *chunks)
+{
+	const char *p = buffer;
+	bool in_dives = false;
+	int depth = 0;
+
+	while ((p = strchr(p, '<')) != NULL) {
+		const char *name = p + 1, *end;
+		int len;
+
+		if (!strncmp(p, "<!--", 4)) {
+			if (!(p = strstr(p + 4, "-->")))
+				return false;
+			p += 3;
+			continue;
+		}
+		if (!strncmp(p, "<![CDATA[", 9)) {
+			if (!(p = strstr(p + 9, "]]>")))
+				return false;
+			p += 3;
+			continue;
+		}
+		if (*name == '?') {
+			if (!(end = strstr(name, "?>")))
+				return false;
+			if (!strncmp(name, "?xml", 4) && !utf8_declaration(name, end))
+				return false;
+			p = end + 2;
+			continue;
+		}
+		/* a DTD could define entities */
+		if (*name == '!')
+			return false;
+
+		if (*name == '/') {
+			if (!(end = strchr(name, '>')) || --depth < 0)
+				return false;
+			if (in_dives && depth == 1) {
+				chunks->content_end = p;
+				in_dives = false;
+			}
+			p = end + 1;
+			continue;
+		}
+
+		len = strcspn(name, " \t\r\n/>");
+		for (end = name + len; *end != '>'; end++) {
+			if (!*end)
+				return false;
+			if ((*end == '"' || *end == '\'') && !(end = strchr(end + 1, *end)))
+				return false;
+		}
+		if (depth == 0) {
+			if (chunks->root || declares_namespace(p, end))
+				return false;
+			chunks->root = name;
+			chunks->root_len = len;
+		} else if (depth == 1 && !chunks->parent && len == 5 && !memcmp(name, "dives", 5)) {
+			if (declares_namespace(p, end))
+				return false;
+			chunks->parent = name;
+			chunks->parent_len = len;
+			chunks->content = end + 1;
+			in_dives = end[-1] != '/';
+		} else if (in_dives && depth == 2) {
+			if (!chunks->nr || p - chunks->chunk[chunks->nr - 1].start >= XML_CHUNK_SIZE)
+				add_xml_chunk(chunks, p);
+		}
+		if (end[-1] != '/')
+			depth++;
+		p = end + 1;
+	}
+	if (depth || !chunks->content_end || chunks->nr < 2)
+		return false;
+	chunks->chunk[chunks->nr - 1].size = chunks->content_end - chunks->chunk[chunks->nr - 1].start;
+	return true;
+}
+
+/* a piece, wrapped up in the elements it was in */
+static void parse_xml_chunk(void *data, int i)
+{
+	struct xml_chunks *chunks = data;
+	struct xml_chunk *chunk = chunks->chunk + i;
+	struct membuffer doc = { 0 };
+
+	put_format(&doc, "<%.*s><%.*s>", chunks->root_len, chunks->root, chunks->parent_len, chunks->parent);
+	put_bytes(&doc, chunk->start, chunk->size);
+	put_format(&doc, "</%.*s></%.*s>", chunks->parent_len, chunks->parent, chunks->root_len, chunks->root);
+	stream_xml(&chunk->state, chunks->url, doc.buffer, doc.len, false, &chunk->failed);
+	dive_end(&chunk->state);
+	free_buffer(&doc);
+}
+
+/*
+ * The settings and everything else outside <dives> are read first, the
+ * pieces in parallel, and then their dives and trips are added in file
+ * order, so we end up with what parsing the whole file would have given.
+ * The only difference is that a broken piece doesn't lose the dives in
+ * the pieces after it.
+ */
+static int parse_xml_chunks(struct parser_state *state, const char *url, const char *buffer)
+{
+	struct xml_chunks chunks = { url };
+	struct membuffer header = { 0 };
+	bool failed = false;
+	int i;
+
+	if (strlen(buffer) < 2 * XML_CHUNK_SIZE || !find_xml_chunks(buffer, &chunks)) {
+		free(chunks.chunk);
+		return -1;
+	}
+	put_bytes(&header, buffer, chunks.chunk[0].start - buffer);
+	put_string(&header, chunks.content_end);
+	stream_xml(state, url, header.buffer, header.len, true, &failed);
+	free_buffer(&header);
+
+	for (i = 0; i < chunks.nr; i++) {
+		struct xml_chunk *chunk = chunks.chunk + i;
+
+		init_parser_state(&chunk->state, &chunk->dives);
+		chunk->state.in_chunk = true;
+		chunk->state.last_chunk_trip = &chunk->state.chunk_trips;
+	}
+	/* the first piece goes on with whatever dive the root element started */
+	chunks.chunk[0].state.cur_dive = state->cur_dive;
+	chunks.chunk[0].state.cur_tm = state->cur_tm;
+	state->cur_dive = NULL;
+
+	/* libxml2 wants to be set up before it is used on other threads */
+	xmlInitParser();
+	prepare_match_indexes();
+	run_in_parallel(chunks.nr, parse_xml_chunk, &chunks);
+
+	for (i = 0; i < chunks.nr; i++) {
+		struct xml_chunk *chunk = chunks.chunk + i;
+		dive_trip_t *trip, *next;
+		int j;
+
+		for (j = 0; j < chunk->dives.nr; j++)
+			record_dive_to_table(chunk->dives.dives[j], state->target_table);
+		for (trip = chunk->state.chunk_trips; trip; trip = next) {
+			next = trip->next;
+			trip->next = NULL;
+			insert_trip(&trip);
+		}
+		free(chunk->dives.dives);
+		failed |= chunk->failed;
+	}
+	free(chunks.chunk);
+	if (failed)
+		report_error(translate("gettextFromC", "Failed to parse '%s'"), url);
+	return 0;
+}
+
+/*
+ * Returns -1 without having touched anything if the file has to go
+ * through the DOM (and possibly XSLT) instead.
+ */
+static int parse_xml_stream(struct parser_state *state, const char *url, const char *buffer)
+{
+	bool failed;
+
+	if (needs_xslt_transform(url, buffer))
+		return -1;
+	if (parse_xml_mode == PARSE_XML_ANY && parse_xml_chunks(state, url, buffer) == 0)
+		return 0;
+	if (!stream_xml(state, url, buffer, strlen(buffer), true, &failed))
+		return -1;
+	dive_end(state);
+	if (failed)
+		report_error(translate("gettextFromC", "Failed to parse '%s'"), url);
+	return 0;
+}
+
 /* divelog.de sends us xml files that claim to be iso-8859-1
  * but once we decode the HTML encoded characters they turn
  * into UTF-8 instead. So skip the incorrect encoding
@@ -1699,27 +2308,33 @@ const char *preprocess_divelog_de(const char *buffer)
 	if (ret) {
 		xmlParserCtxtPtr ctx;
 		char buf[] = "";
-		int i;
+		const char *p;
 
-		for (i = 0; i < strlen(ret); ++i)
-			if (!isascii(ret[i]))
+		/* one pass that also finds the length */
+		for (p = ret; *p; p++)
+			if (!isascii(*p))
 				return buffer;
 
 		ctx = xmlCreateMemoryParserCtxt(buf, sizeof(buf));
-		ret = xmlStringLenDecodeEntities(ctx, ret, strlen(ret), XML_SUBSTITUTE_REF, 0, 0, 0);
+		ret = xmlStringLenDecodeEntities(ctx, ret, p - ret, XML_SUBSTITUTE_REF, 0, 0, 0);
 
 		return ret;
 	}
 	return buffer;
 }
 
+enum parse_xml_mode parse_xml_mode = PARSE_XML_ANY;
+
 void parse_xml_buffer(const char *url, const char *buffer, int size,
 		      struct dive_table *table, const char **params)
 {
 	xmlDoc *doc;
 	const char *res = preprocess_divelog_de(buffer);
+	struct parser_state state;
 
-	target_table = table;
+	init_parser_state(&state, table);
+	if (res == buffer && parse_xml_mode != PARSE_XML_DOM && parse_xml_stream(&state, url, buffer) == 0)
+		return;
 	doc = xmlReadMemory(res, strlen(res), url, NULL, 0);
 	if (res != buffer)
 		free((char *)res);
@@ -1731,88 +2346,115 @@ void parse_xml_buffer(const char *url, const char *buffer, int size,
 	set_save_userid_local(false);
 	set_userid("");
 	reset_all();
-	dive_start();
+	dive_start(&state);
 	doc = test_xslt_transforms(doc, params);
-	traverse(xmlDocGetRootElement(doc));
-	dive_end();
+	traverse(&state, xmlDocGetRootElement(doc));
+	dive_end(&state);
 	xmlFreeDoc(doc);
 }
 
-extern int dm4_events(void *handle, int columns, char **data, char **column)
+#define MAX_SQL_COLUMNS 16
+
+/*
+ * Hand the rows of a prepared query for one dive to a sqlite3_exec() style
+ * callback - which, like with sqlite3_exec(), stops the query by returning
+ * nonzero, and makes us return SQLITE_ABORT.
+ */
+static int sql_dive_rows(sqlite3_stmt *stmt, int dive_id, sqlite3_callback callback, void *param)
+{
+	char *data[MAX_SQL_COLUMNS];
+	int i, columns = MIN(sqlite3_column_count(stmt), MAX_SQL_COLUMNS), retval;
+
+	sqlite3_bind_int(stmt, 1, dive_id);
+	while ((retval = sqlite3_step(stmt)) == SQLITE_ROW) {
+		for (i = 0; i < columns; i++)
+			data[i] = (char *)sqlite3_column_text(stmt, i);
+		if (callback(param, columns, data, NULL)) {
+			retval = SQLITE_ABORT;
+			break;
+		}
+	}
+	sqlite3_reset(stmt);
+	return retval == SQLITE_DONE ? SQLITE_OK : retval;
+}
+
+extern int dm4_events(void *param, int columns, char **data, char **column)
 {
-	event_start();
+	struct parser_state *state = param;
+
+	event_start(state);
 	if (data[1])
-		cur_event.time.seconds = atoi(data[1]);
+		state->cur_event.time.seconds = atoi(data[1]);
 
 	if (data[2]) {
 		switch (atoi(data[2])) {
 		case 1:
 			/* 1 Mandatory Safety Stop */
-			strcpy(cur_event.name, "safety stop (mandatory)");
+			strcpy(state->cur_event.name, "safety stop (mandatory)");
 			break;
 		case 3:
 			/* 3 Deco */
 			/* What is Subsurface's term for going to
 				 * deco? */
-			strcpy(cur_event.name, "deco");
+			strcpy(state->cur_event.name, "deco");
 			break;
 		case 4:
 			/* 4 Ascent warning */
-			strcpy(cur_event.name, "ascent");
+			strcpy(state->cur_event.name, "ascent");
 			break;
 		case 5:
 			/* 5 Ceiling broken */
-			strcpy(cur_event.name, "violation");
+			strcpy(state->cur_event.name, "violation");
 			break;
 		case 6:
 			/* 6 Mandatory safety stop ceiling error */
-			strcpy(cur_event.name, "violation");
+			strcpy(state->cur_event.name, "violation");
 			break;
 		case 7:
 			/* 7 Below deco floor */
-			strcpy(cur_event.name, "below floor");
+			strcpy(state->cur_event.name, "below floor");
 			break;
 		case 8:
 			/* 8 Dive time alarm */
-			strcpy(cur_event.name, "divetime");
+			strcpy(state->cur_event.name, "divetime");
 			break;
 		case 9:
 			/* 9 Depth alarm */
-			strcpy(cur_event.name, "maxdepth");
+			strcpy(state->cur_event.name, "maxdepth");
 			break;
 		case 10:
 		/* 10 OLF 80% */
 		case 11:
 			/* 11 OLF 100% */
-			strcpy(cur_event.name, "OLF");
+			strcpy(state->cur_event.name, "OLF");
 			break;
 		case 12:
 			/* 12 High pO₂ */
-			strcpy(cur_event.name, "PO2");
+			strcpy(state->cur_event.name, "PO2");
 			break;
 		case 13:
 			/* 13 Air time */
-			strcpy(cur_event.name, "airtime");
+			strcpy(state->cur_event.name, "airtime");
 			break;
 		case 17:
 			/* 17 Ascent warning */
-			strcpy(cur_event.name, "ascent");
+			strcpy(state->cur_event.name, "ascent");
 			break;
 		case 18:
 			/* 18 Ceiling error */
-			strcpy(cur_event.name, "ceiling");
+			strcpy(state->cur_event.name, "ceiling");
 			break;
 		case 19:
 			/* 19 Surfaced */
-			strcpy(cur_event.name, "surface");
+			strcpy(state->cur_event.name, "surface");
 			break;
 		case 20:
 			/* 20 Deco */
-			strcpy(cur_event.name, "deco");
+			strcpy(state->cur_event.name, "deco");
 			break;
 		case 22:
 			/* 22 Mandatory safety stop violation */
-			strcpy(cur_event.name, "violation");
+			strcpy(state->cur_event.name, "violation");
 			break;
 		case 257:
 			/* 257 Dive active */
@@ -1822,49 +2464,47 @@ extern int dm4_events(void *handle, int columns, char **data, char **column)
 		case 258:
 			/* 258 Bookmark */
 			if (data[3]) {
-				strcpy(cur_event.name, "heading");
-				cur_event.value = atoi(data[3]);
+				strcpy(state->cur_event.name, "heading");
+				state->cur_event.value = atoi(data[3]);
 			} else {
-				strcpy(cur_event.name, "bookmark");
+				strcpy(state->cur_event.name, "bookmark");
 			}
 			break;
 		default:
-			strcpy(cur_event.name, "unknown");
-			cur_event.value = atoi(data[2]);
+			strcpy(state->cur_event.name, "unknown");
+			state->cur_event.value = atoi(data[2]);
 			break;
 		}
 	}
-	event_end();
+	event_end(state);
 
 	return 0;
 }
 
-extern int dm4_tags(void *handle, int columns, char **data, char **column)
+extern int dm4_tags(void *param, int columns, char **data, char **column)
 {
+	struct parser_state *state = param;
+
 	if (data[0])
-		taglist_add_tag(&cur_dive->tag_list, data[0]);
+		taglist_add_tag(&state->cur_dive->tag_list, data[0]);
 
 	return 0;
 }
 
 extern int dm4_dive(void *param, int columns, char **data, char **column)
 {
+	struct parser_state *state = param;
 	int i, interval, retval = 0;
-	sqlite3 *handle = (sqlite3 *)param;
 	float *profileBlob;
 	unsigned char *tempBlob;
 	int *pressureBlob;
-	char *err = NULL;
-	char get_events_template[] = "select * from Mark where DiveId = %d";
-	char get_tags_template[] = "select Text from DiveTag where DiveId = %d";
-	char get_events[64];
 
-	dive_start();
-	cur_dive->number = atoi(data[0]);
+	dive_start(state);
+	state->cur_dive->number = atoi(data[0]);
 
-	cur_dive->when = (time_t)(atol(data[1]));
+	state->cur_dive->when = (time_t)(atol(data[1]));
 	if (data[2])
-		utf8_string(data[2], &cur_dive->notes);
+		utf8_string(data[2], &state->cur_dive->notes);
 
 	/*
 	 * DM4 stores Duration and DiveTime. It looks like DiveTime is
@@ -1874,90 +2514,88 @@ extern int dm4_dive(void *param, int columns, char **data, char **column)
 	 * DiveTime = data[15]
 	 */
 	if (data[3])
-		cur_dive->duration.seconds = atoi(data[3]);
+		state->cur_dive->duration.seconds = atoi(data[3]);
 	if (data[15])
-		cur_dive->dc.duration.seconds = atoi(data[15]);
+		state->cur_dive->dc.duration.seconds = atoi(data[15]);
 
 	/*
 	 * TODO: the deviceid hash should be calculated here.
 	 */
-	settings_start();
-	dc_settings_start();
+	settings_start(state);
+	dc_settings_start(state);
 	if (data[4])
-		utf8_string(data[4], &cur_settings.dc.serial_nr);
+		utf8_string(data[4], &state->cur_settings.dc.serial_nr);
 	if (data[5])
-		utf8_string(data[5], &cur_settings.dc.model);
+		utf8_string(data[5], &state->cur_settings.dc.model);
 
-	cur_settings.dc.deviceid = 0xffffffff;
-	dc_settings_end();
-	settings_end();
+	state->cur_settings.dc.deviceid = 0xffffffff;
+	dc_settings_end(state);
+	settings_end(state);
 
 	if (data[6])
-		cur_dive->dc.maxdepth.mm = atof(data[6]) * 1000;
+		state->cur_dive->dc.maxdepth.mm = atof(data[6]) * 1000;
 	if (data[8])
-		cur_dive->dc.airtemp.mkelvin = C_to_mkelvin(atoi(data[8]));
+		state->cur_dive->dc.airtemp.mkelvin = C_to_mkelvin(atoi(data[8]));
 	if (data[9])
-		cur_dive->dc.watertemp.mkelvin = C_to_mkelvin(atoi(data[9]));
+		state->cur_dive->dc.watertemp.mkelvin = C_to_mkelvin(atoi(data[9]));
 
 	/*
 	 * TODO: handle multiple cylinders
 	 */
-	cylinder_start();
+	cylinder_start(state);
 	if (data[22] && atoi(data[22]) > 0)
-		cur_dive->cylinder[cur_cylinder_index].start.mbar = atoi(data[22]);
+		state->cur_dive->cylinder[state->cur_cylinder_index].start.mbar = atoi(data[22]);
 	else if (data[10] && atoi(data[10]) > 0)
-		cur_dive->cylinder[cur_cylinder_index].start.mbar = atoi(data[10]);
+		state->cur_dive->cylinder[state->cur_cylinder_index].start.mbar = atoi(data[10]);
 	if (data[23] && atoi(data[23]) > 0)
-		cur_dive->cylinder[cur_cylinder_index].end.mbar = (atoi(data[23]));
+		state->cur_dive->cylinder[state->cur_cylinder_index].end.mbar = (atoi(data[23]));
 	if (data[11] && atoi(data[11]) > 0)
-		cur_dive->cylinder[cur_cylinder_index].end.mbar = (atoi(data[11]));
+		state->cur_dive->cylinder[state->cur_cylinder_index].end.mbar = (atoi(data[11]));
 	if (data[12])
-		cur_dive->cylinder[cur_cylinder_index].type.size.mliter = (atof(data[12])) * 1000;
+		state->cur_dive->cylinder[state->cur_cylinder_index].type.size.mliter = (atof(data[12])) * 1000;
 	if (data[13])
-		cur_dive->cylinder[cur_cylinder_index].type.workingpressure.mbar = (atoi(data[13]));
+		state->cur_dive->cylinder[state->cur_cylinder_index].type.workingpressure.mbar = (atoi(data[13]));
 	if (data[20])
-		cur_dive->cylinder[cur_cylinder_index].gasmix.o2.permille = atoi(data[20]) * 10;
+		state->cur_dive->cylinder[state->cur_cylinder_index].gasmix.o2.permille = atoi(data[20]) * 10;
 	if (data[21])
-		cur_dive->cylinder[cur_cylinder_index].gasmix.he.permille = atoi(data[21]) * 10;
-	cylinder_end();
+		state->cur_dive->cylinder[state->cur_cylinder_index].gasmix.he.permille = atoi(data[21]) * 10;
+	cylinder_end(state);
 
 	if (data[14])
-		cur_dive->dc.surface_pressure.mbar = (atoi(data[14]) * 1000);
+		state->cur_dive->dc.surface_pressure.mbar = (atoi(data[14]) * 1000);
 
 	interval = data[16] ? atoi(data[16]) : 0;
 	profileBlob = (float *)data[17];
 	tempBlob = (unsigned char *)data[18];
 	pressureBlob = (int *)data[19];
-	for (i = 0; interval && i * interval < cur_dive->duration.seconds; i++) {
-		sample_start();
-		cur_sample->time.seconds = i * interval;
+	for (i = 0; interval && i * interval < state->cur_dive->duration.seconds; i++) {
+		sample_start(state);
+		state->cur_sample->time.seconds = i * interval;
 		if (profileBlob)
-			cur_sample->depth.mm = profileBlob[i] * 1000;
+			state->cur_sample->depth.mm = profileBlob[i] * 1000;
 		else
-			cur_sample->depth.mm = cur_dive->dc.maxdepth.mm;
+			state->cur_sample->depth.mm = state->cur_dive->dc.maxdepth.mm;
 
 		if (data[18] && data[18][0])
-			cur_sample->temperature.mkelvin = C_to_mkelvin(tempBlob[i]);
+			state->cur_sample->temperature.mkelvin = C_to_mkelvin(tempBlob[i]);
 		if (data[19] && data[19][0])
-			cur_sample->cylinderpressure.mbar = pressureBlob[i];
-		sample_end();
+			state->cur_sample->cylinderpressure.mbar = pressureBlob[i];
+		sample_end(state);
 	}
 
-	snprintf(get_events, sizeof(get_events) - 1, get_events_template, cur_dive->number);
-	retval = sqlite3_exec(handle, get_events, &dm4_events, 0, &err);
+	retval = sql_dive_rows(state->sql_events, state->cur_dive->number, &dm4_events, state);
 	if (retval != SQLITE_OK) {
 		fprintf(stderr, "%s", translate("gettextFromC", "Database query get_events failed.\n"));
 		return 1;
 	}
 
-	snprintf(get_events, sizeof(get_events) - 1, get_tags_template, cur_dive->number);
-	retval = sqlite3_exec(handle, get_events, &dm4_tags, 0, &err);
+	retval = sql_dive_rows(state->sql_tags, state->cur_dive->number, &dm4_tags, state);
 	if (retval != SQLITE_OK) {
 		fprintf(stderr, "%s", translate("gettextFromC", "Database query get_tags failed.\n"));
 		return 1;
 	}
 
-	dive_end();
+	dive_end(state);
 
 	/*
 	for (i=0; i<columns;++i) {
@@ -1978,13 +2616,26 @@ int parse_dm4_buffer(sqlite3 *handle, const char *url, const char *buffer, int s
 {
 	int retval;
 	char *err = NULL;
-	target_table = table;
+	struct parser_state state;
+
+	init_parser_state(&state, table);
+	state.sql_handle = handle;
+
+	/* Mark and DiveTag are keyed by DiveId, so these are index lookups */
+	if (sqlite3_prepare_v2(handle, "select * from Mark where DiveId = ?", -1, &state.sql_events, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(handle, "select Text from DiveTag where DiveId = ?", -1, &state.sql_tags, NULL) != SQLITE_OK) {
+		sqlite3_finalize(state.sql_events);
+		fprintf(stderr, translate("gettextFromC", "Database query failed '%s'.\n"), url);
+		return 1;
+	}
 
 	/* StartTime is converted from Suunto's nano seconds to standard
 	 * time. We also need epoch, not seconds since year 1. */
 	char get_dives[] = "select D.DiveId,StartTime/10000000-62135596800,Note,Duration,SourceSerialNumber,Source,MaxDepth,SampleInterval,StartTemperature,BottomTemperature,D.StartPressure,D.EndPressure,Size,CylinderWorkPressure,SurfacePressure,DiveTime,SampleInterval,ProfileBlob,TemperatureBlob,PressureBlob,Oxygen,Helium,MIX.StartPressure,MIX.EndPressure FROM Dive AS D JOIN DiveMixture AS MIX ON D.DiveId=MIX.DiveId";
 
-	retval = sqlite3_exec(handle, get_dives, &dm4_dive, handle, &err);
+	retval = sqlite3_exec(handle, get_dives, &dm4_dive, &state, &err);
+	sqlite3_finalize(state.sql_events);
+	sqlite3_finalize(state.sql_tags);
 
 	if (retval != SQLITE_OK) {
 		fprintf(stderr, translate("gettextFromC", "Database query failed '%s'.\n"), url);
@@ -1994,131 +2645,191 @@ int parse_dm4_buffer(sqlite3 *handle, const char *url, const char *buffer, int s
 	return 0;
 }
 
-extern int shearwater_cylinders(void *handle, int columns, char **data, char **column)
+/* A gas of the dive; NULL fractions sort first, like they did in SQL */
+struct shearwater_mix {
+	bool has_o2, has_he;
+	double o2, he;
+};
+
+static int compare_shearwater_mix(const void *_a, const void *_b)
 {
-	cylinder_start();
-	if (data[0])
-		cur_dive->cylinder[cur_cylinder_index].gasmix.o2.permille = atof(data[0]) * 1000;
-	if (data[1])
-		cur_dive->cylinder[cur_cylinder_index].gasmix.he.permille = atof(data[1]) * 1000;
-	cylinder_end();
+	const struct shearwater_mix *a = _a, *b = _b;
 
+	if (a->has_o2 != b->has_o2)
+		return a->has_o2 - b->has_o2;
+	if (a->o2 != b->o2)
+		return a->o2 < b->o2 ? -1 : 1;
+	if (a->has_he != b->has_he)
+		return a->has_he - b->has_he;
+	if (a->he != b->he)
+		return a->he < b->he ? -1 : 1;
 	return 0;
 }
 
-extern int shearwater_changes(void *handle, int columns, char **data, char **column)
+static void shearwater_cylinder(struct parser_state *state, const struct shearwater_mix *mix)
+{
+	cylinder_start(state);
+	if (mix->has_o2)
+		state->cur_dive->cylinder[state->cur_cylinder_index].gasmix.o2.permille = mix->o2 * 1000;
+	if (mix->has_he)
+		state->cur_dive->cylinder[state->cur_cylinder_index].gasmix.he.permille = mix->he * 1000;
+	cylinder_end(state);
+}
+
+extern int shearwater_changes(void *param, int columns, char **data, char **column)
 {
-	event_start();
+	struct parser_state *state = param;
+
+	event_start(state);
 	if (data[0])
-		cur_event.time.seconds = atoi(data[0]);
+		state->cur_event.time.seconds = atoi(data[0]);
 	if (data[1]) {
-		strcpy(cur_event.name, "gaschange");
-		cur_event.value = atof(data[1]) * 100;
+		strcpy(state->cur_event.name, "gaschange");
+		state->cur_event.value = atof(data[1]) * 100;
 	}
-	event_end();
+	event_end(state);
 
 	return 0;
 }
 
-extern int shearwater_profile_sample(void *handle, int columns, char **data, char **column)
+extern int shearwater_profile_sample(void *param, int columns, char **data, char **column)
 {
-	sample_start();
+	struct parser_state *state = param;
+
+	sample_start(state);
 	if (data[0])
-		cur_sample->time.seconds = atoi(data[0]);
+		state->cur_sample->time.seconds = atoi(data[0]);
 	if (data[1])
-		cur_sample->depth.mm = metric ? atof(data[1]) * 1000 : feet_to_mm(atof(data[1]));
+		state->cur_sample->depth.mm = metric ? atof(data[1]) * 1000 : feet_to_mm(atof(data[1]));
 	if (data[2])
-		cur_sample->temperature.mkelvin = metric ? C_to_mkelvin(atof(data[2])) : F_to_mkelvin(atof(data[2]));
+		state->cur_sample->temperature.mkelvin = metric ? C_to_mkelvin(atof(data[2])) : F_to_mkelvin(atof(data[2]));
 	if (data[3]) {
-		cur_sample->setpoint.mbar = atof(data[3]) * 1000;
-		cur_dive->dc.dctype = CCR;
+		state->cur_sample->setpoint.mbar = atof(data[3]) * 1000;
+		state->cur_dive->dc.dctype = CCR;
 	}
 	if (data[4])
-		cur_sample->ndl.seconds = atoi(data[4]) * 60;
+		state->cur_sample->ndl.seconds = atoi(data[4]) * 60;
 	if (data[5])
-		cur_sample->cns = atoi(data[5]);
+		state->cur_sample->cns = atoi(data[5]);
 	if (data[6])
-		cur_sample->stopdepth.mm = metric ? atoi(data[6]) * 1000 : feet_to_mm(atoi(data[6]));
+		state->cur_sample->stopdepth.mm = metric ? atoi(data[6]) * 1000 : feet_to_mm(atoi(data[6]));
 
 	/* We don't actually have data[3], but it should appear in the
 	 * SQL query at some point.
 	if (data[3])
-		cur_sample->cylinderpressure.mbar = metric ? atoi(data[3]) * 1000 : psi_to_mbar(atoi(data[3]));
+		state->cur_sample->cylinderpressure.mbar = metric ? atoi(data[3]) * 1000 : psi_to_mbar(atoi(data[3]));
 	 */
-	sample_end();
+	sample_end(state);
 
 	return 0;
 }
 
+/*
+ * The records of all dives come from one scan of dive_log_records, ordered
+ * like the dives, so that we don't search the table once per dive. Besides
+ * the samples, they give us the gases used and the gas changes: the gas of
+ * the first record, and every record with a different gas than the one
+ * before it.
+ */
+static int shearwater_records(struct parser_state *state, int dive_id)
+{
+	sqlite3_stmt *stmt = state->sql_records;
+	struct shearwater_mix mixes[MAX_CYLINDERS], mix, last_mix;
+	int i, record, last_record = 0, nr_mixes = 0;
+	char *data[MAX_SQL_COLUMNS];
+
+	/* skip records of dives that aren't in dive_info */
+	while (state->sql_records_status == SQLITE_ROW && sqlite3_column_int(stmt, 0) < dive_id)
+		state->sql_records_status = sqlite3_step(stmt);
+
+	for (; state->sql_records_status == SQLITE_ROW && sqlite3_column_int(stmt, 0) == dive_id;
+	     state->sql_records_status = sqlite3_step(stmt)) {
+		for (i = 0; i < 11; i++)
+			data[i] = (char *)sqlite3_column_text(stmt, i);
+		record = sqlite3_column_int(stmt, 1);
+		mix.has_o2 = data[9] != NULL;
+		mix.o2 = sqlite3_column_double(stmt, 9);
+		mix.has_he = data[10] != NULL;
+		mix.he = sqlite3_column_double(stmt, 10);
+
+		/* the first record gives the initial gas */
+		if (mix.has_o2 &&
+		    (!last_record ||
+		     (record == last_record + 1 &&
+		      ((last_mix.has_o2 && mix.o2 != last_mix.o2) ||
+		       (mix.has_he && last_mix.has_he && mix.he != last_mix.he))))) {
+			char *change[] = { data[2], data[9], data[10] };
+			shearwater_changes(state, 3, change, NULL);
+		}
+		for (i = 0; i < nr_mixes; i++) {
+			if (!compare_shearwater_mix(&mix, mixes + i))
+				break;
+		}
+		if (i == nr_mixes && nr_mixes < MAX_CYLINDERS)
+			mixes[nr_mixes++] = mix;
+		shearwater_profile_sample(state, 7, data + 2, NULL);
+		last_mix = mix;
+		last_record = record;
+	}
+
+	qsort(mixes, nr_mixes, sizeof(mixes[0]), compare_shearwater_mix);
+	for (i = 0; i < nr_mixes; i++)
+		shearwater_cylinder(state, mixes + i);
+
+	if (state->sql_records_status != SQLITE_ROW && state->sql_records_status != SQLITE_DONE)
+		return state->sql_records_status;
+	return SQLITE_OK;
+}
+
 extern int shearwater_dive(void *param, int columns, char **data, char **column)
 {
+	struct parser_state *state = param;
 	int retval = 0;
-	sqlite3 *handle = (sqlite3 *)param;
-	char *err = NULL;
-	char get_profile_template[] = "select currentTime,currentDepth,waterTemp,averagePPO2,currentNdl,CNSPercent,decoCeiling from dive_log_records where diveLogId = %d";
-	char get_cylinder_template[] = "select fractionO2,fractionHe from dive_log_records where diveLogId = %d group by fractionO2,fractionHe";
-	char get_changes_template[] = "select a.currentTime,a.fractionO2,a.fractionHe from dive_log_records as a,dive_log_records as b where a.diveLogId = %d and b.diveLogId = %d and (a.id - 1) = b.id and (a.fractionO2 != b.fractionO2 or a.fractionHe != b.fractionHe) union select min(currentTime),fractionO2,fractionHe from dive_log_records";
-	char get_buffer[1024];
 
-	dive_start();
-	cur_dive->number = atoi(data[0]);
+	dive_start(state);
+	state->cur_dive->number = atoi(data[0]);
 
-	cur_dive->when = (time_t)(atol(data[1]));
+	state->cur_dive->when = (time_t)(atol(data[1]));
 
 	if (data[2])
-		utf8_string(data[2], &cur_dive->location);
+		utf8_string(data[2], &state->cur_dive->location);
 	if (data[3])
-		utf8_string(data[3], &cur_dive->buddy);
+		utf8_string(data[3], &state->cur_dive->buddy);
 	if (data[4])
-		utf8_string(data[4], &cur_dive->notes);
+		utf8_string(data[4], &state->cur_dive->notes);
 
 	metric = atoi(data[5]) == 1 ? 0 : 1;
 
 	/* TODO: verify that metric calculation is correct */
 	if (data[6])
-		cur_dive->dc.maxdepth.mm = metric ? atof(data[6]) * 1000 : feet_to_mm(atof(data[6]));
+		state->cur_dive->dc.maxdepth.mm = metric ? atof(data[6]) * 1000 : feet_to_mm(atof(data[6]));
 
 	if (data[7])
-		cur_dive->dc.duration.seconds = atoi(data[7]) * 60;
+		state->cur_dive->dc.duration.seconds = atoi(data[7]) * 60;
 
 	if (data[8])
-		cur_dive->dc.surface_pressure.mbar = atoi(data[8]);
+		state->cur_dive->dc.surface_pressure.mbar = atoi(data[8]);
 	/*
 	 * TODO: the deviceid hash should be calculated here.
 	 */
-	settings_start();
-	dc_settings_start();
+	settings_start(state);
+	dc_settings_start(state);
 	if (data[9])
-		utf8_string(data[9], &cur_settings.dc.serial_nr);
+		utf8_string(data[9], &state->cur_settings.dc.serial_nr);
 	if (data[10])
-		utf8_string(data[10], &cur_settings.dc.model);
-
-	cur_settings.dc.deviceid = 0xffffffff;
-	dc_settings_end();
-	settings_end();
+		utf8_string(data[10], &state->cur_settings.dc.model);
 
-	snprintf(get_buffer, sizeof(get_buffer) - 1, get_cylinder_template, cur_dive->number);
-	retval = sqlite3_exec(handle, get_buffer, &shearwater_cylinders, 0, &err);
-	if (retval != SQLITE_OK) {
-		fprintf(stderr, "%s", translate("gettextFromC", "Database query get_cylinders failed.\n"));
-		return 1;
-	}
-
-	snprintf(get_buffer, sizeof(get_buffer) - 1, get_changes_template, cur_dive->number, cur_dive->number);
-	retval = sqlite3_exec(handle, get_buffer, &shearwater_changes, 0, &err);
-	if (retval != SQLITE_OK) {
-		fprintf(stderr, "%s", translate("gettextFromC", "Database query get_changes failed.\n"));
-		return 1;
-	}
+	state->cur_settings.dc.deviceid = 0xffffffff;
+	dc_settings_end(state);
+	settings_end(state);
 
-	snprintf(get_buffer, sizeof(get_buffer) - 1, get_profile_template, cur_dive->number);
-	retval = sqlite3_exec(handle, get_buffer, &shearwater_profile_sample, 0, &err);
+	retval = shearwater_records(state, state->cur_dive->number);
 	if (retval != SQLITE_OK) {
 		fprintf(stderr, "%s", translate("gettextFromC", "Database query get_profile_sample failed.\n"));
 		return 1;
 	}
 
-	dive_end();
+	dive_end(state);
 
 	return SQLITE_OK;
 }
@@ -2129,11 +2840,21 @@ int parse_shearwater_buffer(sqlite3 *handle, const char *url, const char *buffer
 {
 	int retval;
 	char *err = NULL;
-	target_table = table;
+	struct parser_state state;
+
+	init_parser_state(&state, table);
+	state.sql_handle = handle;
 
-	char get_dives[] = "select i.diveId,timestamp,location||' / '||site,buddy,notes,imperialUnits,maxDepth,maxTime,startSurfacePressure,computerSerial,computerModel FROM dive_info AS i JOIN dive_logs AS l ON i.diveId=l.diveId";
+	char get_dives[] = "select i.diveId,timestamp,location||' / '||site,buddy,notes,imperialUnits,maxDepth,maxTime,startSurfacePressure,computerSerial,computerModel FROM dive_info AS i JOIN dive_logs AS l ON i.diveId=l.diveId ORDER BY i.diveId";
+	char get_records[] = "select diveLogId,id,currentTime,currentDepth,waterTemp,averagePPO2,currentNdl,CNSPercent,decoCeiling,fractionO2,fractionHe from dive_log_records ORDER BY diveLogId,id";
 
-	retval = sqlite3_exec(handle, get_dives, &shearwater_dive, handle, &err);
+	if (sqlite3_prepare_v2(handle, get_records, -1, &state.sql_records, NULL) != SQLITE_OK) {
+		fprintf(stderr, translate("gettextFromC", "Database query failed '%s'.\n"), url);
+		return 1;
+	}
+	state.sql_records_status = sqlite3_step(state.sql_records);
+	retval = sqlite3_exec(handle, get_dives, &shearwater_dive, &state, &err);
+	sqlite3_finalize(state.sql_records);
 
 	if (retval != SQLITE_OK) {
 		fprintf(stderr, translate("gettextFromC", "Database query failed '%s'.\n"), url);
@@ -2150,6 +2871,7 @@ void parse_xml_init(void)
 
 void parse_xml_exit(void)
 {
+	free_stylesheets();
 	xmlCleanupParser();
 }
 
@@ -2174,6 +2896,18 @@ static struct xslt_files {
 	  { NULL, }
   };
 
+/* does a root element like this possibly need a transform? */
+static bool xslt_root_element(const char *name)
+{
+	struct xslt_files *info;
+
+	for (info = xslt_files; info->root; info++) {
+		if (strcasecmp(name, info->root) == 0)
+			return true;
+	}
+	return false;
+}
+
 static xmlDoc *test_xslt_transforms(xmlDoc *doc, const char **params)
 {
 	struct xslt_files *info = xslt_files;
@@ -2210,7 +2944,6 @@ static xmlDoc *test_xslt_transforms(xmlDoc *doc, const char **params)
 		}
 		transformed = xsltApplyStylesheet(xslt, doc, params);
 		xmlFreeDoc(doc);
-		xsltFreeStylesheet(xslt);
 
 		return transformed;
 	}
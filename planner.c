@@ -11,6 +11,7 @@
 #include "dive.h"
 #include "divelist.h"
 #include "planner.h"
+#include "deco.h"
 #include "gettext.h"
 #include "libdivecomputer/parser.h"
 
@@ -120,20 +121,14 @@ int get_gasidx(struct dive *dive, struct gasmix *mix)
 	return -1;
 }
 
-double interpolate_transition(struct dive *dive, duration_t t0, duration_t t1, depth_t d0, depth_t d1, const struct gasmix *gasmix, o2pressure_t po2)
+double interpolate_transition(struct deco_state *ds, struct dive *dive, duration_t t0, duration_t t1, depth_t d0, depth_t d1, const struct gasmix *gasmix, o2pressure_t po2)
 {
-	int j;
-	double tissue_tolerance = 0.0;
-
-	for (j = t0.seconds; j < t1.seconds; j++) {
-		int depth = interpolate(d0.mm, d1.mm, j - t0.seconds, t1.seconds - t0.seconds);
-		tissue_tolerance = add_segment(depth_to_mbar(depth, dive) / 1000.0, gasmix, 1, po2.mbar, dive);
-	}
-	return tissue_tolerance;
+	return add_segment_ramp(ds, depth_to_mbar(d0.mm, dive) / 1000.0, depth_to_mbar(d1.mm, dive) / 1000.0,
+				gasmix, t1.seconds - t0.seconds, po2.mbar, dive);
 }
 
 /* returns the tissue tolerance at the end of this (partial) dive */
-double tissue_at_end(struct dive *dive, char **cached_datap)
+double tissue_at_end(struct deco_state *ds, struct dive *dive, struct deco_state **cached_datap)
 {
 	struct divecomputer *dc;
 	struct sample *sample, *psample;
@@ -141,30 +136,32 @@ double tissue_at_end(struct dive *dive, char **cached_datap)
 	depth_t lastdepth = {};
 	duration_t t0 = {}, t1 = {};
 	double tissue_tolerance;
-	struct gasmix gas;
+	struct gas_timeline timeline;
 
 	if (!dive)
 		return 0.0;
 	if (*cached_datap) {
-		tissue_tolerance = restore_deco_state(*cached_datap);
+		tissue_tolerance = restore_deco_state(ds, *cached_datap);
 	} else {
-		tissue_tolerance = init_decompression(dive);
-		cache_deco_state(tissue_tolerance, cached_datap);
+		tissue_tolerance = init_decompression(ds, dive);
+		cache_deco_state(ds, cached_datap);
 	}
 	dc = &dive->dc;
 	if (!dc->samples)
 		return tissue_tolerance;
 	psample = sample = dc->sample;
+	init_gas_timeline(&timeline, dive, dc);
 
 	for (i = 0; i < dc->samples; i++, sample++) {
+		struct gasmix *gas = &dive->cylinder[gas_timeline_cylinder(&timeline, t0.seconds)].gasmix;
 		t1 = sample->time;
-		get_gas_at_time(dive, dc, t0, &gas);
 		if (i > 0)
 			lastdepth = psample->depth;
-		tissue_tolerance = interpolate_transition(dive, t0, t1, lastdepth, sample->depth, &gas, sample->setpoint);
+		tissue_tolerance = interpolate_transition(ds, dive, t0, t1, lastdepth, sample->depth, gas, sample->setpoint);
 		psample = sample;
 		t0 = t1;
 	}
+	free_gas_timeline(&timeline);
 	return tissue_tolerance;
 }
 
@@ -726,7 +723,7 @@ int ascend_velocity(int depth, int avg_depth, int bottom_time)
 	}
 }
 
-int plan(struct diveplan *diveplan, char **cached_datap, bool is_planner, bool show_disclaimer)
+int plan(struct diveplan *diveplan, struct deco_state **cached_datap, bool is_planner, bool show_disclaimer)
 {
 	struct sample *sample;
 	int po2;
@@ -738,7 +735,7 @@ int plan(struct diveplan *diveplan, char **cached_datap, bool is_planner, bool s
 	struct gaschanges *gaschanges = NULL;
 	int gaschangenr;
 	int *stoplevels = NULL;
-	char *trial_cache = NULL;
+	struct deco_state ds, trial_cache;
 	bool stopping = false;
 	bool clear_to_ascend;
 	int clock, previous_point_time;
@@ -777,7 +774,7 @@ int plan(struct diveplan *diveplan, char **cached_datap, bool is_planner, bool s
 		create_dive_from_plan(diveplan, is_planner);
 		return(error);
 	}
-	tissue_tolerance = tissue_at_end(&displayed_dive, cached_datap);
+	tissue_tolerance = tissue_at_end(&ds, &displayed_dive, cached_datap);
 
 #if DEBUG_PLAN & 4
 	printf("gas %s\n", gasname(&gas));
@@ -826,7 +823,7 @@ int plan(struct diveplan *diveplan, char **cached_datap, bool is_planner, bool s
 			if (depth - deltad < stoplevels[stopidx])
 				deltad = depth - stoplevels[stopidx];
 
-			tissue_tolerance = add_segment(depth_to_mbar(depth, &displayed_dive) / 1000.0,
+			tissue_tolerance = add_segment(&ds, depth_to_mbar(depth, &displayed_dive) / 1000.0,
 						       &displayed_dive.cylinder[current_cylinder].gasmix,
 						       TIMESTEP, po2, &displayed_dive);
 			clock += TIMESTEP;
@@ -856,7 +853,7 @@ int plan(struct diveplan *diveplan, char **cached_datap, bool is_planner, bool s
 
 		/* Save the current state and try to ascend to the next stopdepth */
 		int trial_depth = depth;
-		cache_deco_state(tissue_tolerance, &trial_cache);
+		trial_cache = ds;
 		while (1) {
 			/* Check if ascending to next stop is clear, go back and wait if we hit the ceiling on the way */
 			clear_to_ascend = true;
@@ -864,7 +861,7 @@ int plan(struct diveplan *diveplan, char **cached_datap, bool is_planner, bool s
 				int deltad = ascend_velocity(trial_depth, avg_depth, bottom_time) * TIMESTEP;
 				if (deltad > trial_depth) /* don't test against depth above surface */
 					deltad = trial_depth;
-				tissue_tolerance = add_segment(depth_to_mbar(trial_depth, &displayed_dive) / 1000.0,
+				tissue_tolerance = add_segment(&ds, depth_to_mbar(trial_depth, &displayed_dive) / 1000.0,
 							       &displayed_dive.cylinder[current_cylinder].gasmix,
 							       TIMESTEP, po2, &displayed_dive);
 				if (deco_allowed_depth(tissue_tolerance, diveplan->surface_pressure / 1000.0, &displayed_dive, 1) > trial_depth - deltad) {
@@ -874,7 +871,7 @@ int plan(struct diveplan *diveplan, char **cached_datap, bool is_planner, bool s
 				}
 				trial_depth -= deltad;
 			}
-			restore_deco_state(trial_cache);
+			ds = trial_cache;
 
 			if (clear_to_ascend)
 				break; /* We did not hit the ceiling */
@@ -887,10 +884,10 @@ int plan(struct diveplan *diveplan, char **cached_datap, bool is_planner, bool s
 				previous_point_time = clock;
 				stopping = true;
 			}
-			tissue_tolerance = add_segment(depth_to_mbar(depth, &displayed_dive) / 1000.0,
+			tissue_tolerance = add_segment(&ds, depth_to_mbar(depth, &displayed_dive) / 1000.0,
 						       &displayed_dive.cylinder[current_cylinder].gasmix,
 						       DECOTIMESTEP, po2, &displayed_dive);
-			cache_deco_state(tissue_tolerance, &trial_cache);
+			trial_cache = ds;
 			clock += DECOTIMESTEP;
 			/* Finish infinite deco */
 			if(clock >= 48 * 3600 && depth >= 6000) {
@@ -36,6 +36,7 @@ struct preferences {
 	short gflow;
 	short gfhigh;
 	int animation_speed;
+	int profile_cache_size; /* in MB */
 	bool gf_low_at_maxdepth;
 	short display_invalid_dives;
 	short unit_system;
@@ -26,9 +26,6 @@ unsigned int dc_number = 0;
 static struct plot_data *last_pi_entry_new = NULL;
 double calculate_ccr_po2(struct plot_data *entry, struct divecomputer *dc);
 
-void fill_missing_segment_pressures(pr_track_t *);
-struct pr_interpolate_struct get_pr_interpolate_data(pr_track_t *, struct plot_info *, int);
-void fill_missing_tank_pressures(struct dive *, struct plot_info *, pr_track_t **, int);
 void populate_pressure_information(struct dive *, struct divecomputer *, struct plot_info *, int);
 
 #ifdef DEBUG_PI
@@ -128,12 +125,10 @@ void clear_events(void)
 	evn_used = 0;
 }
 
-void remember_event(const char *eventname)
+static void remember_event_locked(const char *eventname, int len)
 {
-	int i = 0, len;
+	int i = 0;
 
-	if (!eventname || (len = strlen(eventname)) == 0)
-		return;
 	while (i < evn_used) {
 		if (!strncmp(eventname, ev_namelist[i].ev_name, len))
 			return;
@@ -151,6 +146,18 @@ void remember_event(const char *eventname)
 	evn_used++;
 }
 
+/* the parser adds events from several threads */
+void remember_event(const char *eventname)
+{
+	int len;
+
+	if (!eventname || (len = strlen(eventname)) == 0)
+		return;
+	lock_shared_dive_data();
+	remember_event_locked(eventname, len);
+	unlock_shared_dive_data();
+}
+
 /* Get local sac-rate (in ml/min) between entry1 and entry2 */
 static int get_local_sac(struct plot_data *entry1, struct plot_data *entry2, struct dive *dive)
 {
@@ -217,11 +224,86 @@ static void analyze_plot_info_minmax_minute(struct plot_data *entry, struct plot
 	entry->avg[index] = (avg + nr / 2) / nr;
 }
 
-static void analyze_plot_info_minmax(struct plot_data *entry, struct plot_data *first, struct plot_data *last)
+/*
+ * The one-, two- and three-minute windows around each entry, in one pass.
+ *
+ * As the entries are in time order, both ends of each window only ever
+ * move forward. So we keep a running sum for the average and, for the
+ * minimum and maximum, a queue of the entries in the window that can still
+ * become the extreme: each entry is added and removed at most once. Ties
+ * go to the earliest entry, like in analyze_plot_info_minmax_minute().
+ */
+struct minmax_window {
+	int seconds;
+	int start, end; /* the entries in [start, end) are in the window */
+	int sum;
+	int *min, min_head, min_tail; /* entry indices, increasing depth */
+	int *max, max_head, max_tail; /* entry indices, decreasing depth */
+};
+
+static void analyze_plot_info_minmax(struct plot_info *pi)
 {
-	analyze_plot_info_minmax_minute(entry, first, last, 0);
-	analyze_plot_info_minmax_minute(entry, first, last, 1);
-	analyze_plot_info_minmax_minute(entry, first, last, 2);
+	struct plot_data *entry = pi->entry;
+	struct minmax_window window[3];
+	int nr = pi->nr;
+	int i, k, *queues;
+
+	for (i = 1; i < nr; i++) {
+		if (entry[i].sec < entry[i - 1].sec)
+			break;
+	}
+	queues = i < nr ? NULL : malloc(6 * nr * sizeof(int));
+	if (!queues) {
+		/* not in time order (or out of memory) - do it the slow way */
+		for (i = 0; i < nr; i++) {
+			for (k = 0; k < 3; k++)
+				analyze_plot_info_minmax_minute(entry + i, entry, entry + nr, k);
+		}
+		return;
+	}
+
+	memset(window, 0, sizeof(window));
+	for (k = 0; k < 3; k++) {
+		window[k].seconds = 90 * (k + 1);
+		window[k].min = queues + 2 * k * nr;
+		window[k].max = queues + (2 * k + 1) * nr;
+	}
+
+	for (i = 0; i < nr; i++) {
+		int time = entry[i].sec;
+
+		for (k = 0; k < 3; k++) {
+			struct minmax_window *w = window + k;
+			int n;
+
+			while (w->end < nr && entry[w->end].sec <= time + w->seconds) {
+				int depth = entry[w->end].depth;
+
+				w->sum += depth;
+				while (w->min_tail > w->min_head && entry[w->min[w->min_tail - 1]].depth > depth)
+					w->min_tail--;
+				w->min[w->min_tail++] = w->end;
+				while (w->max_tail > w->max_head && entry[w->max[w->max_tail - 1]].depth < depth)
+					w->max_tail--;
+				w->max[w->max_tail++] = w->end;
+				w->end++;
+			}
+			while (entry[w->start].sec < time - w->seconds) {
+				w->sum -= entry[w->start].depth;
+				if (w->min[w->min_head] == w->start)
+					w->min_head++;
+				if (w->max[w->max_head] == w->start)
+					w->max_head++;
+				w->start++;
+			}
+
+			n = w->end - w->start;
+			entry[i].min[k] = entry + w->min[w->min_head];
+			entry[i].max[k] = entry + w->max[w->max_head];
+			entry[i].avg[k] = (w->sum + n / 2) / n;
+		}
+	}
+	free(queues);
 }
 
 static velocity_t velocity(int speed)
@@ -286,10 +368,7 @@ struct plot_info *analyze_plot_info(struct plot_info *pi)
 	}
 
 	/* One-, two- and three-minute minmax data */
-	for (i = 0; i < nr; i++) {
-		struct plot_data *entry = pi->entry + i;
-		analyze_plot_info_minmax(entry, pi->entry, pi->entry + nr);
-	}
+	analyze_plot_info_minmax(pi);
 
 	return pi;
 }
@@ -687,7 +766,7 @@ static void setup_gas_sensor_pressure(struct dive *dive, struct divecomputer *dc
 }
 
 /* calculate DECO STOP / TTS / NDL */
-static void calculate_ndl_tts(double tissue_tolerance, struct plot_data *entry, struct dive *dive, double surface_pressure)
+static void calculate_ndl_tts(struct deco_state *ds, double tissue_tolerance, struct plot_data *entry, struct dive *dive, double surface_pressure)
 {
 	/* FIXME: This should be configurable */
 	/* ascent speed up to first deco stop */
@@ -713,12 +792,9 @@ static void calculate_ndl_tts(double tissue_tolerance, struct plot_data *entry,
 			entry->ndl = max_ndl;
 			return;
 		}
-		/* stop if the ndl is above max_ndl seconds, and call it plenty of time */
-		while (entry->ndl_calc < max_ndl && deco_allowed_depth(tissue_tolerance, surface_pressure, dive, 1) <= 0) {
-			entry->ndl_calc += time_stepsize;
-			tissue_tolerance = add_segment(depth_to_mbar(entry->depth, dive) / 1000.0,
-						       &dive->cylinder[cylinderindex].gasmix, time_stepsize, entry->pressures.o2 * 1000, dive);
-		}
+		/* anything above max_ndl seconds is plenty of time */
+		entry->ndl_calc = rint(deco_ndl(ds, depth_to_mbar(entry->depth, dive) / 1000.0, &dive->cylinder[cylinderindex].gasmix,
+						entry->pressures.o2 * 1000, dive, surface_pressure, max_ndl));
 		/* we don't need to calculate anything else */
 		return;
 	}
@@ -728,7 +804,7 @@ static void calculate_ndl_tts(double tissue_tolerance, struct plot_data *entry,
 
 	/* Add segments for movement to stopdepth */
 	for (; ascent_depth > next_stop; ascent_depth -= ascent_mm_per_step, entry->tts_calc += ascent_s_per_step) {
-		tissue_tolerance = add_segment(depth_to_mbar(ascent_depth, dive) / 1000.0,
+		tissue_tolerance = add_segment(ds, depth_to_mbar(ascent_depth, dive) / 1000.0,
 					       &dive->cylinder[cylinderindex].gasmix, ascent_s_per_step, entry->pressures.o2 * 1000, dive);
 		next_stop = ROUND_UP(deco_allowed_depth(tissue_tolerance, surface_pressure, dive, 1), deco_stepsize);
 	}
@@ -746,13 +822,13 @@ static void calculate_ndl_tts(double tissue_tolerance, struct plot_data *entry,
 			entry->stoptime_calc += time_stepsize;
 
 		entry->tts_calc += time_stepsize;
-		tissue_tolerance = add_segment(depth_to_mbar(ascent_depth, dive) / 1000.0,
+		tissue_tolerance = add_segment(ds, depth_to_mbar(ascent_depth, dive) / 1000.0,
 					       &dive->cylinder[cylinderindex].gasmix, time_stepsize, entry->pressures.o2 * 1000, dive);
 
 		if (deco_allowed_depth(tissue_tolerance, surface_pressure, dive, 1) <= next_stop) {
 			/* move to the next stop and add the travel between stops */
 			for (; ascent_depth > next_stop; ascent_depth -= ascent_mm_per_deco_step, entry->tts_calc += ascent_s_per_deco_step)
-				add_segment(depth_to_mbar(ascent_depth, dive) / 1000.0,
+				add_segment(ds, depth_to_mbar(ascent_depth, dive) / 1000.0,
 					    &dive->cylinder[cylinderindex].gasmix, ascent_s_per_deco_step, entry->pressures.o2 * 1000, dive);
 			ascent_depth = next_stop;
 			next_stop -= deco_stepsize;
@@ -761,8 +837,10 @@ static void calculate_ndl_tts(double tissue_tolerance, struct plot_data *entry,
 }
 
 /* Let's try to do some deco calculations.
+ * Returns false if the calculation was cancelled half way.
  */
-void calculate_deco_information(struct dive *dive, struct divecomputer *dc, struct plot_info *pi, bool print_mode)
+bool calculate_deco_information(struct deco_state *ds, struct dive *dive, struct divecomputer *dc, struct plot_info *pi, bool print_mode,
+				const struct plot_settings *settings)
 {
 	int i;
 	double surface_pressure = (dc->surface_pressure.mbar ? dc->surface_pressure.mbar : get_surface_pressure_in_mbar(dive, true)) / 1000.0;
@@ -771,36 +849,30 @@ void calculate_deco_information(struct dive *dive, struct divecomputer *dc, stru
 	for (i = 1; i < pi->nr; i++) {
 		struct plot_data *entry = pi->entry + i;
 		int j, t0 = (entry - 1)->sec, t1 = entry->sec;
-		int time_stepsize = 20;
 
+		if (settings->cancel && *settings->cancel)
+			return false;
 		entry->ambpressure = (double) depth_to_mbar(entry->depth, dive) / 1000.0;
-		entry->gfline = MAX((double) prefs.gflow, (entry->ambpressure - surface_pressure) / (gf_low_pressure_this_dive - surface_pressure) *
-				(prefs.gflow - prefs.gfhigh) + prefs.gfhigh) * (100.0 - AMB_PERCENTAGE) / 100.0 + AMB_PERCENTAGE;
-		if (t0 != t1 && t1 - t0 < time_stepsize)
-			time_stepsize = t1 - t0;
-		for (j = t0 + time_stepsize; j <= t1; j += time_stepsize) {
-			int depth = interpolate(entry[-1].depth, entry[0].depth, j - t0, t1 - t0);
-			double min_pressure = add_segment(depth_to_mbar(depth, dive) / 1000.0,
-							  &dive->cylinder[entry->cylinderindex].gasmix, time_stepsize, entry->pressures.o2 * 1000, dive);
-			tissue_tolerance = min_pressure;
-			if (j - t0 < time_stepsize)
-				time_stepsize = j - t0;
-		}
+		entry->gfline = MAX((double) settings->gflow, (entry->ambpressure - surface_pressure) / (ds->gf_low_pressure_this_dive - surface_pressure) *
+				(settings->gflow - settings->gfhigh) + settings->gfhigh) * (100.0 - AMB_PERCENTAGE) / 100.0 + AMB_PERCENTAGE;
+		if (t1 > t0)
+			tissue_tolerance = add_segment_ramp(ds, depth_to_mbar((entry - 1)->depth, dive) / 1000.0, entry->ambpressure,
+							    &dive->cylinder[entry->cylinderindex].gasmix, t1 - t0, entry->pressures.o2 * 1000, dive);
 		if (t0 == t1)
 			entry->ceiling = (entry - 1)->ceiling;
 		else
-			entry->ceiling = deco_allowed_depth(tissue_tolerance, surface_pressure, dive, !prefs.calcceiling3m);
+			entry->ceiling = deco_allowed_depth(tissue_tolerance, surface_pressure, dive, !settings->calcceiling3m);
 		for (j = 0; j < 16; j++) {
-			double m_value = buehlmann_inertgas_a[j] + entry->ambpressure / buehlmann_inertgas_b[j];
-			entry->ceilings[j] = deco_allowed_depth(tolerated_by_tissue[j], surface_pressure, dive, 1);
-			entry->percentages[j] = tissue_inertgas_saturation[j] < entry->ambpressure ?
-							tissue_inertgas_saturation[j] / entry->ambpressure * AMB_PERCENTAGE :
-							AMB_PERCENTAGE + (tissue_inertgas_saturation[j] - entry->ambpressure) / (m_value - entry->ambpressure) * (100.0 - AMB_PERCENTAGE);
+			double m_value = ds->buehlmann_inertgas_a[j] + entry->ambpressure / ds->buehlmann_inertgas_b[j];
+			entry->ceilings[j] = deco_allowed_depth(ds->tolerated_by_tissue[j], surface_pressure, dive, 1);
+			entry->percentages[j] = ds->tissue_inertgas_saturation[j] < entry->ambpressure ?
+							ds->tissue_inertgas_saturation[j] / entry->ambpressure * AMB_PERCENTAGE :
+							AMB_PERCENTAGE + (ds->tissue_inertgas_saturation[j] - entry->ambpressure) / (m_value - entry->ambpressure) * (100.0 - AMB_PERCENTAGE);
 		}
 
 		/* should we do more calculations?
 		 * We don't for print-mode because this info doesn't show up there */
-		if (prefs.calcndltts && !print_mode) {
+		if (settings->calcndltts && !print_mode) {
 			/* only calculate ndl/tts on every 30 seconds */
 			if ((entry->sec - last_ndl_tts_calc_time) < 30) {
 				struct plot_data *prev_entry = (entry - 1);
@@ -812,18 +884,15 @@ void calculate_deco_information(struct dive *dive, struct divecomputer *dc, stru
 			}
 			last_ndl_tts_calc_time = entry->sec;
 
-			/* We are going to mess up deco state, so store it for later restore */
-			char *cache_data = NULL;
-			cache_deco_state(tissue_tolerance, &cache_data);
-			calculate_ndl_tts(tissue_tolerance, entry, dive, surface_pressure);
-			/* Restore "real" deco state for next real time step */
-			tissue_tolerance = restore_deco_state(cache_data);
-			free(cache_data);
+			/* We are going to mess up deco state, so work on a copy */
+			struct deco_state ndl_state = *ds;
+			calculate_ndl_tts(&ndl_state, tissue_tolerance, entry, dive, surface_pressure);
 		}
 	}
 #if DECO_CALC_DEBUG & 1
-	dump_tissues();
+	dump_tissues(ds);
 #endif
+	return true;
 }
 
 
@@ -869,7 +938,7 @@ double calculate_ccr_po2(struct plot_data *entry, struct divecomputer *dc) {
 	}
 }
 
-static void calculate_gas_information_new(struct dive *dive, struct plot_info *pi)
+static void calculate_gas_information_new(struct dive *dive, struct plot_info *pi, const struct plot_settings *settings)
 {
 	int i;
 	double amb_pressure;
@@ -889,7 +958,7 @@ static void calculate_gas_information_new(struct dive *dive, struct plot_info *p
 		 * so there is no difference in calculating between OC and CC
 		 * END takes O₂ + N₂ (air) into account ("Narcotic" for trimix dives)
 		 * EAD just uses N₂ ("Air" for nitrox dives) */
-		pressure_t modpO2 = { .mbar = (int)(prefs.modpO2 * 1000) };
+		pressure_t modpO2 = { .mbar = (int)(settings->modpO2 * 1000) };
 		entry->mod = (double)gas_mod(&dive->cylinder[cylinderindex].gasmix, modpO2, 1).mm;
 		entry->end = (entry->depth + 10000) * (1000 - fhe) / 1000.0 - 10000;
 		entry->ead = (entry->depth + 10000) * (1000 - fo2 - fhe) / (double)N2_IN_AIR - 10000;
@@ -981,18 +1050,21 @@ static void debug_print_profiledata(struct plot_info *pi)
 #endif
 
 /*
- * Create a plot-info with smoothing and ranged min/max
+ * Fill in the plot-info for one dive computer of a dive, starting from the
+ * deco state at the beginning of the dive (see init_decompression()).
  *
- * This also makes sure that we have extra empty events on both
- * sides, so that you can do end-points without having to worry
- * about it.
+ * This only looks at the dive passed in and not at the dive list, so it
+ * can run on a private copy of the dive outside the UI thread. The caller
+ * owns pi->entry. Without deco the ceiling, NDL and TTS are left empty;
+ * that is quick enough to show while the rest is still being calculated.
+ * The preferences come from the settings and not from prefs, for the same
+ * reason. Returns false if the settings' cancel flag stopped the deco
+ * calculation; the plot-info is incomplete then.
  */
-void create_plot_info_new(struct dive *dive, struct divecomputer *dc, struct plot_info *pi)
+bool compute_plot_info(struct dive *dive, struct divecomputer *dc, struct plot_info *pi, struct deco_state *ds, bool with_deco,
+		       const struct plot_settings *settings)
 {
 	int o2, he, o2low;
-	init_decompression(dive);
-	/* Create the new plot data */
-	free((void *)last_pi_entry_new);
 
 	get_dive_gas(dive, &o2, &he, &o2low);
 	if (he > 0) {
@@ -1003,7 +1075,7 @@ void create_plot_info_new(struct dive *dive, struct divecomputer *dc, struct plo
 		else
 			pi->dive_type = AIR;
 	}
-	last_pi_entry_new = populate_plot_entries(dive, dc, pi);
+	populate_plot_entries(dive, dc, pi);
 
 	check_gas_change_events(dive, dc, pi);			 /* Populate the gas index from the gas change events */
 	setup_gas_sensor_pressure(dive, dc, pi);		 /* Try to populate our gas pressure knowledge */
@@ -1013,8 +1085,9 @@ void create_plot_info_new(struct dive *dive, struct divecomputer *dc, struct plo
 
 	fill_o2_values(dc, pi, dive);				      /* .. and insert the O2 sensor data having 0 values. */
 	calculate_sac(dive, pi); /* Calculate sac */
-	calculate_deco_information(dive, dc, pi, false); /* and ceiling information, using gradient factor values in Preferences) */
-	calculate_gas_information_new(dive, pi); /* Calculate gas partial pressures */
+	if (with_deco && !calculate_deco_information(ds, dive, dc, pi, false, settings)) /* and ceiling information, using gradient factor values in Preferences) */
+		return false;
+	calculate_gas_information_new(dive, pi, settings); /* Calculate gas partial pressures */
 
 #ifdef DEBUG_GAS
 	debug_print_profiledata(pi);
@@ -1022,6 +1095,246 @@ void create_plot_info_new(struct dive *dive, struct divecomputer *dc, struct plo
 
 	pi->meandepth = dive->dc.meandepth.mm;
 	analyze_plot_info(pi);
+	return true;
+}
+
+/* the plot settings from the current preferences, without a cancel flag */
+void get_plot_settings(struct plot_settings *settings)
+{
+	settings->gflow = prefs.gflow;
+	settings->gfhigh = prefs.gfhigh;
+	settings->calcndltts = prefs.calcndltts;
+	settings->calcceiling3m = prefs.calcceiling3m;
+	settings->modpO2 = prefs.modpO2;
+	settings->cancel = NULL;
+}
+
+/*
+ * The entries of the plot-info the profile shows stay around until the
+ * next one replaces them.
+ */
+void set_displayed_plot_info(struct plot_info *pi)
+{
+	if (pi->entry == last_pi_entry_new)
+		return;
+	free((void *)last_pi_entry_new);
+	last_pi_entry_new = pi->entry;
+}
+
+/*
+ * A small LRU cache of finished plot-infos, so going back and forth between
+ * a few dives only costs the scene update. The key fingerprints everything
+ * compute_plot_info() looks at: the dive and dive computer data, the
+ * preferences and deco settings that change the result, and the deco state
+ * at the start of the dive (which covers the dives before this one).
+ *
+ * The cache keeps its own copies of the entries and hands out copies, so
+ * the ownership rules for pi->entry don't change. It is only used from the
+ * UI thread. How much memory it may use is the profile_cache_size
+ * preference.
+ */
+struct plot_info_cache_entry {
+	struct plot_info_cache_entry *next; /* most recently used first */
+	int dive_id;
+	uint32_t key;
+	size_t size;
+	struct plot_info pi;
+};
+
+static struct plot_info_cache_entry *plot_info_cache;
+static size_t plot_info_cache_size;
+static size_t plot_info_cache_budget = 32 * 1024 * 1024;
+static unsigned int plot_info_cache_hits, plot_info_cache_misses;
+
+uint32_t plot_info_key(struct dive *dive, struct divecomputer *dc, const struct deco_state *ds, const struct plot_settings *settings)
+{
+	uint32_t key = deco_config_hash();
+	struct event *ev;
+	int i;
+
+	key = fnv_hash(key, &settings->gflow, sizeof(settings->gflow));
+	key = fnv_hash(key, &settings->gfhigh, sizeof(settings->gfhigh));
+	key = fnv_hash(key, &settings->calcndltts, sizeof(settings->calcndltts));
+	key = fnv_hash(key, &settings->calcceiling3m, sizeof(settings->calcceiling3m));
+	key = fnv_hash(key, &settings->modpO2, sizeof(settings->modpO2));
+	key = fnv_hash(key, &dc_number, sizeof(dc_number));
+
+	key = fnv_hash(key, &dive->id, sizeof(dive->id));
+	key = fnv_hash(key, &dive->maxdepth, sizeof(dive->maxdepth));
+	key = fnv_hash(key, &dive->mintemp, sizeof(dive->mintemp));
+	key = fnv_hash(key, &dive->maxtemp, sizeof(dive->maxtemp));
+	key = fnv_hash(key, &dive->surface_pressure, sizeof(dive->surface_pressure));
+	key = fnv_hash(key, &dive->salinity, sizeof(dive->salinity));
+	key = fnv_hash(key, &dive->dc.meandepth, sizeof(dive->dc.meandepth));
+	for (i = 0; i < MAX_CYLINDERS; i++) {
+		cylinder_t *cyl = dive->cylinder + i;
+
+		key = fnv_hash(key, &cyl->type.size, sizeof(cyl->type.size));
+		key = fnv_hash(key, &cyl->type.workingpressure, sizeof(cyl->type.workingpressure));
+		key = fnv_hash(key, &cyl->gasmix, sizeof(cyl->gasmix));
+		key = fnv_hash(key, &cyl->start, sizeof(cyl->start));
+		key = fnv_hash(key, &cyl->end, sizeof(cyl->end));
+		key = fnv_hash(key, &cyl->sample_start, sizeof(cyl->sample_start));
+		key = fnv_hash(key, &cyl->sample_end, sizeof(cyl->sample_end));
+	}
+
+	key = fnv_hash(key, &dc->duration, sizeof(dc->duration));
+	key = fnv_hash(key, &dc->maxdepth, sizeof(dc->maxdepth));
+	key = fnv_hash(key, &dc->surface_pressure, sizeof(dc->surface_pressure));
+	key = fnv_hash(key, &dc->dctype, sizeof(dc->dctype));
+	key = fnv_hash(key, &dc->no_o2sensors, sizeof(dc->no_o2sensors));
+	key = fnv_hash(key, &dc->salinity, sizeof(dc->salinity));
+	key = fnv_hash(key, &dc->samples, sizeof(dc->samples));
+	key = fnv_hash(key, dc->sample, dc->samples * sizeof(struct sample));
+	for (ev = dc->events; ev; ev = ev->next) {
+		key = fnv_hash(key, &ev->time, sizeof(ev->time));
+		key = fnv_hash(key, &ev->type, sizeof(ev->type));
+		key = fnv_hash(key, &ev->flags, sizeof(ev->flags));
+		key = fnv_hash(key, &ev->value, sizeof(ev->value));
+		key = fnv_hash(key, &ev->gas, sizeof(ev->gas));
+		key = fnv_hash(key, &ev->deleted, sizeof(ev->deleted));
+		key = fnv_hash(key, ev->name, strlen(ev->name));
+	}
+
+	key = fnv_hash(key, ds->tissue_n2_sat, sizeof(ds->tissue_n2_sat));
+	key = fnv_hash(key, ds->tissue_he_sat, sizeof(ds->tissue_he_sat));
+	key = fnv_hash(key, &ds->gf_low_pressure_this_dive, sizeof(ds->gf_low_pressure_this_dive));
+	return key;
+}
+
+/* the min/max pointers of the entries point into the same array, so move them along */
+static bool copy_plot_info(const struct plot_info *src, struct plot_info *dst)
+{
+	struct plot_data *entry = malloc(src->nr * sizeof(struct plot_data));
+	int i, k;
+
+	if (!entry)
+		return false;
+	memcpy(entry, src->entry, src->nr * sizeof(struct plot_data));
+	for (i = 0; i < src->nr; i++) {
+		for (k = 0; k < 3; k++) {
+			if (entry[i].min[k])
+				entry[i].min[k] = entry + (entry[i].min[k] - src->entry);
+			if (entry[i].max[k])
+				entry[i].max[k] = entry + (entry[i].max[k] - src->entry);
+		}
+	}
+	*dst = *src;
+	dst->entry = entry;
+	return true;
+}
+
+static void free_plot_info_cache_entry(struct plot_info_cache_entry *cached)
+{
+	plot_info_cache_size -= cached->size;
+	free(cached->pi.entry);
+	free(cached);
+}
+
+/* drop the least recently used plot-infos until we are within the budget */
+static void trim_plot_info_cache(size_t budget)
+{
+	while (plot_info_cache && plot_info_cache_size > budget) {
+		struct plot_info_cache_entry **last = &plot_info_cache;
+
+		while ((*last)->next)
+			last = &(*last)->next;
+		free_plot_info_cache_entry(*last);
+		*last = NULL;
+	}
+}
+
+/* fill in a copy of the cached plot-info, if we have one */
+bool get_cached_plot_info(int dive_id, uint32_t key, struct plot_info *pi)
+{
+	struct plot_info_cache_entry **p, *cached;
+
+	for (p = &plot_info_cache; (cached = *p) != NULL; p = &cached->next) {
+		if (cached->dive_id != dive_id || cached->key != key)
+			continue;
+		if (!copy_plot_info(&cached->pi, pi))
+			break;
+		*p = cached->next;
+		cached->next = plot_info_cache;
+		plot_info_cache = cached;
+		plot_info_cache_hits++;
+		return true;
+	}
+	plot_info_cache_misses++;
+	return false;
+}
+
+void add_cached_plot_info(int dive_id, uint32_t key, const struct plot_info *pi)
+{
+	struct plot_info_cache_entry **p, *cached;
+	size_t size = sizeof(*cached) + pi->nr * sizeof(struct plot_data);
+
+	if (!pi->entry || size > plot_info_cache_budget)
+		return;
+	for (p = &plot_info_cache; (cached = *p) != NULL; p = &cached->next) {
+		if (cached->dive_id == dive_id && cached->key == key) {
+			*p = cached->next;
+			free_plot_info_cache_entry(cached);
+			break;
+		}
+	}
+	cached = malloc(sizeof(*cached));
+	if (!cached)
+		return;
+	if (!copy_plot_info(pi, &cached->pi)) {
+		free(cached);
+		return;
+	}
+	trim_plot_info_cache(plot_info_cache_budget - size);
+	cached->dive_id = dive_id;
+	cached->key = key;
+	cached->size = size;
+	cached->next = plot_info_cache;
+	plot_info_cache = cached;
+	plot_info_cache_size += size;
+}
+
+void set_plot_info_cache_budget(size_t bytes)
+{
+	plot_info_cache_budget = bytes;
+	trim_plot_info_cache(bytes);
+}
+
+void free_plot_info_cache(void)
+{
+	if (verbose && (plot_info_cache_hits || plot_info_cache_misses))
+		fprintf(stderr, "plot info cache: %u hits, %u misses\n", plot_info_cache_hits, plot_info_cache_misses);
+	trim_plot_info_cache(0);
+}
+
+/*
+ * Create a plot-info with smoothing and ranged min/max
+ *
+ * This also makes sure that we have extra empty events on both
+ * sides, so that you can do end-points without having to worry
+ * about it.
+ *
+ * Planned and manually added dives change with every edit, so there
+ * is no point in caching them.
+ */
+void create_plot_info_new(struct dive *dive, struct divecomputer *dc, struct plot_info *pi, bool use_cache)
+{
+	struct deco_state plot_deco_state;
+	struct plot_settings settings;
+	uint32_t key;
+
+	init_decompression(&plot_deco_state, dive);
+	get_plot_settings(&settings);
+	if (!use_cache) {
+		compute_plot_info(dive, dc, pi, &plot_deco_state, true, &settings);
+	} else {
+		key = plot_info_key(dive, dc, &plot_deco_state, &settings);
+		if (!get_cached_plot_info(dive->id, key, pi)) {
+			compute_plot_info(dive, dc, pi, &plot_deco_state, true, &settings);
+			add_cached_plot_info(dive->id, key, pi);
+		}
+	}
+	set_displayed_plot_info(pi);
 }
 
 struct divecomputer *select_dc(struct dive *dive)
@@ -16,6 +16,7 @@ typedef enum {
 struct membuffer;
 struct divecomputer;
 struct plot_info;
+struct deco_state;
 struct plot_data {
 	unsigned int in_deco : 1;
 	int cylinderindex;
@@ -60,6 +61,19 @@ struct plot_data {
 	double gfline;
 };
 
+/*
+ * The preferences the plot-info calculation depends on. The profile copies
+ * them when it calculates in the background, so changing the preferences
+ * doesn't affect a calculation that is already running. The calculation
+ * stops early once *cancel becomes nonzero.
+ */
+struct plot_settings {
+	short gflow, gfhigh;
+	short calcndltts, calcceiling3m;
+	double modpO2;
+	const volatile int *cancel;
+};
+
 struct ev_select {
 	char *ev_name;
 	bool plot_ev;
@@ -69,8 +83,18 @@ struct plot_info calculate_max_limits_new(struct dive *dive, struct divecomputer
 void compare_samples(struct plot_data *e1, struct plot_data *e2, char *buf, int bufsize, int sum);
 struct plot_data *populate_plot_entries(struct dive *dive, struct divecomputer *dc, struct plot_info *pi);
 struct plot_info *analyze_plot_info(struct plot_info *pi);
-void create_plot_info_new(struct dive *dive, struct divecomputer *dc, struct plot_info *pi);
-void calculate_deco_information(struct dive *dive, struct divecomputer *dc, struct plot_info *pi, bool print_mode);
+void create_plot_info_new(struct dive *dive, struct divecomputer *dc, struct plot_info *pi, bool use_cache);
+bool compute_plot_info(struct dive *dive, struct divecomputer *dc, struct plot_info *pi, struct deco_state *ds, bool with_deco,
+		       const struct plot_settings *settings);
+void get_plot_settings(struct plot_settings *settings);
+void set_displayed_plot_info(struct plot_info *pi);
+uint32_t plot_info_key(struct dive *dive, struct divecomputer *dc, const struct deco_state *ds, const struct plot_settings *settings);
+bool get_cached_plot_info(int dive_id, uint32_t key, struct plot_info *pi);
+void add_cached_plot_info(int dive_id, uint32_t key, const struct plot_info *pi);
+void set_plot_info_cache_budget(size_t bytes);
+void free_plot_info_cache(void);
+bool calculate_deco_information(struct deco_state *ds, struct dive *dive, struct divecomputer *dc, struct plot_info *pi, bool print_mode,
+				const struct plot_settings *settings);
 struct plot_data *get_plot_details_new(struct plot_info *pi, int time, struct membuffer *);
 
 /*
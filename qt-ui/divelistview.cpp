@@ -41,6 +41,8 @@ DiveListView::DiveListView(QWidget *parent) : QTreeView(parent), mouseClickSelec
 	model->setSortRole(DiveTripModel::SORT_ROLE);
 	model->setFilterKeyColumn(-1); // filter all columns
 	model->setFilterCaseSensitivity(Qt::CaseInsensitive);
+	// the trip model is updated in place, so keep sorting and filtering live
+	model->setDynamicSortFilter(true);
 	setModel(model);
 	connect(model, SIGNAL(layoutChanged()), this, SLOT(fixMessyQtModelBehaviour()));
 
@@ -107,8 +109,8 @@ DiveListView::DiveListView(QWidget *parent) : QTreeView(parent), mouseClickSelec
 
 	searchBox.installEventFilter(this);
 	searchBox.hide();
-//	connect(showSearchBox, SIGNAL(triggered(bool)), this, SLOT(showSearchEdit()));
-//	connect(&searchBox, SIGNAL(textChanged(QString)), model, SLOT(setFilterFixedString(QString)));
+	connect(showSearchBox, SIGNAL(triggered(bool)), this, SLOT(showSearchEdit()));
+	connect(&searchBox, SIGNAL(textChanged(QString)), model, SLOT(setSearchString(QString)));
 }
 
 DiveListView::~DiveListView()
@@ -338,8 +340,7 @@ bool DiveListView::eventFilter(QObject *, QEvent *event)
 
 	searchBox.clear();
 	searchBox.hide();
-	QSortFilterProxyModel *m = qobject_cast<QSortFilterProxyModel *>(model());
-	m->setFilterFixedString(QString());
+	TagFilterSortModel::instance()->setSearchString(QString());
 	return true;
 }
 
@@ -584,7 +585,6 @@ void DiveListView::merge_trip(const QModelIndex &a, int offset)
 		return;
 	combine_trips(trip_a, trip_b);
 	rememberSelection();
-	reload(currentLayout, false);
 	fixMessyQtModelBehaviour();
 	restoreSelection();
 	mark_divelist_changed(true);
@@ -611,7 +611,6 @@ void DiveListView::removeFromTrip()
 			remove_dive_from_trip(d, false);
 	}
 	rememberSelection();
-	reload(currentLayout, false);
 	fixMessyQtModelBehaviour();
 	restoreSelection();
 	mark_divelist_changed(true);
@@ -632,7 +631,6 @@ void DiveListView::newTripAbove()
 			add_dive_to_trip(d, trip);
 	}
 	trip->expanded = 1;
-	reload(currentLayout, false);
 	fixMessyQtModelBehaviour();
 	mark_divelist_changed(true);
 	restoreSelection();
@@ -673,7 +671,6 @@ void DiveListView::addToTrip(int delta)
 	trip->expanded = 1;
 	mark_divelist_changed(true);
 
-	reload(currentLayout, false);
 	restoreSelection();
 	fixMessyQtModelBehaviour();
 }
@@ -727,7 +724,9 @@ void DiveListView::deleteDive()
 		MainWindow::instance()->cleanUpEmpty();
 	}
 	mark_divelist_changed(true);
-	MainWindow::instance()->refreshDisplay();
+	// the dive list model already dropped the deleted dives
+	MainWindow::instance()->refreshDisplay(false);
+	TagFilterModel::instance()->repopulate();
 	if (lastDiveNr != -1) {
 		clearSelection();
 		selectDive(lastDiveNr);
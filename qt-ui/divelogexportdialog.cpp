@@ -311,8 +311,11 @@ void DiveLogExportDialog::on_buttonBox_accepted()
 		settings.setValue("LastDir", fileInfo.dir().path());
 		settings.endGroup();
 		// the non XSLT exports are called directly above, the XSLT based ons are called here
-		if (!stylesheet.isEmpty())
+		if (!stylesheet.isEmpty()) {
+			start_stylesheet_batch();
 			export_dives_xslt(filename.toUtf8(), ui->exportSelected->isChecked(), stylesheet.toUtf8());
+			end_stylesheet_batch("export");
+		}
 	}
 }
 
@@ -67,6 +67,7 @@ DiveLogImportDialog::~DiveLogImportDialog()
 #define VALUE_IF_CHECKED(x) (ui->x->isEnabled() ? ui->x->value() - 1 : -1)
 void DiveLogImportDialog::on_buttonBox_accepted()
 {
+	start_stylesheet_batch();
 	if (ui->tabWidget->currentIndex() == 0) {
 		for (int i = 0; i < fileNames.size(); ++i) {
 			parse_csv_file(fileNames[i].toUtf8().data(), ui->CSVTime->value() - 1,
@@ -95,6 +96,7 @@ void DiveLogImportDialog::on_buttonBox_accepted()
 					  VALUE_IF_CHECKED(Tags));
 		}
 	}
+	end_stylesheet_batch("CSV import");
 	if (ui->knownImports->currentText() == QString("Seabear CSV")) {
 		/* Seabear CSV stores NDL and TTS in Minutes, not seconds */
 		struct dive *dive = dive_table.dives[dive_table.nr - 1];
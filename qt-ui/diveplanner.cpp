@@ -1133,7 +1133,7 @@ void DivePlannerPointsModel::createTemporaryPlan()
 	}
 
 	// what does the cache do???
-	char *cache = NULL;
+	struct deco_state *cache = NULL;
 	struct divedatapoint *dp = NULL;
 	for (int i = 0; i < MAX_CYLINDERS; i++) {
 		cylinder_t *cyl = &displayed_dive.cylinder[i];
@@ -1171,7 +1171,7 @@ void DivePlannerPointsModel::deleteTemporaryPlan()
 void DivePlannerPointsModel::createPlan()
 {
 	// Ok, so, here the diveplan creates a dive
-	char *cache = NULL;
+	struct deco_state *cache = NULL;
 	bool oldRecalc = plannerModel->setRecalc(false);
 	removeDeco();
 	createTemporaryPlan();
@@ -663,6 +663,7 @@ void MainTab::acceptChanges()
 {
 	int i, addedId = -1;
 	struct dive *d;
+	bool timeChanged = false;
 	tabBar()->setTabIcon(0, QIcon()); // Notes
 	tabBar()->setTabIcon(1, QIcon()); // Equipment
 	ui.dateEdit->setEnabled(true);
@@ -684,13 +685,18 @@ void MainTab::acceptChanges()
 		amount_selected = 1;
 	} else if (MainWindow::instance() && MainWindow::instance()->dive_list()->selectedTrips().count() == 1) {
 		/* now figure out if things have changed */
+		bool tripChanged = false;
 		if (!same_string(displayedTrip.notes, currentTrip->notes)) {
 			currentTrip->notes = strdup(displayedTrip.notes);
-			mark_divelist_changed(true);
+			tripChanged = true;
 		}
 		if (!same_string(displayedTrip.location, currentTrip->location)) {
 			currentTrip->location = strdup(displayedTrip.location);
+			tripChanged = true;
+		}
+		if (tripChanged) {
 			mark_divelist_changed(true);
+			notify_trip_changed(currentTrip);
 		}
 		currentTrip = NULL;
 		ui.dateEdit->setEnabled(true);
@@ -724,6 +730,7 @@ void MainTab::acceptChanges()
 		if (displayed_dive.when != cd->when) {
 			time_t offset = cd->when - displayed_dive.when;
 			MODIFY_SELECTED_DIVES(mydive->when -= offset;);
+			timeChanged = true;
 		}
 		if (displayed_dive.latitude.udeg != cd->latitude.udeg ||
 		    displayed_dive.longitude.udeg != cd->longitude.udeg)
@@ -767,9 +774,12 @@ void MainTab::acceptChanges()
 		}
 		// each dive that was selected might have had the temperatures in its active divecomputer changed
 		// so re-populate the temperatures - easiest way to do this is by calling fixup_dive
+		// and let the dive list know about all that
 		for_each_dive (i, d) {
-			if (d->selected)
+			if (d->selected) {
 				fixup_dive(d);
+				notify_dive_changed(d);
+			}
 		}
 	}
 	if (current_dive->divetrip) {
@@ -797,12 +807,20 @@ void MainTab::acceptChanges()
 		MainWindow::instance()->refreshDisplay();
 		MainWindow::instance()->graphics()->replot();
 		emit addDiveFinished();
-	} else {
+	} else if (timeChanged) {
+		// dives may have moved around in the list and between trips
 		editMode = NONE;
 		MainWindow::instance()->dive_list()->rememberSelection();
 		sort_table(&dive_table);
 		MainWindow::instance()->refreshDisplay();
 		MainWindow::instance()->dive_list()->restoreSelection();
+	} else {
+		// the dive list model was told about the changes above
+		editMode = NONE;
+		sort_table(&dive_table);
+		MainWindow::instance()->refreshDisplay(false);
+		// recreateDiveList() isn't called, so the tag filter has to learn about new tags here
+		TagFilterModel::instance()->repopulate();
 	}
 	DivePlannerPointsModel::instance()->setPlanMode(DivePlannerPointsModel::NOTHING);
 	MainWindow::instance()->dive_list()->verticalScrollBar()->setSliderPosition(scrolledBy);
@@ -189,6 +189,7 @@ void MainWindow::current_dive_changed(int divenr)
 	if (divenr >= 0) {
 		select_dive(divenr);
 		ui.globe->centerOnCurrentDive();
+		update_dive_metrics(current_dive);
 	}
 	ui.newProfile->plotDive();
 	ui.InfoWidget->updateDiveInfo();
@@ -1166,10 +1167,12 @@ void MainWindow::importFiles(const QStringList fileNames)
 
 	QByteArray fileNamePtr;
 
+	start_stylesheet_batch();
 	for (int i = 0; i < fileNames.size(); ++i) {
 		fileNamePtr = QFile::encodeName(fileNames.at(i));
 		parse_file(fileNamePtr.data());
 	}
+	end_stylesheet_batch("import");
 	process_dives(true, false);
 	refreshDisplay();
 }
@@ -1182,6 +1185,7 @@ void MainWindow::loadFiles(const QStringList fileNames)
 	QByteArray fileNamePtr;
 	QStringList failedParses;
 
+	start_stylesheet_batch();
 	for (int i = 0; i < fileNames.size(); ++i) {
 		int error;
 
@@ -1194,6 +1198,7 @@ void MainWindow::loadFiles(const QStringList fileNames)
 			failedParses.append(fileNames.at(i));
 		}
 	}
+	end_stylesheet_batch("loading");
 
 	process_dives(false, false);
 	addRecentFile(fileNames);
@@ -13,6 +13,7 @@
 #include "../statistics.h"
 #include "../qthelper.h"
 #include "../gettextfromc.h"
+#include "../divesearch.h"
 
 #include <QCoreApplication>
 #include <QDebug>
@@ -24,6 +25,7 @@
 #include <QIcon>
 #include <QMessageBox>
 #include <QStringListModel>
+#include <QTimer>
 
 CleanerTableModel::CleanerTableModel(QObject *parent) : QAbstractTableModel(parent)
 {
@@ -1114,6 +1116,10 @@ QVariant DiveItem::data(int column, int role) const
 	QVariant retVal;
 	struct dive *dive = get_dive_by_uniq_id(diveId);
 
+	// these are cached in the dive and only recalculated after it changed
+	if (column == GAS || column == SAC || column == OTU || column == MAXCNS)
+		update_dive_metrics(dive);
+
 	switch (role) {
 	case Qt::TextAlignmentRole:
 		retVal = dive_table_alignment(column);
@@ -1193,7 +1199,7 @@ QVariant DiveItem::data(int column, int role) const
 			retVal = QString(dive->cylinder[0].type.description);
 			break;
 		case GAS:
-			retVal = QString(get_dive_gas_string(dive));
+			retVal = QString(dive->gas_string);
 			break;
 		case SAC:
 			retVal = displaySac();
@@ -1331,11 +1337,60 @@ int DiveItem::weight() const
 	return tw.grams;
 }
 
-DiveTripModel::DiveTripModel(QObject *parent) : TreeModel(parent)
+// only the most recently populated model follows the dive list
+static DiveTripModel *notifiedModel = NULL;
+
+static void notifyDiveAdded(struct dive *dive)
+{
+	if (notifiedModel)
+		notifiedModel->diveAdded(dive);
+}
+
+static void notifyDiveRemoved(struct dive *dive)
+{
+	if (notifiedModel)
+		notifiedModel->diveRemoved(dive);
+}
+
+static void notifyDiveTripChanged(struct dive *dive)
+{
+	if (notifiedModel)
+		notifiedModel->diveTripChanged(dive);
+}
+
+static void notifyDiveChanged(struct dive *dive)
+{
+	if (notifiedModel)
+		notifiedModel->diveChanged(dive);
+}
+
+static void notifyTripChanged(dive_trip_t *trip)
+{
+	if (notifiedModel)
+		notifiedModel->tripChanged(trip);
+}
+
+static const struct divelist_notifier divelistNotifier = {
+	notifyDiveAdded,
+	notifyDiveRemoved,
+	notifyDiveTripChanged,
+	notifyDiveChanged,
+	notifyTripChanged
+};
+
+DiveTripModel::DiveTripModel(QObject *parent) : TreeModel(parent),
+	metricsIdx(0),
+	metricsPending(false)
 {
 	columns = COLUMNS;
 }
 
+DiveTripModel::~DiveTripModel()
+{
+	if (notifiedModel == this)
+		notifiedModel = NULL;
+}
+
 Qt::ItemFlags DiveTripModel::flags(const QModelIndex &index) const
 {
 	if (!index.isValid())
@@ -1415,8 +1470,15 @@ void DiveTripModel::setupModelData()
 {
 	int i = dive_table.nr;
 
+	// we rebuild everything below, so ignore the notifications autogroup_dives() sends
+	notifiedModel = NULL;
+	DiveSearchIndex::instance()->sync();
 	if (rowCount()) {
 		beginRemoveRows(QModelIndex(), 0, rowCount() - 1);
+		qDeleteAll(rootItem->children);
+		rootItem->children.clear();
+		trips.clear();
+		diveItems.clear();
 		endRemoveRows();
 	}
 
@@ -1425,30 +1487,27 @@ void DiveTripModel::setupModelData()
 	dive_table.preexisting = dive_table.nr;
 	while (--i >= 0) {
 		struct dive *dive = get_dive(i);
-		update_cylinder_related_info(dive);
 		dive_trip_t *trip = dive->divetrip;
 
 		DiveItem *diveItem = new DiveItem();
 		diveItem->diveId = dive->id;
+		diveItems.insert(dive->id, diveItem);
 
 		if (!trip || currentLayout == LIST) {
 			diveItem->parent = rootItem;
 			rootItem->children.push_back(diveItem);
 			continue;
 		}
-		if (currentLayout == LIST)
-			continue;
 
-		if (!trips.keys().contains(trip)) {
-			TripItem *tripItem = new TripItem();
+		TripItem *tripItem = trips.value(trip);
+		if (!tripItem) {
+			tripItem = new TripItem();
 			tripItem->trip = trip;
 			tripItem->parent = rootItem;
-			tripItem->children.push_back(diveItem);
-			trips[trip] = tripItem;
+			trips.insert(trip, tripItem);
 			rootItem->children.push_back(tripItem);
-			continue;
 		}
-		TripItem *tripItem = trips[trip];
+		diveItem->parent = tripItem;
 		tripItem->children.push_back(diveItem);
 	}
 
@@ -1456,6 +1515,158 @@ void DiveTripModel::setupModelData()
 		beginInsertRows(QModelIndex(), 0, rowCount() - 1);
 		endInsertRows();
 	}
+
+	// calculate the SAC, OTU, CNS and gas of new or changed dives in the background
+	metricsIdx = 0;
+	if (!metricsPending) {
+		metricsPending = true;
+		QTimer::singleShot(0, this, SLOT(updateDiveMetrics()));
+	}
+
+	// from now on keep the model in sync with the dive list without rebuilding it
+	set_divelist_notifier(&divelistNotifier);
+	notifiedModel = this;
+}
+
+QModelIndex DiveTripModel::itemIndex(TreeItem *item) const
+{
+	if (!item || item == rootItem)
+		return QModelIndex();
+	return createIndex(item->row(), 0, item);
+}
+
+TreeItem *DiveTripModel::parentItemFor(struct dive *dive)
+{
+	dive_trip_t *trip = dive->divetrip;
+
+	if (!trip || currentLayout == LIST)
+		return rootItem;
+
+	TripItem *tripItem = trips.value(trip);
+	if (!tripItem) {
+		int row = rootItem->children.count();
+		tripItem = new TripItem();
+		tripItem->trip = trip;
+		tripItem->parent = rootItem;
+		beginInsertRows(QModelIndex(), row, row);
+		rootItem->children.push_back(tripItem);
+		trips.insert(trip, tripItem);
+		endInsertRows();
+	}
+	return tripItem;
+}
+
+void DiveTripModel::insertDiveItem(DiveItem *item, TreeItem *parent)
+{
+	int row = parent->children.count();
+
+	// the view sorts the dives, so appending is good enough
+	beginInsertRows(itemIndex(parent), row, row);
+	item->parent = parent;
+	parent->children.push_back(item);
+	endInsertRows();
+	tripItemChanged(parent);
+}
+
+void DiveTripModel::takeDiveItem(DiveItem *item)
+{
+	TreeItem *parent = item->parent;
+	int row = item->row();
+
+	beginRemoveRows(itemIndex(parent), row, row);
+	parent->children.removeAt(row);
+	item->parent = NULL;
+	endRemoveRows();
+
+	if (parent == rootItem)
+		return;
+	if (!parent->children.isEmpty()) {
+		tripItemChanged(parent);
+		return;
+	}
+	// the last dive left this trip
+	TripItem *tripItem = static_cast<TripItem *>(parent);
+	row = tripItem->row();
+	beginRemoveRows(QModelIndex(), row, row);
+	rootItem->children.removeAt(row);
+	trips.remove(tripItem->trip);
+	endRemoveRows();
+	delete tripItem;
+}
+
+void DiveTripModel::tripItemChanged(TreeItem *item)
+{
+	// a trip shows its date and number of dives, so refresh the whole row
+	if (!item || item == rootItem)
+		return;
+	int row = item->row();
+	emit dataChanged(createIndex(row, 0, item), createIndex(row, COLUMNS - 1, item));
+}
+
+void DiveTripModel::diveAdded(struct dive *dive)
+{
+	if (diveItems.contains(dive->id))
+		return;
+	DiveItem *item = new DiveItem();
+	item->diveId = dive->id;
+	diveItems.insert(dive->id, item);
+	insertDiveItem(item, parentItemFor(dive));
+	DiveSearchIndex::instance()->updateDive(dive);
+}
+
+void DiveTripModel::diveRemoved(struct dive *dive)
+{
+	DiveSearchIndex::instance()->removeDive(dive->id);
+	DiveItem *item = diveItems.take(dive->id);
+	if (!item)
+		return;
+	takeDiveItem(item);
+	delete item;
+}
+
+void DiveTripModel::diveTripChanged(struct dive *dive)
+{
+	DiveItem *item = diveItems.value(dive->id);
+	if (!item)
+		return;
+	// the dive is now found by the location of its new trip
+	DiveSearchIndex::instance()->updateDive(dive);
+	TreeItem *parent = parentItemFor(dive);
+	if (item->parent == parent) {
+		diveChanged(dive);
+		return;
+	}
+	takeDiveItem(item);
+	insertDiveItem(item, parent);
+}
+
+void DiveTripModel::diveChanged(struct dive *dive)
+{
+	DiveItem *item = diveItems.value(dive->id);
+	if (!item)
+		return;
+	DiveSearchIndex::instance()->updateDive(dive);
+	int row = item->row();
+	emit dataChanged(createIndex(row, 0, item), createIndex(row, COLUMNS - 1, item));
+	tripItemChanged(item->parent);
+}
+
+void DiveTripModel::tripChanged(dive_trip_t *trip)
+{
+	for (struct dive *dive = trip->dives; dive; dive = dive->next)
+		DiveSearchIndex::instance()->updateDive(dive);
+	tripItemChanged(trips.value(trip));
+}
+
+void DiveTripModel::updateDiveMetrics()
+{
+	// only do a few dives at a time so the UI stays responsive
+	for (int i = 0; i < 50 && metricsIdx < dive_table.nr; i++)
+		update_dive_metrics(get_dive(metricsIdx++));
+	if (metricsIdx < dive_table.nr)
+		QTimer::singleShot(0, this, SLOT(updateDiveMetrics()));
+	else
+		metricsPending = false;
 }
 
 DiveTripModel::Layout DiveTripModel::layout() const
@@ -2185,9 +2396,11 @@ void TagFilterModel::repopulate()
 	if (g_tag_list == NULL)
 		return;
 	QStringList list;
+	tagIds.clear();
 	struct tag_entry *current_tag_entry = g_tag_list->next;
 	while (current_tag_entry != NULL) {
 		list.append(QString(current_tag_entry->tag->name));
+		tagIds.append(current_tag_entry->tag->id);
 		current_tag_entry = current_tag_entry->next;
 	}
 	list << tr("Empty Tags");
@@ -2196,6 +2409,7 @@ void TagFilterModel::repopulate()
 	checkState = new bool[list.count()];
 	memset(checkState, false, list.count());
 	checkState[list.count() - 1] = false;
+	checkedTags.clear();
 	anyChecked = false;
 }
 
@@ -2210,6 +2424,15 @@ bool TagFilterModel::setData(const QModelIndex &index, const QVariant &value, in
 				break;
 			}
 		}
+		// filterRow() only needs to test one bit per tag of a dive
+		int size = 0;
+		for (int i = 0; i < tagIds.count(); i++)
+			size = qMax(size, tagIds[i] + 1);
+		checkedTags.fill(false, size);
+		for (int i = 0; i < tagIds.count(); i++) {
+			if (checkState[i])
+				checkedTags.setBit(tagIds[i]);
+		}
 		dataChanged(index, index);
 		return true;
 	}
@@ -2245,16 +2468,11 @@ bool TagFilterModel::filterRow(int source_row, const QModelIndex &source_parent,
 	}
 
 	// have at least one tag.
-	QStringList tagList = stringList();
-	if (!tagList.isEmpty()) {
-		tagList.removeLast(); // remove the "Show Empty Tags";
-		while (head) {
-			QString tagName(head->tag->name);
-			int index = tagList.indexOf(tagName);
-			if (checkState[index])
-				return true;
-			head = head->next;
-		}
+	while (head) {
+		int id = head->tag->id;
+		if (id < checkedTags.size() && checkedTags.testBit(id))
+			return true;
+		head = head->next;
 	}
 	return false;
 }
@@ -2265,12 +2483,39 @@ TagFilterSortModel *TagFilterSortModel::instance()
 	return self;
 }
 
-TagFilterSortModel::TagFilterSortModel(QObject *parent) : QSortFilterProxyModel(parent)
+TagFilterSortModel::TagFilterSortModel(QObject *parent) : QSortFilterProxyModel(parent),
+	searchGeneration(0)
 {
 }
 
+bool TagFilterSortModel::searchAcceptsRow(int source_row, const QModelIndex &source_parent) const
+{
+	QModelIndex index0 = sourceModel()->index(source_row, 0, source_parent);
+	struct dive *d = (struct dive *)sourceModel()->data(index0, DiveTripModel::DIVE_ROLE).value<void *>();
+
+	if (!d) { // a trip is shown if any of its dives match
+		for (int i = 0; i < sourceModel()->rowCount(index0); i++) {
+			if (searchAcceptsRow(i, index0))
+				return true;
+		}
+		return false;
+	}
+	return searchResult.contains(d->id);
+}
+
 bool TagFilterSortModel::filterAcceptsRow(int source_row, const QModelIndex &source_parent) const
 {
+	if (!searchString.isEmpty()) {
+		DiveSearchIndex *index = DiveSearchIndex::instance();
+		// the dives changed since we last looked the query up
+		if (searchGeneration != index->generation()) {
+			searchResult = index->search(searchString);
+			searchGeneration = index->generation();
+		}
+		if (!searchAcceptsRow(source_row, source_parent))
+			return false;
+	}
+
 	if (models.isEmpty()) {
 		return true;
 	}
@@ -2289,6 +2534,15 @@ void TagFilterSortModel::myInvalidate()
 	invalidate();
 }
 
+void TagFilterSortModel::setSearchString(const QString &text)
+{
+	// an empty query or one without any words shows everything
+	searchString = DiveSearchIndex::tokenize(text).join(" ");
+	searchResult = DiveSearchIndex::instance()->search(searchString);
+	searchGeneration = DiveSearchIndex::instance()->generation();
+	invalidateFilter();
+}
+
 void TagFilterSortModel::addFilterModel(MultiFilterInterface *model)
 {
 	QAbstractItemModel *itemModel = dynamic_cast<QAbstractItemModel *>(model);
@@ -12,6 +12,10 @@
 #include <QStringList>
 #include <QStringListModel>
 #include <QSortFilterProxyModel>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QBitArray>
 
 #include "metrics.h"
 
@@ -273,13 +277,33 @@ public:
 	virtual QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const;
 	virtual bool setData(const QModelIndex &index, const QVariant &value, int role = Qt::EditRole);
 	DiveTripModel(QObject *parent = 0);
+	~DiveTripModel();
 	Layout layout() const;
 	void setLayout(Layout layout);
 
+	/* called through the divelist notifier */
+	void diveAdded(struct dive *dive);
+	void diveRemoved(struct dive *dive);
+	void diveTripChanged(struct dive *dive);
+	void diveChanged(struct dive *dive);
+	void tripChanged(dive_trip_t *trip);
+
+private
+slots:
+	void updateDiveMetrics();
+
 private:
 	void setupModelData();
-	QMap<dive_trip_t *, TripItem *> trips;
+	QModelIndex itemIndex(TreeItem *item) const;
+	TreeItem *parentItemFor(struct dive *dive);
+	void insertDiveItem(DiveItem *item, TreeItem *parent);
+	void takeDiveItem(DiveItem *item);
+	void tripItemChanged(TreeItem *item);
+	QHash<dive_trip_t *, TripItem *> trips;
+	QHash<int, DiveItem *> diveItems;
 	Layout currentLayout;
+	int metricsIdx;
+	bool metricsPending;
 };
 
 class DiveComputerModel : public CleanerTableModel {
@@ -441,6 +465,8 @@ slots:
 
 private:
 	explicit TagFilterModel(QObject *parent = 0);
+	QVector<int> tagIds;	// the id of the tag in each row
+	QBitArray checkedTags;	// indexed by tag id
 };
 
 class TagFilterSortModel : public QSortFilterProxyModel {
@@ -452,8 +478,13 @@ public:
 	void removeFilterModel(MultiFilterInterface *model);
 public slots:
 	void myInvalidate();
+	void setSearchString(const QString &text);
 private:
 	TagFilterSortModel(QObject *parent = 0);
+	bool searchAcceptsRow(int source_row, const QModelIndex &source_parent) const;
 	QList<MultiFilterInterface*> models;
+	QString searchString;
+	mutable QSet<int> searchResult;
+	mutable unsigned int searchGeneration;
 };
 #endif // MODELS_H
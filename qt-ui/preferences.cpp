@@ -1,5 +1,7 @@
 #include "preferences.h"
 #include "mainwindow.h"
+#include "dive.h"
+#include "profile.h"
 #include <QSettings>
 #include <QDebug>
 #include <QFileDialog>
@@ -339,6 +341,8 @@ void PreferencesDialog::loadSettings()
 	GET_BOOL("show_sac", show_sac);
 	GET_BOOL("display_unused_tanks", display_unused_tanks);
 	GET_BOOL("show_average_depth", show_average_depth);
+	GET_INT("profile_cache_size", profile_cache_size);
+	set_plot_info_cache_budget((size_t)prefs.profile_cache_size * 1024 * 1024);
 	s.endGroup();
 
 	s.beginGroup("GeneralSettings");
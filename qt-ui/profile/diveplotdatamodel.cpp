@@ -4,6 +4,7 @@
 #include "profile.h"
 #include "graphicsview-common.h"
 #include "divelist.h"
+#include "deco.h"
 #include <QDebug>
 
 DivePlotDataModel::DivePlotDataModel(QObject *parent) : QAbstractTableModel(parent), diveId(0)
@@ -187,7 +188,10 @@ void DivePlotDataModel::emitDataChanged()
 void DivePlotDataModel::calculateDecompression()
 {
 	struct divecomputer *dc = select_dc(&displayed_dive);
-	init_decompression(&displayed_dive);
-	calculate_deco_information(&displayed_dive, dc, &pInfo, false);
+	struct deco_state ds;
+	struct plot_settings settings;
+	init_decompression(&ds, &displayed_dive);
+	get_plot_settings(&settings);
+	calculate_deco_information(&ds, &displayed_dive, dc, &pInfo, false, &settings);
 	dataChanged(index(0, CEILING), index(pInfo.nr - 1, TISSUE_16));
 }
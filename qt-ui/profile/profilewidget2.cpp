@@ -15,6 +15,7 @@
 #include "ruleritem.h"
 #include "tankitem.h"
 #include "dive.h"
+#include "deco.h"
 #include "pref.h"
 #include <libdivecomputer/parser.h>
 #include <QSignalTransition>
@@ -25,6 +26,8 @@
 #include <QScrollBar>
 #include <QtCore/qmath.h>
 #include <QMessageBox>
+#include <QFutureWatcher>
+#include <QtConcurrentRun>
 #include <QInputDialog>
 
 #ifndef QT_NO_DEBUG
@@ -421,12 +424,97 @@ void ProfileWidget2::setupSceneAndFlags()
 	background->setFlag(QGraphicsItem::ItemIgnoresTransformations);
 }
 
+// A profile calculation for the worker threads. It works on a private copy
+// of the dive, the deco state at its start (which carries the gradient
+// factors) and the preferences, so it doesn't touch anything the UI thread
+// may change in the meantime.
+struct PlotInfoJob {
+	volatile int cancelled; // set by the UI thread, polled by the calculation
+	bool complete;
+	int duration; // milliseconds the calculation took
+	unsigned int dcNr;
+	uint32_t key;
+	struct plot_settings settings;
+	struct dive dive;
+	struct deco_state ds;
+	struct plot_info pInfo;
+};
+
+static PlotInfoJob *calculatePlotInfo(PlotInfoJob *job)
+{
+	QTime measureDuration;
+	measureDuration.start();
+	job->complete = compute_plot_info(&job->dive, get_dive_dc(&job->dive, job->dcNr), &job->pInfo, &job->ds, true, &job->settings);
+	job->duration = measureDuration.elapsed();
+	return job;
+}
+
+static void freePlotInfoJob(PlotInfoJob *job)
+{
+	free(job->pInfo.entry);
+	clear_dive(&job->dive);
+	delete job;
+}
+
+// Anything above a second is way too long, so if we are calculating
+// TTS / NDL then let's force that off.
+static void checkDecoDuration(int duration, bool calcndltts)
+{
+	if (duration > 1000 && calcndltts && prefs.calcndltts) {
+		MainWindow::instance()->turnOffNdlTts();
+		MainWindow::instance()->showError("Show NDL / TTS was disabled because of excessive processing time");
+	}
+}
+
+ProfileWidget2::~ProfileWidget2()
+{
+	// the running calculations stop at the next sample, but we still
+	// have to wait for them before their jobs can go
+	cancelPlotInfoJobs();
+	QHashIterator<QFutureWatcher<PlotInfoJob *> *, PlotInfoJob *> it(plotInfoJobs);
+	while (it.hasNext()) {
+		it.next();
+		it.key()->waitForFinished();
+		freePlotInfoJob(it.value());
+	}
+	plotInfoJobs.clear();
+}
+
+// whatever the jobs we started are calculating, it isn't going to be shown
+void ProfileWidget2::cancelPlotInfoJobs()
+{
+	Q_FOREACH (PlotInfoJob *job, plotInfoJobs)
+		job->cancelled = 1;
+}
+
+void ProfileWidget2::plotInfoCalculated()
+{
+	QFutureWatcher<PlotInfoJob *> *watcher = static_cast<QFutureWatcher<PlotInfoJob *> *>(sender());
+	PlotInfoJob *job = plotInfoJobs.take(watcher);
+
+	watcher->deleteLater();
+	if (!job)
+		return;
+	if (job->complete) {
+		// even if the user moved on, they may well come back to this dive
+		add_cached_plot_info(job->dive.id, job->key, &job->pInfo);
+		if (!job->cancelled && job->dive.id == displayed_dive.id &&
+		    currentState != EMPTY && currentState != ADD && currentState != PLAN) {
+			set_displayed_plot_info(&job->pInfo);
+			setPlotInfo(job->pInfo, select_dc(&displayed_dive));
+			job->pInfo.entry = NULL;
+		}
+		checkDecoDuration(job->duration, job->settings.calcndltts);
+	}
+	freePlotInfoJob(job);
+}
+
 // Currently just one dive, but the plan is to enable All of the selected dives.
 void ProfileWidget2::plotDive(struct dive *d, bool force)
 {
 	static bool firstCall = true;
-	QTime measureDuration; // let's measure how long this takes us (maybe we'll turn of TTL calculation later
-	measureDuration.start();
+	QTime measureDuration; // let's measure how long the deco takes us (maybe we'll turn of TTL calculation later
+	bool decoCalculated = false;
 
 	if (currentState != ADD && currentState != PLAN) {
 		if (!d) {
@@ -479,9 +567,11 @@ void ProfileWidget2::plotDive(struct dive *d, bool force)
 	// let's create a fake profile that's somewhat reasonable for the
 	// data that we have
 	struct divecomputer *currentdc = select_dc(&displayed_dive);
+	bool fakeProfile = false;
 	Q_ASSERT(currentdc);
 	if (!currentdc || !currentdc->samples) {
 		currentdc = fake_dc(currentdc);
+		fakeProfile = true;
 	}
 
 	/* This struct holds all the data that's about to be plotted.
@@ -491,8 +581,87 @@ void ProfileWidget2::plotDive(struct dive *d, bool force)
 	 * so I'll *not* calculate everything if something is not being
 	 * shown.
 	 */
+	cancelPlotInfoJobs();
 	struct plot_info pInfo = calculate_max_limits_new(&displayed_dive, currentdc);
-	create_plot_info_new(&displayed_dive, currentdc, &pInfo);
+	if (currentState != ADD && currentState != PLAN && !printMode && !fakeProfile) {
+		// The deco part is what takes time; unless we have seen this dive
+		// recently, show the profile without it right away and let a worker
+		// thread fill in the rest.
+		PlotInfoJob *job = new PlotInfoJob();
+		init_decompression(&job->ds, &displayed_dive);
+		get_plot_settings(&job->settings);
+		job->key = plot_info_key(&displayed_dive, currentdc, &job->ds, &job->settings);
+		if (get_cached_plot_info(displayed_dive.id, job->key, &pInfo)) {
+			delete job;
+		} else {
+			job->cancelled = 0;
+			job->complete = false;
+			job->settings.cancel = &job->cancelled;
+			job->dcNr = dc_number;
+			job->pInfo = pInfo;
+			copy_dive(&displayed_dive, &job->dive);
+
+			QFutureWatcher<PlotInfoJob *> *watcher = new QFutureWatcher<PlotInfoJob *>(this);
+			connect(watcher, SIGNAL(finished()), this, SLOT(plotInfoCalculated()));
+			plotInfoJobs.insert(watcher, job);
+			watcher->setFuture(QtConcurrent::run(calculatePlotInfo, job));
+
+			compute_plot_info(&displayed_dive, currentdc, &pInfo, NULL, false, &job->settings);
+		}
+		set_displayed_plot_info(&pInfo);
+	} else {
+		measureDuration.start();
+		decoCalculated = true;
+		create_plot_info_new(&displayed_dive, currentdc, &pInfo, currentState != ADD && currentState != PLAN);
+	}
+	setPlotInfo(pInfo, currentdc);
+
+	// The event items are a bit special since we don't know how many events are going to
+	// exist on a dive, so I cant create cache items for that. that's why they are here
+	// while all other items are up there on the constructor.
+	qDeleteAll(eventItems);
+	eventItems.clear();
+	struct event *event = currentdc->events;
+	while (event) {
+		DiveEventItem *item = new DiveEventItem();
+		item->setHorizontalAxis(timeAxis);
+		item->setVerticalAxis(profileYAxis);
+		item->setModel(dataModel);
+		item->setEvent(event);
+		item->setZValue(2);
+		scene()->addItem(item);
+		eventItems.push_back(item);
+		event = event->next;
+	}
+	// Only set visible the events that should be visible
+	Q_FOREACH (DiveEventItem *event, eventItems) {
+		event->setVisible(!event->shouldBeHidden());
+	}
+	QString dcText = get_dc_nickname(currentdc->model, currentdc->deviceid);
+	int nr;
+	if ((nr = number_of_computers(&displayed_dive)) > 1)
+		dcText += tr(" (#%1 of %2)").arg(dc_number + 1).arg(nr);
+	diveComputerText->setText(dcText);
+	if (MainWindow::instance()->filesFromCommandLine() && animSpeedBackup != 0) {
+		prefs.animation_speed = animSpeedBackup;
+	}
+
+	if (currentState == ADD || currentState == PLAN) { // TODO: figure a way to move this from here.
+		repositionDiveHandlers();
+		DivePlannerPointsModel *model = DivePlannerPointsModel::instance();
+		model->deleteTemporaryPlan();
+	}
+	plotPictures();
+
+	// OK, how long did this take us? The calculations in the background
+	// check that themselves when they are done.
+	if (decoCalculated)
+		checkDecoDuration(measureDuration.elapsed(), prefs.calcndltts);
+}
+
+// Update the model and the axes to a (possibly more complete) plot info of the shown dive
+void ProfileWidget2::setPlotInfo(struct plot_info &pInfo, struct divecomputer *currentdc)
+{
 	if(shouldCalculateMaxTime)
 		maxtime = get_maxtime(&pInfo);
 
@@ -561,49 +730,6 @@ void ProfileWidget2::plotDive(struct dive *d, bool force)
 	Animations::moveTo(meanDepth,3, profileYAxis->posAtValue(pInfo.meandepth));
 
 	dataModel->emitDataChanged();
-	// The event items are a bit special since we don't know how many events are going to
-	// exist on a dive, so I cant create cache items for that. that's why they are here
-	// while all other items are up there on the constructor.
-	qDeleteAll(eventItems);
-	eventItems.clear();
-	struct event *event = currentdc->events;
-	while (event) {
-		DiveEventItem *item = new DiveEventItem();
-		item->setHorizontalAxis(timeAxis);
-		item->setVerticalAxis(profileYAxis);
-		item->setModel(dataModel);
-		item->setEvent(event);
-		item->setZValue(2);
-		scene()->addItem(item);
-		eventItems.push_back(item);
-		event = event->next;
-	}
-	// Only set visible the events that should be visible
-	Q_FOREACH (DiveEventItem *event, eventItems) {
-		event->setVisible(!event->shouldBeHidden());
-	}
-	QString dcText = get_dc_nickname(currentdc->model, currentdc->deviceid);
-	int nr;
-	if ((nr = number_of_computers(&displayed_dive)) > 1)
-		dcText += tr(" (#%1 of %2)").arg(dc_number + 1).arg(nr);
-	diveComputerText->setText(dcText);
-	if (MainWindow::instance()->filesFromCommandLine() && animSpeedBackup != 0) {
-		prefs.animation_speed = animSpeedBackup;
-	}
-
-	if (currentState == ADD || currentState == PLAN) { // TODO: figure a way to move this from here.
-		repositionDiveHandlers();
-		DivePlannerPointsModel *model = DivePlannerPointsModel::instance();
-		model->deleteTemporaryPlan();
-	}
-	plotPictures();
-
-	// OK, how long did this take us? Anything above the second is way too long,
-	// so if we are calculation TTS / NDL then let's force that off.
-	if (measureDuration.elapsed() > 1000 && prefs.calcndltts) {
-		MainWindow::instance()->turnOffNdlTts();
-		MainWindow::instance()->showError("Show NDL / TTS was disabled because of excessive processing time");
-	}
 }
 
 void ProfileWidget2::settingsChanged()
@@ -1234,6 +1360,8 @@ void ProfileWidget2::changeGas()
 
 	validate_gas(gas.toUtf8().constData(), &gasmix);
 	add_gas_switch_event(&displayed_dive, current_dc, seconds, get_gasidx(&displayed_dive, &gasmix));
+	// the event went into the current dive, so its SAC, OTU and CNS have to be recalculated
+	invalidate_dive_metrics(current_dive);
 	// this means we potentially have a new tank that is being used and needs to be shown
 	fixup_dive(&displayed_dive);
 
@@ -19,6 +19,7 @@
 
 class RulerItem2;
 struct dive;
+struct divecomputer;
 struct plot_info;
 class ToolTipItem;
 class MeanDepthLine;
@@ -47,6 +48,8 @@ class DiveHandler;
 class QGraphicsSimpleTextItem;
 class QModelIndex;
 class DivePictureItem;
+struct PlotInfoJob;
+template <typename T> class QFutureWatcher;
 
 class ProfileWidget2 : public QGraphicsView {
 	Q_OBJECT
@@ -70,6 +73,7 @@ public:
 	};
 
 	ProfileWidget2(QWidget *parent = 0);
+	~ProfileWidget2();
 	void plotDive(struct dive *d = 0, bool force = false);
 	virtual bool eventFilter(QObject *, QEvent *);
 	void setupItem(AbstractProfilePolygonItem *item, DiveCartesianAxis *hAxis, DiveCartesianAxis *vAxis, DivePlotDataModel *model, int vData, int hData, int zValue);
@@ -116,6 +120,7 @@ slots: // Necessary to call from QAction's signals.
 
 	void divePlannerHandlerClicked();
 	void divePlannerHandlerReleased();
+	void plotInfoCalculated();
 protected:
 	virtual void resizeEvent(QResizeEvent *event);
 	virtual void wheelEvent(QWheelEvent *event);
@@ -133,6 +138,8 @@ private: /*methods*/
 	void addItemsToScene();
 	void setupItemOnScene();
 	void disconnectTemporaryConnections();
+	void setPlotInfo(struct plot_info &pInfo, struct divecomputer *currentdc);
+	void cancelPlotInfoJobs();
 
 private:
 	DivePlotDataModel *dataModel;
@@ -189,6 +196,7 @@ private:
 	int maxtime;
 	int maxdepth;
 	double fontPrintScale;
+	QHash<QFutureWatcher<PlotInfoJob *> *, PlotInfoJob *> plotInfoJobs;
 };
 
 #endif // PROFILEWIDGET2_H
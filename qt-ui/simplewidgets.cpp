@@ -234,10 +234,10 @@ void ShiftImageTimesDialog::syncCameraClicked()
 
 	scene->addPixmap(picture.scaled(ui.DCImage->size()));
 	ui.DCImage->setScene(scene);
-	if (readfile(fileNames.at(0).toUtf8().data(), &mem) <= 0)
+	if (mapfile(fileNames.at(0).toUtf8().data(), &mem) <= 0)
 		return;
 	retval = exiv.parseFrom((const unsigned char *)mem.buffer, (unsigned)mem.size);
-	free(mem.buffer);
+	unmapfile(&mem);
 	if (retval != PARSE_EXIF_SUCCESS)
 		return;
 	dcImageEpoch = exiv.epoch();
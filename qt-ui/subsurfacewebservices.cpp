@@ -207,13 +207,11 @@ bool DivelogsDeWebServices::prepare_dives_for_divelogs(const QString &tempfile,
 		}
 	}
 	zip_close(zip);
-	xsltFreeStylesheet(xslt);
 	return true;
 
 error_close_zip:
 	zip_close(zip);
 	QFile::remove(tempfile);
-	xsltFreeStylesheet(xslt);
 	return false;
 }
 
@@ -615,7 +613,12 @@ void DivelogsDeWebServices::prepareDivesForUpload(bool selected)
 {
 	/* generate a random filename and create/open that file with zip_open */
 	QString filename = QDir::tempPath() + "/import-" + QString::number(qrand() % 99999999) + ".dld";
-	if (prepare_dives_for_divelogs(filename, selected)) {
+	bool prepared;
+
+	start_stylesheet_batch();
+	prepared = prepare_dives_for_divelogs(filename, selected);
+	end_stylesheet_batch("divelogs.de upload");
+	if (prepared) {
 		QFile f(filename);
 		if (f.open(QIODevice::ReadOnly)) {
 			uploadDives((QIODevice *)&f);
@@ -11,6 +11,11 @@
 #include <QMap>
 #include <QDebug>
 #include <QSettings>
+#include <QMutex>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QHash>
+#include <QElapsedTimer>
 #include <libxslt/documents.h>
 
 #define translate(_context, arg) trGettext(arg)
@@ -216,6 +221,9 @@ int dive_getUniqID(struct dive *d)
 {
 	static QSet<int> ids;
 	static int maxId = 83529;
+	static QMutex lock;
+	// dives can be allocated by several parser threads at once
+	QMutexLocker locker(&lock);
 
 	int id = d->id;
 	if (id) {
@@ -232,6 +240,40 @@ int dive_getUniqID(struct dive *d)
 	return id;
 }
 
+class ParallelTask : public QRunnable {
+public:
+	ParallelTask(void (*fn)(void *, int), void *data, int i) : fn(fn), data(data), i(i) {}
+	void run() { fn(data, i); }
+
+private:
+	void (*fn)(void *, int);
+	void *data;
+	int i;
+};
+
+// run fn(data, 0) .. fn(data, nr - 1) on as many threads as we have cores and wait for them
+extern "C" void run_in_parallel(int nr, void (*fn)(void *data, int i), void *data)
+{
+	// not the global pool: we only want to wait for our own tasks
+	QThreadPool pool;
+	for (int i = 0; i < nr; i++)
+		pool.start(new ParallelTask(fn, data, i));
+	pool.waitForDone();
+}
+
+// guards the global lists that parser threads add to (tags, event names)
+static QMutex sharedDiveDataLock;
+
+extern "C" void lock_shared_dive_data(void)
+{
+	sharedDiveDataLock.lock();
+}
+
+extern "C" void unlock_shared_dive_data(void)
+{
+	sharedDiveDataLock.unlock();
+}
+
 
 static xmlDocPtr get_stylesheet_doc(const xmlChar *uri, xmlDictPtr, int, void *, xsltLoadType)
 {
@@ -246,9 +288,30 @@ static xmlDocPtr get_stylesheet_doc(const xmlChar *uri, xmlDictPtr, int, void *,
 	return doc;
 }
 
+/*
+ * Compiled stylesheets are kept until parse_xml_exit(), so importing or
+ * exporting a batch of files compiles each of them only once. libxslt
+ * allows several transforms to use the same compiled stylesheet at once.
+ */
+static QMutex stylesheetLock;
+static QHash<QByteArray, xsltStylesheetPtr> stylesheets;
+static int stylesheetsCompiled, stylesheetsReused;
+static qint64 stylesheetCompileTime;
+static int batchCompiled, batchReused;
+static qint64 batchCompileTime;
+
+// the returned stylesheet belongs to the cache - don't free it
 extern "C" xsltStylesheetPtr get_stylesheet(const char *name)
 {
-	// this needs to be done only once, but doesn't hurt to run every time
+	QMutexLocker locker(&stylesheetLock);
+	QElapsedTimer timer;
+
+	xsltStylesheetPtr xslt = stylesheets.value(name);
+	if (xslt) {
+		stylesheetsReused++;
+		return xslt;
+	}
+	timer.start();
 	xsltSetLoaderFunc(get_stylesheet_doc);
 
 	// get main document:
@@ -257,21 +320,64 @@ extern "C" xsltStylesheetPtr get_stylesheet(const char *name)
 		return NULL;
 
 	//	xsltSetGenericErrorFunc(stderr, NULL);
-	xsltStylesheetPtr xslt = xsltParseStylesheetDoc(doc);
+	xslt = xsltParseStylesheetDoc(doc);
 	if (!xslt) {
 		xmlFreeDoc(doc);
 		return NULL;
 	}
-
+	stylesheets.insert(name, xslt);
+	stylesheetsCompiled++;
+	stylesheetCompileTime += timer.nsecsElapsed();
 	return xslt;
 }
 
+// remember the counters when an import or export starts...
+extern "C" void start_stylesheet_batch(void)
+{
+	QMutexLocker locker(&stylesheetLock);
+
+	batchCompiled = stylesheetsCompiled;
+	batchReused = stylesheetsReused;
+	batchCompileTime = stylesheetCompileTime;
+}
+
+// ...and say what the cache did for it when it ends
+extern "C" void end_stylesheet_batch(const char *what)
+{
+	QMutexLocker locker(&stylesheetLock);
+	int compiled = stylesheetsCompiled - batchCompiled, reused = stylesheetsReused - batchReused;
+	qint64 compileTime = stylesheetCompileTime - batchCompileTime;
+
+	if (!compiled && !reused)
+		return;
+	// a reuse saves what compiling a stylesheet has cost on average so far
+	qint64 average = stylesheetsCompiled ? stylesheetCompileTime / stylesheetsCompiled : 0;
+	qDebug() << what << "compiled" << compiled << "stylesheets in" << compileTime / 1000000 << "ms,"
+		 << "reused cached ones" << reused << "times, saving about" << reused * average / 1000000 << "ms";
+}
+
+extern "C" void free_stylesheets(void)
+{
+	QMutexLocker locker(&stylesheetLock);
+
+	if (verbose && stylesheetsCompiled) {
+		qint64 average = stylesheetCompileTime / stylesheetsCompiled;
+		qDebug() << "compiled" << stylesheetsCompiled << "stylesheets in" << stylesheetCompileTime / 1000000 << "ms,"
+			 << "reused them" << stylesheetsReused << "times, saving about" << stylesheetsReused * average / 1000000 << "ms";
+	}
+	Q_FOREACH (xsltStylesheetPtr xslt, stylesheets)
+		xsltFreeStylesheet(xslt);
+	stylesheets.clear();
+	stylesheetsCompiled = stylesheetsReused = 0;
+	stylesheetCompileTime = 0;
+}
+
 extern "C" void picture_load_exif_data(struct picture *p, timestamp_t *timestamp)
 {
 	EXIFInfo exif;
 	memblock mem;
 
-	if (readfile(p->filename, &mem) <= 0)
+	if (mapfile(p->filename, &mem) <= 0)
 		goto picture_load_exit;
 	if (exif.parseFrom((const unsigned char *)mem.buffer, (unsigned)mem.size) != PARSE_EXIF_SUCCESS)
 		goto picture_load_exit;
@@ -280,7 +386,7 @@ extern "C" void picture_load_exif_data(struct picture *p, timestamp_t *timestamp
 	p->latitude.udeg  = lrint(1000000.0 * exif.GeoLocation.Latitude);
 
 picture_load_exit:
-	free(mem.buffer);
+	unmapfile(&mem);
 	return;
 }
 
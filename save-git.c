@@ -376,15 +376,24 @@ const char *get_error_string(void)
 	return str;
 }
 
+/* Has anything been reported since the error string was last fetched? */
+bool have_error_string(void)
+{
+	return error_string_buffer.len != 0;
+}
+
 int report_error(const char *fmt, ...)
 {
 	struct membuffer *buf = &error_string_buffer;
 
+	/* the parsers can report errors from several threads */
+	lock_shared_dive_data();
 	/* Previous unprinted errors? Add a newline in between */
 	if (buf->len)
 		put_bytes(buf, "\n", 1);
 	VA_BUF(buf, fmt);
 	mb_cstring(buf);
+	unlock_shared_dive_data();
 	return -1;
 }
 
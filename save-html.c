@@ -1,4 +1,5 @@
 #include "save-html.h"
+#include "divelist.h"
 #include "gettext.h"
 #include "stdio.h"
 
@@ -56,6 +57,7 @@ void write_divecomputers(struct membuffer *b, struct dive *dive)
 
 void write_dive_status(struct membuffer *b, struct dive *dive)
 {
+	update_dive_metrics(dive);
 	put_format(b, "\"sac\":\"%d\",", dive->sac);
 	put_format(b, "\"otu\":\"%d\",", dive->otu);
 	put_format(b, "\"cns\":\"%d\",", dive->cns);
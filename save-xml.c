@@ -642,7 +642,6 @@ int export_dives_xslt(const char *filename, const bool selected, const char *exp
 	} else {
 		res = report_error("Failed to open %s for writing (%s)", filename, strerror(errno));
 	}
-	xsltFreeStylesheet(xslt);
 	xmlFreeDoc(transformed);
 
 	return res;
@@ -0,0 +1,759 @@
+/*
+ * A snapshot is a binary copy of everything loading a logbook into an
+ * empty session gave us: the dives with their dive computers, samples,
+ * events, tags and pictures, the trips, and the settings that came with
+ * the file. It sits next to the logbook and remembers what the logbook
+ * looked like when it was taken (size and modification time of a file,
+ * or the commit of a git branch), so as long as that hasn't changed we
+ * can map it and copy the dives out of it instead of parsing the XML and
+ * running fixup_dive() on every dive again.
+ *
+ * The payload is written in our own byte order and covered by a SHA1;
+ * a snapshot that is stale, damaged, or was written by a different
+ * version is simply ignored and the logbook gets loaded the normal way.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "dive.h"
+#include "divelist.h"
+#include "device.h"
+#include "file.h"
+#include "membuffer.h"
+#include "sha1.h"
+
+#define SNAPSHOT_MAGIC "SSRFSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTEORDER 0x01020304
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint32_t sample_size;	/* the samples are stored just like they are in memory */
+	uint32_t unused;
+	uint64_t length;	/* of the payload after the header */
+	char key[SNAPSHOT_KEY_SIZE];
+	unsigned char sha1[20];
+};
+
+char *snapshot_name(const char *filename)
+{
+	int len = strlen(filename);
+	char *name = malloc(len + sizeof(".snapshot"));
+
+	if (!name)
+		return NULL;
+	memcpy(name, filename, len);
+	strcpy(name + len, ".snapshot");
+	return name;
+}
+
+static void put_u32(struct membuffer *b, uint32_t val)
+{
+	put_bytes(b, (const char *)&val, sizeof(val));
+}
+
+static void put_u64(struct membuffer *b, uint64_t val)
+{
+	put_bytes(b, (const char *)&val, sizeof(val));
+}
+
+/* length plus one, so that we can tell a NULL string from an empty one */
+static void put_str(struct membuffer *b, const char *str)
+{
+	int len;
+
+	if (!str) {
+		put_u32(b, 0);
+		return;
+	}
+	len = strlen(str);
+	put_u32(b, len + 1);
+	put_bytes(b, str, len);
+}
+
+static void put_device(void *_b, const char *model, uint32_t deviceid,
+			const char *nickname, const char *serial_nr, const char *firmware)
+{
+	struct membuffer *b = _b;
+
+	put_u32(b, 1);
+	put_str(b, model);
+	put_u32(b, deviceid);
+	put_str(b, nickname);
+	put_str(b, serial_nr);
+	put_str(b, firmware);
+}
+
+static void put_settings(struct membuffer *b)
+{
+	put_u32(b, prefs.save_userid_local);
+	put_str(b, prefs.save_userid_local ? prefs.userid : NULL);
+	put_u32(b, autogroup);
+	call_for_each_dc(b, put_device);
+	put_u32(b, 0);
+}
+
+static void put_cylinder(struct membuffer *b, cylinder_t *cyl)
+{
+	put_u32(b, cyl->type.size.mliter);
+	put_u32(b, cyl->type.workingpressure.mbar);
+	put_str(b, cyl->type.description);
+	put_u32(b, cyl->gasmix.o2.permille);
+	put_u32(b, cyl->gasmix.he.permille);
+	put_u32(b, cyl->start.mbar);
+	put_u32(b, cyl->end.mbar);
+	put_u32(b, cyl->sample_start.mbar);
+	put_u32(b, cyl->sample_end.mbar);
+	put_u32(b, cyl->depth.mm);
+	put_u32(b, cyl->manually_added);
+	put_u32(b, cyl->gas_used.mliter);
+	put_u32(b, cyl->deco_gas_used.mliter);
+}
+
+static void put_dc(struct membuffer *b, struct divecomputer *dc)
+{
+	struct event *ev;
+	int nr = 0;
+
+	put_u64(b, dc->when);
+	put_u32(b, dc->duration.seconds);
+	put_u32(b, dc->surfacetime.seconds);
+	put_u32(b, dc->maxdepth.mm);
+	put_u32(b, dc->meandepth.mm);
+	put_u32(b, dc->airtemp.mkelvin);
+	put_u32(b, dc->watertemp.mkelvin);
+	put_u32(b, dc->surface_pressure.mbar);
+	put_u32(b, dc->dctype);
+	put_u32(b, dc->no_o2sensors);
+	put_u32(b, dc->salinity);
+	put_str(b, dc->model);
+	put_u32(b, dc->deviceid);
+	put_u32(b, dc->diveid);
+	put_u32(b, dc->samples);
+	put_bytes(b, (const char *)dc->sample, dc->samples * sizeof(struct sample));
+
+	for (ev = dc->events; ev; ev = ev->next)
+		nr++;
+	put_u32(b, nr);
+	for (ev = dc->events; ev; ev = ev->next) {
+		put_u32(b, ev->time.seconds);
+		put_u32(b, ev->type);
+		put_u32(b, ev->flags);
+		put_u32(b, ev->value);
+		put_u32(b, ev->gas.index);
+		put_u32(b, ev->gas.mix.o2.permille);
+		put_u32(b, ev->gas.mix.he.permille);
+		put_u32(b, ev->deleted);
+		put_str(b, ev->name);
+	}
+}
+
+static void put_dive(struct membuffer *b, struct dive *dive)
+{
+	struct tag_entry *tag;
+	struct divecomputer *dc;
+	struct picture *pic;
+	int i, nr;
+
+	put_u32(b, dive->number);
+	put_u32(b, dive->tripflag);
+	put_u32(b, dive->downloaded);
+	put_u64(b, dive->when);
+	put_str(b, dive->location);
+	put_str(b, dive->notes);
+	put_str(b, dive->divemaster);
+	put_str(b, dive->buddy);
+	put_u32(b, dive->rating);
+	put_u32(b, dive->latitude.udeg);
+	put_u32(b, dive->longitude.udeg);
+	put_u32(b, dive->visibility);
+	for (i = 0; i < MAX_CYLINDERS; i++)
+		put_cylinder(b, dive->cylinder + i);
+	for (i = 0; i < MAX_WEIGHTSYSTEMS; i++) {
+		put_u32(b, dive->weightsystem[i].weight.grams);
+		put_str(b, dive->weightsystem[i].description);
+	}
+	put_str(b, dive->suit);
+	put_u32(b, dive->sac);
+	put_u32(b, dive->otu);
+	put_u32(b, dive->cns);
+	put_u32(b, dive->maxcns);
+	put_u32(b, dive->mintemp.mkelvin);
+	put_u32(b, dive->maxtemp.mkelvin);
+	put_u32(b, dive->watertemp.mkelvin);
+	put_u32(b, dive->airtemp.mkelvin);
+	put_u32(b, dive->maxdepth.mm);
+	put_u32(b, dive->meandepth.mm);
+	put_u32(b, dive->surface_pressure.mbar);
+	put_u32(b, dive->duration.seconds);
+	put_u32(b, dive->salinity);
+
+	/* tags go by their untranslated name, like in the XML file */
+	nr = 0;
+	for (tag = dive->tag_list; tag; tag = tag->next)
+		nr++;
+	put_u32(b, nr);
+	for (tag = dive->tag_list; tag; tag = tag->next)
+		put_str(b, tag->tag->source ? tag->tag->source : tag->tag->name);
+
+	nr = 0;
+	for (dc = &dive->dc; dc; dc = dc->next)
+		nr++;
+	put_u32(b, nr);
+	for (dc = &dive->dc; dc; dc = dc->next)
+		put_dc(b, dc);
+
+	nr = 0;
+	for (pic = dive->picture_list; pic; pic = pic->next)
+		nr++;
+	put_u32(b, nr);
+	for (pic = dive->picture_list; pic; pic = pic->next) {
+		put_str(b, pic->filename);
+		put_u32(b, pic->offset.seconds);
+		put_u32(b, pic->latitude.udeg);
+		put_u32(b, pic->longitude.udeg);
+	}
+}
+
+#define TRIP_LISTED 16
+
+/* the dives of a trip go by their index in the dive table, in the order of the trip's list */
+static int put_trip(struct membuffer *b, dive_trip_t *trip, bool listed)
+{
+	struct dive *dive;
+	int nr = 0;
+
+	put_u64(b, trip->when);
+	put_str(b, trip->location);
+	put_str(b, trip->notes);
+	put_u32(b, trip->expanded | trip->selected << 1 | trip->autogen << 2 | trip->fixup << 3 |
+		   (listed ? TRIP_LISTED : 0));
+	for (dive = trip->dives; dive; dive = dive->next)
+		nr++;
+	put_u32(b, nr);
+	for (dive = trip->dives; dive; dive = dive->next) {
+		int idx = get_divenr(dive);
+		if (idx < 0)
+			return -1;
+		put_u32(b, idx);
+	}
+	return 0;
+}
+
+/*
+ * Write a snapshot of the whole session; the caller has just loaded it
+ * from the logbook described by key.
+ */
+int save_dive_snapshot(const char *filename, const char *key)
+{
+	struct membuffer buf = { 0 };
+	struct snapshot_header header;
+	struct membuffer tmpname = { 0 };
+	dive_trip_t *trip;
+	struct dive *dive;
+	FILE *f;
+	int i, nr, error = 0;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.byteorder = SNAPSHOT_BYTEORDER;
+	header.sample_size = sizeof(struct sample);
+	strncpy(header.key, key, sizeof(header.key) - 1);
+	put_bytes(&buf, (const char *)&header, sizeof(header));
+
+	put_settings(&buf);
+	put_u32(&buf, dive_table.nr);
+	for_each_dive (i, dive)
+		put_dive(&buf, dive);
+
+	/*
+	 * The trips of the dives are normally all on the trip list, but
+	 * insert_trip() can leave some dives behind in a trip it merged
+	 * away, and those dives have to come back just the same. Like in
+	 * save-xml.c, trip->index is scratch space.
+	 */
+	for (trip = dive_trip_list; trip; trip = trip->next)
+		trip->index = 0;
+	for_each_dive (i, dive) {
+		if (dive->divetrip)
+			dive->divetrip->index = 0;
+	}
+	nr = 0;
+	for (trip = dive_trip_list; trip; trip = trip->next)
+		trip->index = ++nr;
+	for_each_dive (i, dive) {
+		if (dive->divetrip && !dive->divetrip->index)
+			dive->divetrip->index = ++nr;
+	}
+	put_u32(&buf, nr);
+	nr = 0;
+	for (trip = dive_trip_list; trip && !error; trip = trip->next, nr++)
+		error = put_trip(&buf, trip, true);
+	for_each_dive (i, dive) {
+		trip = dive->divetrip;
+		if (trip && trip->index == nr + 1 && !error) {
+			error = put_trip(&buf, trip, false);
+			nr++;
+		}
+	}
+	for_each_dive (i, dive) {
+		if (dive->divetrip)
+			dive->divetrip->index = 0;
+	}
+	for (trip = dive_trip_list; trip; trip = trip->next)
+		trip->index = 0;
+	if (error) {
+		free_buffer(&buf);
+		return -1;
+	}
+
+	header.length = buf.len - sizeof(header);
+	SHA1(buf.buffer + sizeof(header), header.length, header.sha1);
+	memcpy(buf.buffer, &header, sizeof(header));
+
+	/* write it under a different name first, so nobody ever sees half a snapshot */
+	put_format(&tmpname, "%s.new", filename);
+	f = subsurface_fopen(mb_cstring(&tmpname), "wb");
+	error = -1;
+	if (f) {
+		flush_buffer(&buf, f);
+		error = fclose(f);
+		if (!error)
+			error = subsurface_rename(mb_cstring(&tmpname), filename);
+		if (error)
+			remove(mb_cstring(&tmpname));
+	}
+	if (error && verbose)
+		fprintf(stderr, "Unable to write snapshot %s (%s)\n", filename, strerror(errno));
+	free_buffer(&buf);
+	free_buffer(&tmpname);
+	return error;
+}
+
+struct snapshot_reader {
+	const char *pos, *end;
+	bool failed;
+};
+
+static const char *get_bytes(struct snapshot_reader *r, size_t len)
+{
+	const char *p = r->pos;
+
+	if (r->failed || len > (size_t)(r->end - r->pos)) {
+		r->failed = true;
+		return NULL;
+	}
+	r->pos += len;
+	return p;
+}
+
+static uint32_t get_u32(struct snapshot_reader *r)
+{
+	uint32_t val = 0;
+	const char *p = get_bytes(r, sizeof(val));
+
+	if (p)
+		memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+static uint64_t get_u64(struct snapshot_reader *r)
+{
+	uint64_t val = 0;
+	const char *p = get_bytes(r, sizeof(val));
+
+	if (p)
+		memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+static char *get_str(struct snapshot_reader *r)
+{
+	uint32_t len = get_u32(r);
+	const char *p;
+	char *str;
+
+	if (!len)
+		return NULL;
+	p = get_bytes(r, len - 1);
+	if (!p)
+		return NULL;
+	str = malloc(len);
+	if (!str)
+		exit(1);
+	memcpy(str, p, len - 1);
+	str[len - 1] = 0;
+	return str;
+}
+
+/* an element count, which has to fit in what is left of the snapshot */
+static uint32_t get_count(struct snapshot_reader *r)
+{
+	uint32_t nr = get_u32(r);
+
+	if (nr > (size_t)(r->end - r->pos)) {
+		r->failed = true;
+		return 0;
+	}
+	return nr;
+}
+
+/* we go over the settings twice: once to skip them, and once everything else checked out */
+static void read_settings(struct snapshot_reader *r, bool apply)
+{
+	bool save_userid_local = get_u32(r);
+	char *userid = get_str(r);
+
+	if (get_u32(r) && apply)
+		set_autogroup(true);
+	while (get_u32(r) && !r->failed) {
+		char *model = get_str(r);
+		uint32_t deviceid = get_u32(r);
+		char *nickname = get_str(r);
+		char *serial_nr = get_str(r);
+		char *firmware = get_str(r);
+
+		if (apply)
+			create_device_node(model, deviceid, serial_nr, firmware, nickname);
+		free(model);
+		free(nickname);
+		free(serial_nr);
+		free(firmware);
+	}
+	if (apply) {
+		set_save_userid_local(save_userid_local);
+		set_userid(userid ? userid : "");
+	}
+	free(userid);
+}
+
+static void read_cylinder(struct snapshot_reader *r, cylinder_t *cyl)
+{
+	cyl->type.size.mliter = get_u32(r);
+	cyl->type.workingpressure.mbar = get_u32(r);
+	cyl->type.description = get_str(r);
+	cyl->gasmix.o2.permille = get_u32(r);
+	cyl->gasmix.he.permille = get_u32(r);
+	cyl->start.mbar = get_u32(r);
+	cyl->end.mbar = get_u32(r);
+	cyl->sample_start.mbar = get_u32(r);
+	cyl->sample_end.mbar = get_u32(r);
+	cyl->depth.mm = get_u32(r);
+	cyl->manually_added = get_u32(r);
+	cyl->gas_used.mliter = get_u32(r);
+	cyl->deco_gas_used.mliter = get_u32(r);
+}
+
+static void read_dc(struct snapshot_reader *r, struct divecomputer *dc)
+{
+	struct event **evp = &dc->events;
+	const char *samples;
+	uint32_t nr;
+
+	dc->when = get_u64(r);
+	dc->duration.seconds = get_u32(r);
+	dc->surfacetime.seconds = get_u32(r);
+	dc->maxdepth.mm = get_u32(r);
+	dc->meandepth.mm = get_u32(r);
+	dc->airtemp.mkelvin = get_u32(r);
+	dc->watertemp.mkelvin = get_u32(r);
+	dc->surface_pressure.mbar = get_u32(r);
+	dc->dctype = get_u32(r);
+	dc->no_o2sensors = get_u32(r);
+	dc->salinity = get_u32(r);
+	dc->model = get_str(r);
+	dc->deviceid = get_u32(r);
+	dc->diveid = get_u32(r);
+
+	nr = get_count(r);
+	if (nr > (r->end - r->pos) / sizeof(struct sample))
+		r->failed = true;
+	samples = get_bytes(r, nr * sizeof(struct sample));
+	if (samples && nr) {
+		dc->sample = malloc(nr * sizeof(struct sample));
+		if (!dc->sample)
+			exit(1);
+		memcpy(dc->sample, samples, nr * sizeof(struct sample));
+		dc->samples = dc->alloc_samples = nr;
+	}
+
+	nr = get_count(r);
+	while (nr-- && !r->failed) {
+		struct event ev = { 0 }, *new;
+		char *name;
+
+		ev.time.seconds = get_u32(r);
+		ev.type = get_u32(r);
+		ev.flags = get_u32(r);
+		ev.value = get_u32(r);
+		ev.gas.index = get_u32(r);
+		ev.gas.mix.o2.permille = get_u32(r);
+		ev.gas.mix.he.permille = get_u32(r);
+		ev.deleted = get_u32(r);
+		name = get_str(r);
+		if (!name)
+			name = strdup("");
+
+		/* keep the events in the order they were in */
+		new = malloc(sizeof(ev) + strlen(name) + 1);
+		if (!new)
+			exit(1);
+		*new = ev;
+		strcpy(new->name, name);
+		free(name);
+		/* the profile's list of event names to show or hide */
+		remember_event(new->name);
+		*evp = new;
+		evp = &new->next;
+	}
+}
+
+static void free_dc_contents(struct divecomputer *dc)
+{
+	struct event *ev = dc->events;
+
+	while (ev) {
+		struct event *next = ev->next;
+		free(ev);
+		ev = next;
+	}
+	free(dc->sample);
+	free((void *)dc->model);
+}
+
+/* clear_dive() takes care of the rest */
+static void free_snapshot_dive(struct dive *dive)
+{
+	int i;
+
+	for (i = 0; i < MAX_CYLINDERS; i++)
+		free((void *)dive->cylinder[i].type.description);
+	for (i = 0; i < MAX_WEIGHTSYSTEMS; i++)
+		free((void *)dive->weightsystem[i].description);
+	free_dc_contents(&dive->dc);
+	clear_dive(dive);
+	free(dive);
+}
+
+static struct dive *read_dive(struct snapshot_reader *r)
+{
+	struct dive *dive = alloc_dive();
+	struct divecomputer *dc = NULL;
+	struct picture **picp = &dive->picture_list;
+	uint32_t nr;
+	int i;
+
+	dive->number = get_u32(r);
+	dive->tripflag = get_u32(r);
+	dive->downloaded = get_u32(r);
+	dive->when = get_u64(r);
+	dive->location = get_str(r);
+	dive->notes = get_str(r);
+	dive->divemaster = get_str(r);
+	dive->buddy = get_str(r);
+	dive->rating = get_u32(r);
+	dive->latitude.udeg = get_u32(r);
+	dive->longitude.udeg = get_u32(r);
+	dive->visibility = get_u32(r);
+	for (i = 0; i < MAX_CYLINDERS; i++)
+		read_cylinder(r, dive->cylinder + i);
+	for (i = 0; i < MAX_WEIGHTSYSTEMS; i++) {
+		dive->weightsystem[i].weight.grams = get_u32(r);
+		dive->weightsystem[i].description = get_str(r);
+	}
+	dive->suit = get_str(r);
+	dive->sac = get_u32(r);
+	dive->otu = get_u32(r);
+	dive->cns = get_u32(r);
+	dive->maxcns = get_u32(r);
+	dive->mintemp.mkelvin = get_u32(r);
+	dive->maxtemp.mkelvin = get_u32(r);
+	dive->watertemp.mkelvin = get_u32(r);
+	dive->airtemp.mkelvin = get_u32(r);
+	dive->maxdepth.mm = get_u32(r);
+	dive->meandepth.mm = get_u32(r);
+	dive->surface_pressure.mbar = get_u32(r);
+	dive->duration.seconds = get_u32(r);
+	dive->salinity = get_u32(r);
+
+	nr = get_count(r);
+	while (nr-- && !r->failed) {
+		char *tag = get_str(r);
+		if (tag)
+			taglist_add_tag(&dive->tag_list, tag);
+		free(tag);
+	}
+
+	nr = get_count(r);
+	while (nr-- && !r->failed) {
+		if (!dc) {
+			dc = &dive->dc;
+		} else {
+			dc->next = calloc(1, sizeof(*dc));
+			if (!dc->next)
+				exit(1);
+			dc = dc->next;
+		}
+		read_dc(r, dc);
+	}
+
+	nr = get_count(r);
+	while (nr-- && !r->failed) {
+		struct picture *pic = alloc_picture();
+
+		pic->filename = get_str(r);
+		pic->offset.seconds = get_u32(r);
+		pic->latitude.udeg = get_u32(r);
+		pic->longitude.udeg = get_u32(r);
+		*picp = pic;
+		picp = &pic->next;
+	}
+	return dive;
+}
+
+static dive_trip_t *read_trip(struct snapshot_reader *r, struct dive_table *table, bool *listed)
+{
+	dive_trip_t *trip = calloc(1, sizeof(*trip));
+	uint32_t flags, nr, i, *idx;
+	timestamp_t when;
+
+	if (!trip)
+		exit(1);
+	trip->when = when = get_u64(r);
+	trip->location = get_str(r);
+	trip->notes = get_str(r);
+	flags = get_u32(r);
+	trip->expanded = flags & 1;
+	trip->selected = (flags >> 1) & 1;
+	trip->autogen = (flags >> 2) & 1;
+	trip->fixup = (flags >> 3) & 1;
+	*listed = flags & TRIP_LISTED;
+
+	nr = get_count(r);
+	idx = malloc(nr * sizeof(*idx) + 1);
+	if (!idx)
+		exit(1);
+	for (i = 0; i < nr; i++) {
+		idx[i] = get_u32(r);
+		if (idx[i] >= (uint32_t)table->nr || table->dives[idx[i]]->divetrip)
+			r->failed = true;
+	}
+	if (nr && !trip->when)
+		r->failed = true;
+
+	/* add_dive_to_trip() puts each dive at the front of the list */
+	while (nr-- && !r->failed) {
+		struct dive *dive = table->dives[idx[nr]];
+		tripflag_t tripflag = dive->tripflag;
+
+		add_dive_to_trip(dive, trip);
+		dive->tripflag = tripflag;
+	}
+	free(idx);
+	trip->when = when;
+	return trip;
+}
+
+static int read_snapshot(struct snapshot_reader *r)
+{
+	struct dive_table table = { 0 };
+	dive_trip_t **trips, **tripp = &dive_trip_list;
+	bool *listed;
+	struct snapshot_reader settings = *r;
+	uint32_t nr, trips_nr = 0, i;
+	int ret = 0;
+
+	read_settings(r, false);
+	nr = get_count(r);
+	table.dives = malloc(nr * sizeof(struct dive *) + 1);
+	if (!table.dives)
+		exit(1);
+	table.allocated = nr;
+	while (table.nr < (int)nr && !r->failed)
+		table.dives[table.nr++] = read_dive(r);
+
+	nr = get_count(r);
+	trips = malloc(nr * sizeof(*trips) + 1);
+	listed = malloc(nr * sizeof(*listed) + 1);
+	if (!trips || !listed)
+		exit(1);
+	while (trips_nr < nr && !r->failed) {
+		trips[trips_nr] = read_trip(r, &table, listed + trips_nr);
+		trips_nr++;
+	}
+
+	if (r->failed || r->pos != r->end) {
+		for (i = 0; i < (uint32_t)table.nr; i++) {
+			table.dives[i]->divetrip = NULL;
+			free_snapshot_dive(table.dives[i]);
+		}
+		for (i = 0; i < trips_nr; i++) {
+			free(trips[i]->location);
+			free(trips[i]->notes);
+			free(trips[i]);
+		}
+		ret = -1;
+	} else {
+		/* the session was empty, so everything goes in just like it was */
+		read_settings(&settings, true);
+		for (i = 0; i < trips_nr; i++) {
+			if (listed[i]) {
+				*tripp = trips[i];
+				tripp = &trips[i]->next;
+			}
+		}
+		for (i = 0; i < (uint32_t)table.nr; i++)
+			add_dive_to_table(table.dives[i], &dive_table);
+	}
+	free(table.dives);
+	free(trips);
+	free(listed);
+	return ret;
+}
+
+/*
+ * Load the dives from a snapshot into an empty session. Returns zero if
+ * we did, or a negative value if the snapshot is missing, doesn't match
+ * key, or is damaged - in which case nothing was changed.
+ */
+int load_dive_snapshot(const char *filename, const char *key)
+{
+	struct memblock mem;
+	struct snapshot_header header;
+	struct snapshot_reader r;
+	unsigned char sha1[20];
+	int ret = -1;
+
+	if (dive_table.nr || dive_trip_list)
+		return -1;
+	if (mapfile(filename, &mem) < (int)sizeof(header)) {
+		unmapfile(&mem);
+		return -1;
+	}
+	memcpy(&header, mem.buffer, sizeof(header));
+	if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) ||
+	    header.version != SNAPSHOT_VERSION ||
+	    header.byteorder != SNAPSHOT_BYTEORDER ||
+	    header.sample_size != sizeof(struct sample) ||
+	    header.length != mem.size - sizeof(header) ||
+	    strncmp(header.key, key, sizeof(header.key)))
+		goto out;
+
+	r.pos = (const char *)mem.buffer + sizeof(header);
+	r.end = r.pos + header.length;
+	r.failed = false;
+	SHA1(r.pos, header.length, sha1);
+	if (memcmp(sha1, header.sha1, sizeof(sha1)))
+		goto out;
+	ret = read_snapshot(&r);
+out:
+	if (ret && verbose)
+		fprintf(stderr, "Ignoring snapshot %s\n", filename);
+	unmapfile(&mem);
+	return ret;
+}
@@ -49,6 +49,7 @@ static void process_dive(struct dive *dp, stats_t *stats)
 	int old_tt, sac_time = 0;
 	int duration = dp->duration.seconds;
 
+	update_dive_metrics(dp);
 	old_tt = stats->total_time.seconds;
 	stats->total_time.seconds += duration;
 	if (duration > stats->longest_time.seconds)
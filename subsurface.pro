@@ -43,6 +43,7 @@ HEADERS = \
 	qthelper.h \
 	units.h \
 	divecomputer.h \
+	divesearch.h \
 	qt-ui/about.h \
 	qt-ui/completionmodels.h \
 	qt-ui/divecomputermanagementdialog.h \
@@ -126,8 +127,10 @@ SOURCES =  \
 	profile.c \
 	gaspressures.c \
 	divecomputer.cpp \
+	divesearch.cpp \
 	worldmap-save.c \
 	save-html.c \
+	snapshot.c \
 	qt-gui.cpp \
 	qthelper.cpp \
 	qt-ui/about.cpp \
@@ -28,6 +28,7 @@ struct preferences default_prefs = {
 	.gflow = 30,
 	.gfhigh = 75,
 	.animation_speed = 500,
+	.profile_cache_size = 32,
 	.gf_low_at_maxdepth = false,
 	.font_size = -1,
 	.display_invalid_dives = false,
@@ -71,7 +72,21 @@ static int sortfn(const void *_a, const void *_b)
 
 void sort_table(struct dive_table *table)
 {
-	qsort(table->dives, table->nr, sizeof(struct dive *), sortfn);
+	int i;
+
+	/* usually nothing moves, and then the dive id index stays valid */
+	for (i = 1; i < table->nr; i++) {
+		if (sortfn(table->dives + i - 1, table->dives + i) > 0)
+			break;
+	}
+	if (i < table->nr) {
+		qsort(table->dives, table->nr, sizeof(struct dive *), sortfn);
+		if (table == &dive_table)
+			invalidate_dive_indexes();
+	}
+	/* dives get sorted after their start or duration was edited */
+	if (table == &dive_table)
+		invalidate_dive_time_index();
 }
 
 const char *weekday(int wday)
@@ -0,0 +1,266 @@
+#include "testdeco.h"
+#include "dive.h"
+#include "divelist.h"
+#include "deco.h"
+#include <QElapsedTimer>
+
+static struct gasmix air = { { 209 }, { 0 } };
+static struct gasmix tx18_45 = { { 180 }, { 450 } };
+static struct gasmix tx21_35 = { { 210 }, { 350 } };
+
+void TestDeco::testCeilings()
+{
+	struct deco_state ds;
+	struct dive dive;
+	double tolerance = 0.0;
+	int i;
+
+	memset(&dive, 0, sizeof(dive));
+	set_gf(30, 75, false);
+
+	// 30 minutes at 40m on air, in one minute steps
+	clear_deco(&ds, 1.013);
+	for (i = 0; i < 30; i++)
+		tolerance = add_segment(&ds, depth_to_mbar(40000, &dive) / 1000.0, &air, 60, 0, &dive);
+	QCOMPARE(IS_FP_SAME(tolerance, 2.9783188098557374), true);
+	QCOMPARE(deco_allowed_depth(tolerance, 1.013, &dive, true), 19450u);
+	QCOMPARE(deco_allowed_depth(tolerance, 1.013, &dive, false), 21000u);
+
+	// 25 minutes at 60m on trimix 18/45, in one second steps
+	clear_deco(&ds, 1.013);
+	for (i = 0; i < 25 * 60; i++)
+		tolerance = add_segment(&ds, depth_to_mbar(60000, &dive) / 1000.0, &tx18_45, 1, 0, &dive);
+	QCOMPARE(IS_FP_SAME(tolerance, 4.3662320773932795), true);
+	QCOMPARE(deco_allowed_depth(tolerance, 1.013, &dive, true), 33180u);
+	QCOMPARE(deco_allowed_depth(tolerance, 1.013, &dive, false), 36000u);
+	QCOMPARE(ds.ci_pointing_to_guiding_tissue, 1);
+}
+
+void TestDeco::testRamp()
+{
+	struct deco_state stepped, ramp;
+	struct dive dive;
+	int i, ci;
+
+	memset(&dive, 0, sizeof(dive));
+	set_gf(30, 75, false);
+
+	// descend from the surface to 60m in 3 minutes; one second steps at
+	// the mid point of each second approximate the exact solution closely
+	clear_deco(&stepped, 1.013);
+	ramp = stepped;
+	for (i = 0; i < 180; i++)
+		add_segment(&stepped, 1.013 + 6.0 * (i + 0.5) / 180, &tx18_45, 1, 0, &dive);
+	add_segment_ramp(&ramp, 1.013, 7.013, &tx18_45, 180, 0, &dive);
+	for (ci = 0; ci < 16; ci++) {
+		QVERIFY(fabs(stepped.tissue_n2_sat[ci] - ramp.tissue_n2_sat[ci]) < 0.0001);
+		QVERIFY(fabs(stepped.tissue_he_sat[ci] - ramp.tissue_he_sat[ci]) < 0.0001);
+	}
+
+	// a ramp without depth change is the same as a constant depth segment
+	stepped = ramp;
+	add_segment(&stepped, 7.013, &tx18_45, 120, 0, &dive);
+	add_segment_ramp(&ramp, 7.013, 7.013, &tx18_45, 120, 0, &dive);
+	QCOMPARE(memcmp(stepped.tissue_n2_sat, ramp.tissue_n2_sat, sizeof(ramp.tissue_n2_sat)), 0);
+	QCOMPARE(memcmp(stepped.tissue_he_sat, ramp.tissue_he_sat, sizeof(ramp.tissue_he_sat)), 0);
+}
+
+// add steps until a ceiling appears, the way the profile used to (in one minute steps)
+static int stepped_ndl(struct deco_state ds, double pressure, struct gasmix *gasmix, struct dive *dive, int step)
+{
+	double tolerance = ds.tissue_tolerance;
+	int t = 0;
+
+	while (t < 7200 && deco_allowed_depth(tolerance, 1.013, dive, true) == 0) {
+		tolerance = add_segment(&ds, pressure, gasmix, step, 0, dive);
+		t += step;
+	}
+	return t;
+}
+
+void TestDeco::testNdl()
+{
+	struct deco_state ds;
+	struct dive dive;
+	double pressure;
+	int i;
+
+	memset(&dive, 0, sizeof(dive));
+	set_gf(30, 75, false);
+
+	// fresh tissues at 30m and 18m on air
+	clear_deco(&ds, 1.013);
+	pressure = depth_to_mbar(30000, &dive) / 1000.0;
+	QCOMPARE(deco_ndl(&ds, pressure, &air, 0, &dive, 1.013, 7200), (double)stepped_ndl(ds, pressure, &air, &dive, 1));
+	pressure = depth_to_mbar(18000, &dive) / 1000.0;
+	QCOMPARE(deco_ndl(&ds, pressure, &air, 0, &dive, 1.013, 7200), (double)stepped_ndl(ds, pressure, &air, &dive, 1));
+
+	// trimix, where a and b change with the N2/He ratio
+	for (i = 0; i < 120; i++)
+		add_segment(&ds, depth_to_mbar(50000, &dive) / 1000.0, &tx21_35, 1, 0, &dive);
+	pressure = depth_to_mbar(50000, &dive) / 1000.0;
+	QCOMPARE(deco_ndl(&ds, pressure, &tx21_35, 0, &dive, 1.013, 7200), (double)stepped_ndl(ds, pressure, &tx21_35, &dive, 1));
+
+	// shallow enough to never go into deco, and already in deco
+	clear_deco(&ds, 1.013);
+	QCOMPARE(deco_ndl(&ds, depth_to_mbar(6000, &dive) / 1000.0, &air, 0, &dive, 1.013, 7200), 7200.0);
+	for (i = 0; i < 30; i++)
+		add_segment(&ds, depth_to_mbar(40000, &dive) / 1000.0, &air, 60, 0, &dive);
+	QCOMPARE(deco_ndl(&ds, depth_to_mbar(40000, &dive) / 1000.0, &air, 0, &dive, 1.013, 7200), 0.0);
+}
+
+// the NDL has to be what stepping gives, with gf_low in play as well
+void TestDeco::testNdlGradientFactors()
+{
+	static const int gradient_factors[][2] = { { 30, 75 }, { 30, 100 }, { 50, 80 }, { 20, 90 }, { 85, 85 }, { 100, 100 } };
+	static const int depths[] = { 12000, 18000, 25000, 30000, 40000, 50000 };
+	struct gasmix ean32 = { { 320 }, { 0 } };
+	struct gasmix *gases[] = { &air, &ean32, &tx21_35 };
+	struct deco_state ds;
+	struct dive dive;
+	unsigned int gf, gas, depth;
+	int maxdepth;
+
+	memset(&dive, 0, sizeof(dive));
+	for (maxdepth = 0; maxdepth < 2; maxdepth++) {
+		for (gf = 0; gf < sizeof(gradient_factors) / sizeof(gradient_factors[0]); gf++) {
+			set_gf(gradient_factors[gf][0], gradient_factors[gf][1], maxdepth);
+			for (gas = 0; gas < sizeof(gases) / sizeof(gases[0]); gas++) {
+				for (depth = 0; depth < sizeof(depths) / sizeof(depths[0]); depth++) {
+					double pressure = depth_to_mbar(depths[depth], &dive) / 1000.0;
+					double ndl;
+					int minutes;
+
+					// descend, with some trimix loading from an earlier dive every other time
+					clear_deco(&ds, 1.013);
+					if (depth & 1) {
+						add_segment(&ds, 5.0, &tx21_35, 1200, 0, &dive);
+						add_segment(&ds, 1.013, &air, 2400, 0, &dive);
+					}
+					add_segment_ramp(&ds, 1.013, pressure, gases[gas], 120, 0, &dive);
+					add_segment(&ds, pressure, gases[gas], 120, 0, &dive);
+					if (deco_allowed_depth(ds.tissue_tolerance, 1.013, &dive, true))
+						continue;
+
+					ndl = deco_ndl(&ds, pressure, gases[gas], 0, &dive, 1.013, 7200);
+					QCOMPARE(ndl, (double)stepped_ndl(ds, pressure, gases[gas], &dive, 1));
+					// the old one minute steps rounded up
+					minutes = stepped_ndl(ds, pressure, gases[gas], &dive, 60);
+					QVERIFY(ndl <= minutes && ndl > minutes - 60);
+				}
+			}
+		}
+	}
+	set_gf(30, 75, false);
+}
+
+static struct dive *add_deco_dive(timestamp_t when, int depth, int minutes, int surface_pressure, dive_trip_t **trip)
+{
+	struct dive *dive = alloc_dive();
+	int times[] = { 0, 120, minutes * 60 - 300, minutes * 60 };
+	int depths[] = { 0, depth, depth, 0 };
+	int i;
+
+	dive->when = when;
+	dive->surface_pressure.mbar = surface_pressure;
+	for (i = 0; i < 4; i++) {
+		struct sample *sample = prepare_sample(&dive->dc);
+		sample->time.seconds = times[i];
+		sample->depth.mm = depths[i];
+		finish_sample(&dive->dc);
+	}
+	record_dive(dive);
+	if (*trip)
+		add_dive_to_trip(dive, *trip);
+	else
+		*trip = create_and_hookup_trip_from_dive(dive);
+	return dive;
+}
+
+static void forget_deco_snapshots()
+{
+	struct dive *dive;
+	int i;
+
+	for_each_dive (i, dive) {
+		free(dive->deco_snapshot);
+		dive->deco_snapshot = NULL;
+	}
+}
+
+static bool same_tissues(const struct deco_state *a, double a_tolerance, const struct deco_state *b, double b_tolerance)
+{
+	return !memcmp(a->tissue_n2_sat, b->tissue_n2_sat, sizeof(a->tissue_n2_sat)) &&
+	       !memcmp(a->tissue_he_sat, b->tissue_he_sat, sizeof(a->tissue_he_sat)) &&
+	       a_tolerance == b_tolerance;
+}
+
+// two dives at different surface pressures share the tissue snapshots of the dives before them
+void TestDeco::testRepetitiveDives()
+{
+	dive_trip_t *trip = NULL;
+	struct dive *a, *b, *c;
+	struct deco_state ds, ref_b, ref_c;
+	double tolerance, ref_b_tolerance, ref_c_tolerance;
+	uint32_t key;
+
+	while (dive_table.nr)
+		delete_single_dive(0);
+	set_gf(30, 75, false);
+	a = add_deco_dive(1400000000, 30000, 40, 1013, &trip);
+	b = add_deco_dive(1400000000 + 3 * 3600, 25000, 45, 1013, &trip);
+	c = add_deco_dive(1400000000 + 6 * 3600, 20000, 50, 850, &trip);
+
+	// without any snapshots
+	ref_b_tolerance = init_decompression(&ref_b, b);
+	forget_deco_snapshots();
+	ref_c_tolerance = init_decompression(&ref_c, c);
+	forget_deco_snapshots();
+
+	tolerance = init_decompression(&ds, b);
+	QVERIFY(same_tissues(&ds, tolerance, &ref_b, ref_b_tolerance));
+	QVERIFY(a->deco_snapshot != NULL);
+	key = a->deco_snapshot->key;
+	tolerance = init_decompression(&ds, c);
+	QVERIFY(same_tissues(&ds, tolerance, &ref_c, ref_c_tolerance));
+	QCOMPARE(a->deco_snapshot->key, key);
+	tolerance = init_decompression(&ds, b);
+	QVERIFY(same_tissues(&ds, tolerance, &ref_b, ref_b_tolerance));
+	QCOMPARE(a->deco_snapshot->key, key);
+	tolerance = init_decompression(&ds, c);
+	QVERIFY(same_tissues(&ds, tolerance, &ref_c, ref_c_tolerance));
+
+	// both really come from the snapshots: damage them and the results change
+	a->deco_snapshot->ds.tissue_n2_sat[0] += 0.1;
+	b->deco_snapshot->ds.tissue_n2_sat[0] += 0.1;
+	tolerance = init_decompression(&ds, b);
+	QVERIFY(!same_tissues(&ds, tolerance, &ref_b, ref_b_tolerance));
+	tolerance = init_decompression(&ds, c);
+	QVERIFY(!same_tissues(&ds, tolerance, &ref_c, ref_c_tolerance));
+
+	while (dive_table.nr)
+		delete_single_dive(0);
+}
+
+void TestDeco::benchmarkAddSegment()
+{
+	struct deco_state ds;
+	struct dive dive;
+	const int calls = 1000000;
+	double tolerance = 0.0;
+	QElapsedTimer timer;
+	int i;
+
+	memset(&dive, 0, sizeof(dive));
+	set_gf(30, 75, false);
+	clear_deco(&ds, 1.013);
+	timer.start();
+	// alternate step sizes and depths like the planner does
+	for (i = 0; i < calls; i++)
+		tolerance = add_segment(&ds, 1.0 + (i % 600) / 100.0, &tx18_45, (i & 1) ? 3 : 60, 0, &dive);
+	qint64 elapsed = qMax(timer.elapsed(), (qint64)1);
+	qDebug() << "add_segment:" << (calls * 1000.0 / elapsed) << "calls per second";
+	QVERIFY(tolerance > 0.0);
+}
+
+QTEST_MAIN(TestDeco)
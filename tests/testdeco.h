@@ -0,0 +1,17 @@
+#ifndef TESTDECO_H
+#define TESTDECO_H
+
+#include <QtTest>
+
+class TestDeco : public QObject{
+	Q_OBJECT
+private slots:
+	void testCeilings();
+	void testRamp();
+	void testNdl();
+	void testNdlGradientFactors();
+	void testRepetitiveDives();
+	void benchmarkAddSegment();
+};
+
+#endif
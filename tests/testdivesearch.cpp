@@ -0,0 +1,113 @@
+#include "testdivesearch.h"
+#include "dive.h"
+#include "divelist.h"
+#include "divesearch.h"
+#include <QElapsedTimer>
+
+static struct dive *add_test_dive(const char *location, const char *buddy, const char *tag)
+{
+	struct dive *dive = alloc_dive();
+
+	dive->when = 1400000000 + dive_table.nr * 3600;
+	dive->location = location ? strdup(location) : NULL;
+	dive->buddy = buddy ? strdup(buddy) : NULL;
+	if (tag)
+		taglist_add_tag(&dive->tag_list, tag);
+	record_dive(dive);
+	return dive;
+}
+
+static void clear_dives()
+{
+	while (dive_table.nr)
+		delete_single_dive(0);
+}
+
+void TestDiveSearch::testTokenize()
+{
+	QStringList tokens = DiveSearchIndex::tokenize("Blue Hole, Dahab (Egypt)  2nd-dive");
+	QCOMPARE(tokens, QStringList() << "blue" << "hole" << "dahab" << "egypt" << "2nd" << "dive");
+	QCOMPARE(DiveSearchIndex::tokenize(" ,; ").count(), 0);
+}
+
+void TestDiveSearch::testSearch()
+{
+	DiveSearchIndex index;
+	struct dive *a, *b, *c;
+
+	clear_dives();
+	a = add_test_dive("Blue Hole, Dahab", "Anna", "cave");
+	b = add_test_dive("Canyon, Dahab", "Bernd", NULL);
+	c = add_test_dive("Thistlegorm", "anna", "wreckage");
+	index.sync();
+
+	QCOMPARE(index.search("dahab"), QSet<int>() << a->id << b->id);
+	QCOMPARE(index.search("DAH"), QSet<int>() << a->id << b->id);
+	QCOMPARE(index.search("anna"), QSet<int>() << a->id << c->id);
+	QCOMPARE(index.search("anna dahab"), QSet<int>() << a->id);
+	QCOMPARE(index.search("wreck"), QSet<int>() << c->id);
+	QCOMPARE(index.search("hole canyon").isEmpty(), true);
+	QCOMPARE(index.search("ole").isEmpty(), true);
+	clear_dives();
+}
+
+void TestDiveSearch::testUpdate()
+{
+	DiveSearchIndex index;
+	struct dive *a, *b;
+	unsigned int generation;
+
+	clear_dives();
+	a = add_test_dive("Blue Hole", NULL, NULL);
+	b = add_test_dive("Canyon", NULL, NULL);
+	index.sync();
+
+	generation = index.generation();
+	index.sync();
+	QCOMPARE(index.generation(), generation);
+
+	free(a->location);
+	a->location = strdup("Bells");
+	index.updateDive(a);
+	QVERIFY(index.generation() != generation);
+	QCOMPARE(index.search("hole").isEmpty(), true);
+	QCOMPARE(index.search("bel"), QSet<int>() << a->id);
+
+	int id = b->id;
+	delete_single_dive(get_divenr(b));
+	index.sync();
+	QCOMPARE(index.search("canyon").isEmpty(), true);
+	index.removeDive(id);
+	clear_dives();
+}
+
+void TestDiveSearch::benchmarkSearch()
+{
+	static const char *places[] = { "Blue Hole", "Canyon", "Thistlegorm", "Shark Reef", "Yolanda", "Ras Mohammed", "Abu Nuhas", "Elphinstone" };
+	static const char *buddies[] = { "Anna", "Bernd", "Carla", "Dirk", "Eva" };
+	DiveSearchIndex index;
+	QElapsedTimer timer;
+	QSet<int> result;
+	const int queries = 1000;
+	int i;
+
+	clear_dives();
+	for (i = 0; i < 10000; i++) {
+		char location[64];
+		snprintf(location, sizeof(location), "%s %d", places[i % 8], i);
+		add_test_dive(location, buddies[i % 5], (i % 3) ? "boat" : "shore");
+	}
+	timer.start();
+	index.sync();
+	qDebug() << "indexing 10000 dives:" << timer.elapsed() << "ms";
+
+	timer.restart();
+	for (i = 0; i < queries; i++)
+		result = index.search("sha anna");
+	qint64 elapsed = qMax(timer.elapsed(), (qint64)1);
+	qDebug() << "search:" << (elapsed * 1000.0 / queries) << "us per query";
+	QCOMPARE(result.count(), 250);
+	clear_dives();
+}
+
+QTEST_MAIN(TestDiveSearch)
@@ -0,0 +1,15 @@
+#ifndef TESTDIVESEARCH_H
+#define TESTDIVESEARCH_H
+
+#include <QtTest>
+
+class TestDiveSearch : public QObject{
+	Q_OBJECT
+private slots:
+	void testTokenize();
+	void testSearch();
+	void testUpdate();
+	void benchmarkSearch();
+};
+
+#endif
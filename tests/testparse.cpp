@@ -0,0 +1,494 @@
+#include "testparse.h"
+#include "dive.h"
+#include "divelist.h"
+#include "file.h"
+#include "membuffer.h"
+#include "device.h"
+#include "divecomputer.h"
+#include "profile.h"
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QTemporaryFile>
+#include <sqlite3.h>
+#include <git2.h>
+
+#define NR_DIVES 2000
+#define NR_SAMPLES 20
+
+// every other group of ten dives is in a trip
+static bool in_trip(int i)
+{
+	return (i / 10) % 2 == 0;
+}
+
+static QByteArray big_logbook()
+{
+	QByteArray xml("<divelog program='subsurface' version='3'>\n<settings>\n"
+		       "<divecomputerid model='Test' deviceid='12345678' nickname='Test computer' />\n"
+		       "<autogroup state='1' />\n</settings>\n<dives>\n");
+
+	for (int i = 0; i < NR_DIVES; i++) {
+		QDateTime when = QDateTime::fromTime_t(1400000000 + i * 7200).toUTC();
+		QString date = when.toString("yyyy-MM-dd"), time = when.toString("hh:mm:ss");
+
+		if (in_trip(i) && i % 10 == 0)
+			xml += QString("<trip date='%1' time='%2' location='Trip %3'>\n").arg(date, time).arg(i / 10).toUtf8();
+		xml += QString("<dive number='%1' tags='tag%2' date='%3' time='%4' duration='30:00 min'>\n")
+			       .arg(i + 1).arg(i % 7).arg(date, time).toUtf8();
+		xml += QString("  <location gps='%1.500000 %2.250000'>Site %1</location>\n").arg(i % 50).arg(i % 100).toUtf8();
+		xml += QString("  <notes>Dive %1</notes>\n").arg(i + 1).toUtf8();
+		xml += QString("  <cylinder size='12.0 l' workpressure='232.0 bar' description='D12' o2='%1.0%' start='200.0 bar' end='%2.0 bar' />\n")
+			       .arg(21 + i % 12).arg(50 + i % 100).toUtf8();
+		xml += QString("  <weightsystem weight='%1.0 kg' description='belt' />\n").arg(4 + i % 5).toUtf8();
+		if (i % 5 == 0)
+			xml += QString("  <picture filename='/pictures/dive%1.jpg' offset='+%2:00 min' gps='%3.500000 %4.250000' />\n")
+				       .arg(i + 1).arg(i % NR_SAMPLES).arg(i % 50).arg(i % 100).toUtf8();
+		xml += "  <!-- not a <dive> -->\n  <divecomputer model='Test'>\n";
+		xml += QString("  <event time='%1:00 min' type='8' name='bookmark' />\n").arg(i % NR_SAMPLES).toUtf8();
+		for (int j = 0; j < NR_SAMPLES; j++)
+			xml += QString("  <sample time='%1:00 min' depth='%2 m' />\n").arg(j).arg(j < NR_SAMPLES / 2 ? j + 1 : NR_SAMPLES - j).toUtf8();
+		xml += "  </divecomputer>\n";
+		if (i % 3 == 0) {
+			xml += "  <divecomputer model='Test 2' deviceid='87654321'>\n";
+			xml += QString("  <event time='%1:00 min' type='25' name='gaschange' value='%2' />\n").arg(i % NR_SAMPLES).arg(21 + i % 12).toUtf8();
+			for (int j = 0; j < NR_SAMPLES; j++)
+				xml += QString("  <sample time='%1:10 min' depth='%2.5 m' />\n").arg(j).arg(j < NR_SAMPLES / 2 ? j + 1 : NR_SAMPLES - j).toUtf8();
+			xml += "  </divecomputer>\n";
+		}
+		xml += "</dive>\n";
+		if (in_trip(i) && i % 10 == 9)
+			xml += "</trip>\n";
+	}
+	xml += "</dives>\n</divelog>\n";
+	return xml;
+}
+
+static QByteArray saved_dives()
+{
+	struct membuffer b = { 0 };
+
+	save_dives_buffer(&b, false);
+	QByteArray xml(b.buffer, b.len);
+	free_buffer(&b);
+	return xml;
+}
+
+// a big file is parsed in pieces on several threads; we must get the same dives
+void TestParse::testParseChunks()
+{
+	QByteArray xml = big_logbook();
+	struct dive *dive;
+	dive_trip_t *trip;
+	int i, trips = 0;
+
+	QVERIFY(xml.size() > 1024 * 1024);
+	while (dive_table.nr)
+		delete_single_dive(0);
+	parse_xml_buffer("big.xml", xml.constData(), xml.size(), &dive_table, NULL);
+	QCOMPARE(dive_table.nr, NR_DIVES);
+	sort_table(&dive_table);
+
+	for_each_dive (i, dive) {
+		QCOMPARE(dive->number, i + 1);
+		QCOMPARE(dive->when, (timestamp_t)1400000000 + i * 7200);
+		QCOMPARE(dive->dc.samples, NR_SAMPLES);
+		QCOMPARE(dive->dc.maxdepth.mm, NR_SAMPLES / 2 * 1000);
+		QCOMPARE(QString(dive->location), QString("Site %1").arg(i % 50));
+		QCOMPARE(dive->longitude.udeg, (i % 100) * 1000000 + 250000);
+		QVERIFY(dive->dc.events && !dive->dc.events->next);
+		QCOMPARE(dive->dc.events->time.seconds, i % NR_SAMPLES * 60);
+		QVERIFY(dive->tag_list && !dive->tag_list->next);
+		QCOMPARE(QString(dive->tag_list->tag->name), QString("tag%1").arg(i % 7));
+		QCOMPARE(dive->divetrip != NULL, in_trip(i));
+		if (dive->divetrip)
+			QCOMPARE(QString(dive->divetrip->location), QString("Trip %1").arg(i / 10));
+	}
+	for (trip = dive_trip_list; trip; trip = trip->next) {
+		QCOMPARE(trip->nrdives, 10);
+		trips++;
+	}
+	QCOMPARE(trips, NR_DIVES / 20);
+}
+
+// parsing the pieces of a big file on several threads must give what parsing it in one go gives
+void TestParse::testParseSerial()
+{
+	QByteArray xml = big_logbook(), serial;
+
+	while (dive_table.nr)
+		delete_single_dive(0);
+	parse_xml_mode = PARSE_XML_SERIAL;
+	parse_xml_buffer("big.xml", xml.constData(), xml.size(), &dive_table, NULL);
+	parse_xml_mode = PARSE_XML_ANY;
+	QCOMPARE(dive_table.nr, NR_DIVES);
+	serial = saved_dives();
+
+	while (dive_table.nr)
+		delete_single_dive(0);
+	parse_xml_buffer("big.xml", xml.constData(), xml.size(), &dive_table, NULL);
+	QCOMPARE(dive_table.nr, NR_DIVES);
+	QVERIFY(saved_dives() == serial);
+}
+
+static void remove_dir(const QString &path)
+{
+	QDir dir(path);
+
+	foreach (const QFileInfo &info, dir.entryInfoList(QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot)) {
+		if (info.isDir())
+			remove_dir(info.filePath());
+		else
+			dir.remove(info.fileName());
+	}
+	dir.rmdir(path);
+}
+
+// the git loader parses the dives of a tree on several threads; we must get what the XML gave us
+void TestParse::testParseGit()
+{
+	QByteArray xml = big_logbook(), saved;
+	QString path = QDir::tempPath() + QString("/testparse-git-%1").arg(QCoreApplication::applicationPid());
+	QByteArray name = (path + "[master]").toUtf8();
+	git_repository *repo;
+	git_config *config;
+
+	git_threads_init();
+	remove_dir(path);
+	QCOMPARE(git_repository_init(&repo, path.toUtf8().data(), true), 0);
+	QCOMPARE(git_repository_config(&config, repo), 0);
+	git_config_set_string(config, "user.name", "Subsurface test");
+	git_config_set_string(config, "user.email", "test@subsurface-divelog.org");
+	git_config_free(config);
+	git_repository_free(repo);
+
+	clear_session();
+	parse_xml_buffer("big.xml", xml.constData(), xml.size(), &dive_table, NULL);
+	QCOMPARE(dive_table.nr, NR_DIVES);
+	sort_table(&dive_table);
+	saved = saved_dives();
+	QCOMPARE(save_dives(name.data()), 0);
+
+	// many more dives than the loader hands to one task
+	clear_session();
+	QCOMPARE(parse_file(name.data()), 0);
+	QCOMPARE(dive_table.nr, NR_DIVES);
+	sort_table(&dive_table);
+	QVERIFY(saved_dives() == saved);
+
+	clear_session();
+	remove_dir(path);
+}
+
+// mapped or read, the parsers get the whole file followed by a NUL
+void TestParse::testMapFile()
+{
+	QByteArray contents[] = { QByteArray(100, 'a'), QByteArray(4096, 'b'), QByteArray(3 * 4096 + 1, 'c') };
+	struct memblock mem;
+
+	for (unsigned int i = 0; i < sizeof(contents) / sizeof(contents[0]); i++) {
+		QTemporaryFile file;
+		QVERIFY(file.open());
+		file.write(contents[i]);
+		file.close();
+		QCOMPARE(mapfile(file.fileName().toUtf8().data(), &mem), contents[i].size());
+		QCOMPARE((int)mem.size, contents[i].size());
+		QVERIFY(memcmp(mem.buffer, contents[i].constData(), mem.size) == 0);
+		QCOMPARE(((const char *)mem.buffer)[mem.size], '\0');
+		unmapfile(&mem);
+		QVERIFY(mem.buffer == NULL);
+	}
+	QVERIFY(mapfile("/nonexistent/file.xml", &mem) < 0);
+	QVERIFY(mem.buffer == NULL);
+}
+
+// only the last of several lines with the same time counts
+void TestParse::testParseCsv()
+{
+	QTemporaryFile file;
+	struct dive *dive;
+
+	while (dive_table.nr)
+		delete_single_dive(0);
+	QVERIFY(file.open());
+	file.write("Time;Depth;Temp;Pressure\r\n"
+		   "0;0;20;200\r\n"
+		   "10;1;19;199\r\n"
+		   "10;1,5;19;198\r\n"
+		   "0:20;3.5;18;197\r\n"
+		   "0:00:30;4;17;0\r\n");
+	file.close();
+	QCOMPARE(parse_csv_file(file.fileName().toUtf8().data(), 0, 1, 2, -1, -1, -1, -1, -1, 3, 2, "csv", 0), 0);
+	QCOMPARE(dive_table.nr, 1);
+	dive = get_dive(0);
+	QCOMPARE(dive->dc.samples, 4);
+	QCOMPARE(dive->dc.sample[1].time.seconds, 10);
+	QCOMPARE(dive->dc.sample[1].depth.mm, 1500);
+	QCOMPARE(dive->dc.sample[1].cylinderpressure.mbar, 198000);
+	QCOMPARE(dive->dc.sample[2].time.seconds, 20);
+	QCOMPARE(dive->dc.sample[2].temperature.mkelvin, (int)C_to_mkelvin(18));
+	QCOMPARE(dive->dc.sample[3].time.seconds, 30);
+	QCOMPARE(dive->dc.sample[3].cylinderpressure.mbar, 0);
+	QCOMPARE(dive->dc.maxdepth.mm, 4000);
+	QVERIFY(dcList.getExact("csv", 0xffffffff) != NULL);
+}
+
+void TestParse::testParseDM4()
+{
+	struct dive *dive;
+
+	while (dive_table.nr)
+		delete_single_dive(0);
+	QCOMPARE(parse_file("../dives/TestDiveDM4.db"), 0);
+	QCOMPARE(dive_table.nr, 1);
+	dive = get_dive(0);
+	QCOMPARE(dive->number, 1);
+	QCOMPARE(QString(dive->notes), QString("Notes are here"));
+	QCOMPARE(dive->dc.samples, 179);
+	QCOMPARE(dive->cylinder[0].gasmix.o2.permille, 330);
+	QCOMPARE(dive->dc.maxdepth.mm, 22440);
+}
+
+// the sample has no tags, and its one mark is past the end of the dive
+void TestParse::testParseDM4Marks()
+{
+	QTemporaryFile file(QDir::tempPath() + "/dm4XXXXXX.db");
+	QFile sample("../dives/TestDiveDM4.db");
+	QByteArray name;
+	struct dive *dive;
+	struct event *ev;
+	sqlite3 *handle;
+
+	QVERIFY(sample.open(QIODevice::ReadOnly));
+	QVERIFY(file.open());
+	file.write(sample.readAll());
+	file.close();
+	name = file.fileName().toUtf8();
+	QCOMPARE(sqlite3_open(name.data(), &handle), SQLITE_OK);
+	QCOMPARE(sqlite3_exec(handle, "insert into DiveTag values (1, 'wreck'); insert into DiveTag values (1, 'night');"
+				      "insert into Mark values (1, 600, 258, 120); insert into Mark values (1, 900, 3, NULL);",
+			      NULL, NULL, NULL), SQLITE_OK);
+	sqlite3_close(handle);
+
+	while (dive_table.nr)
+		delete_single_dive(0);
+	QCOMPARE(parse_file(name.data()), 0);
+	QCOMPARE(dive_table.nr, 1);
+	dive = get_dive(0);
+	QVERIFY(dive->tag_list && dive->tag_list->next && !dive->tag_list->next->next);
+	QCOMPARE(QString(dive->tag_list->tag->name), QString("night"));
+	QCOMPARE(QString(dive->tag_list->next->tag->name), QString("wreck"));
+	ev = dive->dc.events;
+	QVERIFY(ev && ev->next && !ev->next->next);
+	QCOMPARE(ev->time.seconds, 600);
+	QCOMPARE(QString(ev->name), QString("heading"));
+	QCOMPARE(ev->value, 120);
+	QCOMPARE(ev->next->time.seconds, 900);
+	QCOMPARE(QString(ev->next->name), QString("deco"));
+}
+
+// the records of both dives, and of one that isn't in dive_info, come from one scan
+void TestParse::testParseShearwater()
+{
+	struct dive *dive;
+	struct event *ev;
+
+	while (dive_table.nr)
+		delete_single_dive(0);
+	QCOMPARE(parse_file("../dives/TestDiveShearwater.db"), 0);
+	QCOMPARE(dive_table.nr, 2);
+
+	// open circuit, metric, with a deco gas
+	dive = get_dive(0);
+	QCOMPARE(dive->number, 1);
+	QCOMPARE(QString(dive->location), QString("Red Sea / Elphinstone"));
+	QCOMPARE(dive->dc.samples, 20);
+	QCOMPARE(dive->dc.maxdepth.mm, 30500);
+	QCOMPARE(dive->cylinder[0].gasmix.o2.permille, 320);
+	QCOMPARE(dive->cylinder[1].gasmix.o2.permille, 500);
+	ev = dive->dc.events;
+	QVERIFY(ev && ev->next && !ev->next->next);
+	QCOMPARE(QString(ev->name), QString("gaschange"));
+	QCOMPARE(ev->time.seconds, 0);
+	QCOMPARE(ev->value, 32);
+	QCOMPARE(ev->next->time.seconds, 600);
+	QCOMPARE(ev->next->value, 50);
+
+	// closed circuit, imperial, going to a richer diluent and back
+	dive = get_dive(1);
+	QCOMPARE(dive->number, 2);
+	QCOMPARE(dive->dc.dctype, CCR);
+	QCOMPARE(dive->dc.samples, 20);
+	QCOMPARE(dive->dc.sample[0].setpoint.mbar, 1300);
+	QCOMPARE(dive->dc.maxdepth.mm, (int)feet_to_mm(100));
+	QCOMPARE(dive->cylinder[0].gasmix.he.permille, 350);
+	QCOMPARE(dive->cylinder[1].gasmix.he.permille, 450);
+	ev = dive->dc.events;
+	QVERIFY(ev && ev->next && ev->next->next && !ev->next->next->next);
+	QCOMPARE(ev->time.seconds, 0);
+	QCOMPARE(ev->next->time.seconds, 480);
+	QCOMPARE(ev->next->next->time.seconds, 840);
+}
+
+// the streaming parser must read our sample files just like the DOM parser
+void TestParse::testParseStreaming()
+{
+	QDir dir("../dives");
+	QStringList files = dir.entryList(QStringList() << "*.xml");
+
+	QVERIFY(!files.isEmpty());
+	foreach (QString name, files) {
+		QByteArray path = dir.filePath(name).toUtf8(), xml;
+
+		while (dive_table.nr)
+			delete_single_dive(0);
+		parse_file(path.data());
+		xml = saved_dives();
+
+		while (dive_table.nr)
+			delete_single_dive(0);
+		parse_xml_mode = PARSE_XML_DOM;
+		parse_file(path.data());
+		parse_xml_mode = PARSE_XML_ANY;
+		QVERIFY2(saved_dives() == xml, path.data());
+	}
+	while (dive_table.nr)
+		delete_single_dive(0);
+}
+
+extern struct ev_select *ev_namelist;
+extern int evn_used;
+
+static void add_device(void *data, const char *model, uint32_t deviceid, const char *nickname, const char *serial, const char *firmware)
+{
+	QStringList *summary = (QStringList *)data;
+
+	summary->append(QString("%1 %2 %3 %4 %5").arg(QString(model)).arg(deviceid).arg(QString(nickname)).arg(QString(serial)).arg(QString(firmware)));
+}
+
+// what we want to get back from a snapshot
+static QStringList dive_summary()
+{
+	QStringList summary;
+	struct dive *dive;
+	struct divecomputer *dc;
+	struct event *ev;
+	struct picture *pic;
+	struct tag_entry *tag;
+	int i;
+
+	for_each_dive (i, dive) {
+		QString line = QString("%1 %2 %3 %4").arg(dive->number).arg(dive->when).arg(dive->dc.samples).arg(dive->maxdepth.mm);
+		for (int j = 0; j < dive->dc.samples; j++)
+			line += QString(" %1").arg(dive->dc.sample[j].depth.mm);
+		for (tag = dive->tag_list; tag; tag = tag->next)
+			line += " " + QString(tag->tag->name);
+		if (dive->divetrip)
+			line += QString(" %1 %2").arg(QString(dive->divetrip->location)).arg(dive->divetrip->nrdives);
+		line += QString(" %1 %2 %3 %4").arg(QString(dive->location)).arg(dive->latitude.udeg).arg(dive->longitude.udeg).arg(QString(dive->notes));
+		for (int j = 0; j < MAX_CYLINDERS; j++) {
+			cylinder_t *cyl = dive->cylinder + j;
+			line += QString(" %1 %2 %3 %4 %5 %6 %7").arg(QString(cyl->type.description)).arg(cyl->type.size.mliter).arg(cyl->type.workingpressure.mbar)
+				       .arg(cyl->gasmix.o2.permille).arg(cyl->gasmix.he.permille).arg(cyl->start.mbar).arg(cyl->end.mbar);
+		}
+		for (int j = 0; j < MAX_WEIGHTSYSTEMS; j++)
+			line += QString(" %1 %2").arg(QString(dive->weightsystem[j].description)).arg(dive->weightsystem[j].weight.grams);
+		for_each_dc (dive, dc) {
+			for (ev = dc->events; ev; ev = ev->next)
+				line += QString(" %1 %2 %3 %4").arg(ev->time.seconds).arg(ev->type).arg(ev->value).arg(QString(ev->name));
+		}
+		for (pic = dive->picture_list; pic; pic = pic->next)
+			line += QString(" %1 %2 %3 %4").arg(QString(pic->filename)).arg(pic->offset.seconds).arg(pic->latitude.udeg).arg(pic->longitude.udeg);
+		summary.append(line);
+	}
+
+	// the settings, and the event names the profile can show or hide
+	summary.append(QString("autogroup %1").arg(autogroup));
+	call_for_each_dc(&summary, add_device);
+	for (i = 0; i < evn_used; i++)
+		summary.append(ev_namelist[i].ev_name);
+	return summary;
+}
+
+// the settings and event names aren't cleared with the dives
+static void clear_session()
+{
+	while (dive_table.nr)
+		delete_single_dive(0);
+	clear_events();
+	set_autogroup(false);
+	dcList.dcMap.clear();
+}
+
+void TestParse::testSnapshot()
+{
+	QByteArray xml = big_logbook();
+	QTemporaryFile file;
+	QStringList summary;
+	QByteArray name;
+
+	QVERIFY(file.open());
+	file.close();
+	name = file.fileName().toUtf8();
+	clear_session();
+	parse_xml_buffer("big.xml", xml.constData(), xml.size(), &dive_table, NULL);
+	summary = dive_summary();
+	QCOMPARE(save_dive_snapshot(name.data(), "key"), 0);
+
+	// not while there are dives already
+	QVERIFY(load_dive_snapshot(name.data(), "key") < 0);
+	QCOMPARE(dive_table.nr, NR_DIVES);
+
+	clear_session();
+	QVERIFY(dive_trip_list == NULL);
+	QVERIFY(load_dive_snapshot(name.data(), "other key") < 0);
+	QCOMPARE(dive_table.nr, 0);
+	QCOMPARE(load_dive_snapshot(name.data(), "key"), 0);
+	QCOMPARE(dive_summary(), summary);
+
+	// a damaged snapshot is ignored
+	clear_session();
+	QVERIFY(file.open());
+	file.seek(file.size() / 2);
+	file.write("damage");
+	file.close();
+	QVERIFY(load_dive_snapshot(name.data(), "key") < 0);
+	QCOMPARE(dive_table.nr, 0);
+	QVERIFY(dive_trip_list == NULL);
+}
+
+// starting up with a big logbook, the first time and the next time
+void TestParse::benchmarkSnapshot()
+{
+	QTemporaryFile file(QDir::tempPath() + "/snapshotXXXXXX.xml");
+	QByteArray name;
+	QStringList summary;
+	QElapsedTimer timer;
+	qint64 elapsed;
+
+	QVERIFY(file.open());
+	file.write(big_logbook());
+	file.close();
+	name = file.fileName().toUtf8();
+	QFile::remove(file.fileName() + ".snapshot");
+	// a load that reported errors doesn't get a snapshot
+	get_error_string();
+
+	clear_session();
+	timer.start();
+	QCOMPARE(parse_file(name.data()), 0);
+	elapsed = timer.elapsed();
+	qDebug() << "loading the XML and writing the snapshot:" << elapsed << "ms";
+	QVERIFY(QFile::exists(file.fileName() + ".snapshot"));
+	summary = dive_summary();
+
+	clear_session();
+	timer.start();
+	QCOMPARE(parse_file(name.data()), 0);
+	elapsed = timer.elapsed();
+	qDebug() << "loading the snapshot:" << elapsed << "ms";
+	QCOMPARE(dive_summary(), summary);
+	QFile::remove(file.fileName() + ".snapshot");
+}
+
+QTEST_MAIN(TestParse)
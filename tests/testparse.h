@@ -0,0 +1,22 @@
+#ifndef TESTPARSE_H
+#define TESTPARSE_H
+
+#include <QtTest>
+
+class TestParse : public QObject{
+	Q_OBJECT
+private slots:
+	void testParseChunks();
+	void testParseSerial();
+	void testParseGit();
+	void testMapFile();
+	void testParseCsv();
+	void testParseDM4();
+	void testParseDM4Marks();
+	void testParseShearwater();
+	void testParseStreaming();
+	void testSnapshot();
+	void benchmarkSnapshot();
+};
+
+#endif
@@ -1,9 +1,96 @@
 #include "testprofile.h"
 #include "dive.h"
+#include "display.h"
+#include "profile.h"
+#include <QDir>
+#include <QFile>
+#include <QTextStream>
 
 void TestProfile::testRedCeiling()
 {
 	parse_file("../dives/deep.xml");
 }
 
-QTEST_MAIN(TestProfile)
\ No newline at end of file
+// the straightforward way of finding the min/max/avg depth around an entry
+static void check_minmax(struct plot_info *pi, int i, int index)
+{
+	struct plot_data *entry = pi->entry + i;
+	int seconds = 90 * (index + 1);
+	struct plot_data *min, *max, *p;
+	int first = i, last = i, sum = 0;
+
+	while (first > 0 && pi->entry[first - 1].sec >= entry->sec - seconds)
+		first--;
+	while (last < pi->nr - 1 && pi->entry[last + 1].sec <= entry->sec + seconds)
+		last++;
+	min = max = pi->entry + first;
+	for (p = pi->entry + first; p <= pi->entry + last; p++) {
+		sum += p->depth;
+		if (p->depth < min->depth)
+			min = p;
+		if (p->depth > max->depth)
+			max = p;
+	}
+	QCOMPARE(entry->min[index], min);
+	QCOMPARE(entry->max[index], max);
+	QCOMPARE(entry->avg[index], (sum + (last - first + 1) / 2) / (last - first + 1));
+}
+
+void TestProfile::testMinMax()
+{
+	QDir dir("../dives");
+	struct dive *dive;
+	int i, j, k;
+
+	Q_FOREACH (const QString &file, dir.entryList(QStringList() << "*.xml", QDir::Files))
+		parse_file(dir.filePath(file).toUtf8().data());
+	QVERIFY(dive_table.nr > 0);
+
+	for_each_dive (i, dive) {
+		struct divecomputer *dc;
+
+		for (dc = &dive->dc; dc; dc = dc->next) {
+			struct plot_info pi = calculate_max_limits_new(dive, dc);
+
+			create_plot_info_new(dive, dc, &pi, true);
+			for (j = 0; j < pi.nr; j++) {
+				for (k = 0; k < 3; k++)
+					check_minmax(&pi, j, k);
+			}
+		}
+	}
+}
+
+// the interpolated tank pressures have to match the ones we used to calculate
+void TestProfile::testTankPressures()
+{
+	QFile ref("../dives/tankpressurereference.csv");
+	struct dive *dive;
+	int i, j, dcnr;
+
+	while (dive_table.nr)
+		delete_single_dive(0);
+	parse_file("../dives/tank_pressure.xml");
+	parse_file("../dives/sac-test.xml");
+	QVERIFY(ref.open(QIODevice::ReadOnly | QIODevice::Text));
+	QTextStream in(&ref);
+
+	for_each_dive (i, dive) {
+		struct divecomputer *dc;
+
+		for (dc = &dive->dc, dcnr = 0; dc; dc = dc->next, dcnr++) {
+			struct plot_info pi = calculate_max_limits_new(dive, dc);
+
+			create_plot_info_new(dive, dc, &pi, true);
+			for (j = 0; j < pi.nr; j++) {
+				struct plot_data *entry = pi.entry + j;
+				QString line = QString("%1,%2,%3,%4,%5,%6").arg(i).arg(dcnr).arg(entry->sec).arg(entry->cylinderindex)
+						       .arg(SENSOR_PRESSURE(entry)).arg(INTERPOLATED_PRESSURE(entry));
+				QCOMPARE(line, in.readLine());
+			}
+		}
+	}
+	QVERIFY(in.atEnd());
+}
+
+QTEST_MAIN(TestProfile)